@@ -0,0 +1,830 @@
+/****************************************************************************
+ *         Multi-threaded reading of the blocks of an HDF5 dataset          *
+ *                            Author: H. Pag\`es                            *
+ ****************************************************************************/
+#include "H5BlockReader.h"
+
+#include "global_errmsg_buf.h"
+#include "H5DSetDescriptor.h"
+#include "h5mread_helpers.h"
+
+#include <pthread.h>
+#include <stdio.h>  /* for snprintf() */
+#include <stdlib.h>  /* for malloc, free */
+#include <string.h>  /* for memcpy */
+#include <zlib.h>  /* for uncompress(), Z_OK */
+
+/*
+ * An H5BlockReader reads the blocks of a grid (an arbitrary list of
+ * hyperslabs) with a pool of worker threads, and hands them back to R in
+ * grid order thru C_read_next_block_from_H5BlockReader_xp(). The workers
+ * work on the blocks that follow the last returned block, by up to
+ * 'nslot' blocks.
+ *
+ * The HDF5 library that we link to (Rhdf5lib) is not built thread-safe so
+ * all the HDF5 calls are serialized thru 'hdf5_lock'. The R thread holds
+ * this lock at all times while at least one H5BlockReader is open, except
+ * when it is waiting for a block in C_read_next_block_from_H5BlockReader_xp()
+ * or destroying a reader. This guarantees that the worker threads never
+ * make HDF5 calls at the same time as the rest of the package (or as
+ * rhdf5, which doesn't know about 'hdf5_lock'). The downside is that the
+ * workers can only touch the file while R is waiting for a block: there
+ * is no read-ahead of the file while R processes a block, only decoding of
+ * the raw chunks that were loaded during the last wait.
+ *
+ * When the dataset is chunked, its filter pipeline only contains the
+ * shuffle and/or deflate filters, and the type of the data on disk is the
+ * native type we load the data in (see 'narrow_type' in H5DSetDescriptor.h),
+ * the workers only use HDF5 to load the raw chunks with H5Dread_chunk(),
+ * then release 'hdf5_lock' and decode the chunks themselves. This is where
+ * the time goes for compressed data, and it happens in parallel. Otherwise
+ * they load each block with a single H5Dread(), which is serialized.
+ */
+
+static pthread_mutex_t hdf5_lock = PTHREAD_MUTEX_INITIALIZER;
+static int nopen_readers = 0;
+
+#define	SLOT_FREE	0
+#define	SLOT_BUSY	1
+#define	SLOT_READY	2
+#define	SLOT_FAILED	3
+
+typedef struct {
+	int state;
+	long long int block;	/* block loaded in this slot */
+	void *data;		/* block data (in the type of the final array) */
+	char errmsg[ERRMSG_BUF_LENGTH];
+} BlockSlot;
+
+typedef struct {
+	hid_t file_id;
+	H5DSetDescriptor h5dset;
+	int ndim;
+	long long int nblock;
+	/* 'nblock' x 'ndim' matrices (0-based offsets and dimensions). */
+	int *block_off, *block_dim;
+	int decode_chunks, shuffle_idx, deflate_idx;
+	size_t disk_elt_size;
+	int nthread, nthread_started, nslot;
+	pthread_t *threads;
+	BlockSlot *slots;
+	long long int next_to_read, next_to_return;
+	int stop;
+	/* Protect 'slots', 'next_to_read', 'next_to_return', and 'stop'. */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} H5BlockReader;
+
+
+/****************************************************************************
+ * Check whether the workers can decode the chunks themselves
+ */
+
+/* Set 'br->shuffle_idx' and 'br->deflate_idx' (-1 if the filter is not
+   used). Return 1 if the pipeline only uses those filters (with shuffle
+   before deflate), 0 if not, and -1 on error. */
+static int get_filter_pipeline(H5BlockReader *br)
+{
+	int nfilter, i;
+	unsigned int flags, cd_values[8], filter_config;
+	size_t cd_nelmts;
+	H5Z_filter_t filter_id;
+
+	br->shuffle_idx = br->deflate_idx = -1;
+	nfilter = H5Pget_nfilters(br->h5dset.plist_id);
+	if (nfilter < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Pget_nfilters() returned an error");
+		return -1;
+	}
+	for (i = 0; i < nfilter; i++) {
+		cd_nelmts = sizeof(cd_values) / sizeof(unsigned int);
+		filter_id = H5Pget_filter2(br->h5dset.plist_id, (unsigned) i,
+					   &flags, &cd_nelmts, cd_values,
+					   0, NULL, &filter_config);
+		if (filter_id < 0) {
+			PRINT_TO_ERRMSG_BUF("H5Pget_filter2() "
+					    "returned an error");
+			return -1;
+		}
+		if (filter_id == H5Z_FILTER_SHUFFLE && br->shuffle_idx < 0 &&
+		    br->deflate_idx < 0)
+			br->shuffle_idx = i;
+		else if (filter_id == H5Z_FILTER_DEFLATE && br->deflate_idx < 0)
+			br->deflate_idx = i;
+		else
+			return 0;
+	}
+	return 1;
+}
+
+static int can_decode_chunks(H5BlockReader *br)
+{
+	const H5DSetDescriptor *h5dset = &br->h5dset;
+	hid_t mem_type_id;
+	htri_t ret;
+
+	if (h5dset->H5layout != H5D_CHUNKED || h5dset->Rtype == STRSXP)
+		return 0;
+	mem_type_id = h5dset->narrow_type != NARROW_NONE ?
+		      h5dset->narrow_mem_type_id : h5dset->mem_type_id;
+	ret = H5Tequal(h5dset->dtype_id, mem_type_id);
+	if (ret < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Tequal() returned an error");
+		return -1;
+	}
+	if (!ret)
+		return 0;
+	return get_filter_pipeline(br);
+}
+
+
+/****************************************************************************
+ * Reading a block (called by the worker threads)
+ *
+ * Nothing in this section can use the R API, the scratch arena, or the
+ * global error message buffer. Errors are reported in the 'errmsg' buffer
+ * of the slot.
+ */
+
+/* Load the block with a single H5Dread(). Called with 'hdf5_lock' held. */
+static int read_block_with_H5Dread(const H5BlockReader *br, long long int b,
+		void *out, char *errmsg)
+{
+	const H5DSetDescriptor *h5dset = &br->h5dset;
+	int ndim, along, h5along, ret;
+	hsize_t *h5off, *h5count;
+	hid_t file_space_id, mem_space_id;
+
+	ndim = br->ndim;
+	h5off = (hsize_t *) malloc(2 * ndim * sizeof(hsize_t));
+	if (h5off == NULL) {
+		snprintf(errmsg, ERRMSG_BUF_LENGTH, "malloc() failed");
+		return -1;
+	}
+	h5count = h5off + ndim;
+	for (along = 0, h5along = ndim - 1; along < ndim; along++, h5along--) {
+		h5off[h5along] = br->block_off[b + along * br->nblock];
+		h5count[h5along] = br->block_dim[b + along * br->nblock];
+	}
+	ret = -1;
+	file_space_id = H5Scopy(h5dset->space_id);
+	mem_space_id = H5Screate_simple(ndim, h5count, NULL);
+	if (file_space_id < 0 || mem_space_id < 0) {
+		snprintf(errmsg, ERRMSG_BUF_LENGTH,
+			 "H5Scopy() or H5Screate_simple() returned an error");
+	} else if (H5Sselect_hyperslab(file_space_id, H5S_SELECT_SET,
+				       h5off, NULL, h5count, NULL) < 0) {
+		snprintf(errmsg, ERRMSG_BUF_LENGTH,
+			 "H5Sselect_hyperslab() returned an error");
+	} else if (H5Dread(h5dset->dset_id, h5dset->mem_type_id,
+			   mem_space_id, file_space_id,
+			   H5P_DEFAULT, out) < 0) {
+		snprintf(errmsg, ERRMSG_BUF_LENGTH,
+			 "H5Dread() returned an error");
+	} else {
+		ret = 0;
+	}
+	if (mem_space_id >= 0)
+		H5Sclose(mem_space_id);
+	if (file_space_id >= 0)
+		H5Sclose(file_space_id);
+	free(h5off);
+	return ret;
+}
+
+/* Undo the shuffle filter. */
+static void unshuffle_bytes(const char *in, size_t nelt, size_t elt_size,
+			    char *out)
+{
+	size_t i, j;
+
+	for (j = 0; j < elt_size; j++)
+		for (i = 0; i < nelt; i++)
+			out[i * elt_size + j] = *(in++);
+	return;
+}
+
+/* 'raw' is the chunk data as loaded by H5Dread_chunk(). On success, return
+   a pointer to the decoded chunk data (either 'raw', 'buf1', or 'buf2'). */
+static const char *decode_chunk(const H5BlockReader *br,
+		const char *raw, hsize_t raw_size, uint32_t filter_mask,
+		size_t chunk_nelt, char *buf1, char *buf2, char *errmsg)
+{
+	size_t chunk_size;
+	uLong destLen;
+	const char *in;
+
+	chunk_size = chunk_nelt * br->disk_elt_size;
+	in = raw;
+	if (br->deflate_idx >= 0 && !(filter_mask & (1U << br->deflate_idx))) {
+		destLen = (uLong) chunk_size;
+		if (uncompress((Bytef *) buf1, &destLen,
+			       (const Bytef *) raw, (uLong) raw_size) != Z_OK ||
+		    destLen != chunk_size)
+		{
+			snprintf(errmsg, ERRMSG_BUF_LENGTH,
+				 "failed to uncompress chunk data");
+			return NULL;
+		}
+		in = buf1;
+	} else if (raw_size != chunk_size) {
+		snprintf(errmsg, ERRMSG_BUF_LENGTH,
+			 "unexpected chunk storage size");
+		return NULL;
+	}
+	if (br->shuffle_idx >= 0 && !(filter_mask & (1U << br->shuffle_idx))) {
+		unshuffle_bytes(in, chunk_nelt, br->disk_elt_size, buf2);
+		in = buf2;
+	}
+	return in;
+}
+
+/* Copy the part of the chunk that intersects with the block. 'chunk_off'
+   and 'xbuf' must be of length 'ndim'. 'lo_hi' must be of length
+   2 x 'ndim'. */
+static void copy_chunk_to_block(const H5BlockReader *br, long long int b,
+		const long long int *chunk_off, const char *chunk_data,
+		void *out, long long int *lo_hi, long long int *xbuf)
+{
+	const H5DSetDescriptor *h5dset = &br->h5dset;
+	int ndim, along, narrow;
+	long long int *lo, *hi, boff, bdim, cdim, d;
+	size_t in_off, out_off, in_stride, out_stride, in_elt_size, out_elt_size;
+
+	ndim = br->ndim;
+	lo = lo_hi;
+	hi = lo_hi + ndim;
+	for (along = 0; along < ndim; along++) {
+		boff = br->block_off[b + along * br->nblock];
+		bdim = br->block_dim[b + along * br->nblock];
+		cdim = h5dset->h5chunkdim[ndim - 1 - along];
+		d = h5dset->h5dim[ndim - 1 - along];
+		lo[along] = chunk_off[along] > boff ? chunk_off[along] : boff;
+		hi[along] = chunk_off[along] + cdim;
+		if (hi[along] > boff + bdim)
+			hi[along] = boff + bdim;
+		if (hi[along] > d)
+			hi[along] = d;
+		xbuf[along] = lo[along];
+	}
+	narrow = h5dset->narrow_type != NARROW_NONE;
+	in_elt_size = br->disk_elt_size;
+	out_elt_size = h5dset->ans_elt_size;
+	while (1) {
+		in_off = out_off = 0;
+		in_stride = out_stride = 1;
+		for (along = 0; along < ndim; along++) {
+			boff = br->block_off[b + along * br->nblock];
+			in_off += (xbuf[along] - chunk_off[along]) * in_stride;
+			out_off += (xbuf[along] - boff) * out_stride;
+			in_stride *= h5dset->h5chunkdim[ndim - 1 - along];
+			out_stride *= br->block_dim[b + along * br->nblock];
+		}
+		if (narrow)
+			_widen_narrow_data(h5dset,
+					   chunk_data + in_off * in_elt_size,
+					   (char *) out + out_off * out_elt_size,
+					   hi[0] - lo[0]);
+		else
+			memcpy((char *) out + out_off * out_elt_size,
+			       chunk_data + in_off * in_elt_size,
+			       (hi[0] - lo[0]) * in_elt_size);
+		for (along = 1; along < ndim; along++) {
+			if (++xbuf[along] < hi[along])
+				break;
+			xbuf[along] = lo[along];
+		}
+		if (along >= ndim)
+			break;
+	}
+	return;
+}
+
+typedef struct {
+	int nchunk;
+	long long int *first_chunk, *nchunk_along, *midx, *chunk_off;
+	long long int *lo_hi, *xbuf;
+	hsize_t *h5off;
+	void **raw;
+	hsize_t *raw_size;
+	uint32_t *filter_mask;
+	char *buf1, *buf2;
+} ChunkBufs;
+
+static void free_ChunkBufs(ChunkBufs *cb)
+{
+	int k;
+
+	if (cb->raw != NULL) {
+		for (k = 0; k < cb->nchunk; k++)
+			free(cb->raw[k]);
+		free(cb->raw);
+	}
+	free(cb->raw_size);
+	free(cb->filter_mask);
+	free(cb->first_chunk);
+	free(cb->h5off);
+	free(cb->buf1);
+	free(cb->buf2);
+	return;
+}
+
+static int alloc_ChunkBufs(const H5BlockReader *br, long long int b,
+			   ChunkBufs *cb)
+{
+	const H5DSetDescriptor *h5dset = &br->h5dset;
+	int ndim, along;
+	long long int boff, bdim, cdim, nchunk;
+	size_t chunk_size;
+
+	memset(cb, 0, sizeof(ChunkBufs));
+	ndim = br->ndim;
+	cb->first_chunk = (long long int *)
+			  malloc(7 * ndim * sizeof(long long int));
+	cb->h5off = (hsize_t *) malloc(ndim * sizeof(hsize_t));
+	if (cb->first_chunk == NULL || cb->h5off == NULL)
+		return -1;
+	cb->nchunk_along = cb->first_chunk + ndim;
+	cb->midx = cb->nchunk_along + ndim;
+	cb->chunk_off = cb->midx + ndim;
+	cb->lo_hi = cb->chunk_off + ndim;
+	cb->xbuf = cb->lo_hi + 2 * ndim;
+	nchunk = 1;
+	chunk_size = br->disk_elt_size;
+	for (along = 0; along < ndim; along++) {
+		boff = br->block_off[b + along * br->nblock];
+		bdim = br->block_dim[b + along * br->nblock];
+		cdim = h5dset->h5chunkdim[ndim - 1 - along];
+		cb->first_chunk[along] = boff / cdim;
+		cb->nchunk_along[along] = bdim == 0 ? 0 :
+			(boff + bdim - 1) / cdim - cb->first_chunk[along] + 1;
+		nchunk *= cb->nchunk_along[along];
+		chunk_size *= cdim;
+		cb->midx[along] = 0;
+	}
+	cb->nchunk = (int) nchunk;
+	if (nchunk == 0)
+		return 0;
+	cb->raw = (void **) calloc(nchunk, sizeof(void *));
+	cb->raw_size = (hsize_t *) malloc(nchunk * sizeof(hsize_t));
+	cb->filter_mask = (uint32_t *) malloc(nchunk * sizeof(uint32_t));
+	cb->buf1 = (char *) malloc(chunk_size);
+	cb->buf2 = (char *) malloc(chunk_size);
+	if (cb->raw == NULL || cb->raw_size == NULL ||
+	    cb->filter_mask == NULL || cb->buf1 == NULL || cb->buf2 == NULL)
+		return -1;
+	return 0;
+}
+
+/* Move to the next chunk touched by the block. Also set 'cb->chunk_off'
+   to the offsets of the current chunk. */
+static void set_chunk_off(const H5BlockReader *br, ChunkBufs *cb)
+{
+	int ndim, along;
+
+	ndim = br->ndim;
+	for (along = 0; along < ndim; along++)
+		cb->chunk_off[along] = (cb->first_chunk[along] +
+					cb->midx[along]) *
+				       br->h5dset.h5chunkdim[ndim - 1 - along];
+	return;
+}
+
+static void next_chunk(const H5BlockReader *br, ChunkBufs *cb)
+{
+	int along;
+
+	for (along = 0; along < br->ndim; along++) {
+		if (++cb->midx[along] < cb->nchunk_along[along])
+			break;
+		cb->midx[along] = 0;
+	}
+	return;
+}
+
+/* Load the raw chunks touched by the block. Called with 'hdf5_lock' held.
+   Return 1 if one of the chunks is not allocated (in which case the block
+   must be loaded with H5Dread()), 0 on success, and -1 on error. */
+static int load_raw_chunks(const H5BlockReader *br, ChunkBufs *cb,
+			   char *errmsg)
+{
+	int ndim, k, along;
+
+	ndim = br->ndim;
+	for (k = 0; k < cb->nchunk; k++, next_chunk(br, cb)) {
+		set_chunk_off(br, cb);
+		for (along = 0; along < ndim; along++)
+			cb->h5off[ndim - 1 - along] = cb->chunk_off[along];
+		if (H5Dget_chunk_storage_size(br->h5dset.dset_id, cb->h5off,
+					      cb->raw_size + k) < 0)
+		{
+			snprintf(errmsg, ERRMSG_BUF_LENGTH,
+				 "H5Dget_chunk_storage_size() "
+				 "returned an error");
+			return -1;
+		}
+		if (cb->raw_size[k] == 0)
+			return 1;
+		cb->raw[k] = malloc(cb->raw_size[k]);
+		if (cb->raw[k] == NULL) {
+			snprintf(errmsg, ERRMSG_BUF_LENGTH, "malloc() failed");
+			return -1;
+		}
+		if (H5Dread_chunk(br->h5dset.dset_id, H5P_DEFAULT, cb->h5off,
+				  cb->filter_mask + k, cb->raw[k]) < 0)
+		{
+			snprintf(errmsg, ERRMSG_BUF_LENGTH,
+				 "H5Dread_chunk() returned an error");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int read_block(const H5BlockReader *br, long long int b,
+		void *out, char *errmsg)
+{
+	ChunkBufs cb;
+	size_t chunk_nelt;
+	int ndim, along, k, ret;
+	const char *chunk_data;
+
+	if (!br->decode_chunks) {
+		pthread_mutex_lock(&hdf5_lock);
+		ret = read_block_with_H5Dread(br, b, out, errmsg);
+		pthread_mutex_unlock(&hdf5_lock);
+		return ret;
+	}
+	ret = -1;
+	if (alloc_ChunkBufs(br, b, &cb) < 0) {
+		snprintf(errmsg, ERRMSG_BUF_LENGTH, "malloc() failed");
+		goto done;
+	}
+	pthread_mutex_lock(&hdf5_lock);
+	ret = load_raw_chunks(br, &cb, errmsg);
+	if (ret == 1)
+		ret = read_block_with_H5Dread(br, b, out, errmsg);
+	else
+		ret = ret < 0 ? -1 : 1;
+	pthread_mutex_unlock(&hdf5_lock);
+	if (ret <= 0)
+		goto done;
+
+	/* Decode the chunks (no lock held). */
+	ndim = br->ndim;
+	chunk_nelt = 1;
+	for (along = 0; along < ndim; along++)
+		chunk_nelt *= br->h5dset.h5chunkdim[along];
+	for (along = 0; along < ndim; along++)
+		cb.midx[along] = 0;
+	for (k = 0; k < cb.nchunk; k++, next_chunk(br, &cb)) {
+		set_chunk_off(br, &cb);
+		chunk_data = decode_chunk(br, cb.raw[k], cb.raw_size[k],
+					  cb.filter_mask[k], chunk_nelt,
+					  cb.buf1, cb.buf2, errmsg);
+		if (chunk_data == NULL) {
+			ret = -1;
+			goto done;
+		}
+		copy_chunk_to_block(br, b, cb.chunk_off, chunk_data, out,
+				    cb.lo_hi, cb.xbuf);
+	}
+	ret = 0;
+
+    done:
+	free_ChunkBufs(&cb);
+	return ret;
+}
+
+static void *worker(void *arg)
+{
+	H5BlockReader *br = arg;
+	long long int b;
+	BlockSlot *slot;
+	int ret;
+
+	pthread_mutex_lock(&br->mutex);
+	while (1) {
+		while (!br->stop &&
+		       !(br->next_to_read < br->nblock &&
+			 br->next_to_read < br->next_to_return + br->nslot))
+			pthread_cond_wait(&br->cond, &br->mutex);
+		if (br->stop)
+			break;
+		b = br->next_to_read++;
+		slot = br->slots + b % br->nslot;
+		slot->block = b;
+		slot->state = SLOT_BUSY;
+		pthread_mutex_unlock(&br->mutex);
+		ret = read_block(br, b, slot->data, slot->errmsg);
+		pthread_mutex_lock(&br->mutex);
+		slot->state = ret < 0 ? SLOT_FAILED : SLOT_READY;
+		pthread_cond_broadcast(&br->cond);
+	}
+	pthread_mutex_unlock(&br->mutex);
+	return NULL;
+}
+
+
+/****************************************************************************
+ * Creating and destroying an H5BlockReader
+ */
+
+static void destroy_H5BlockReader(H5BlockReader *br)
+{
+	int i;
+
+	if (br->nthread_started != 0) {
+		pthread_mutex_lock(&br->mutex);
+		br->stop = 1;
+		pthread_cond_broadcast(&br->cond);
+		pthread_mutex_unlock(&br->mutex);
+		/* The workers might be waiting for 'hdf5_lock'. */
+		pthread_mutex_unlock(&hdf5_lock);
+		for (i = 0; i < br->nthread_started; i++)
+			pthread_join(br->threads[i], NULL);
+		pthread_mutex_lock(&hdf5_lock);
+	}
+	if (--nopen_readers == 0)
+		pthread_mutex_unlock(&hdf5_lock);
+	pthread_cond_destroy(&br->cond);
+	pthread_mutex_destroy(&br->mutex);
+	if (br->slots != NULL) {
+		for (i = 0; i < br->nslot; i++)
+			free(br->slots[i].data);
+		free(br->slots);
+	}
+	free(br->threads);
+	free(br->block_off);
+	_destroy_H5DSetDescriptor(&br->h5dset);
+	H5Dclose(br->h5dset.dset_id);
+	H5Fclose(br->file_id);
+	free(br);
+	return;
+}
+
+/* Return the length of the biggest block or -1 if 'block_starts' or
+   'block_counts' is invalid. */
+static long long int check_blocks(const H5DSetDescriptor *h5dset,
+		SEXP block_starts, SEXP block_counts, long long int nblock)
+{
+	int ndim, along;
+	long long int b, start, count, block_len, max_block_len;
+	const int *starts_p, *counts_p;
+
+	ndim = h5dset->ndim;
+	starts_p = INTEGER(block_starts);
+	counts_p = INTEGER(block_counts);
+	max_block_len = 0;
+	for (b = 0; b < nblock; b++) {
+		block_len = 1;
+		for (along = 0; along < ndim; along++) {
+			start = starts_p[b + along * nblock];
+			count = counts_p[b + along * nblock];
+			if (start == NA_INTEGER || count == NA_INTEGER ||
+			    start < 1 || count < 0 ||
+			    start - 1 + count >
+			    (long long int) h5dset->h5dim[ndim - 1 - along])
+			{
+				PRINT_TO_ERRMSG_BUF("block %lld is out of "
+						    "bounds", b + 1);
+				return -1;
+			}
+			block_len *= count;
+		}
+		if (block_len > max_block_len)
+			max_block_len = block_len;
+	}
+	return max_block_len;
+}
+
+static int init_H5BlockReader(H5BlockReader *br,
+		SEXP block_starts, SEXP block_counts, int nthread)
+{
+	int ndim, i, ret;
+	long long int nblock, max_block_len, b;
+	size_t block_size;
+
+	ndim = br->ndim = br->h5dset.ndim;
+	if (br->h5dset.Rtype == STRSXP) {
+		PRINT_TO_ERRMSG_BUF("H5BlockReader objects don't support "
+				    "string data");
+		return -1;
+	}
+	if (!(IS_INTEGER(block_starts) && IS_INTEGER(block_counts) &&
+	      LENGTH(block_starts) == LENGTH(block_counts) &&
+	      (ndim == 0 || LENGTH(block_starts) % ndim == 0)))
+	{
+		PRINT_TO_ERRMSG_BUF("'block_starts' and 'block_counts' must "
+				    "be integer matrices with one column per "
+				    "dimension in the dataset");
+		return -1;
+	}
+	nblock = br->nblock = ndim == 0 ? 0 : LENGTH(block_starts) / ndim;
+	max_block_len = check_blocks(&br->h5dset, block_starts, block_counts,
+				     nblock);
+	if (max_block_len < 0)
+		return -1;
+
+	br->block_off = (int *) malloc(2 * nblock * ndim * sizeof(int) + 1);
+	if (br->block_off == NULL) {
+		PRINT_TO_ERRMSG_BUF("failed to allocate memory "
+				    "for 'br->block_off'");
+		return -1;
+	}
+	br->block_dim = br->block_off + nblock * ndim;
+	for (b = 0; b < nblock * ndim; b++) {
+		br->block_off[b] = INTEGER(block_starts)[b] - 1;
+		br->block_dim[b] = INTEGER(block_counts)[b];
+	}
+
+	ret = can_decode_chunks(br);
+	if (ret < 0)
+		return -1;
+	br->decode_chunks = ret;
+	br->disk_elt_size = br->h5dset.narrow_type != NARROW_NONE ?
+			    br->h5dset.narrow_elt_size :
+			    br->h5dset.ans_elt_size;
+
+	/* Two slots per thread so the workers can keep decoding the raw
+	   chunks they've already loaded while R processes the current
+	   block. */
+	br->nslot = 2 * nthread;
+	br->slots = (BlockSlot *) calloc(br->nslot, sizeof(BlockSlot));
+	if (br->slots == NULL) {
+		PRINT_TO_ERRMSG_BUF("failed to allocate memory "
+				    "for 'br->slots'");
+		return -1;
+	}
+	block_size = max_block_len * br->h5dset.ans_elt_size;
+	for (i = 0; i < br->nslot; i++) {
+		br->slots[i].block = -1;
+		br->slots[i].data = malloc(block_size != 0 ? block_size : 1);
+		if (br->slots[i].data == NULL) {
+			PRINT_TO_ERRMSG_BUF("failed to allocate memory "
+					    "for the block buffers");
+			return -1;
+		}
+	}
+
+	br->nthread = nthread;
+	br->threads = (pthread_t *) malloc(nthread * sizeof(pthread_t));
+	if (br->threads == NULL) {
+		PRINT_TO_ERRMSG_BUF("failed to allocate memory "
+				    "for 'br->threads'");
+		return -1;
+	}
+	for (i = 0; i < nthread; i++) {
+		if (pthread_create(br->threads + i, NULL, worker, br) != 0) {
+			PRINT_TO_ERRMSG_BUF("pthread_create() failed");
+			return -1;
+		}
+		br->nthread_started++;
+	}
+	return 0;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_new_H5BlockReader_xp(SEXP filepath, SEXP name, SEXP as_integer,
+			    SEXP block_starts, SEXP block_counts,
+			    SEXP nthread)
+{
+	int as_int, nthread0;
+	hid_t file_id, dset_id;
+	H5BlockReader *br;
+
+	/* Check 'as_integer'. */
+	if (!(IS_LOGICAL(as_integer) && LENGTH(as_integer) == 1))
+		error("'as_integer' must be TRUE or FALSE");
+	as_int = LOGICAL(as_integer)[0];
+
+	/* Check 'nthread'. */
+	if (!(IS_INTEGER(nthread) && LENGTH(nthread) == 1 &&
+	      INTEGER(nthread)[0] != NA_INTEGER && INTEGER(nthread)[0] >= 1))
+		error("'nthread' must be a single positive integer");
+	nthread0 = INTEGER(nthread)[0];
+
+	file_id = _get_file_id(filepath, 1);
+	dset_id = _get_dset_id(file_id, name, filepath);
+
+	br = (H5BlockReader *) calloc(1, sizeof(H5BlockReader));
+	if (br == NULL) {
+		H5Dclose(dset_id);
+		H5Fclose(file_id);
+		error("C_new_H5BlockReader_xp(): calloc() failed");
+	}
+	if (_init_H5DSetDescriptor(&br->h5dset, dset_id, as_int, 0) < 0) {
+		free(br);
+		H5Dclose(dset_id);
+		H5Fclose(file_id);
+		error(_HDF5Array_global_errmsg_buf());
+	}
+	br->file_id = file_id;
+	pthread_mutex_init(&br->mutex, NULL);
+	pthread_cond_init(&br->cond, NULL);
+	if (nopen_readers++ == 0)
+		pthread_mutex_lock(&hdf5_lock);
+
+	if (init_H5BlockReader(br, block_starts, block_counts, nthread0) < 0) {
+		destroy_H5BlockReader(br);
+		error(_HDF5Array_global_errmsg_buf());
+	}
+	return R_MakeExternalPtr(br, R_NilValue, R_NilValue);
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_destroy_H5BlockReader_xp(SEXP xp)
+{
+	H5BlockReader *br;
+
+	br = R_ExternalPtrAddr(xp);
+	if (br != NULL) {
+		destroy_H5BlockReader(br);
+		R_ClearExternalPtr(xp);
+	}
+	return R_NilValue;
+}
+
+
+/****************************************************************************
+ * C_read_next_block_from_H5BlockReader_xp()
+ *
+ * Return the next block in grid order, or NULL once all the blocks have
+ * been returned.
+ */
+
+/* See fix_logical_NAs() in h5mread.c */
+static void fix_logical_NAs(int *x, R_xlen_t x_len)
+{
+	R_xlen_t i;
+
+	for (i = 0; i < x_len; i++, x++) {
+		if (*x < 0)
+			*x = NA_LOGICAL;
+	}
+	return;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_read_next_block_from_H5BlockReader_xp(SEXP xp)
+{
+	H5BlockReader *br;
+	long long int b;
+	BlockSlot *slot;
+	int state, ndim, along;
+	R_xlen_t ans_len;
+	SEXP ans, ans_dim;
+	char errmsg[ERRMSG_BUF_LENGTH];
+
+	br = R_ExternalPtrAddr(xp);
+	if (br == NULL)
+		error("H5BlockReader object is closed");
+	b = br->next_to_return;
+	if (b >= br->nblock)
+		return R_NilValue;
+	slot = br->slots + b % br->nslot;
+
+	/* Let the workers use HDF5 while we wait. */
+	pthread_mutex_unlock(&hdf5_lock);
+	pthread_mutex_lock(&br->mutex);
+	while (!(slot->block == b &&
+		 (slot->state == SLOT_READY || slot->state == SLOT_FAILED)))
+		pthread_cond_wait(&br->cond, &br->mutex);
+	state = slot->state;
+	pthread_mutex_unlock(&br->mutex);
+	pthread_mutex_lock(&hdf5_lock);
+
+	ans = R_NilValue;
+	if (state == SLOT_READY) {
+		ndim = br->ndim;
+		ans_dim = PROTECT(NEW_INTEGER(ndim));
+		ans_len = 1;
+		for (along = 0; along < ndim; along++) {
+			INTEGER(ans_dim)[along] =
+				br->block_dim[b + along * br->nblock];
+			ans_len *= INTEGER(ans_dim)[along];
+		}
+		ans = PROTECT(allocVector(br->h5dset.Rtype, ans_len));
+		if (ans_len != 0)
+			memcpy(DATAPTR(ans), slot->data,
+			       ans_len * br->h5dset.ans_elt_size);
+		if (br->h5dset.Rtype == LGLSXP)
+			fix_logical_NAs(LOGICAL(ans), ans_len);
+		SET_DIM(ans, ans_dim);
+		UNPROTECT(2);
+	} else {
+		memcpy(errmsg, slot->errmsg, ERRMSG_BUF_LENGTH);
+	}
+
+	/* Release the slot. */
+	pthread_mutex_lock(&br->mutex);
+	slot->state = SLOT_FREE;
+	br->next_to_return++;
+	pthread_cond_broadcast(&br->cond);
+	pthread_mutex_unlock(&br->mutex);
+
+	if (state != SLOT_READY)
+		error("failed to read block %lld: %s", b + 1, errmsg);
+	return ans;
+}
+
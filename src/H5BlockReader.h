@@ -0,0 +1,20 @@
+#ifndef _H5BLOCKREADER_H_
+#define _H5BLOCKREADER_H_
+
+#include <Rdefines.h>
+
+SEXP C_new_H5BlockReader_xp(
+	SEXP filepath,
+	SEXP name,
+	SEXP as_integer,
+	SEXP block_starts,
+	SEXP block_counts,
+	SEXP nthread
+);
+
+SEXP C_read_next_block_from_H5BlockReader_xp(SEXP xp);
+
+SEXP C_destroy_H5BlockReader_xp(SEXP xp);
+
+#endif  /* _H5BLOCKREADER_H_ */
+
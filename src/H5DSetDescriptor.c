@@ -5,12 +5,14 @@
 #include "H5DSetDescriptor.h"
 
 #include "global_errmsg_buf.h"
+#include "PackedArray.h"  /* for PACKED_FLOAT32_NA_BITS */
 
+#include <stdint.h>  /* for uint32_t */
 #include <stdlib.h>  /* for malloc, free */
-#include <string.h>  /* for strcmp */
+#include <string.h>  /* for strcmp, memcpy */
 #include <limits.h>  /* for INT_MAX */
 
-static const char *H5class2str(H5T_class_t H5class)
+const char *_H5class2str(H5T_class_t H5class)
 {
 	static char s[32];
 
@@ -32,7 +34,7 @@ static const char *H5class2str(H5T_class_t H5class)
 	return s;
 }
 
-static const char *H5layout2str(H5D_layout_t H5layout)
+const char *_H5layout2str(H5D_layout_t H5layout)
 {
 	static char s[32];
 
@@ -292,7 +294,7 @@ static int map_H5class_to_Rtype(H5T_class_t H5class, int as_int, size_t H5size,
 	    default: break;
 	}
 	PRINT_TO_ERRMSG_BUF("unsupported dataset class: %s",
-			    H5class2str(H5class));
+			    _H5class2str(H5class));
 	return -1;
 }
 
@@ -321,8 +323,61 @@ static hid_t get_mem_type_id_from_Rtype(SEXPTYPE Rtype, hid_t dtype_id)
 	return -1;
 }
 
+/* Only for H5T_INTEGER data of size 1 or 2 read as int or logical, and for
+   H5T_FLOAT data of size 4 read as double. Note that we use predefined
+   native types only so there's nothing to close. */
+static int set_narrow_type(H5DSetDescriptor *h5dset)
+{
+	H5T_sign_t sign;
+
+	h5dset->narrow_type = NARROW_NONE;
+	h5dset->narrow_mem_type_id = -1;
+	h5dset->narrow_elt_size = 0;
+	if (h5dset->H5class == H5T_FLOAT) {
+		if (h5dset->Rtype != REALSXP || h5dset->H5size != sizeof(float))
+			return 0;
+		h5dset->narrow_type = NARROW_FLOAT;
+		h5dset->narrow_mem_type_id = H5T_NATIVE_FLOAT;
+		h5dset->narrow_elt_size = sizeof(float);
+		return 0;
+	}
+	if (h5dset->H5class != H5T_INTEGER ||
+	    (h5dset->Rtype != INTSXP && h5dset->Rtype != LGLSXP) ||
+	    h5dset->H5size > 2)
+		return 0;
+	sign = H5Tget_sign(h5dset->dtype_id);
+	if (sign == H5T_SGN_ERROR) {
+		PRINT_TO_ERRMSG_BUF("H5Tget_sign() returned an error");
+		return -1;
+	}
+	if (h5dset->H5size == 1) {
+		if (sign == H5T_SGN_NONE) {
+			h5dset->narrow_type = NARROW_UCHAR;
+			h5dset->narrow_mem_type_id = H5T_NATIVE_UCHAR;
+		} else {
+			h5dset->narrow_type = NARROW_SCHAR;
+			h5dset->narrow_mem_type_id = H5T_NATIVE_SCHAR;
+		}
+	} else {
+		if (sign == H5T_SGN_NONE) {
+			h5dset->narrow_type = NARROW_USHORT;
+			h5dset->narrow_mem_type_id = H5T_NATIVE_USHORT;
+		} else {
+			h5dset->narrow_type = NARROW_SHORT;
+			h5dset->narrow_mem_type_id = H5T_NATIVE_SHORT;
+		}
+	}
+	h5dset->narrow_elt_size = h5dset->H5size;
+	return 0;
+}
+
 void _destroy_H5DSetDescriptor(H5DSetDescriptor *h5dset)
 {
+	if (h5dset->allocated_chunks != NULL &&
+	    !h5dset->allocated_chunks_is_cached)
+		free(h5dset->allocated_chunks);
+	if (h5dset->where_chunks != NULL)
+		free(h5dset->where_chunks);
 	if (h5dset->h5nchunk != NULL)
 		free(h5dset->h5nchunk);
 	if (h5dset->h5chunkdim != NULL &&
@@ -336,6 +391,10 @@ void _destroy_H5DSetDescriptor(H5DSetDescriptor *h5dset)
 		H5Sclose(h5dset->space_id);
 	if (h5dset->dtype_id != -1)
 		H5Tclose(h5dset->dtype_id);
+	if (h5dset->xfer_plist_id != H5P_DEFAULT)
+		H5Pclose(h5dset->xfer_plist_id);
+	if (h5dset->packed_mem_type_is_copy)
+		H5Tclose(h5dset->mem_type_id);
 	if (h5dset->storage_mode_attr != NULL)
 		free(h5dset->storage_mode_attr);
 	if (h5dset->h5name != NULL)
@@ -357,6 +416,12 @@ int _init_H5DSetDescriptor(H5DSetDescriptor *h5dset, hid_t dset_id,
 	CharAE *buf;
 
 	h5dset->dset_id = dset_id;
+	h5dset->packed_type = PACKED_NONE;
+	h5dset->packed_NA_found = 0;
+	h5dset->allocated_chunks_mode = ALLOCATED_CHUNKS_ALL;
+	h5dset->use_chunkstats = 0;
+	h5dset->where_op = WHERE_NONE;
+	h5dset->where_chunks = NULL;
 
 	/* Initialize the fields that _destroy_H5DSetDescriptor() will free
 	   or close. */
@@ -365,9 +430,13 @@ int _init_H5DSetDescriptor(H5DSetDescriptor *h5dset, hid_t dset_id,
 	h5dset->dtype_id = -1;
 	h5dset->space_id = -1;
 	h5dset->plist_id = -1;
+	h5dset->xfer_plist_id = H5P_DEFAULT;
+	h5dset->packed_mem_type_is_copy = 0;
 	h5dset->h5dim = NULL;
 	h5dset->h5chunkdim = NULL;
 	h5dset->h5nchunk = NULL;
+	h5dset->allocated_chunks = NULL;
+	h5dset->allocated_chunks_is_cached = 0;
 
 	/* Set 'h5dset->h5name'. */
 	h5name = get_h5name(dset_id);
@@ -429,12 +498,26 @@ int _init_H5DSetDescriptor(H5DSetDescriptor *h5dset, hid_t dset_id,
 		if (map_H5class_to_Rtype(H5class, as_int, H5size, &Rtype) < 0)
 			goto on_error;
 	}
-	if (Rtype == STRSXP && H5Tis_variable_str(dtype_id) != 0) {
-		PRINT_TO_ERRMSG_BUF("reading variable-length string data "
-				    "is not supported at the moment");
+	h5dset->Rtype = Rtype;
+
+	/* Set 'h5dset->is_variable_str'. */
+	if (H5class == H5T_STRING) {
+		ret = H5Tis_variable_str(dtype_id);
+		if (ret < 0) {
+			PRINT_TO_ERRMSG_BUF("H5Tis_variable_str() "
+					    "returned an error");
+			goto on_error;
+		}
+		h5dset->is_variable_str = ret;
+	} else {
+		h5dset->is_variable_str = 0;
+	}
+	if (h5dset->is_variable_str && Rtype != STRSXP) {
+		PRINT_TO_ERRMSG_BUF("the dataset to read contains "
+				    "variable-length string data so can only "
+				    "be read as character data");
 		goto on_error;
 	}
-	h5dset->Rtype = Rtype;
 
 	if (get_Rtype_only)
 		return 0;
@@ -559,6 +642,11 @@ int _init_H5DSetDescriptor(H5DSetDescriptor *h5dset, hid_t dset_id,
 	if (mem_type_id < 0)
 		goto on_error;
 	h5dset->mem_type_id = mem_type_id;
+
+	/* Set 'h5dset->narrow_type', 'h5dset->narrow_mem_type_id',
+	   and 'h5dset->narrow_elt_size'. */
+	if (set_narrow_type(h5dset) < 0)
+		goto on_error;
 	return 0;
 
     on_error:
@@ -567,6 +655,197 @@ int _init_H5DSetDescriptor(H5DSetDescriptor *h5dset, hid_t dset_id,
 }
 
 
+/****************************************************************************
+ * _set_H5DSetDescriptor_packed_type()
+ *
+ * Switch an H5DSetDescriptor struct initialized with _init_H5DSetDescriptor()
+ * to packed mode: the data will be loaded as float32 or uint16 values in a
+ * raw vector with 4 or 2 bytes per element. The conversion is done by HDF5
+ * (no-op if the data on disk is already of that type).
+ *
+ * HDF5 knows nothing about R's NAs: it would turn NA_integer_ into 0 when
+ * converting to uint16, and NA_real_ into a plain NaN when converting to
+ * float32. So we ask HDF5 to report the values it cannot convert exactly
+ * (this includes NA_integer_ and the NaNs) to packed_conv_cb(), which
+ * replaces the NAs with PACKED_FLOAT32_NA_BITS when converting to float32,
+ * and aborts the conversion to uint16 (this type has no room for NA).
+ */
+
+/* 'buf' contains a value of HDF5 type 'type_id', in the byte order of
+   that type. */
+static void copy_to_native_order(void *out, const void *buf, hid_t type_id,
+				 size_t size)
+{
+	const unsigned char *in;
+	unsigned char *out_p;
+	size_t i;
+
+	if (H5Tget_order(type_id) == H5Tget_order(H5T_NATIVE_INT)) {
+		memcpy(out, buf, size);
+		return;
+	}
+	in = (const unsigned char *) buf;
+	out_p = (unsigned char *) out;
+	for (i = 0; i < size; i++)
+		out_p[i] = in[size - 1 - i];
+	return;
+}
+
+/* Whether 'src_buf' contains an NA (or any NaN if 'nan_is_na' is 1). */
+static int is_R_NA(hid_t src_id, const void *src_buf, int nan_is_na)
+{
+	size_t size;
+	int i;
+	double x;
+	float f;
+
+	size = H5Tget_size(src_id);
+	switch (H5Tget_class(src_id)) {
+	    case H5T_INTEGER:
+		if (size != sizeof(int) || H5Tget_sign(src_id) != H5T_SGN_2)
+			return 0;
+		copy_to_native_order(&i, src_buf, src_id, size);
+		return i == NA_INTEGER;
+	    case H5T_FLOAT:
+		if (size == sizeof(double)) {
+			copy_to_native_order(&x, src_buf, src_id, size);
+			return nan_is_na ? ISNAN(x) : R_IsNA(x);
+		}
+		if (size == sizeof(float) && nan_is_na) {
+			copy_to_native_order(&f, src_buf, src_id, size);
+			return ISNAN(f);
+		}
+		return 0;
+	    default:
+		return 0;
+	}
+}
+
+/* Registered with H5Pset_type_conv_cb(). 'op_data' is the H5DSetDescriptor
+   struct. */
+static H5T_conv_ret_t packed_conv_cb(H5T_conv_except_t except_type,
+		hid_t src_id, hid_t dst_id,
+		void *src_buf, void *dst_buf, void *op_data)
+{
+	H5DSetDescriptor *h5dset = (H5DSetDescriptor *) op_data;
+	uint32_t na_bits;
+
+	if (h5dset->packed_type == PACKED_FLOAT32) {
+		if (!is_R_NA(src_id, src_buf, 0))
+			return H5T_CONV_UNHANDLED;
+		na_bits = PACKED_FLOAT32_NA_BITS;
+		memcpy(dst_buf, &na_bits, sizeof(float));
+		return H5T_CONV_HANDLED;
+	}
+	if (!is_R_NA(src_id, src_buf, 1))
+		return H5T_CONV_UNHANDLED;
+	h5dset->packed_NA_found = 1;
+	return H5T_CONV_ABORT;
+}
+
+/* Only 32-bit signed integers and doubles can represent R's NAs. */
+static int may_contain_R_NAs(const H5DSetDescriptor *h5dset)
+{
+	if (h5dset->H5class == H5T_FLOAT)
+		return h5dset->H5size == sizeof(double);
+	return h5dset->H5size == sizeof(int) &&
+	       H5Tget_sign(h5dset->dtype_id) == H5T_SGN_2;
+}
+
+int _set_H5DSetDescriptor_packed_type(H5DSetDescriptor *h5dset,
+				      int packed_type)
+{
+	int h5along;
+	size_t chunk_data_buf_size;
+	hid_t xfer_plist_id, mem_type_id;
+
+	if (packed_type == PACKED_NONE)
+		return 0;
+	if (h5dset->Rtype == STRSXP ||
+	    (h5dset->H5class != H5T_INTEGER && h5dset->H5class != H5T_FLOAT))
+	{
+		PRINT_TO_ERRMSG_BUF("'as.type' can only be used on a dataset "
+				    "that contains numeric data");
+		return -1;
+	}
+	xfer_plist_id = H5Pcreate(H5P_DATASET_XFER);
+	if (xfer_plist_id < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Pcreate() returned an error");
+		return -1;
+	}
+	h5dset->xfer_plist_id = xfer_plist_id;
+	if (H5Pset_type_conv_cb(xfer_plist_id, packed_conv_cb, h5dset) < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Pset_type_conv_cb() returned an error");
+		return -1;
+	}
+	if (packed_type == PACKED_FLOAT32) {
+		mem_type_id = H5T_NATIVE_FLOAT;
+		if (may_contain_R_NAs(h5dset)) {
+			/* HDF5's hard conversions to float don't reliably
+			   report NA_integer_ and the NaNs to packed_conv_cb()
+			   but its soft conversions do. A copy of
+			   H5T_NATIVE_FLOAT with a different internal padding
+			   (meaningless since the type has no internal bits)
+			   is not equal to H5T_NATIVE_FLOAT so forces HDF5 to
+			   use the latter. */
+			mem_type_id = H5Tcopy(H5T_NATIVE_FLOAT);
+			if (mem_type_id < 0) {
+				PRINT_TO_ERRMSG_BUF("H5Tcopy() returned "
+						    "an error");
+				return -1;
+			}
+			h5dset->mem_type_id = mem_type_id;
+			h5dset->packed_mem_type_is_copy = 1;
+			if (H5Tset_inpad(mem_type_id, H5T_PAD_ONE) < 0) {
+				PRINT_TO_ERRMSG_BUF("H5Tset_inpad() returned "
+						    "an error");
+				return -1;
+			}
+		}
+		h5dset->mem_type_id = mem_type_id;
+		h5dset->ans_elt_size = sizeof(float);
+	} else {
+		h5dset->mem_type_id = H5T_NATIVE_USHORT;
+		h5dset->ans_elt_size = sizeof(unsigned short);
+	}
+	h5dset->packed_type = packed_type;
+	h5dset->Rtype = RAWSXP;
+	if (h5dset->h5chunkdim != NULL) {
+		chunk_data_buf_size = h5dset->ans_elt_size;
+		for (h5along = 0; h5along < h5dset->ndim; h5along++)
+			chunk_data_buf_size *=
+				h5dset->h5chunkdim[h5along];
+		h5dset->chunk_data_buf_size = chunk_data_buf_size;
+	}
+	/* The data is loaded directly in the packed type. */
+	h5dset->narrow_type = NARROW_NONE;
+	return 0;
+}
+
+
+/****************************************************************************
+ * _set_H5DSetDescriptor_where()
+ *
+ * Attach a comparison predicate to an H5DSetDescriptor struct initialized
+ * with _init_H5DSetDescriptor(). Only method 8 supports it.
+ */
+
+int _set_H5DSetDescriptor_where(H5DSetDescriptor *h5dset,
+				int where_op, double where_value)
+{
+	if (where_op == WHERE_NONE)
+		return 0;
+	if (h5dset->Rtype != INTSXP && h5dset->Rtype != REALSXP) {
+		PRINT_TO_ERRMSG_BUF("'where' can only be used on a dataset "
+				    "that contains integer or numeric data");
+		return -1;
+	}
+	h5dset->where_op = where_op;
+	h5dset->where_value = where_value;
+	return 0;
+}
+
+
 /****************************************************************************
  * Convenience wrappers to H5Fopen() and H5Dopen(), with argument checking
  *
@@ -700,12 +979,14 @@ SEXP C_show_H5DSetDescriptor_xp(SEXP xp)
 
 	Rprintf("- dtype_id = %lu\n", h5dset->dtype_id);
 
-	Rprintf("- H5class = %s\n", H5class2str(h5dset->H5class));
+	Rprintf("- H5class = %s\n", _H5class2str(h5dset->H5class));
 
 	Rprintf("- H5size = %lu\n", h5dset->H5size);
 
 	Rprintf("- Rtype = \"%s\"\n", CHAR(type2str(h5dset->Rtype)));
 
+	Rprintf("- is_variable_str = %d\n", h5dset->is_variable_str);
+
 	Rprintf("- as_na_attr = %d\n", h5dset->as_na_attr);
 
 	Rprintf("- space_id = %lu\n", h5dset->space_id);
@@ -719,7 +1000,7 @@ SEXP C_show_H5DSetDescriptor_xp(SEXP xp)
 		Rprintf(" %llu", h5dset->h5dim[h5along]);
 	Rprintf("\n");
 
-	Rprintf("- H5layout = %s\n", H5layout2str(h5dset->H5layout));
+	Rprintf("- H5layout = %s\n", _H5layout2str(h5dset->H5layout));
 
 	Rprintf("- h5chunkdim =");
 	if (h5dset->h5chunkdim == NULL) {
@@ -744,6 +1025,16 @@ SEXP C_show_H5DSetDescriptor_xp(SEXP xp)
 
 	Rprintf("- mem_type_id = %lu\n", h5dset->mem_type_id);
 
+	Rprintf("- packed_type = %d\n", h5dset->packed_type);
+
+	Rprintf("- narrow_type = %d\n", h5dset->narrow_type);
+	if (h5dset->narrow_type != NARROW_NONE) {
+		Rprintf("    narrow_mem_type_id = %lu\n",
+			h5dset->narrow_mem_type_id);
+		Rprintf("    narrow_elt_size = %lu\n",
+			h5dset->narrow_elt_size);
+	}
+
 	return R_NilValue;
 }
 
@@ -16,11 +16,96 @@ typedef struct {
 	H5T_class_t H5class;
 	size_t H5size, ans_elt_size, chunk_data_buf_size;
 	SEXPTYPE Rtype;
-	int as_na_attr, ndim, *h5nchunk;
+	int is_variable_str, as_na_attr, ndim, *h5nchunk;
 	hsize_t *h5dim, *h5chunkdim;
 	H5D_layout_t H5layout;
+	/* When the type of the data on disk is narrower than the type of
+	   'ans' (e.g. H5T_IEEE_F32LE read as double, or H5T_STD_U16LE read
+	   as int), 'narrow_type' is set to one of the NARROW_* codes below
+	   and 'narrow_mem_type_id' to the native type that matches the data
+	   on disk. The chunk readers can then load the data in that type and
+	   widen it themselves during the gather step, which is much cheaper
+	   than HDF5's own conversion path. Set to NARROW_NONE otherwise. */
+	int narrow_type;
+	hid_t narrow_mem_type_id;
+	size_t narrow_elt_size;
+	/* When the user requests a packed result (see 'as.type' argument of
+	   h5mread()), 'packed_type' is set to one of the PACKED_* codes below
+	   by _set_H5DSetDescriptor_packed_type(). 'Rtype' is then RAWSXP and
+	   'ans_elt_size' is the number of bytes used per element of 'ans'.
+	   Set to PACKED_NONE otherwise. */
+	int packed_type;
+	/* In packed mode, 'xfer_plist_id' is a dataset transfer property list
+	   that makes HDF5 report the values it cannot convert to
+	   packed_conv_cb() (see H5DSetDescriptor.c), which handles the NAs.
+	   'packed_mem_type_is_copy' is 1 if 'mem_type_id' is a copy of
+	   H5T_NATIVE_FLOAT that _destroy_H5DSetDescriptor() must close.
+	   'packed_NA_found' is set to 1 by packed_conv_cb() when it aborts
+	   the conversion to uint16 because the data contains NAs. */
+	hid_t xfer_plist_id;
+	int packed_mem_type_is_copy, packed_NA_found;
+	/* Which chunks are allocated (i.e. were actually written to the
+	   file). Set by _load_allocated_chunks(). 'allocated_chunks_mode'
+	   is ALLOCATED_CHUNKS_ALL by default, meaning that the readers treat
+	   all the chunks as allocated. With ALLOCATED_CHUNKS_BITMAP,
+	   'allocated_chunks' is a bitmap with one bit per chunk (chunks
+	   are numbered in HDF5 order i.e. the last dimension varies fastest).
+	   With ALLOCATED_CHUNKS_LOOKUP, the chunks must be looked up one at
+	   a time. The bitmap belongs to the cache of allocated chunks (see
+	   h5mread_helpers.c) when 'allocated_chunks_is_cached' is 1, in which
+	   case _destroy_H5DSetDescriptor() doesn't free it. */
+	int allocated_chunks_mode;
+	unsigned char *allocated_chunks;
+	int allocated_chunks_is_cached;
+	/* Whether the chunk statistics of the dataset (see h5mread_helpers.c)
+	   can be used to skip chunks. Nothing guarantees that they are up to
+	   date so this must be requested explicitly (see 'use.chunkstats'
+	   argument of h5mread()). */
+	int use_chunkstats;
+	/* When the user supplies a comparison predicate (see 'where' argument
+	   of h5mread()), 'where_op' is set to one of the WHERE_* codes below
+	   by _set_H5DSetDescriptor_where() and method 8 only gathers the
+	   nonzero values 'x' for which 'x <where_op> where_value' is TRUE.
+	   If the dataset has chunk statistics and 'use_chunkstats' is 1,
+	   'where_chunks' is set by _load_where_chunks() to a bitmap of the
+	   chunks that can contain such values (same numbering as
+	   'allocated_chunks'). Set to WHERE_NONE otherwise. */
+	int where_op;
+	double where_value;
+	unsigned char *where_chunks;
 } H5DSetDescriptor;
 
+#define	NARROW_NONE	0
+#define	NARROW_SCHAR	1
+#define	NARROW_UCHAR	2
+#define	NARROW_SHORT	3
+#define	NARROW_USHORT	4
+#define	NARROW_FLOAT	5
+
+#define	PACKED_NONE	0
+#define	PACKED_FLOAT32	1
+#define	PACKED_UINT16	2
+
+#define	ALLOCATED_CHUNKS_ALL	0
+#define	ALLOCATED_CHUNKS_LOOKUP	1
+#define	ALLOCATED_CHUNKS_BITMAP	2
+
+#define	WHERE_NONE	0
+#define	WHERE_EQ	1
+#define	WHERE_NE	2
+#define	WHERE_LT	3
+#define	WHERE_LE	4
+#define	WHERE_GT	5
+#define	WHERE_GE	6
+
+
+const char *_H5class2str(
+	H5T_class_t H5class
+);
+
+const char *_H5layout2str(
+	H5D_layout_t H5layout
+);
 
 hsize_t *_alloc_hsize_t_buf(
 	size_t buflength,
@@ -45,6 +130,17 @@ int _init_H5DSetDescriptor(
 	int Rtype_only
 );
 
+int _set_H5DSetDescriptor_packed_type(
+	H5DSetDescriptor *h5dset,
+	int packed_type
+);
+
+int _set_H5DSetDescriptor_where(
+	H5DSetDescriptor *h5dset,
+	int where_op,
+	double where_value
+);
+
 hid_t _get_file_id(
 	SEXP filepath,
 	int readonly
@@ -0,0 +1,152 @@
+/****************************************************************************
+ *                 Extracting array elements from a PackedArray             *
+ *                            Author: H. Pag\`es                            *
+ ****************************************************************************/
+#include "PackedArray.h"
+
+#include <stdint.h>  /* for uint32_t */
+#include <string.h>  /* for strcmp(), memcpy() */
+
+/*
+ * The selected elements are unpacked directly from the raw vector, without
+ * computing the byte offsets of the selection at the R level (that would
+ * cost about 32 bytes per element with a double index per byte).
+ * 'index' must be a list with one NULL or integer vector per dimension
+ * (1-based, like the 'index' argument of extract_array()).
+ */
+
+static void check_index(SEXP index, const int *dim, int ndim, int *counts)
+{
+	int along, d, n, i, idx;
+	SEXP index_elt;
+
+	if (!isVectorList(index) || LENGTH(index) != ndim)
+		error("'index' must be a list with one element "
+		      "per dimension");
+	for (along = 0; along < ndim; along++) {
+		d = dim[along];
+		index_elt = VECTOR_ELT(index, along);
+		if (index_elt == R_NilValue) {
+			counts[along] = d;
+			continue;
+		}
+		if (!IS_INTEGER(index_elt))
+			error("'index[[%d]]' must be NULL or "
+			      "an integer vector", along + 1);
+		n = LENGTH(index_elt);
+		for (i = 0; i < n; i++) {
+			idx = INTEGER(index_elt)[i];
+			if (idx == NA_INTEGER || idx < 1 || idx > d)
+				error("'index[[%d]]' contains out-of-bounds "
+				      "indices", along + 1);
+		}
+		counts[along] = n;
+	}
+	return;
+}
+
+/* Returns the 0-based position of the i-th selected element along a
+   dimension. */
+static inline R_xlen_t get_pos(SEXP index_elt, int i)
+{
+	return index_elt == R_NilValue ? i : INTEGER(index_elt)[i] - 1;
+}
+
+static void unpack_elt(const Rbyte *data, R_xlen_t offset, int is_float32,
+		       SEXP ans, R_xlen_t k)
+{
+	float f;
+	uint32_t bits;
+	unsigned short u;
+
+	if (is_float32) {
+		memcpy(&f, data + offset * sizeof(float), sizeof(float));
+		memcpy(&bits, &f, sizeof(float));
+		REAL(ans)[k] = bits == PACKED_FLOAT32_NA_BITS ? NA_REAL
+							      : (double) f;
+	} else {
+		memcpy(&u, data + offset * sizeof(unsigned short),
+		       sizeof(unsigned short));
+		INTEGER(ans)[k] = (int) u;
+	}
+	return;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_extract_array_from_PackedArray(SEXP data, SEXP dim, SEXP packed_type,
+				      SEXP index)
+{
+	int ndim, is_float32, along, i, *counts, *midx;
+	const char *packed_type0;
+	const int *dim_p;
+	const Rbyte *data_p;
+	R_xlen_t ans_len, k, outer_offset, *strides;
+	SEXP ans, ans_dim, index0;
+
+	if (!(IS_CHARACTER(packed_type) && LENGTH(packed_type) == 1))
+		error("'packed_type' must be a single string");
+	packed_type0 = CHAR(STRING_ELT(packed_type, 0));
+	if (strcmp(packed_type0, "float32") == 0) {
+		is_float32 = 1;
+	} else if (strcmp(packed_type0, "uint16") == 0) {
+		is_float32 = 0;
+	} else {
+		error("'packed_type' must be \"float32\" or \"uint16\"");
+	}
+	ndim = LENGTH(dim);
+	if (ndim == 0)
+		error("'dim' must have at least one element");
+	dim_p = INTEGER(dim);
+	counts = (int *) R_alloc(ndim, sizeof(int));
+	check_index(index, dim_p, ndim, counts);
+
+	strides = (R_xlen_t *) R_alloc(ndim, sizeof(R_xlen_t));
+	ans_len = 1;
+	for (along = 0; along < ndim; along++) {
+		strides[along] = along == 0 ? 1 :
+				 strides[along - 1] * dim_p[along - 1];
+		ans_len *= counts[along];
+	}
+	if (XLENGTH(data) != strides[ndim - 1] * dim_p[ndim - 1] *
+			     (is_float32 ? sizeof(float) :
+					   sizeof(unsigned short)))
+		error("length of 'data' is incompatible with 'dim'");
+
+	ans = PROTECT(allocVector(is_float32 ? REALSXP : INTSXP, ans_len));
+	ans_dim = PROTECT(NEW_INTEGER(ndim));
+	memcpy(INTEGER(ans_dim), counts, sizeof(int) * ndim);
+	SET_DIM(ans, ans_dim);
+	UNPROTECT(1);
+	if (ans_len == 0) {
+		UNPROTECT(1);
+		return ans;
+	}
+
+	/* Walk the selection with the innermost dimension varying fastest.
+	   'midx' holds the position of the current column along the outer
+	   dimensions. */
+	data_p = RAW(data);
+	index0 = VECTOR_ELT(index, 0);
+	midx = (int *) R_alloc(ndim, sizeof(int));
+	memset(midx, 0, sizeof(int) * ndim);
+	k = 0;
+	while (1) {
+		outer_offset = 0;
+		for (along = 1; along < ndim; along++)
+			outer_offset += get_pos(VECTOR_ELT(index, along),
+						midx[along]) *
+					strides[along];
+		for (i = 0; i < counts[0]; i++, k++)
+			unpack_elt(data_p, outer_offset + get_pos(index0, i),
+				   is_float32, ans, k);
+		for (along = 1; along < ndim; along++) {
+			if (++midx[along] < counts[along])
+				break;
+			midx[along] = 0;
+		}
+		if (along == ndim)
+			break;
+	}
+	UNPROTECT(1);
+	return ans;
+}
@@ -0,0 +1,17 @@
+#ifndef _PACKEDARRAY_H_
+#define _PACKEDARRAY_H_
+
+#include <Rdefines.h>
+
+/* The bit pattern used to represent NA in "float32" data. Like NA_real_,
+   this is a NaN with payload 1954 so is.nan() is TRUE on it. */
+#define	PACKED_FLOAT32_NA_BITS	0x7F8007A2U
+
+SEXP C_extract_array_from_PackedArray(
+	SEXP data,
+	SEXP dim,
+	SEXP packed_type,
+	SEXP index
+);
+
+#endif  /* _PACKEDARRAY_H_ */
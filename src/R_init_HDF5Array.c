@@ -3,7 +3,18 @@
 #include "uaselection.h"
 #include "H5DSetDescriptor.h"
 #include "h5mread.h"
+#include "h5mread_mmap.h"
+#include "h5mread_lazy.h"
+#include "h5mread_from_reshaped.h"
+#include "h5mread_trace.h"
 #include "h5dimscales.h"
+#include "h5dimnames_index.h"
+#include "h5dsetinfo.h"
+#include "h5transpose.h"
+#include "h5rechunk.h"
+#include "h5writeBlocks.h"
+#include "H5BlockReader.h"
+#include "PackedArray.h"
 
 #define CALLMETHOD_DEF(fun, numArgs) {#fun, (DL_FUNC) &fun, numArgs}
 
@@ -22,7 +33,20 @@ static const R_CallMethodDef callMethods[] = {
 	CALLMETHOD_DEF(C_get_h5mread_returned_type, 3),
 
 /* h5mread.c */
-	CALLMETHOD_DEF(C_h5mread, 8),
+	CALLMETHOD_DEF(C_h5mread, 11),
+
+/* h5mread_lazy.c */
+	CALLMETHOD_DEF(C_h5mread_lazy, 6),
+
+/* h5mread_from_reshaped.c */
+	CALLMETHOD_DEF(C_h5mread_from_reshaped, 8),
+
+/* h5mread_trace.c */
+	CALLMETHOD_DEF(C_set_h5mread_tracing, 1),
+	CALLMETHOD_DEF(C_get_h5mread_trace, 0),
+	CALLMETHOD_DEF(C_clear_h5mread_trace, 0),
+	CALLMETHOD_DEF(C_get_h5mread_stats, 0),
+	CALLMETHOD_DEF(C_reset_h5mread_stats, 0),
 
 /* h5dimscales.c */
 	CALLMETHOD_DEF(C_h5isdimscale, 2),
@@ -31,12 +55,38 @@ static const R_CallMethodDef callMethods[] = {
 	CALLMETHOD_DEF(C_h5getdimlabels, 2),
 	CALLMETHOD_DEF(C_h5setdimlabels, 3),
 
+/* h5dsetinfo.c */
+	CALLMETHOD_DEF(C_h5dsetinfo, 3),
+
+/* h5dimnames_index.c */
+	CALLMETHOD_DEF(C_h5writeDimnamesIndex, 3),
+	CALLMETHOD_DEF(C_h5matchDimnames, 4),
+
+/* h5transpose.c */
+	CALLMETHOD_DEF(C_h5transpose, 7),
+
+/* h5rechunk.c */
+	CALLMETHOD_DEF(C_h5rechunk, 8),
+
+/* h5writeBlocks.c */
+	CALLMETHOD_DEF(C_h5writeBlocks, 5),
+
+/* H5BlockReader.c */
+	CALLMETHOD_DEF(C_new_H5BlockReader_xp, 6),
+	CALLMETHOD_DEF(C_read_next_block_from_H5BlockReader_xp, 1),
+	CALLMETHOD_DEF(C_destroy_H5BlockReader_xp, 1),
+
+/* PackedArray.c */
+	CALLMETHOD_DEF(C_extract_array_from_PackedArray, 4),
+
 	{NULL, NULL, 0}
 };
 
 void R_init_HDF5Array(DllInfo *info)
 {
 	R_registerRoutines(info, NULL, callMethods, NULL, NULL);
+	_init_mmap_altrep_classes(info);
+	_init_lazy_altrep_classes(info);
 
 	return;
 }
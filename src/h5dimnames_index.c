@@ -0,0 +1,567 @@
+/****************************************************************************
+ *                  Hash index for fast lookup of dimnames                  *
+ *                            Author: H. Pag\`es                            *
+ ****************************************************************************/
+#include "h5dimnames_index.h"
+
+#include "global_errmsg_buf.h"
+#include "H5DSetDescriptor.h"  /* for _get_file_id() */
+
+#include <limits.h>  /* for INT_MAX */
+#include <stdlib.h>  /* for malloc, calloc, free */
+#include <string.h>  /* for memcmp, strnlen */
+
+/*
+ * The index of a 1D dataset of strings (typically a dimscale dataset
+ * containing dimnames) is an open-addressing hash table stored in a
+ * contiguous 2D dataset of 32-bit integers. The table has 'nslot' rows
+ * and 2 columns, where 'nslot' is a power of 2 that is >= 2 times the
+ * number of strings. Row i is the slot i and contains the FNV-1a hash of
+ * a string and its 1-based position in the dataset of strings, or
+ * (0, 0) if the slot is empty. Collisions are resolved by linear probing.
+ * Duplicated strings are not inserted so looking up a string returns the
+ * position of its first occurrence, like match() does.
+ *
+ * Looking up a string reads the slots that are probed (by small windows
+ * of consecutive slots) and the candidate strings (i.e. the strings with
+ * the same hash), and nothing else.
+ */
+
+#define	PROBE_WINDOW 8
+
+static unsigned int hash_string(const char *s, size_t s_len)
+{
+	unsigned int h;
+	size_t i;
+
+	h = 2166136261U;
+	for (i = 0; i < s_len; i++) {
+		h ^= (unsigned char) s[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static const char *get_string_arg(SEXP x, const char *what)
+{
+	if (!(IS_CHARACTER(x) && LENGTH(x) == 1) ||
+	    STRING_ELT(x, 0) == NA_STRING)
+		error("'%s' must be a single string", what);
+	return CHAR(STRING_ELT(x, 0));
+}
+
+
+/****************************************************************************
+ * Reading the strings of a 1D dataset of strings
+ */
+
+typedef struct {
+	const char *name;
+	hid_t dset_id, space_id, type_id, mem_space_id;
+	hsize_t n;
+	int is_vlen, spacepad;
+	size_t size;     /* fixed-length strings only */
+	char *buf;       /* fixed-length strings only */
+	char *vlen_str;  /* variable-length strings only */
+} StringDSet;
+
+static void close_StringDSet(StringDSet *sdset)
+{
+	if (sdset->vlen_str != NULL)
+		H5free_memory(sdset->vlen_str);
+	if (sdset->buf != NULL)
+		free(sdset->buf);
+	if (sdset->mem_space_id >= 0)
+		H5Sclose(sdset->mem_space_id);
+	if (sdset->type_id >= 0)
+		H5Tclose(sdset->type_id);
+	if (sdset->space_id >= 0)
+		H5Sclose(sdset->space_id);
+	H5Dclose(sdset->dset_id);
+	return;
+}
+
+static int open_StringDSet(StringDSet *sdset, hid_t file_id, const char *name)
+{
+	hsize_t one = 1;
+	int ret;
+
+	sdset->name = name;
+	sdset->space_id = sdset->type_id = sdset->mem_space_id = -1;
+	sdset->buf = sdset->vlen_str = NULL;
+	sdset->dset_id = H5Dopen(file_id, name, H5P_DEFAULT);
+	if (sdset->dset_id < 0) {
+		PRINT_TO_ERRMSG_BUF("failed to open dataset '%s'", name);
+		return -1;
+	}
+	sdset->type_id = H5Dget_type(sdset->dset_id);
+	if (sdset->type_id < 0) {
+		close_StringDSet(sdset);
+		PRINT_TO_ERRMSG_BUF("H5Dget_type() returned an error");
+		return -1;
+	}
+	if (H5Tget_class(sdset->type_id) != H5T_STRING) {
+		close_StringDSet(sdset);
+		PRINT_TO_ERRMSG_BUF("'%s' is not a dataset of strings", name);
+		return -1;
+	}
+	sdset->space_id = H5Dget_space(sdset->dset_id);
+	if (sdset->space_id < 0) {
+		close_StringDSet(sdset);
+		PRINT_TO_ERRMSG_BUF("H5Dget_space() returned an error");
+		return -1;
+	}
+	if (H5Sget_simple_extent_ndims(sdset->space_id) != 1) {
+		close_StringDSet(sdset);
+		PRINT_TO_ERRMSG_BUF("'%s' is not a 1D dataset", name);
+		return -1;
+	}
+	H5Sget_simple_extent_dims(sdset->space_id, &sdset->n, NULL);
+	ret = H5Tis_variable_str(sdset->type_id);
+	if (ret < 0) {
+		close_StringDSet(sdset);
+		PRINT_TO_ERRMSG_BUF("H5Tis_variable_str() returned an error");
+		return -1;
+	}
+	sdset->is_vlen = ret;
+	sdset->spacepad = H5Tget_strpad(sdset->type_id) == H5T_STR_SPACEPAD;
+	if (!sdset->is_vlen) {
+		sdset->size = H5Tget_size(sdset->type_id);
+		sdset->buf = (char *) malloc(sdset->size);
+		if (sdset->buf == NULL) {
+			close_StringDSet(sdset);
+			PRINT_TO_ERRMSG_BUF("failed to allocate memory "
+					    "for 'sdset->buf'");
+			return -1;
+		}
+	}
+	sdset->mem_space_id = H5Screate_simple(1, &one, NULL);
+	if (sdset->mem_space_id < 0) {
+		close_StringDSet(sdset);
+		PRINT_TO_ERRMSG_BUF("H5Screate_simple() returned an error");
+		return -1;
+	}
+	return 0;
+}
+
+/* The strings are compared without their padding. */
+static size_t fixed_string_len(const char *s, size_t size, int spacepad)
+{
+	size_t s_len;
+
+	s_len = strnlen(s, size);
+	if (spacepad)
+		while (s_len > 0 && s[s_len - 1] == ' ')
+			s_len--;
+	return s_len;
+}
+
+/* Read the 'i'-th string (0-based). The returned string is valid until the
+   next call to read_string() or close_StringDSet(). */
+static int read_string(StringDSet *sdset, hsize_t i,
+		       const char **s, size_t *s_len)
+{
+	void *mem;
+
+	if (H5Sselect_elements(sdset->space_id, H5S_SELECT_SET, 1, &i) < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Sselect_elements() returned an error");
+		return -1;
+	}
+	if (sdset->is_vlen) {
+		if (sdset->vlen_str != NULL) {
+			H5free_memory(sdset->vlen_str);
+			sdset->vlen_str = NULL;
+		}
+		mem = &sdset->vlen_str;
+	} else {
+		mem = sdset->buf;
+	}
+	if (H5Dread(sdset->dset_id, sdset->type_id, sdset->mem_space_id,
+		    sdset->space_id, H5P_DEFAULT, mem) < 0)
+	{
+		PRINT_TO_ERRMSG_BUF("failed to read string %llu "
+				    "from dataset '%s'",
+				    (unsigned long long int) i + 1, sdset->name);
+		return -1;
+	}
+	if (sdset->is_vlen) {
+		*s = sdset->vlen_str != NULL ? sdset->vlen_str : "";
+		*s_len = strlen(*s);
+	} else {
+		*s = sdset->buf;
+		*s_len = fixed_string_len(*s, sdset->size, sdset->spacepad);
+	}
+	return 0;
+}
+
+/* Read all the strings at once. On success, '*strs' and '*lens' must be
+   released with free_all_strings(). */
+static int read_all_strings(StringDSet *sdset,
+			    char **buf, char ***strs, size_t **lens)
+{
+	hsize_t i;
+	herr_t ret;
+
+	*buf = NULL;
+	*strs = (char **) malloc(sizeof(char *) * (sdset->n + 1));
+	*lens = (size_t *) malloc(sizeof(size_t) * (sdset->n + 1));
+	if (*strs == NULL || *lens == NULL) {
+		free(*strs);
+		free(*lens);
+		PRINT_TO_ERRMSG_BUF("failed to allocate memory "
+				    "for the strings");
+		return -1;
+	}
+	if (sdset->is_vlen) {
+		ret = H5Dread(sdset->dset_id, sdset->type_id, H5S_ALL, H5S_ALL,
+			      H5P_DEFAULT, *strs);
+	} else {
+		*buf = (char *) malloc(sdset->size * sdset->n + 1);
+		if (*buf == NULL) {
+			free(*strs);
+			free(*lens);
+			PRINT_TO_ERRMSG_BUF("failed to allocate memory "
+					    "for the strings");
+			return -1;
+		}
+		ret = H5Dread(sdset->dset_id, sdset->type_id, H5S_ALL, H5S_ALL,
+			      H5P_DEFAULT, *buf);
+	}
+	if (ret < 0) {
+		free(*buf);
+		free(*strs);
+		free(*lens);
+		PRINT_TO_ERRMSG_BUF("failed to read dataset '%s'", sdset->name);
+		return -1;
+	}
+	for (i = 0; i < sdset->n; i++) {
+		if (sdset->is_vlen) {
+			if ((*strs)[i] == NULL) {
+				(*lens)[i] = 0;
+			} else {
+				(*lens)[i] = strlen((*strs)[i]);
+			}
+		} else {
+			(*strs)[i] = *buf + i * sdset->size;
+			(*lens)[i] = fixed_string_len((*strs)[i], sdset->size,
+						      sdset->spacepad);
+		}
+	}
+	return 0;
+}
+
+static void free_all_strings(StringDSet *sdset,
+			     char *buf, char **strs, size_t *lens)
+{
+	hsize_t i;
+
+	if (sdset->is_vlen) {
+		for (i = 0; i < sdset->n; i++)
+			if (strs[i] != NULL)
+				H5free_memory(strs[i]);
+	} else {
+		free(buf);
+	}
+	free(strs);
+	free(lens);
+	return;
+}
+
+
+/****************************************************************************
+ * C_h5writeDimnamesIndex()
+ */
+
+/* Return the nb of slots or 0 on error. */
+static hsize_t build_index(int **table, char **strs, const size_t *lens,
+			   hsize_t n)
+{
+	hsize_t nslot, mask, i, slot;
+	unsigned int h;
+	int pos, *row;
+
+	if (n > INT_MAX / 4) {
+		PRINT_TO_ERRMSG_BUF("too many strings to index");
+		return 0;
+	}
+	for (nslot = PROBE_WINDOW; nslot < 2 * n; nslot *= 2) {}
+	*table = (int *) calloc(2 * nslot, sizeof(int));
+	if (*table == NULL) {
+		PRINT_TO_ERRMSG_BUF("failed to allocate memory for the index");
+		return 0;
+	}
+	mask = nslot - 1;
+	for (i = 0; i < n; i++) {
+		h = hash_string(strs[i], lens[i]);
+		slot = h & mask;
+		while (1) {
+			row = *table + 2 * slot;
+			pos = row[1];
+			if (pos == 0) {
+				row[0] = (int) h;
+				row[1] = (int) i + 1;
+				break;
+			}
+			/* Don't insert duplicates. */
+			if ((unsigned int) row[0] == h &&
+			    lens[pos - 1] == lens[i] &&
+			    (lens[i] == 0 ||
+			     memcmp(strs[pos - 1], strs[i], lens[i]) == 0))
+				break;
+			slot = (slot + 1) & mask;
+		}
+	}
+	return nslot;
+}
+
+static int write_index(hid_t file_id, const char *index_name,
+		       const int *table, hsize_t nslot)
+{
+	hsize_t h5dim[2];
+	hid_t space_id, dset_id;
+	int ret;
+
+	h5dim[0] = nslot;
+	h5dim[1] = 2;
+	space_id = H5Screate_simple(2, h5dim, NULL);
+	if (space_id < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Screate_simple() returned an error");
+		return -1;
+	}
+	dset_id = H5Dcreate(file_id, index_name, H5T_STD_I32LE, space_id,
+			    H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+	H5Sclose(space_id);
+	if (dset_id < 0) {
+		PRINT_TO_ERRMSG_BUF("failed to create dataset '%s'",
+				    index_name);
+		return -1;
+	}
+	ret = H5Dwrite(dset_id, H5T_NATIVE_INT, H5S_ALL, H5S_ALL,
+		       H5P_DEFAULT, table);
+	H5Dclose(dset_id);
+	if (ret < 0) {
+		PRINT_TO_ERRMSG_BUF("failed to write dataset '%s'",
+				    index_name);
+		return -1;
+	}
+	return 0;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_h5writeDimnamesIndex(SEXP filepath, SEXP dimscale_name,
+			    SEXP index_name)
+{
+	const char *dimscale_name0, *index_name0;
+	hid_t file_id;
+	StringDSet sdset;
+	char *buf, **strs;
+	size_t *lens;
+	int *table, ret;
+	hsize_t nslot;
+
+	dimscale_name0 = get_string_arg(dimscale_name, "dimscale_name");
+	index_name0 = get_string_arg(index_name, "index_name");
+	file_id = _get_file_id(filepath, 0);  /* read/write */
+	if (open_StringDSet(&sdset, file_id, dimscale_name0) < 0) {
+		H5Fclose(file_id);
+		error(_HDF5Array_global_errmsg_buf());
+	}
+	ret = read_all_strings(&sdset, &buf, &strs, &lens);
+	if (ret < 0) {
+		close_StringDSet(&sdset);
+		H5Fclose(file_id);
+		error(_HDF5Array_global_errmsg_buf());
+	}
+	nslot = build_index(&table, strs, lens, sdset.n);
+	free_all_strings(&sdset, buf, strs, lens);
+	close_StringDSet(&sdset);
+	ret = nslot == 0 ? -1 : write_index(file_id, index_name0, table, nslot);
+	if (nslot != 0)
+		free(table);
+	H5Fclose(file_id);
+	if (ret < 0)
+		error(_HDF5Array_global_errmsg_buf());
+	return R_NilValue;
+}
+
+
+/****************************************************************************
+ * C_h5matchDimnames()
+ */
+
+typedef struct {
+	hid_t dset_id, space_id, mem_space_id;
+	hsize_t nslot;
+	/* The window of slots currently loaded in 'rows'. */
+	hsize_t window_start, window_len;
+	int rows[2 * PROBE_WINDOW];
+} DimnamesIndex;
+
+static void close_DimnamesIndex(DimnamesIndex *index)
+{
+	if (index->mem_space_id >= 0)
+		H5Sclose(index->mem_space_id);
+	if (index->space_id >= 0)
+		H5Sclose(index->space_id);
+	H5Dclose(index->dset_id);
+	return;
+}
+
+static int open_DimnamesIndex(DimnamesIndex *index, hid_t file_id,
+			      const char *index_name)
+{
+	hsize_t h5dim[2];
+
+	index->space_id = index->mem_space_id = -1;
+	index->window_start = index->window_len = 0;
+	index->dset_id = H5Dopen(file_id, index_name, H5P_DEFAULT);
+	if (index->dset_id < 0) {
+		PRINT_TO_ERRMSG_BUF("failed to open dataset '%s'", index_name);
+		return -1;
+	}
+	index->space_id = H5Dget_space(index->dset_id);
+	if (index->space_id < 0) {
+		close_DimnamesIndex(index);
+		PRINT_TO_ERRMSG_BUF("H5Dget_space() returned an error");
+		return -1;
+	}
+	if (H5Sget_simple_extent_ndims(index->space_id) != 2 ||
+	    H5Sget_simple_extent_dims(index->space_id, h5dim, NULL) < 0 ||
+	    h5dim[1] != 2 || h5dim[0] < PROBE_WINDOW ||
+	    (h5dim[0] & (h5dim[0] - 1)) != 0)
+	{
+		close_DimnamesIndex(index);
+		PRINT_TO_ERRMSG_BUF("'%s' is not a valid dimnames index",
+				    index_name);
+		return -1;
+	}
+	index->nslot = h5dim[0];
+	h5dim[0] = PROBE_WINDOW;
+	index->mem_space_id = H5Screate_simple(2, h5dim, NULL);
+	if (index->mem_space_id < 0) {
+		close_DimnamesIndex(index);
+		PRINT_TO_ERRMSG_BUF("H5Screate_simple() returned an error");
+		return -1;
+	}
+	return 0;
+}
+
+/* Return a pointer to the row of 'slot', or NULL on error. */
+static const int *get_slot(DimnamesIndex *index, hsize_t slot)
+{
+	hsize_t h5off[2], h5count[2];
+
+	if (slot >= index->window_start &&
+	    slot < index->window_start + index->window_len)
+		return index->rows + 2 * (slot - index->window_start);
+	/* 'nslot' is a multiple of PROBE_WINDOW so the window never wraps
+	   around the end of the table. */
+	h5off[0] = slot - slot % PROBE_WINDOW;
+	h5off[1] = 0;
+	h5count[0] = PROBE_WINDOW;
+	h5count[1] = 2;
+	if (H5Sselect_hyperslab(index->space_id, H5S_SELECT_SET,
+				h5off, NULL, h5count, NULL) < 0)
+	{
+		PRINT_TO_ERRMSG_BUF("H5Sselect_hyperslab() returned an error");
+		return NULL;
+	}
+	if (H5Dread(index->dset_id, H5T_NATIVE_INT, index->mem_space_id,
+		    index->space_id, H5P_DEFAULT, index->rows) < 0)
+	{
+		index->window_len = 0;
+		PRINT_TO_ERRMSG_BUF("failed to read the dimnames index");
+		return NULL;
+	}
+	index->window_start = h5off[0];
+	index->window_len = PROBE_WINDOW;
+	return index->rows + 2 * (slot - index->window_start);
+}
+
+/* Return the 1-based position of 'key' in 'sdset', 0 if it's not found,
+   or -1 on error. */
+static int lookup_key(DimnamesIndex *index, StringDSet *sdset,
+		      const char *key, size_t key_len)
+{
+	unsigned int h;
+	hsize_t mask, slot, nprobe;
+	const int *row;
+	const char *s;
+	size_t s_len;
+
+	h = hash_string(key, key_len);
+	mask = index->nslot - 1;
+	slot = h & mask;
+	for (nprobe = 0; nprobe < index->nslot; nprobe++) {
+		row = get_slot(index, slot);
+		if (row == NULL)
+			return -1;
+		if (row[1] == 0)
+			return 0;
+		if ((unsigned int) row[0] == h) {
+			if (row[1] < 0 || (hsize_t) row[1] > sdset->n) {
+				PRINT_TO_ERRMSG_BUF("invalid position %d "
+						    "in the dimnames index",
+						    row[1]);
+				return -1;
+			}
+			if (read_string(sdset, row[1] - 1, &s, &s_len) < 0)
+				return -1;
+			if (s_len == key_len && memcmp(s, key, key_len) == 0)
+				return row[1];
+		}
+		slot = (slot + 1) & mask;
+	}
+	return 0;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_h5matchDimnames(SEXP filepath, SEXP dimscale_name, SEXP index_name,
+		       SEXP keys)
+{
+	const char *dimscale_name0, *index_name0;
+	hid_t file_id;
+	StringDSet sdset;
+	DimnamesIndex index;
+	SEXP ans, key;
+	int nkey, i, pos, *ans_p;
+
+	dimscale_name0 = get_string_arg(dimscale_name, "dimscale_name");
+	index_name0 = get_string_arg(index_name, "index_name");
+	if (!IS_CHARACTER(keys))
+		error("'keys' must be a character vector");
+	file_id = _get_file_id(filepath, 1);  /* read-only */
+	if (open_StringDSet(&sdset, file_id, dimscale_name0) < 0) {
+		H5Fclose(file_id);
+		error(_HDF5Array_global_errmsg_buf());
+	}
+	if (open_DimnamesIndex(&index, file_id, index_name0) < 0) {
+		close_StringDSet(&sdset);
+		H5Fclose(file_id);
+		error(_HDF5Array_global_errmsg_buf());
+	}
+	nkey = LENGTH(keys);
+	ans = PROTECT(NEW_INTEGER(nkey));
+	ans_p = INTEGER(ans);
+	for (i = 0; i < nkey; i++) {
+		key = STRING_ELT(keys, i);
+		if (key == NA_STRING) {
+			ans_p[i] = NA_INTEGER;
+			continue;
+		}
+		pos = lookup_key(&index, &sdset, CHAR(key), LENGTH(key));
+		if (pos < 0)
+			break;
+		ans_p[i] = pos == 0 ? NA_INTEGER : pos;
+	}
+	close_DimnamesIndex(&index);
+	close_StringDSet(&sdset);
+	H5Fclose(file_id);
+	if (i < nkey) {
+		UNPROTECT(1);
+		error(_HDF5Array_global_errmsg_buf());
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
@@ -0,0 +1,20 @@
+#ifndef _H5DIMNAMES_INDEX_H_
+#define _H5DIMNAMES_INDEX_H_
+
+#include <Rdefines.h>
+
+SEXP C_h5writeDimnamesIndex(
+	SEXP filepath,
+	SEXP dimscale_name,
+	SEXP index_name
+);
+
+SEXP C_h5matchDimnames(
+	SEXP filepath,
+	SEXP dimscale_name,
+	SEXP index_name,
+	SEXP keys
+);
+
+#endif  /* _H5DIMNAMES_INDEX_H_ */
+
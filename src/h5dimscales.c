@@ -75,7 +75,12 @@ static herr_t visitor(hid_t dset_id, unsigned int along, hid_t dimscale_id,
 	return 0;
 }
 
-static int get_scale_along(const H5DSetDescriptor *h5dset,
+/* Return 1 if a Dimension Scale named 'scalename' (or any unnamed Dimension
+   Scale if 'scalename' is NULL) is attached along dimension 'along' of
+   'h5dset', in which case 'h5dimscale' is initialized and must be destroyed
+   by the caller. Return 0 if no such Dimension Scale is found, and -1 on
+   error. */
+int _get_h5dimscale_along(const H5DSetDescriptor *h5dset,
 		int along, const char *scalename,
 		H5DSetDescriptor *h5dimscale, CharAE *NAME_buf)
 {
@@ -119,8 +124,8 @@ SEXP C_h5getdimscales(SEXP filepath, SEXP name, SEXP scalename)
 
 	NAME_buf = new_CharAE(0);
 	for (along = 0; along < h5dset.ndim; along++) {
-		ret = get_scale_along(&h5dset, along, scalename0,
-				      &h5dimscale, NAME_buf);
+		ret = _get_h5dimscale_along(&h5dset, along, scalename0,
+					    &h5dimscale, NAME_buf);
 		if (ret < 0) {
 			_destroy_H5DSetDescriptor(&h5dset);
 			H5Dclose(dset_id);
@@ -253,8 +258,8 @@ static int check_scale_along(hid_t file_id, const H5DSetDescriptor *h5dset,
 				    h5dimscale.h5name);
 		return -1;
 	}
-	ret = get_scale_along(h5dset, along, scalename,
-			      &h5dimscale2, NAME_buf);
+	ret = _get_h5dimscale_along(h5dset, along, scalename,
+				    &h5dimscale2, NAME_buf);
 	if (ret < 0) {
 		_destroy_H5DSetDescriptor(&h5dimscale);
 		H5Dclose(dimscale_id);
@@ -501,46 +506,31 @@ SEXP C_h5setdimscales(SEXP filepath, SEXP name, SEXP dimscales, SEXP scalename,
  * C_h5getdimlabels() and C_h5setdimlabels()
  */
 
-/* --- .Call ENTRY POINT --- */
-SEXP C_h5getdimlabels(SEXP filepath, SEXP name)
+/* Return R_NilValue if the dataset has no dimension labels, or NULL on
+   error. The returned character vector is not protected. */
+SEXP _get_h5dimlabels(hid_t dset_id, int ndim)
 {
-	hid_t file_id, dset_id;
-	H5DSetDescriptor h5dset;
 	int along;
 	ssize_t max_label_size, label_size;
 	char *label_buf;
 	SEXP ans, ans_elt;
 
-	file_id = _get_file_id(filepath, 1);  /* read-only */
-	dset_id = _get_dset_id(file_id, name, filepath);
-	if (_init_H5DSetDescriptor(&h5dset, dset_id, 0, 0) < 0) {
-		H5Dclose(dset_id);
-		H5Fclose(file_id);
-		error(_HDF5Array_global_errmsg_buf());
-	}
-
 	/* First pass */
 	max_label_size = 0;
-	for (along = 0; along < h5dset.ndim; along++) {
+	for (along = 0; along < ndim; along++) {
 		label_size = H5DSget_label(dset_id, (unsigned int) along,
 					   NULL, 0);
 		if (label_size < 0) {
-			_destroy_H5DSetDescriptor(&h5dset);
-			H5Dclose(dset_id);
-			H5Fclose(file_id);
-			error("H5DSget_label() returned an error");
+			PRINT_TO_ERRMSG_BUF("H5DSget_label() returned an error");
+			return NULL;
 		}
 		//printf("label_size = %ld\n", label_size);
 		if (label_size > max_label_size)
 			max_label_size = label_size;
 	}
 
-	if (max_label_size == 0) {
-		_destroy_H5DSetDescriptor(&h5dset);
-		H5Dclose(dset_id);
-		H5Fclose(file_id);
+	if (max_label_size == 0)
 		return R_NilValue;
-	}
 
 	/* Second pass */
 	if (max_label_size > INT_MAX) {
@@ -550,22 +540,19 @@ SEXP C_h5getdimlabels(SEXP filepath, SEXP name)
 	}
 	label_buf = (char *) malloc((size_t) max_label_size + 1);
 	if (label_buf == NULL) {
-		_destroy_H5DSetDescriptor(&h5dset);
-		H5Dclose(dset_id);
-		H5Fclose(file_id);
-		error("failed to allocate memory for 'label_buf'");
+		PRINT_TO_ERRMSG_BUF("failed to allocate memory for 'label_buf'");
+		return NULL;
 	}
-	ans = PROTECT(NEW_CHARACTER(h5dset.ndim));
-	for (along = 0; along < h5dset.ndim; along++) {
+	ans = PROTECT(NEW_CHARACTER(ndim));
+	for (along = 0; along < ndim; along++) {
 		label_size = H5DSget_label(dset_id, (unsigned int) along,
 					   label_buf, max_label_size + 1);
 		/* Should never happen. */
 		if (label_size < 0) {
 			free(label_buf);
-			_destroy_H5DSetDescriptor(&h5dset);
-			H5Dclose(dset_id);
-			H5Fclose(file_id);
-			error("H5DSget_label() returned an error");
+			UNPROTECT(1);
+			PRINT_TO_ERRMSG_BUF("H5DSget_label() returned an error");
+			return NULL;
 		}
 		if (label_size > INT_MAX)
 			label_size = INT_MAX;
@@ -573,12 +560,31 @@ SEXP C_h5getdimlabels(SEXP filepath, SEXP name)
 		SET_STRING_ELT(ans, along, ans_elt);
 		UNPROTECT(1);
 	}
-
 	free(label_buf);
+	UNPROTECT(1);
+	return ans;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_h5getdimlabels(SEXP filepath, SEXP name)
+{
+	hid_t file_id, dset_id;
+	H5DSetDescriptor h5dset;
+	SEXP ans;
+
+	file_id = _get_file_id(filepath, 1);  /* read-only */
+	dset_id = _get_dset_id(file_id, name, filepath);
+	if (_init_H5DSetDescriptor(&h5dset, dset_id, 0, 0) < 0) {
+		H5Dclose(dset_id);
+		H5Fclose(file_id);
+		error(_HDF5Array_global_errmsg_buf());
+	}
+	ans = _get_h5dimlabels(dset_id, h5dset.ndim);
 	_destroy_H5DSetDescriptor(&h5dset);
 	H5Dclose(dset_id);
 	H5Fclose(file_id);
-	UNPROTECT(1);
+	if (ans == NULL)
+		error(_HDF5Array_global_errmsg_buf());
 	return ans;
 }
 
@@ -2,6 +2,20 @@
 #define _H5DIMSCALES_H_
 
 #include <Rdefines.h>
+#include "H5DSetDescriptor.h"
+
+int _get_h5dimscale_along(
+	const H5DSetDescriptor *h5dset,
+	int along,
+	const char *scalename,
+	H5DSetDescriptor *h5dimscale,
+	CharAE *NAME_buf
+);
+
+SEXP _get_h5dimlabels(
+	hid_t dset_id,
+	int ndim
+);
 
 SEXP C_h5isdimscale(
 	SEXP filepath,
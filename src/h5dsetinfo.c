@@ -0,0 +1,251 @@
+/****************************************************************************
+ *           Collect all the metadata of a dataset in a single pass         *
+ *                            Author: H. Pag\`es                            *
+ ****************************************************************************/
+#include "h5dsetinfo.h"
+
+#include "global_errmsg_buf.h"
+#include "H5DSetDescriptor.h"
+#include "h5dimscales.h"  /* for _get_h5dimscale_along(), _get_h5dimlabels() */
+#include "h5mread.h"  /* for _h5mread() */
+
+#include "hdf5_hl.h"
+
+/*
+ * C_h5dsetinfo() returns everything that the HDF5ArraySeed() constructor
+ * and validator need to know about a dataset, with a single opening of the
+ * file. This replaces a series of calls to h5dim(), h5chunkdim(),
+ * get_h5dimnames(), h5getdimlabels(), etc... that each had to open the
+ * file and the dataset again, which is slow on network file systems.
+ */
+
+enum {
+	INFO_DIM = 0,
+	INFO_CHUNKDIM,
+	INFO_LAYOUT,
+	INFO_H5CLASS,
+	INFO_H5SIZE,
+	INFO_TYPE,
+	INFO_STORAGE_MODE,
+	INFO_AS_NA,
+	INFO_FILTERS,
+	INFO_IS_DIMSCALE,
+	INFO_DIMSCALES,
+	INFO_DIMSCALE_LENGTHS,
+	INFO_DIMLABELS,
+	INFO_FIRST_VAL,
+	INFO_LENGTH
+};
+
+static const char *info_names[] = {
+	"dim", "chunkdim", "layout", "H5class", "H5size", "type",
+	"storage.mode", "as.na", "filters", "is_dimscale",
+	"dimscales", "dimscale_lengths", "dimlabels", "first_val"
+};
+
+/* The dimensions are returned as doubles (in R order) so that the caller
+   can report dimensions that are too big for an int. */
+static SEXP make_dim(int ndim, const hsize_t *h5dim)
+{
+	SEXP ans;
+	int along, h5along;
+
+	ans = PROTECT(NEW_NUMERIC(ndim));
+	for (along = 0, h5along = ndim - 1; along < ndim; along++, h5along--)
+		REAL(ans)[along] = (double) h5dim[h5along];
+	UNPROTECT(1);
+	return ans;
+}
+
+/* Return NULL on error. */
+static SEXP get_filters(hid_t plist_id)
+{
+	int nfilter, i;
+	unsigned int flags, filter_config;
+	size_t cd_nelmts;
+	char filter_name[80];
+	SEXP ans, ans_elt;
+
+	nfilter = H5Pget_nfilters(plist_id);
+	if (nfilter < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Pget_nfilters() returned an error");
+		return NULL;
+	}
+	ans = PROTECT(NEW_CHARACTER(nfilter));
+	for (i = 0; i < nfilter; i++) {
+		cd_nelmts = 0;
+		if (H5Pget_filter2(plist_id, (unsigned int) i, &flags,
+				   &cd_nelmts, NULL,
+				   sizeof(filter_name), filter_name,
+				   &filter_config) < 0)
+		{
+			UNPROTECT(1);
+			PRINT_TO_ERRMSG_BUF("H5Pget_filter2() "
+					    "returned an error");
+			return NULL;
+		}
+		ans_elt = PROTECT(mkChar(filter_name));
+		SET_STRING_ELT(ans, i, ans_elt);
+		UNPROTECT(1);
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+/* Set the INFO_DIMSCALES and INFO_DIMSCALE_LENGTHS elements of 'info'.
+   Return -1 on error. */
+static int set_dimscales(SEXP info, const H5DSetDescriptor *h5dset)
+{
+	SEXP dimscales, dimscale_lengths, dimscale;
+	H5DSetDescriptor h5dimscale;
+	CharAE *NAME_buf;
+	int along, ret, h5along;
+	double len;
+
+	dimscales = PROTECT(NEW_CHARACTER(h5dset->ndim));
+	SET_VECTOR_ELT(info, INFO_DIMSCALES, dimscales);
+	UNPROTECT(1);
+	dimscale_lengths = PROTECT(NEW_NUMERIC(h5dset->ndim));
+	SET_VECTOR_ELT(info, INFO_DIMSCALE_LENGTHS, dimscale_lengths);
+	UNPROTECT(1);
+	NAME_buf = new_CharAE(0);
+	for (along = 0; along < h5dset->ndim; along++) {
+		/* Same as get_h5dimnames() at the R level. */
+		ret = _get_h5dimscale_along(h5dset, along, "dimnames",
+					    &h5dimscale, NAME_buf);
+		if (ret < 0)
+			return -1;
+		if (ret == 0) {
+			SET_STRING_ELT(dimscales, along, NA_STRING);
+			REAL(dimscale_lengths)[along] = NA_REAL;
+			continue;
+		}
+		len = 1.0;
+		for (h5along = 0; h5along < h5dimscale.ndim; h5along++)
+			len *= (double) h5dimscale.h5dim[h5along];
+		REAL(dimscale_lengths)[along] = len;
+		dimscale = PROTECT(mkChar(h5dimscale.h5name));
+		SET_STRING_ELT(dimscales, along, dimscale);
+		UNPROTECT(1);
+		_destroy_H5DSetDescriptor(&h5dimscale);
+	}
+	return 0;
+}
+
+/* Read the first value of the dataset with _h5mread(). The dataset must
+   not be empty. Return R_NilValue on error. */
+static SEXP read_first_val(hid_t dset_id, int ndim)
+{
+	SEXP starts, ans;
+	int along;
+
+	if (ndim == 0)
+		return _h5mread(dset_id, R_NilValue, R_NilValue, 0, 0, 0,
+				PACKED_NONE, 0, WHERE_NONE, 0.0, 0);
+	starts = PROTECT(NEW_LIST(ndim));
+	for (along = 0; along < ndim; along++)
+		SET_VECTOR_ELT(starts, along, ScalarInteger(1));
+	ans = _h5mread(dset_id, starts, R_NilValue, 0, 0, 0, PACKED_NONE, 0,
+		       WHERE_NONE, 0.0, 0);
+	UNPROTECT(1);
+	return ans;
+}
+
+/* Return R_NilValue on error. */
+static SEXP h5dsetinfo(hid_t dset_id, int with_first_val)
+{
+	H5DSetDescriptor h5dset;
+	SEXP info, info_names0, info_elt;
+	int i, is_empty, ret;
+
+	if (_init_H5DSetDescriptor(&h5dset, dset_id, 0, 0) < 0)
+		return R_NilValue;
+
+	info = PROTECT(NEW_LIST(INFO_LENGTH));
+	info_names0 = PROTECT(NEW_CHARACTER(INFO_LENGTH));
+	for (i = 0; i < INFO_LENGTH; i++)
+		SET_STRING_ELT(info_names0, i, mkChar(info_names[i]));
+	SET_NAMES(info, info_names0);
+	UNPROTECT(1);
+
+	SET_VECTOR_ELT(info, INFO_DIM, make_dim(h5dset.ndim, h5dset.h5dim));
+	/* Not 'h5dset.h5chunkdim' which is artificially set on contiguous
+	   string data. */
+	if (h5dset.H5layout == H5D_CHUNKED)
+		SET_VECTOR_ELT(info, INFO_CHUNKDIM,
+			       make_dim(h5dset.ndim, h5dset.h5chunkdim));
+	SET_VECTOR_ELT(info, INFO_LAYOUT,
+		       mkString(_H5layout2str(h5dset.H5layout)));
+	SET_VECTOR_ELT(info, INFO_H5CLASS,
+		       mkString(_H5class2str(h5dset.H5class)));
+	SET_VECTOR_ELT(info, INFO_H5SIZE,
+		       ScalarReal((double) h5dset.H5size));
+	SET_VECTOR_ELT(info, INFO_TYPE, ScalarString(type2str(h5dset.Rtype)));
+	SET_VECTOR_ELT(info, INFO_STORAGE_MODE,
+		       h5dset.storage_mode_attr != NULL ?
+				mkString(h5dset.storage_mode_attr) :
+				ScalarString(NA_STRING));
+	SET_VECTOR_ELT(info, INFO_AS_NA, ScalarLogical(h5dset.as_na_attr));
+
+	info_elt = get_filters(h5dset.plist_id);
+	if (info_elt == NULL)
+		goto on_error;
+	SET_VECTOR_ELT(info, INFO_FILTERS, info_elt);
+
+	ret = H5DSis_scale(dset_id);
+	if (ret < 0) {
+		PRINT_TO_ERRMSG_BUF("H5DSis_scale() returned an error");
+		goto on_error;
+	}
+	SET_VECTOR_ELT(info, INFO_IS_DIMSCALE, ScalarLogical(ret));
+
+	if (set_dimscales(info, &h5dset) < 0)
+		goto on_error;
+
+	info_elt = _get_h5dimlabels(dset_id, h5dset.ndim);
+	if (info_elt == NULL)
+		goto on_error;
+	SET_VECTOR_ELT(info, INFO_DIMLABELS, info_elt);
+
+	if (with_first_val) {
+		is_empty = 0;
+		for (i = 0; i < h5dset.ndim; i++)
+			if (h5dset.h5dim[i] == 0)
+				is_empty = 1;
+		if (!is_empty) {
+			info_elt = read_first_val(dset_id, h5dset.ndim);
+			if (info_elt == R_NilValue)
+				goto on_error;
+			SET_VECTOR_ELT(info, INFO_FIRST_VAL, info_elt);
+		}
+	}
+
+	_destroy_H5DSetDescriptor(&h5dset);
+	UNPROTECT(1);
+	return info;
+
+    on_error:
+	_destroy_H5DSetDescriptor(&h5dset);
+	UNPROTECT(1);
+	return R_NilValue;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_h5dsetinfo(SEXP filepath, SEXP name, SEXP first_val)
+{
+	hid_t file_id, dset_id;
+	SEXP ans;
+
+	if (!(IS_LOGICAL(first_val) && LENGTH(first_val) == 1))
+		error("'first_val' must be TRUE or FALSE");
+	file_id = _get_file_id(filepath, 1);  /* read-only */
+	dset_id = _get_dset_id(file_id, name, filepath);
+	ans = PROTECT(h5dsetinfo(dset_id, LOGICAL(first_val)[0]));
+	H5Dclose(dset_id);
+	H5Fclose(file_id);
+	UNPROTECT(1);
+	if (ans == R_NilValue)
+		error(_HDF5Array_global_errmsg_buf());
+	return ans;
+}
+
@@ -0,0 +1,13 @@
+#ifndef _H5DSETINFO_H_
+#define _H5DSETINFO_H_
+
+#include <Rdefines.h>
+
+SEXP C_h5dsetinfo(
+	SEXP filepath,
+	SEXP name,
+	SEXP first_val
+);
+
+#endif  /* _H5DSETINFO_H_ */
+
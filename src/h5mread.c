@@ -10,15 +10,44 @@
 #include "h5mread_startscounts.h"
 #include "h5mread_starts.h"
 #include "h5mread_sparse.h"
+#include "h5mread_mmap.h"
+#include "h5mread_helpers.h"
+#include "h5mread_trace.h"
 
 #include "hdf5.h"
 
-/* Return -1 on error. */
+#include <string.h>  /* for strcmp */
+
+/* Return -1 on error. When it calls _mmap_read_is_possible(), the returned
+   value is stored in '*mmap_mode' so _h5mread_mmap() doesn't need to call it
+   again. */
 static int select_method(const H5DSetDescriptor *h5dset,
-			 SEXP starts, SEXP counts, int sparse, int method)
+			 SEXP starts, SEXP counts, int sparse, int method,
+			 int *mmap_mode)
 {
-	int along;
+	int along, ret;
 
+	if (h5dset->packed_type != PACKED_NONE) {
+		if (sparse) {
+			PRINT_TO_ERRMSG_BUF("'as.type' cannot be used when "
+					    "'as.sparse' is set to TRUE");
+			return -1;
+		}
+		/* Method 5 bypasses the type conversion machinery and
+		   method 9 reads the data as-is from the file. */
+		if (method == 5 || method == 9) {
+			PRINT_TO_ERRMSG_BUF("methods 5 and 9 cannot be used "
+					    "when 'as.type' is specified");
+			return -1;
+		}
+		if (method == 0 && h5dset->h5chunkdim == NULL)
+			return 1;
+	}
+	if (h5dset->where_op != WHERE_NONE && !sparse) {
+		PRINT_TO_ERRMSG_BUF("'where' can only be used when "
+				    "'as.sparse' is set to TRUE");
+		return -1;
+	}
 	if (sparse) {
 		if (counts != R_NilValue) {
 			PRINT_TO_ERRMSG_BUF("'counts' must be NULL when "
@@ -30,6 +59,11 @@ static int select_method(const H5DSetDescriptor *h5dset,
 					    "on a contiguous dataset");
 			return -1;
 		}
+		if (h5dset->is_variable_str) {
+			PRINT_TO_ERRMSG_BUF("'as.sparse=TRUE' is not supported "
+					    "on variable-length string data");
+			return -1;
+		}
 		if (method == 0) {
 			method = 8;
 		} else if (method != 8) {
@@ -53,9 +87,28 @@ static int select_method(const H5DSetDescriptor *h5dset,
 					    "string data");
 			return -1;
 		}
+		/* Method 5 bypasses the type conversion machinery so cannot
+		   turn the heap references stored in the chunks into
+		   strings. */
+		if (method == 5 && h5dset->is_variable_str) {
+			PRINT_TO_ERRMSG_BUF("only method 4 is supported when "
+					    "reading variable-length "
+					    "string data");
+			return -1;
+		}
 		return method;
 	}
 	if (method == 0) {
+		if (h5dset->h5chunkdim == NULL) {
+			/* Contiguous layout. Use method 9 (memory-mapped
+			   reads) if we can, otherwise method 1 (e.g. if
+			   the file is not accessed thru the sec2 driver). */
+			ret = _mmap_read_is_possible(h5dset);
+			if (ret < 0)
+				return -1;
+			*mmap_mode = ret;
+			return ret > 0 ? 9 : 1;
+		}
 		method = 1;
 		/* March 27, 2019: My early testing (from Nov 2018) seemed
 		   to indicate that method 6 was a better choice over method 4
@@ -87,10 +140,10 @@ static int select_method(const H5DSetDescriptor *h5dset,
 				}
 			}
 		}
-	} else if (method < 0 || method > 7) {
-		PRINT_TO_ERRMSG_BUF("'method' must be >= 0 and <= 7");
+	} else if (method < 0 || method > 9 || method == 8) {
+		PRINT_TO_ERRMSG_BUF("'method' must be >= 0 and <= 7, or 9");
 		return -1;
-	} else if (method >= 4) {
+	} else if (method >= 4 && method <= 7) {
 		/* Make sure the data is chunked and 'counts' is NULL. */
 		if (h5dset->h5chunkdim == NULL) {
 			PRINT_TO_ERRMSG_BUF("methods 4, 5, 6, and 7 cannot "
@@ -148,23 +201,36 @@ static void set_character_NAs(SEXP x)
 }
 
 /* Return R_NilValue on error. */
-static SEXP h5mread(hid_t dset_id, SEXP starts, SEXP counts, int noreduce,
-		    int as_int, int sparse, int method)
+SEXP _h5mread(hid_t dset_id, SEXP starts, SEXP counts, int noreduce,
+	      int as_int, int sparse, int packed_type, int method,
+	      int where_op, double where_value, int use_chunkstats)
 {
-	SEXP ans, ans_dim;
+	SEXP ans, ans_dim, packed_ans;
 	H5DSetDescriptor h5dset;
-	int ret;
+	int ret, zero_copy, mmap_mode, fixed_NAs;
 
 	ans = R_NilValue;
 
+	_trace_begin_call();
 	if (_init_H5DSetDescriptor(&h5dset, dset_id, as_int, 0) < 0)
 		return ans;
+	if (_set_H5DSetDescriptor_packed_type(&h5dset, packed_type) < 0)
+		goto on_error;
+	if (_set_H5DSetDescriptor_where(&h5dset, where_op, where_value) < 0)
+		goto on_error;
+	h5dset.use_chunkstats = use_chunkstats;
 
 	ret = _shallow_check_uaselection(h5dset.ndim, starts, counts);
 	if (ret < 0)
 		goto on_error;
 
-	method = select_method(&h5dset, starts, counts, sparse, method);
+	/* The array returned by method 9 can be backed by a memory mapping of
+	   the file only if the method was explicitly requested (see
+	   h5mread_mmap.c). */
+	zero_copy = method == 9;
+	mmap_mode = -1;
+	method = select_method(&h5dset, starts, counts, sparse, method,
+			       &mmap_mode);
 	if (method < 0)
 		goto on_error;
 
@@ -178,27 +244,45 @@ static SEXP h5mread(hid_t dset_id, SEXP starts, SEXP counts, int noreduce,
 		/* Implements methods 4 to 7. */
 		ans = _h5mread_starts(&h5dset, starts,
 				      method, INTEGER(ans_dim));
-	} else {
+	} else if (method == 8) {
 		/* Implements method 8.
 		   Return 'list(nzindex, nzdata, NULL)' or R_NilValue if
 		   an error occured. */
 		ans = _h5mread_sparse(&h5dset, starts, INTEGER(ans_dim));
+	} else {
+		/* Implements method 9. */
+		ans = _h5mread_mmap(&h5dset, starts, counts,
+				    mmap_mode, zero_copy, INTEGER(ans_dim));
 	}
 
 	if (ans != R_NilValue) {
 		PROTECT(ans);
+		/* When the data was loaded in its narrow type (methods 4, 7,
+		   and 8), the logical NAs were already fixed when widening
+		   it (see _widen_narrow_data()). */
+		fixed_NAs = h5dset.narrow_type != NARROW_NONE &&
+			    (method == 4 || method == 7 || method == 8);
 		if (sparse) {
-			if (h5dset.Rtype == LGLSXP)
+			if (h5dset.Rtype == LGLSXP && !fixed_NAs)
 				fix_logical_NAs(VECTOR_ELT(ans, 1));
 			else if (h5dset.Rtype == STRSXP && h5dset.as_na_attr)
 				set_character_NAs(VECTOR_ELT(ans, 1));
 			/* Final 'ans' is 'list(nzindex, nzdata, ans_dim)'. */
 			SET_VECTOR_ELT(ans, 2, ans_dim);
+		} else if (h5dset.packed_type != PACKED_NONE) {
+			/* 'ans' is a raw vector so we cannot set its dim.
+			   Final 'ans' is 'list(data, ans_dim)'. */
+			packed_ans = PROTECT(NEW_LIST(2));
+			SET_VECTOR_ELT(packed_ans, 0, ans);
+			SET_VECTOR_ELT(packed_ans, 1, ans_dim);
+			UNPROTECT(2);
+			PROTECT(ans = packed_ans);
 		} else {
-			if (h5dset.Rtype == LGLSXP)
+			if (h5dset.Rtype == LGLSXP && !fixed_NAs)
 				fix_logical_NAs(ans);
 			SET_DIM(ans, ans_dim);
 		}
+		_trace_end(&h5dset, method, INTEGER(ans_dim));
 		UNPROTECT(1);  /* 'ans' */
 	}
 
@@ -206,15 +290,56 @@ static SEXP h5mread(hid_t dset_id, SEXP starts, SEXP counts, int noreduce,
 
     on_error:
 	_destroy_H5DSetDescriptor(&h5dset);
+	_reset_scratch_arena();
 	return ans;
 }
 
+/* 'where' must be NULL or 'list(op, value)' where 'op' is one of "==", "!=",
+   "<", "<=", ">", ">=", and 'value' is a single non-NA number. Return the
+   WHERE_* code of 'op' (WHERE_NONE if 'where' is NULL) and store 'value'
+   in '*where_value'. */
+static int get_where_op(SEXP where, double *where_value)
+{
+	static const char *ops[] = {"==", "!=", "<", "<=", ">", ">="};
+	SEXP op, value;
+	const char *op0;
+	int i;
+
+	*where_value = 0.0;
+	if (where == R_NilValue)
+		return WHERE_NONE;
+	if (!(isVectorList(where) && LENGTH(where) == 2))
+		error("'where' must be NULL or a list of length 2");
+	op = VECTOR_ELT(where, 0);
+	value = VECTOR_ELT(where, 1);
+	if (!(IS_CHARACTER(op) && LENGTH(op) == 1 &&
+	      STRING_ELT(op, 0) != NA_STRING))
+		error("'where$op' must be a single string");
+	if (!(IS_NUMERIC(value) && LENGTH(value) == 1 &&
+	      !ISNAN(REAL(value)[0])))
+		error("'where$value' must be a single non-NA number");
+	op0 = CHAR(STRING_ELT(op, 0));
+	for (i = 0; i < WHERE_GE; i++) {
+		if (strcmp(op0, ops[i]) == 0) {
+			*where_value = REAL(value)[0];
+			return WHERE_EQ + i;
+		}
+	}
+	error("'where$op' must be one of \"==\", \"!=\", \"<\", \"<=\", "
+	      "\">\", \">=\"");
+	return WHERE_NONE;  /* will never reach this */
+}
+
 /* --- .Call ENTRY POINT --- */
 SEXP C_h5mread(SEXP filepath, SEXP name,
 	       SEXP starts, SEXP counts, SEXP noreduce,
-	       SEXP as_integer, SEXP as_sparse, SEXP method)
+	       SEXP as_integer, SEXP as_sparse, SEXP as_type, SEXP method,
+	       SEXP where, SEXP use_chunkstats)
 {
-	int noreduce0, as_int, sparse, method0;
+	int noreduce0, as_int, sparse, packed_type, method0, where_op,
+	    use_chunkstats0;
+	double where_value;
+	const char *as_type0;
 	hid_t file_id, dset_id;
 	SEXP ans;
 
@@ -233,20 +358,47 @@ SEXP C_h5mread(SEXP filepath, SEXP name,
 		error("'as_sparse' must be TRUE or FALSE");
 	sparse = LOGICAL(as_sparse)[0];
 
+	/* Check 'as_type'. */
+	packed_type = PACKED_NONE;
+	if (as_type != R_NilValue) {
+		if (!(IS_CHARACTER(as_type) && LENGTH(as_type) == 1 &&
+		      STRING_ELT(as_type, 0) != NA_STRING))
+			error("'as_type' must be NULL or a single string");
+		as_type0 = CHAR(STRING_ELT(as_type, 0));
+		if (strcmp(as_type0, "float32") == 0)
+			packed_type = PACKED_FLOAT32;
+		else if (strcmp(as_type0, "uint16") == 0)
+			packed_type = PACKED_UINT16;
+		else
+			error("'as_type' must be \"float32\" or \"uint16\"");
+	}
+
 	/* Check 'method'. */
 	if (!(IS_INTEGER(method) && LENGTH(method) == 1))
 		error("'method' must be a single integer");
 	method0 = INTEGER(method)[0];
 
+	/* Check 'where'. */
+	where_op = get_where_op(where, &where_value);
+
+	/* Check 'use_chunkstats'. */
+	if (!(IS_LOGICAL(use_chunkstats) && LENGTH(use_chunkstats) == 1))
+		error("'use_chunkstats' must be TRUE or FALSE");
+	use_chunkstats0 = LOGICAL(use_chunkstats)[0];
+
 	file_id = _get_file_id(filepath, 1);
 	dset_id = _get_dset_id(file_id, name, filepath);
-	ans = PROTECT(h5mread(dset_id, starts, counts, noreduce0,
-			      as_int, sparse, method0));
+	_trace_begin(filepath);
+	ans = PROTECT(_h5mread(dset_id, starts, counts, noreduce0,
+			       as_int, sparse, packed_type, method0,
+			       where_op, where_value, use_chunkstats0));
 	H5Dclose(dset_id);
 	H5Fclose(file_id);
 	UNPROTECT(1);
-	if (ans == R_NilValue)
+	if (ans == R_NilValue) {
+		_trace_cancel();
 		error(_HDF5Array_global_errmsg_buf());
+	}
 	return ans;
 }
 
@@ -2,6 +2,21 @@
 #define _H5MREAD_H_
 
 #include <Rdefines.h>
+#include "hdf5.h"
+
+SEXP _h5mread(
+	hid_t dset_id,
+	SEXP starts,
+	SEXP counts,
+	int noreduce,
+	int as_int,
+	int sparse,
+	int packed_type,
+	int method,
+	int where_op,
+	double where_value,
+	int use_chunkstats
+);
 
 SEXP C_h5mread(
 	SEXP filepath,
@@ -11,7 +26,10 @@ SEXP C_h5mread(
 	SEXP noreduce,
 	SEXP as_integer,
 	SEXP as_sparse,
-	SEXP method
+	SEXP as_type,
+	SEXP method,
+	SEXP where,
+	SEXP use_chunkstats
 );
 
 #endif  /* _H5MREAD_H_ */
@@ -0,0 +1,446 @@
+/****************************************************************************
+ *           Reading data from a virtually reshaped HDF5 dataset            *
+ *                            Author: H. Pag\`es                            *
+ ****************************************************************************/
+#include "h5mread_from_reshaped.h"
+
+#include "global_errmsg_buf.h"
+#include "H5DSetDescriptor.h"
+#include "h5mread.h"  /* for _h5mread() */
+#include "h5mread_trace.h"
+
+#include "hdf5.h"
+
+#include <limits.h>  /* for INT_MAX */
+#include <stdlib.h>  /* for qsort, bsearch */
+#include <string.h>  /* for memcpy */
+
+/*
+ * The reshaped dataset is obtained by collapsing dimensions 'along1' to
+ * 'along2' of the HDF5 dataset into a single dimension (see
+ * find_dims_to_collapse() in R/h5mread_from_reshaped.R). The linear indices
+ * in 'start1' (the subscript along the collapsed dimension) are translated
+ * into coordinates along the original dimensions, and the data is read with
+ * one or more _h5mread() calls on a dataset that is opened only once. Each
+ * call returns a "source" array whose rows along dimensions 'along1' to
+ * 'along2' are then copied to their final place in the reshaped array.
+ */
+
+/* If the bounding selection (i.e. the cartesian product of the unique
+   coordinates along each collapsed dimension) has at most BOUNDING_FACTOR
+   times as many rows as there are indices in 'start1', we read it with a
+   single _h5mread() call. Otherwise we make one _h5mread() call per run of
+   consecutive indices in 'start1' that only move along the first collapsed
+   dimension. */
+#define	BOUNDING_FACTOR	4.0
+
+
+/****************************************************************************
+ * Helpers
+ */
+
+/* Get the dimensions of the dataset in R order. Return -1 on error. */
+static int get_dim0(hid_t dset_id, int ndim, long long int *dim0)
+{
+	hid_t space_id;
+	hsize_t *h5dim;
+	int ret, along, h5along;
+
+	space_id = H5Dget_space(dset_id);
+	if (space_id < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Dget_space() returned an error");
+		return -1;
+	}
+	ret = H5Sget_simple_extent_ndims(space_id);
+	if (ret != ndim) {
+		H5Sclose(space_id);
+		PRINT_TO_ERRMSG_BUF("'starts' must have one list element "
+				    "per dimension in the HDF5 dataset");
+		return -1;
+	}
+	h5dim = (hsize_t *) R_alloc(ndim, sizeof(hsize_t));
+	ret = H5Sget_simple_extent_dims(space_id, h5dim, NULL);
+	H5Sclose(space_id);
+	if (ret != ndim) {
+		PRINT_TO_ERRMSG_BUF("H5Sget_simple_extent_dims() "
+				    "returned an error");
+		return -1;
+	}
+	for (along = 0, h5along = ndim - 1; along < ndim; along++, h5along--)
+		dim0[along] = (long long int) h5dim[h5along];
+	return 0;
+}
+
+/* Translate the linear indices in 'start1' into 0-based coordinates along
+   the 'ncdim' collapsed dimensions. The coordinates of the i-th index are
+   stored in 'coords[i * ncdim]' to 'coords[i * ncdim + ncdim - 1]'.
+   Return -1 on error. */
+static int decompose_start1(SEXP start1, int along1,
+			    const long long int *cdim, int ncdim, int *coords)
+{
+	R_xlen_t n, i;
+	double clen, v;
+	long long int x;
+	int d;
+
+	clen = 1.0;
+	for (d = 0; d < ncdim; d++)
+		clen *= (double) cdim[d];
+	n = XLENGTH(start1);
+	for (i = 0; i < n; i++) {
+		if (IS_INTEGER(start1)) {
+			if (INTEGER(start1)[i] == NA_INTEGER)
+				goto on_NA;
+			v = (double) INTEGER(start1)[i];
+		} else {
+			v = REAL(start1)[i];
+			if (ISNAN(v))
+				goto on_NA;
+		}
+		if (v < 1.0 || v >= clen + 1.0) {
+			PRINT_TO_ERRMSG_BUF("'starts[[%d]]' contains "
+					    "out-of-bounds indices", along1 + 1);
+			return -1;
+		}
+		x = (long long int) v - 1;
+		for (d = 0; d < ncdim; d++) {
+			coords[i * ncdim + d] = (int) (x % cdim[d]);
+			x /= cdim[d];
+		}
+	}
+	return 0;
+
+    on_NA:
+	PRINT_TO_ERRMSG_BUF("'starts[[%d]]' contains NAs", along1 + 1);
+	return -1;
+}
+
+/* The source and final arrays are seen as 3D arrays of dimensions
+   nL x m x nR and nL x n x nR, respectively. Copy rows 'src_rows[0]' to
+   'src_rows[k - 1]' of the source array to rows 'ans_off' to
+   'ans_off + k - 1' of the final array.
+   Return -1 on error. */
+static int copy_rows(SEXP src, R_xlen_t m, const R_xlen_t *src_rows,
+		     R_xlen_t k, SEXP ans, R_xlen_t n, R_xlen_t ans_off,
+		     R_xlen_t nL, R_xlen_t nR)
+{
+	R_xlen_t r, j, src_i, ans_i, l;
+	size_t size;
+	const char *src_p;
+	char *ans_p;
+
+	if (TYPEOF(ans) == STRSXP) {
+		for (r = 0; r < nR; r++) {
+			for (j = 0; j < k; j++) {
+				src_i = (r * m + src_rows[j]) * nL;
+				ans_i = (r * n + ans_off + j) * nL;
+				for (l = 0; l < nL; l++)
+					SET_STRING_ELT(ans, ans_i + l,
+						STRING_ELT(src, src_i + l));
+			}
+		}
+		return 0;
+	}
+	switch (TYPEOF(ans)) {
+	    case LGLSXP:
+		size = sizeof(int);
+		src_p = (const char *) LOGICAL(src);
+		ans_p = (char *) LOGICAL(ans);
+		break;
+	    case INTSXP:
+		size = sizeof(int);
+		src_p = (const char *) INTEGER(src);
+		ans_p = (char *) INTEGER(ans);
+		break;
+	    case REALSXP:
+		size = sizeof(double);
+		src_p = (const char *) REAL(src);
+		ans_p = (char *) REAL(ans);
+		break;
+	    case RAWSXP:
+		size = sizeof(Rbyte);
+		src_p = (const char *) RAW(src);
+		ans_p = (char *) RAW(ans);
+		break;
+	    default:
+		PRINT_TO_ERRMSG_BUF("unsupported type: %s",
+				    CHAR(type2str(TYPEOF(ans))));
+		return -1;
+	}
+	size *= nL;
+	for (r = 0; r < nR; r++) {
+		for (j = 0; j < k; j++) {
+			src_i = r * m + src_rows[j];
+			ans_i = r * n + ans_off + j;
+			memcpy(ans_p + ans_i * size, src_p + src_i * size,
+			       size);
+		}
+	}
+	return 0;
+}
+
+/* Allocate the final array based on the type and dimensions of the first
+   source array. */
+static SEXP alloc_ans(SEXP src, int ndim0, int along1, int along2, int n,
+		      R_xlen_t *nL, R_xlen_t *nR)
+{
+	SEXP src_dim, ans_dim, ans;
+	int ndim, along0, along;
+
+	src_dim = GET_DIM(src);
+	ndim = ndim0 - (along2 - along1);
+	ans_dim = PROTECT(NEW_INTEGER(ndim));
+	*nL = *nR = 1;
+	for (along0 = along = 0; along0 < ndim0; along0++) {
+		if (along0 < along1) {
+			*nL *= INTEGER(src_dim)[along0];
+		} else if (along0 > along2) {
+			*nR *= INTEGER(src_dim)[along0];
+		} else {
+			if (along0 == along1)
+				INTEGER(ans_dim)[along++] = n;
+			continue;
+		}
+		INTEGER(ans_dim)[along++] = INTEGER(src_dim)[along0];
+	}
+	ans = PROTECT(allocVector(TYPEOF(src), *nL * (R_xlen_t) n * *nR));
+	SET_DIM(ans, ans_dim);
+	UNPROTECT(2);
+	return ans;
+}
+
+
+/****************************************************************************
+ * read_bounding_selection() and read_runs()
+ *
+ * Both return R_NilValue on error. 'starts' is a copy of the user-supplied
+ * 'starts' that is modified in place.
+ */
+
+static SEXP read_bounding_selection(SEXP filepath, hid_t dset_id,
+		SEXP starts, int along1, int along2,
+		const long long int *cdim, const int *coords, int n,
+		const int *nuniq, int **ranks,
+		int noreduce, int as_int, int method)
+{
+	int ndim0, ncdim, d, c, u;
+	R_xlen_t i, m, stride, *src_rows, nL, nR;
+	SEXP start, src, ans;
+
+	ndim0 = LENGTH(starts);
+	ncdim = along2 - along1 + 1;
+	for (d = 0; d < ncdim; d++) {
+		start = PROTECT(NEW_INTEGER(nuniq[d]));
+		for (c = u = 0; c < cdim[d]; c++)
+			if (ranks[d][c] >= 0)
+				INTEGER(start)[u++] = c + 1;
+		SET_VECTOR_ELT(starts, along1 + d, start);
+		UNPROTECT(1);
+	}
+	src_rows = (R_xlen_t *) R_alloc(n, sizeof(R_xlen_t));
+	for (i = 0; i < n; i++) {
+		src_rows[i] = 0;
+		stride = 1;
+		for (d = 0; d < ncdim; d++) {
+			src_rows[i] += ranks[d][coords[i * ncdim + d]] * stride;
+			stride *= nuniq[d];
+		}
+	}
+	m = 1;
+	for (d = 0; d < ncdim; d++)
+		m *= nuniq[d];
+
+	_trace_begin(filepath);
+	src = PROTECT(_h5mread(dset_id, starts, R_NilValue, noreduce,
+			       as_int, 0, PACKED_NONE, method,
+			       WHERE_NONE, 0.0, 0));
+	if (src == R_NilValue) {
+		UNPROTECT(1);
+		_trace_cancel();
+		return R_NilValue;
+	}
+	ans = PROTECT(alloc_ans(src, ndim0, along1, along2, n, &nL, &nR));
+	if (copy_rows(src, m, src_rows, n, ans, n, 0, nL, nR) < 0) {
+		UNPROTECT(2);
+		return R_NilValue;
+	}
+	UNPROTECT(2);
+	return ans;
+}
+
+static int compar_ints(const void *p1, const void *p2)
+{
+	int i1, i2;
+
+	i1 = *((const int *) p1);
+	i2 = *((const int *) p2);
+	return (i1 > i2) - (i1 < i2);
+}
+
+static SEXP read_runs(SEXP filepath, hid_t dset_id,
+		SEXP starts, int along1, int along2,
+		const int *coords, int n,
+		int noreduce, int as_int, int method)
+{
+	int ndim0, ncdim, off, k, d, j, u, *sorted_buf, *p;
+	R_xlen_t nL, nR, *src_rows;
+	SEXP ans, start, src;
+	PROTECT_INDEX ans_pidx;
+
+	ndim0 = LENGTH(starts);
+	ncdim = along2 - along1 + 1;
+	sorted_buf = (int *) R_alloc(n, sizeof(int));
+	src_rows = (R_xlen_t *) R_alloc(n, sizeof(R_xlen_t));
+	PROTECT_WITH_INDEX(ans = R_NilValue, &ans_pidx);
+	nL = nR = 0;
+	for (off = 0; off < n; off += k) {
+		/* Find the run that starts at 'off'. */
+		for (k = 1; off + k < n; k++) {
+			for (d = 1; d < ncdim; d++)
+				if (coords[(off + k) * ncdim + d] !=
+				    coords[off * ncdim + d])
+					break;
+			if (d < ncdim)
+				break;
+		}
+		/* Like h5mread() at the R level, we read the sorted unique
+		   coordinates along the first collapsed dimension and
+		   re-expand them when copying the rows. */
+		for (j = 0; j < k; j++)
+			sorted_buf[j] = coords[(off + j) * ncdim];
+		qsort(sorted_buf, k, sizeof(int), compar_ints);
+		for (j = u = 1; j < k; j++)
+			if (sorted_buf[j] != sorted_buf[u - 1])
+				sorted_buf[u++] = sorted_buf[j];
+		for (j = 0; j < k; j++) {
+			p = bsearch(coords + (off + j) * ncdim, sorted_buf, u,
+				    sizeof(int), compar_ints);
+			src_rows[j] = p - sorted_buf;
+		}
+		start = PROTECT(NEW_INTEGER(u));
+		for (j = 0; j < u; j++)
+			INTEGER(start)[j] = sorted_buf[j] + 1;
+		SET_VECTOR_ELT(starts, along1, start);
+		UNPROTECT(1);
+		for (d = 1; d < ncdim; d++)
+			SET_VECTOR_ELT(starts, along1 + d,
+				ScalarInteger(coords[off * ncdim + d] + 1));
+
+		_trace_begin(filepath);
+		src = PROTECT(_h5mread(dset_id, starts, R_NilValue, noreduce,
+				       as_int, 0, PACKED_NONE, method,
+				       WHERE_NONE, 0.0, 0));
+		if (src == R_NilValue) {
+			UNPROTECT(2);
+			_trace_cancel();
+			return R_NilValue;
+		}
+		if (ans == R_NilValue)
+			REPROTECT(ans = alloc_ans(src, ndim0, along1, along2,
+						  n, &nL, &nR), ans_pidx);
+		if (copy_rows(src, u, src_rows, k, ans, n, off, nL, nR) < 0) {
+			UNPROTECT(2);
+			return R_NilValue;
+		}
+		UNPROTECT(1);
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+/* Return R_NilValue on error. */
+static SEXP h5mread_from_reshaped(SEXP filepath, hid_t dset_id,
+		SEXP starts, int along1, int along2, SEXP start1,
+		int noreduce, int as_int, int method)
+{
+	int ndim0, ncdim, n, d, i, c, *coords, *nuniq, **ranks;
+	long long int *dim0;
+	double bounding_len;
+
+	ndim0 = LENGTH(starts);
+	dim0 = (long long int *) R_alloc(ndim0, sizeof(long long int));
+	if (get_dim0(dset_id, ndim0, dim0) < 0)
+		return R_NilValue;
+	if (XLENGTH(start1) > INT_MAX) {
+		PRINT_TO_ERRMSG_BUF("'starts[[%d]]' is too long", along1 + 1);
+		return R_NilValue;
+	}
+	n = LENGTH(start1);
+	ncdim = along2 - along1 + 1;
+	coords = (int *) R_alloc((size_t) n * ncdim, sizeof(int));
+	if (decompose_start1(start1, along1, dim0 + along1, ncdim, coords) < 0)
+		return R_NilValue;
+
+	/* Rank the unique coordinates along each collapsed dimension. */
+	nuniq = (int *) R_alloc(ncdim, sizeof(int));
+	ranks = (int **) R_alloc(ncdim, sizeof(int *));
+	bounding_len = 1.0;
+	for (d = 0; d < ncdim; d++) {
+		ranks[d] = (int *) R_alloc(dim0[along1 + d], sizeof(int));
+		for (c = 0; c < dim0[along1 + d]; c++)
+			ranks[d][c] = -1;
+		for (i = 0; i < n; i++)
+			ranks[d][coords[i * ncdim + d]] = 0;
+		nuniq[d] = 0;
+		for (c = 0; c < dim0[along1 + d]; c++)
+			if (ranks[d][c] >= 0)
+				ranks[d][c] = nuniq[d]++;
+		bounding_len *= nuniq[d];
+	}
+
+	if (bounding_len <= BOUNDING_FACTOR * n)
+		return read_bounding_selection(filepath, dset_id,
+				starts, along1, along2,
+				dim0 + along1, coords, n, nuniq, ranks,
+				noreduce, as_int, method);
+	return read_runs(filepath, dset_id, starts, along1, along2,
+			 coords, n, noreduce, as_int, method);
+}
+
+/* --- .Call ENTRY POINT ---
+ * 'collapse_along' must be the 1-based 'c(along1, along2)' vector returned
+ * by find_dims_to_collapse(). 'starts' must be a list with one element per
+ * dimension in the HDF5 dataset. Its elements 'along1' to 'along2' are
+ * ignored (they get replaced with the coordinates derived from 'start1').
+ * 'start1' must be a non-empty numeric vector of linear indices along the
+ * collapsed dimension.
+ */
+SEXP C_h5mread_from_reshaped(SEXP filepath, SEXP name,
+		SEXP collapse_along, SEXP starts, SEXP start1,
+		SEXP noreduce, SEXP as_integer, SEXP method)
+{
+	int along1, along2;
+	hid_t file_id, dset_id;
+	SEXP starts0, ans;
+
+	if (!(IS_INTEGER(collapse_along) && LENGTH(collapse_along) == 2))
+		error("'collapse_along' must be an integer vector of length 2");
+	along1 = INTEGER(collapse_along)[0] - 1;
+	along2 = INTEGER(collapse_along)[1] - 1;
+	if (!isVectorList(starts) ||
+	    along1 < 0 || along2 <= along1 || along2 >= LENGTH(starts))
+		error("invalid 'collapse_along' or 'starts'");
+	if (!(IS_INTEGER(start1) || IS_NUMERIC(start1)))
+		error("'start1' must be a numeric vector");
+	if (!(IS_LOGICAL(noreduce) && LENGTH(noreduce) == 1))
+		error("'noreduce' must be TRUE or FALSE");
+	if (!(IS_LOGICAL(as_integer) && LENGTH(as_integer) == 1))
+		error("'as_integer' must be TRUE or FALSE");
+	if (!(IS_INTEGER(method) && LENGTH(method) == 1))
+		error("'method' must be a single integer");
+
+	starts0 = PROTECT(shallow_duplicate(starts));
+	file_id = _get_file_id(filepath, 1);  /* read-only */
+	dset_id = _get_dset_id(file_id, name, filepath);
+	ans = PROTECT(h5mread_from_reshaped(filepath, dset_id,
+				starts0, along1, along2, start1,
+				LOGICAL(noreduce)[0], LOGICAL(as_integer)[0],
+				INTEGER(method)[0]));
+	H5Dclose(dset_id);
+	H5Fclose(file_id);
+	UNPROTECT(2);
+	if (ans == R_NilValue)
+		error(_HDF5Array_global_errmsg_buf());
+	return ans;
+}
+
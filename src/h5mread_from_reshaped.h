@@ -0,0 +1,18 @@
+#ifndef _H5MREAD_FROM_RESHAPED_H_
+#define _H5MREAD_FROM_RESHAPED_H_
+
+#include <Rdefines.h>
+
+SEXP C_h5mread_from_reshaped(
+	SEXP filepath,
+	SEXP name,
+	SEXP collapse_along,
+	SEXP starts,
+	SEXP start1,
+	SEXP noreduce,
+	SEXP as_integer,
+	SEXP method
+);
+
+#endif  /* _H5MREAD_FROM_RESHAPED_H_ */
+
@@ -17,8 +17,11 @@ Some useful links:
 #include "global_errmsg_buf.h"
 #include "uaselection.h"
 #include "H5DSetDescriptor.h"
+#include "h5mread_trace.h"
 
 #include <stdlib.h>  /* for malloc, free */
+#include <string.h>  /* for memset */
+#include <sys/stat.h>  /* for stat() */
 #include <zlib.h>  /* for uncompress(), Z_OK, Z_MEM_ERROR, etc.. */
 
 
@@ -45,7 +48,443 @@ static void print_chunk_data(const H5DSetDescriptor *h5dset,
 
 
 /****************************************************************************
- * Memory management of H5Viewport structs
+ * Scratch arena
+ *
+ * All the scratch memory needed during an h5mread() call (viewports,
+ * multidimensional indices, coordinate buffers, etc...) is carved out of
+ * a single arena that is reset at the end of the call. The arena is made
+ * of a chain of blocks. When more than one block was needed during a call,
+ * the blocks get consolidated into a single bigger block at reset time so
+ * subsequent calls of similar size never hit malloc(). Note that the arena
+ * is owned by the thread that calls h5mread() (i.e. R's main thread) and
+ * must never be used from any other thread.
+ */
+
+typedef struct scratch_block_t {
+	struct scratch_block_t *prev;
+	size_t size, used;
+} ScratchBlock;
+
+#define	SCRATCH_ALIGNMENT		16
+#define	SCRATCH_HEADER_SIZE		((sizeof(ScratchBlock) + \
+					  SCRATCH_ALIGNMENT - 1) & \
+					 ~((size_t) SCRATCH_ALIGNMENT - 1))
+#define	SCRATCH_BLOCK_MINSIZE		65536	/* 64 KB */
+#define	SCRATCH_ARENA_MAXSIZE		16777216	/* 16 MB */
+
+static ScratchBlock *scratch_arena = NULL;
+
+static ScratchBlock *new_scratch_block(size_t size, ScratchBlock *prev)
+{
+	ScratchBlock *block;
+
+	if (size < SCRATCH_BLOCK_MINSIZE)
+		size = SCRATCH_BLOCK_MINSIZE;
+	block = (ScratchBlock *) malloc(SCRATCH_HEADER_SIZE + size);
+	if (block == NULL)
+		return NULL;
+	block->prev = prev;
+	block->size = size;
+	block->used = 0;
+	return block;
+}
+
+/* Return a pointer to 'size' bytes of scratch memory (aligned on
+   SCRATCH_ALIGNMENT bytes) or NULL if an error occured. The memory will
+   be released by the next call to _reset_scratch_arena(). */
+void *_scratch_alloc(size_t size, int zeroes, const char *what)
+{
+	ScratchBlock *block;
+	char *p;
+
+	size = (size + SCRATCH_ALIGNMENT - 1) &
+	       ~((size_t) SCRATCH_ALIGNMENT - 1);
+	block = scratch_arena;
+	if (block == NULL || block->size - block->used < size) {
+		/* Grow geometrically. */
+		block = new_scratch_block(block == NULL || size > block->size ?
+					  size : 2 * block->size, block);
+		if (block == NULL) {
+			PRINT_TO_ERRMSG_BUF("failed to allocate memory "
+					    "for %s", what);
+			return NULL;
+		}
+		scratch_arena = block;
+	}
+	p = (char *) block + SCRATCH_HEADER_SIZE + block->used;
+	block->used += size;
+	if (zeroes)
+		memset(p, 0, size);
+	return p;
+}
+
+static void reset_scratch_blocks(void)
+{
+	ScratchBlock *block, *prev;
+	size_t total_size;
+
+	if (scratch_arena == NULL)
+		return;
+	if (scratch_arena->prev == NULL &&
+	    scratch_arena->size <= SCRATCH_ARENA_MAXSIZE)
+	{
+		scratch_arena->used = 0;
+		return;
+	}
+	/* Consolidate (or shrink). */
+	total_size = 0;
+	for (block = scratch_arena; block != NULL; block = prev) {
+		prev = block->prev;
+		total_size += block->size;
+		free(block);
+	}
+	if (total_size > SCRATCH_ARENA_MAXSIZE)
+		total_size = SCRATCH_BLOCK_MINSIZE;
+	/* If this fails, the arena will be re-created on the next call
+	   to _scratch_alloc(). */
+	scratch_arena = new_scratch_block(total_size, NULL);
+	return;
+}
+
+/* The buffer used to load the chunk data is retained between calls. It
+   only gets reallocated when the requested size changes (i.e. when we
+   switch to a dataset with a different chunk geometry or type), or
+   released at reset time when it's too big to be worth keeping around. */
+
+#define	RETAINED_CHUNK_DATA_BUF_MAXSIZE	67108864	/* 64 MB */
+
+static void *retained_chunk_data_buf = NULL;
+static size_t retained_chunk_data_buf_size = 0;
+
+void *_get_chunk_data_buf(size_t size)
+{
+	if (retained_chunk_data_buf != NULL) {
+		if (retained_chunk_data_buf_size == size)
+			return retained_chunk_data_buf;
+		free(retained_chunk_data_buf);
+	}
+	retained_chunk_data_buf = malloc(size);
+	if (retained_chunk_data_buf == NULL) {
+		retained_chunk_data_buf_size = 0;
+		PRINT_TO_ERRMSG_BUF("failed to allocate memory "
+				    "for 'chunk_data_buf'");
+		return NULL;
+	}
+	retained_chunk_data_buf_size = size;
+	return retained_chunk_data_buf;
+}
+
+static void reset_charsxp_cache(void);
+
+/* To call at the end of each h5mread() call. */
+void _reset_scratch_arena(void)
+{
+	reset_charsxp_cache();
+	reset_scratch_blocks();
+	if (retained_chunk_data_buf_size > RETAINED_CHUNK_DATA_BUF_MAXSIZE) {
+		free(retained_chunk_data_buf);
+		retained_chunk_data_buf = NULL;
+		retained_chunk_data_buf_size = 0;
+	}
+	return;
+}
+
+
+/****************************************************************************
+ * CHARSXP cache
+ *
+ * A per-call open-addressing hash table that maps the bytes of a string
+ * (the raw fixed-width bytes for fixed-length strings) to the CHARSXP it
+ * turns into. When the same value shows up many times in the selection
+ * (e.g. categorical labels), R's global CHARSXP hash table is only hit
+ * once per distinct value, and the scan for the terminating null byte
+ * and the "NA" check are only done once per distinct value too. The
+ * table and the copies of the keys live in the scratch arena so the keys
+ * don't need to survive the buffers they were read from.
+ *
+ * The cached CHARSXPs are NOT protected. Callers must store them in a
+ * protected object (e.g. 'ans') right away. Since the cache is initialized
+ * at the beginning of a read and reset with the arena at the end of it,
+ * this is enough to guarantee that it never hands out a CHARSXP that has
+ * been garbage collected.
+ *
+ * The cache turns itself off when it doesn't pay off i.e. when most of
+ * the values are distinct (e.g. cell barcodes).
+ *
+ * In "dictionary mode" the cache is used to dictionary-encode the strings
+ * instead: each distinct key gets an integer code (in order of first
+ * appearance) and can be retrieved from it. In that mode the cache never
+ * turns itself off. This is used by _h5mread_sparse() to collect the
+ * nonzero strings without allocating anything per string.
+ */
+
+typedef struct {
+	const char *key;
+	int key_len, code;
+	SEXP val;
+} CharsxpBucket;
+
+#define	CHARSXP_CACHE_MIN_NBUCKET	1024
+#define	CHARSXP_CACHE_MAX_NELT		1048576
+#define	CHARSXP_CACHE_PROBATION		4096
+
+static struct {
+	int enabled, dict_mode;
+	cetype_t enc;
+	CharsxpBucket *buckets;
+	size_t nbucket;  /* always a power of 2 */
+	int nelt;
+	long long int nlookup, nhit;
+	/* Dictionary mode only. */
+	CharsxpBucket **code2bucket;
+	int code2bucket_len;
+} charsxp_cache = {0, 0, CE_NATIVE, NULL, 0, 0, 0, 0, NULL, 0};
+
+static void reset_charsxp_cache(void)
+{
+	charsxp_cache.enabled = charsxp_cache.dict_mode = 0;
+	charsxp_cache.buckets = NULL;
+	charsxp_cache.nbucket = 0;
+	charsxp_cache.nelt = 0;
+	charsxp_cache.nlookup = charsxp_cache.nhit = 0;
+	charsxp_cache.code2bucket = NULL;
+	charsxp_cache.code2bucket_len = 0;
+	return;
+}
+
+static CharsxpBucket *alloc_charsxp_buckets(size_t nbucket)
+{
+	return (CharsxpBucket *) _scratch_alloc(nbucket * sizeof(CharsxpBucket),
+						1, "the CHARSXP cache");
+}
+
+/* To call before reading string data. Return -1 on error (can only happen
+   in dictionary mode, otherwise a failure to allocate the cache just means
+   that it won't be used). */
+int _init_charsxp_cache(cetype_t enc, int dict_mode)
+{
+	reset_charsxp_cache();
+	charsxp_cache.enc = enc;
+	charsxp_cache.dict_mode = dict_mode;
+	charsxp_cache.buckets = alloc_charsxp_buckets(CHARSXP_CACHE_MIN_NBUCKET);
+	if (charsxp_cache.buckets == NULL)
+		return dict_mode ? -1 : 0;
+	charsxp_cache.nbucket = CHARSXP_CACHE_MIN_NBUCKET;
+	charsxp_cache.enabled = 1;
+	return 0;
+}
+
+/* FNV-1a */
+static inline size_t hash_bytes(const char *s, int s_len)
+{
+	unsigned long long int h;
+	int i;
+
+	h = 14695981039346656037ULL;
+	for (i = 0; i < s_len; i++) {
+		h ^= (unsigned char) s[i];
+		h *= 1099511628211ULL;
+	}
+	return (size_t) h;
+}
+
+static CharsxpBucket *lookup_charsxp_bucket(CharsxpBucket *buckets,
+		size_t nbucket, const char *s, int s_len, size_t h)
+{
+	size_t mask, i;
+	CharsxpBucket *bucket;
+
+	mask = nbucket - 1;
+	for (i = h & mask; ; i = (i + 1) & mask) {
+		bucket = buckets + i;
+		if (bucket->key == NULL)
+			return bucket;
+		if (bucket->key_len == s_len &&
+		    memcmp(bucket->key, s, s_len) == 0)
+			return bucket;
+	}
+}
+
+static int grow_charsxp_cache(void)
+{
+	CharsxpBucket *new_buckets, *old_bucket, *new_bucket;
+	size_t new_nbucket, i;
+
+	new_nbucket = 2 * charsxp_cache.nbucket;
+	new_buckets = alloc_charsxp_buckets(new_nbucket);
+	if (new_buckets == NULL)
+		return -1;
+	for (i = 0; i < charsxp_cache.nbucket; i++) {
+		old_bucket = charsxp_cache.buckets + i;
+		if (old_bucket->key == NULL)
+			continue;
+		new_bucket = lookup_charsxp_bucket(new_buckets, new_nbucket,
+				old_bucket->key, old_bucket->key_len,
+				hash_bytes(old_bucket->key,
+					   old_bucket->key_len));
+		*new_bucket = *old_bucket;
+		if (charsxp_cache.dict_mode)
+			charsxp_cache.code2bucket[new_bucket->code] =
+				new_bucket;
+	}
+	charsxp_cache.buckets = new_buckets;
+	charsxp_cache.nbucket = new_nbucket;
+	return 0;
+}
+
+static int grow_code2bucket(void)
+{
+	CharsxpBucket **new_code2bucket;
+	int new_len;
+
+	new_len = charsxp_cache.code2bucket_len == 0 ?
+		  CHARSXP_CACHE_MIN_NBUCKET :
+		  2 * charsxp_cache.code2bucket_len;
+	new_code2bucket = (CharsxpBucket **)
+		_scratch_alloc(new_len * sizeof(CharsxpBucket *), 0,
+			       "the CHARSXP cache");
+	if (new_code2bucket == NULL)
+		return -1;
+	if (charsxp_cache.nelt != 0)
+		memcpy(new_code2bucket, charsxp_cache.code2bucket,
+		       charsxp_cache.nelt * sizeof(CharsxpBucket *));
+	charsxp_cache.code2bucket = new_code2bucket;
+	charsxp_cache.code2bucket_len = new_len;
+	return 0;
+}
+
+/* Store a copy of the key in 'bucket' (which must be the empty bucket
+   returned by lookup_charsxp_bucket() for that key). Return the bucket
+   where the key ended up or NULL if an error occured. */
+static CharsxpBucket *add_key(CharsxpBucket *bucket,
+			      const char *key, int key_len)
+{
+	char *key_copy;
+
+	if (charsxp_cache.dict_mode &&
+	    charsxp_cache.nelt == charsxp_cache.code2bucket_len &&
+	    grow_code2bucket() < 0)
+		return NULL;
+	key_copy = (char *) _scratch_alloc(key_len + 1, 0,
+					   "a CHARSXP cache key");
+	if (key_copy == NULL)
+		return NULL;
+	memcpy(key_copy, key, key_len);
+	bucket->key = key_copy;
+	bucket->key_len = key_len;
+	bucket->code = charsxp_cache.nelt++;
+	bucket->val = NULL;
+	if (charsxp_cache.dict_mode)
+		charsxp_cache.code2bucket[bucket->code] = bucket;
+	/* Keep the load factor <= 0.5. */
+	if (2 * (size_t) charsxp_cache.nelt > charsxp_cache.nbucket) {
+		if (!charsxp_cache.dict_mode &&
+		    charsxp_cache.nelt >= CHARSXP_CACHE_MAX_NELT)
+			return NULL;
+		if (grow_charsxp_cache() < 0)
+			return NULL;
+		bucket = charsxp_cache.dict_mode ?
+			 charsxp_cache.code2bucket[charsxp_cache.nelt - 1] :
+			 lookup_charsxp_bucket(charsxp_cache.buckets,
+					       charsxp_cache.nbucket,
+					       key, key_len,
+					       hash_bytes(key, key_len));
+	}
+	return bucket;
+}
+
+/* Return the cached CHARSXP for 'key' or NULL if it's not in the cache. */
+SEXP _charsxp_cache_get(const char *key, int key_len)
+{
+	CharsxpBucket *bucket;
+
+	if (!charsxp_cache.enabled)
+		return NULL;
+	charsxp_cache.nlookup++;
+	bucket = lookup_charsxp_bucket(charsxp_cache.buckets,
+				       charsxp_cache.nbucket,
+				       key, key_len, hash_bytes(key, key_len));
+	if (bucket->key == NULL)
+		return NULL;
+	charsxp_cache.nhit++;
+	return bucket->val;
+}
+
+/* To call after _charsxp_cache_get() returned NULL for 'key'. */
+void _charsxp_cache_put(const char *key, int key_len, SEXP val)
+{
+	CharsxpBucket *bucket;
+
+	if (!charsxp_cache.enabled)
+		return;
+	/* Give up if most values are distinct. */
+	if (charsxp_cache.nlookup >= CHARSXP_CACHE_PROBATION &&
+	    4 * charsxp_cache.nhit < charsxp_cache.nlookup)
+	{
+		charsxp_cache.enabled = 0;
+		return;
+	}
+	bucket = lookup_charsxp_bucket(charsxp_cache.buckets,
+				       charsxp_cache.nbucket,
+				       key, key_len, hash_bytes(key, key_len));
+	bucket = add_key(bucket, key, key_len);
+	if (bucket == NULL) {
+		charsxp_cache.enabled = 0;
+		return;
+	}
+	bucket->val = val;
+	return;
+}
+
+/* Same as mkCharLenCE(s, s_len, enc) where 'enc' is the encoding that was
+   passed to _init_charsxp_cache(). */
+SEXP _charsxp_cache_mkCharLen(const char *s, int s_len)
+{
+	return mkCharLenCE(s, s_len, charsxp_cache.enc);
+}
+
+/* Dictionary mode only. Return the code of 'key' (adding it to the
+   dictionary if needed) or -1 if an error occured. */
+int _charsxp_cache_code(const char *key, int key_len)
+{
+	CharsxpBucket *bucket;
+
+	bucket = lookup_charsxp_bucket(charsxp_cache.buckets,
+				       charsxp_cache.nbucket,
+				       key, key_len, hash_bytes(key, key_len));
+	if (bucket->key == NULL) {
+		bucket = add_key(bucket, key, key_len);
+		if (bucket == NULL) {
+			PRINT_TO_ERRMSG_BUF("failed to allocate memory "
+					    "for the CHARSXP cache");
+			return -1;
+		}
+	}
+	return bucket->code;
+}
+
+/* Dictionary mode only. */
+int _charsxp_cache_ncode(void)
+{
+	return charsxp_cache.nelt;
+}
+
+/* Dictionary mode only. */
+const char *_charsxp_cache_key(int code, int *key_len)
+{
+	const CharsxpBucket *bucket;
+
+	bucket = charsxp_cache.code2bucket[code];
+	*key_len = bucket->key_len;
+	return bucket->key;
+}
+
+
+/****************************************************************************
+ * Allocation of H5Viewport structs
+ *
+ * The fields are allocated from the scratch arena so there's no need to
+ * free them.
  */
 
 int _alloc_H5Viewport(H5Viewport *vp, int ndim, int mode)
@@ -54,36 +493,23 @@ int _alloc_H5Viewport(H5Viewport *vp, int ndim, int mode)
 	vp->off = NULL;
 	if (mode != ALLOC_OFF_AND_DIM) {
 		/* Allocate memory for the 'h5off' and 'h5dim' fields. */
-		vp->h5off = _alloc_hsize_t_buf(2 * ndim, 0,
-					       "H5Viewport fields");
+		vp->h5off = _scratch_alloc(2 * ndim * sizeof(hsize_t), 0,
+					   "H5Viewport fields");
 		if (vp->h5off == NULL)
 			return -1;
 		vp->h5dim = vp->h5off + ndim;
 	}
 	if (mode != ALLOC_H5OFF_AND_H5DIM) {
 		/* Allocate memory for the 'off' and 'dim' fields. */
-		vp->off = (int *) malloc(2 * ndim * sizeof(int));
-		if (vp->off == NULL) {
-			if (mode != ALLOC_OFF_AND_DIM)
-				free(vp->h5off);
-			PRINT_TO_ERRMSG_BUF("failed to allocate memory "
-					    "for H5Viewport fields");
+		vp->off = _scratch_alloc(2 * ndim * sizeof(int), 0,
+					 "H5Viewport fields");
+		if (vp->off == NULL)
 			return -1;
-		}
 		vp->dim = vp->off + ndim;
 	}
 	return 0;
 }
 
-void _free_H5Viewport(H5Viewport *vp)
-{
-	if (vp->h5off != NULL)
-		free(vp->h5off);
-	if (vp->off != NULL)
-		free(vp->off);
-	return;
-}
-
 /* Used in read_data_4_5(), read_data_7(), and read_data_8(). */
 int _alloc_tchunk_vp_middle_vp_dest_vp(int ndim,
 		H5Viewport *tchunk_vp,
@@ -92,30 +518,12 @@ int _alloc_tchunk_vp_middle_vp_dest_vp(int ndim,
 {
 	if (_alloc_H5Viewport(tchunk_vp, ndim, ALLOC_H5OFF_AND_H5DIM) < 0)
 		return -1;
-	middle_vp->h5off = _alloc_hsize_t_buf(ndim, 1, "'middle_vp->h5off'");
-	if (middle_vp->h5off == NULL) {
-		_free_H5Viewport(tchunk_vp);
+	middle_vp->h5off = _scratch_alloc(ndim * sizeof(hsize_t), 1,
+					  "'middle_vp->h5off'");
+	if (middle_vp->h5off == NULL)
 		return -1;
-	}
 	middle_vp->h5dim = tchunk_vp->h5dim;
-	if (_alloc_H5Viewport(dest_vp, ndim, dest_vp_mode) < 0) {
-		free(middle_vp->h5off);
-		_free_H5Viewport(tchunk_vp);
-		return -1;
-	}
-	return 0;
-}
-
-/* Used in read_data_4_5(), read_data_7(), and read_data_8(). */
-void _free_tchunk_vp_middle_vp_dest_vp(
-		H5Viewport *tchunk_vp,
-		H5Viewport *middle_vp,
-		H5Viewport *dest_vp)
-{
-	_free_H5Viewport(dest_vp);
-	free(middle_vp->h5off);
-	_free_H5Viewport(tchunk_vp);
-	return;
+	return _alloc_H5Viewport(dest_vp, ndim, dest_vp_mode);
 }
 
 /* Used in read_data_6(). */
@@ -126,28 +534,9 @@ int _alloc_tchunk_vp_inner_vp_dest_vp(int ndim,
 {
 	if (_alloc_H5Viewport(tchunk_vp, ndim, ALLOC_H5OFF_AND_H5DIM) < 0)
 		return -1;
-	if (_alloc_H5Viewport(inner_vp, ndim, ALLOC_H5OFF_AND_H5DIM) < 0) {
-		_free_H5Viewport(tchunk_vp);
-		return -1;
-	}
-	if (_alloc_H5Viewport(dest_vp, ndim, ALLOC_ALL_FIELDS) < 0) {
-		_free_H5Viewport(inner_vp);
-		_free_H5Viewport(tchunk_vp);
+	if (_alloc_H5Viewport(inner_vp, ndim, ALLOC_H5OFF_AND_H5DIM) < 0)
 		return -1;
-	}
-	return 0;
-}
-
-/* Used in read_data_6(). */
-void _free_tchunk_vp_inner_vp_dest_vp(
-		H5Viewport *tchunk_vp,
-		H5Viewport *inner_vp,
-		H5Viewport *dest_vp)
-{
-	_free_H5Viewport(dest_vp);
-	_free_H5Viewport(inner_vp);
-	_free_H5Viewport(tchunk_vp);
-	return;
+	return _alloc_H5Viewport(dest_vp, ndim, ALLOC_ALL_FIELDS);
 }
 
 
@@ -155,24 +544,76 @@ void _free_tchunk_vp_inner_vp_dest_vp(
  * Other helpers
  */
 
+/* Decode 'starts' so the functions that walk on the selected elements
+   don't need to access it (and to dispatch on INTEGER vs REAL) in their
+   inner loops. Assumes that 'starts' has already been checked. */
+int _decode_starts(const H5DSetDescriptor *h5dset, SEXP starts,
+		   DecodedStarts *dstarts)
+{
+	int ndim, along, h5along, n, i;
+	SEXP start;
+	long long int *off, chunkd;
+	int *chunk_off;
+
+	ndim = h5dset->ndim;
+	dstarts->off = _scratch_alloc(ndim * sizeof(long long int *), 1,
+				      "'dstarts->off'");
+	dstarts->chunk_off = _scratch_alloc(ndim * sizeof(int *), 1,
+					    "'dstarts->chunk_off'");
+	if (dstarts->off == NULL || dstarts->chunk_off == NULL)
+		return -1;
+	for (along = 0, h5along = ndim - 1; along < ndim; along++, h5along--) {
+		start = GET_LIST_ELT(starts, along);
+		if (start == R_NilValue)
+			continue;
+		n = LENGTH(start);
+		off = _scratch_alloc(n * sizeof(long long int), 0,
+				     "'dstarts->off'");
+		if (off == NULL)
+			return -1;
+		if (IS_INTEGER(start)) {
+			const int *start_p = INTEGER(start);
+			for (i = 0; i < n; i++)
+				off[i] = (long long int) start_p[i] - 1;
+		} else {
+			const double *start_p = REAL(start);
+			for (i = 0; i < n; i++)
+				off[i] = (long long int) start_p[i] - 1;
+		}
+		dstarts->off[along] = off;
+		if (h5dset->h5chunkdim == NULL)
+			continue;
+		chunk_off = _scratch_alloc(n * sizeof(int), 0,
+					   "'dstarts->chunk_off'");
+		if (chunk_off == NULL)
+			return -1;
+		chunkd = (long long int) h5dset->h5chunkdim[h5along];
+		for (i = 0; i < n; i++)
+			chunk_off[i] = (int) (off[i] % chunkd);
+		dstarts->chunk_off[along] = chunk_off;
+	}
+	return 0;
+}
+
 int _map_starts_to_h5chunks(const H5DSetDescriptor *h5dset,
 		SEXP starts,
 		int *nstart_buf,
 		IntAEAE *breakpoint_bufs, LLongAEAE *tchunkidx_bufs)
 {
 	int ndim, along, h5along;
-	LLongAE *dim_buf, *chunkdim_buf;
+	long long int *dim_buf, *chunkdim_buf;
 
 	ndim = h5dset->ndim;
-	dim_buf = new_LLongAE(ndim, ndim, 0);
-	chunkdim_buf = new_LLongAE(ndim, ndim, 0);
+	dim_buf = _scratch_alloc(2 * ndim * sizeof(long long int), 0,
+				 "'dim_buf' and 'chunkdim_buf'");
+	if (dim_buf == NULL)
+		return -1;
+	chunkdim_buf = dim_buf + ndim;
 	for (along = 0, h5along = ndim - 1; along < ndim; along++, h5along--) {
-		dim_buf->elts[along] =
-			(long long int) h5dset->h5dim[h5along];
-		chunkdim_buf->elts[along] =
-			(long long int) h5dset->h5chunkdim[h5along];
+		dim_buf[along] = (long long int) h5dset->h5dim[h5along];
+		chunkdim_buf[along] = (long long int) h5dset->h5chunkdim[h5along];
 	}
-	return _map_starts_to_chunks(ndim, dim_buf->elts, chunkdim_buf->elts,
+	return _map_starts_to_chunks(ndim, dim_buf, chunkdim_buf,
 				     starts,
 				     nstart_buf,
 				     breakpoint_bufs, tchunkidx_bufs);
@@ -208,7 +649,7 @@ hid_t _create_mem_space(int ndim, const int *dim)
 	hid_t mem_space_id;
 
 	/* Allocate and set 'h5dim'. */
-	h5dim = _alloc_hsize_t_buf(ndim, 0, "'h5dim'");
+	h5dim = _scratch_alloc(ndim * sizeof(hsize_t), 0, "'h5dim'");
 	if (h5dim == NULL)
 		return -1;
 	for (along = 0, h5along = ndim - 1; along < ndim; along++, h5along--)
@@ -216,7 +657,6 @@ hid_t _create_mem_space(int ndim, const int *dim)
 	mem_space_id = H5Screate_simple(ndim, h5dim, NULL);
 	if (mem_space_id < 0)
 		PRINT_TO_ERRMSG_BUF("H5Screate_simple() returned an error");
-	free(h5dim);
 	return mem_space_id;
 }
 
@@ -243,15 +683,29 @@ int _add_H5Viewport_to_h5selection(hid_t space_id, const H5Viewport *vp)
 		PRINT_TO_ERRMSG_BUF("H5Sselect_hyperslab() returned an error");
 		return -1;
 	}
+	_h5mread_stats.nhyperslab++;
 	return 0;
 }
 
-int _read_H5Viewport(const H5DSetDescriptor *h5dset,
+static void print_H5Dread_error(const H5DSetDescriptor *h5dset)
+{
+	/* See packed_conv_cb() in H5DSetDescriptor.c */
+	if (h5dset->packed_NA_found)
+		PRINT_TO_ERRMSG_BUF("'as.type=\"uint16\"' cannot be used on "
+				    "data that contains NAs or NaNs");
+	else
+		PRINT_TO_ERRMSG_BUF("H5Dread() returned an error");
+	return;
+}
+
+static int read_H5Viewport(const H5DSetDescriptor *h5dset,
+		hid_t mem_type_id,
 		const H5Viewport *h5dset_vp,
 		const H5Viewport *mem_vp,
 		void *mem, hid_t mem_space_id)
 {
 	int ret;
+	double t0;
 
 	ret = _select_H5Viewport(h5dset->space_id, h5dset_vp);
 	if (ret < 0)
@@ -259,20 +713,66 @@ int _read_H5Viewport(const H5DSetDescriptor *h5dset,
 	ret = _select_H5Viewport(mem_space_id, mem_vp);
 	if (ret < 0)
 		return -1;
+	t0 = _trace_time();
 	ret = H5Dread(h5dset->dset_id,
-		      h5dset->mem_type_id, mem_space_id,
-		      h5dset->space_id, H5P_DEFAULT, mem);
+		      mem_type_id, mem_space_id,
+		      h5dset->space_id, h5dset->xfer_plist_id, mem);
+	_trace_add_read_time(t0);
+	_h5mread_stats.nH5Dread++;
 	if (ret < 0)
-		PRINT_TO_ERRMSG_BUF("H5Dread() returned an error");
+		print_H5Dread_error(h5dset);
 	//print_chunk_data(h5dset, mem);
 	return ret;
 }
 
+int _read_H5Viewport(const H5DSetDescriptor *h5dset,
+		const H5Viewport *h5dset_vp,
+		const H5Viewport *mem_vp,
+		void *mem, hid_t mem_space_id)
+{
+	return read_H5Viewport(h5dset, h5dset->mem_type_id,
+			       h5dset_vp, mem_vp, mem, mem_space_id);
+}
+
+/* Like _read_H5Viewport() but loads the data in the native type that
+   matches the data on disk (see 'narrow_type' in H5DSetDescriptor.h).
+   The data must then be widened with _widen_narrow_data(). */
+int _read_narrow_H5Viewport(const H5DSetDescriptor *h5dset,
+		const H5Viewport *h5dset_vp,
+		const H5Viewport *mem_vp,
+		void *mem, hid_t mem_space_id)
+{
+	return read_H5Viewport(h5dset, h5dset->narrow_mem_type_id,
+			       h5dset_vp, mem_vp, mem, mem_space_id);
+}
+
+/* Release the memory allocated by H5Dread() for the variable-length data
+   of the elements selected in 'mem_space_id'. */
+int _reclaim_vlen_data(const H5DSetDescriptor *h5dset,
+		hid_t mem_space_id, void *mem)
+{
+	herr_t ret;
+
+#if H5_VERSION_GE(1, 12, 0)
+	ret = H5Treclaim(h5dset->mem_type_id, mem_space_id, H5P_DEFAULT, mem);
+#else
+	ret = H5Dvlen_reclaim(h5dset->mem_type_id, mem_space_id,
+			      H5P_DEFAULT, mem);
+#endif
+	if (ret < 0) {
+		PRINT_TO_ERRMSG_BUF("failed to reclaim the memory used by "
+				    "variable-length data");
+		return -1;
+	}
+	return 0;
+}
+
 int _read_h5selection(const H5DSetDescriptor *h5dset,
 		const H5Viewport *mem_vp,
 		void *mem, hid_t mem_space_id)
 {
 	int ret;
+	double t0;
 
 	if (mem_vp == NULL) {
 		ret = H5Sselect_all(mem_space_id);
@@ -283,21 +783,23 @@ int _read_h5selection(const H5DSetDescriptor *h5dset,
 	}
 	if (ret < 0)
 		return -1;
+	t0 = _trace_time();
 	ret = H5Dread(h5dset->dset_id,
 		      h5dset->mem_type_id, mem_space_id,
-		      h5dset->space_id, H5P_DEFAULT, mem);
+		      h5dset->space_id, h5dset->xfer_plist_id, mem);
+	_trace_add_read_time(t0);
+	_h5mread_stats.nH5Dread++;
 	if (ret < 0)
-		PRINT_TO_ERRMSG_BUF("H5Dread() returned an error");
+		print_H5Dread_error(h5dset);
 	return ret;
 }
 
 static void update_tchunk_vp(const H5DSetDescriptor *h5dset,
 		const int *tchunk_midx, int moved_along,
-		SEXP starts, const LLongAEAE *tchunkidx_bufs,
+		const DecodedStarts *dstarts, const LLongAEAE *tchunkidx_bufs,
 		H5Viewport *tchunk_vp)
 {
 	int ndim, along, h5along, i;
-	SEXP start;
 	long long int tchunkidx;
 	hsize_t chunkd, off, d;
 
@@ -306,8 +808,7 @@ static void update_tchunk_vp(const H5DSetDescriptor *h5dset,
 		if (along > moved_along)
 			break;
 		i = tchunk_midx[along];
-		start = GET_LIST_ELT(starts, along);
-		if (start != R_NilValue) {
+		if (dstarts->off[along] != NULL) {
 			tchunkidx = tchunkidx_bufs->elts[along]->elts[i];
 		} else {
 			tchunkidx = i;
@@ -333,11 +834,10 @@ static void update_tchunk_vp(const H5DSetDescriptor *h5dset,
 
 static void update_dest_vp(const H5DSetDescriptor *h5dset,
 		const int *tchunk_midx, int moved_along,
-		SEXP starts, const IntAEAE *breakpoint_bufs,
+		const DecodedStarts *dstarts, const IntAEAE *breakpoint_bufs,
 		const H5Viewport *tchunk_vp, H5Viewport *dest_vp)
 {
 	int ndim, along, h5along, i, off, d;
-	SEXP start;
 	const int *breakpoint;
 
 	ndim = h5dset->ndim;
@@ -345,8 +845,7 @@ static void update_dest_vp(const H5DSetDescriptor *h5dset,
 		if (along > moved_along)
 			break;
 		i = tchunk_midx[along];
-		start = GET_LIST_ELT(starts, along);
-		if (start != R_NilValue ) {
+		if (dstarts->off[along] != NULL) {
 			breakpoint = breakpoint_bufs->elts[along]->elts;
 			off = i == 0 ? 0 : breakpoint[i - 1];
 			d = breakpoint[i] - off;
@@ -374,19 +873,21 @@ static void update_dest_vp(const H5DSetDescriptor *h5dset,
 
 void _update_tchunk_vp_dest_vp(const H5DSetDescriptor *h5dset,
 		const int *tchunk_midx, int moved_along,
-		SEXP starts,
+		const DecodedStarts *dstarts,
 		const IntAEAE *breakpoint_bufs,
 		const LLongAEAE *tchunkidx_bufs,
 		H5Viewport *tchunk_vp, H5Viewport *dest_vp)
 {
 	update_tchunk_vp(h5dset,
 			tchunk_midx, moved_along,
-			starts, tchunkidx_bufs,
+			dstarts, tchunkidx_bufs,
 			tchunk_vp);
 	update_dest_vp(h5dset,
 			tchunk_midx, moved_along,
-			starts, breakpoint_bufs,
+			dstarts, breakpoint_bufs,
 			tchunk_vp, dest_vp);
+	if (_tchunk_is_truncated(h5dset, tchunk_vp))
+		_h5mread_stats.ntruncated_tchunk++;
 	return;
 }
 
@@ -425,6 +926,724 @@ int _tchunk_is_fully_selected(int ndim,
 }
 
 
+/****************************************************************************
+ * Chunk statistics
+ *
+ * The writers can record some statistics about each chunk of a dataset in
+ * a companion dataset (see R/h5chunkstats.R). For dataset "a/b", they are
+ * stored in dataset "a/.b_chunkstats" as a matrix with one row per chunk
+ * and one column per statistic (see CHUNKSTAT_* in h5mread_helpers.h).
+ * The chunks are ordered like the elements of an ordinary array with the
+ * dimensions of the chunk grid, i.e. in HDF5 order (the last HDF5
+ * dimension varies fastest). Note that, once on disk, the R matrix gets
+ * transposed so each statistic is stored in an HDF5 row.
+ */
+
+static char *get_chunkstats_name(const char *h5name)
+{
+	const char *bname;
+	size_t dname_len;
+	char *name;
+
+	bname = strrchr(h5name, '/');
+	bname = bname == NULL ? h5name : bname + 1;
+	dname_len = bname - h5name;
+	name = _scratch_alloc(strlen(h5name) + 1 + strlen(CHUNKSTATS_SUFFIX) + 1,
+			      0, "'name'");
+	if (name == NULL)
+		return NULL;
+	memcpy(name, h5name, dname_len);
+	name[dname_len] = '.';
+	strcpy(name + dname_len + 1, bname);
+	strcat(name, CHUNKSTATS_SUFFIX);
+	return name;
+}
+
+static int read_chunkstat(hid_t stats_id, int stat, long long int nchunk,
+			  double *buf)
+{
+	hid_t space_id, mem_space_id;
+	hsize_t dims[2], offset[2], count[2], mem_dim;
+	int ret;
+
+	space_id = H5Dget_space(stats_id);
+	if (space_id < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Dget_space() returned an error");
+		return -1;
+	}
+	/* The statistics are ignored if they don't match the chunk grid
+	   of the dataset (e.g. if the dataset was replaced). */
+	if (H5Sget_simple_extent_ndims(space_id) != 2 ||
+	    H5Sget_simple_extent_dims(space_id, dims, NULL) != 2 ||
+	    dims[0] != NCHUNKSTAT || dims[1] != (hsize_t) nchunk)
+	{
+		H5Sclose(space_id);
+		return 0;
+	}
+	offset[0] = stat;
+	offset[1] = 0;
+	count[0] = 1;
+	count[1] = nchunk;
+	mem_dim = nchunk;
+	ret = -1;
+	if (H5Sselect_hyperslab(space_id, H5S_SELECT_SET,
+				offset, NULL, count, NULL) < 0)
+	{
+		PRINT_TO_ERRMSG_BUF("H5Sselect_hyperslab() returned an error");
+		goto on_error;
+	}
+	mem_space_id = H5Screate_simple(1, &mem_dim, NULL);
+	if (mem_space_id < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Screate_simple() returned an error");
+		goto on_error;
+	}
+	if (H5Dread(stats_id, H5T_NATIVE_DOUBLE, mem_space_id, space_id,
+		    H5P_DEFAULT, buf) < 0)
+		PRINT_TO_ERRMSG_BUF("H5Dread() returned an error");
+	else
+		ret = 1;
+	H5Sclose(mem_space_id);
+    on_error:
+	H5Sclose(space_id);
+	return ret;
+}
+
+/* Load statistic 'stat' (one of the CHUNKSTAT_* codes) of all the chunks of
+   the dataset into 'buf' ('buf' must have room for 'nchunk' doubles).
+   Return 1 on success, 0 if the dataset has no chunk statistics, and -1 on
+   error. */
+int _load_chunkstat(const H5DSetDescriptor *h5dset, int stat,
+		    long long int nchunk, double *buf)
+{
+	char *name;
+	hid_t file_id, stats_id;
+	htri_t exists;
+	int ret;
+
+	if (h5dset->h5name == NULL || h5dset->H5layout != H5D_CHUNKED)
+		return 0;
+	name = get_chunkstats_name(h5dset->h5name);
+	if (name == NULL)
+		return -1;
+	file_id = H5Iget_file_id(h5dset->dset_id);
+	if (file_id < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Iget_file_id() returned an error");
+		return -1;
+	}
+	exists = H5Lexists(file_id, name, H5P_DEFAULT);
+	if (exists <= 0) {
+		H5Fclose(file_id);
+		if (exists < 0) {
+			PRINT_TO_ERRMSG_BUF("H5Lexists() returned an error");
+			return -1;
+		}
+		return 0;
+	}
+	stats_id = H5Dopen(file_id, name, H5P_DEFAULT);
+	H5Fclose(file_id);
+	if (stats_id < 0) {
+		PRINT_TO_ERRMSG_BUF("failed to open dataset '%s'", name);
+		return -1;
+	}
+	ret = read_chunkstat(stats_id, stat, nchunk, buf);
+	H5Dclose(stats_id);
+	return ret;
+}
+
+
+/****************************************************************************
+ * Allocated chunks
+ *
+ * The chunks of a sparse dataset (e.g. written with writeHDF5Array(...,
+ * as.sparse=TRUE)) that contain only zeros are typically never written to
+ * the file. H5Dread() synthesizes a buffer filled with the fill value for
+ * each of them, which the gatherers then scan element by element. When the
+ * fill value is zero, methods 4 to 8 skip these "unallocated" chunks
+ * instead: methods 4 to 7 zero the part of 'ans' that they map to, and
+ * method 8 has nothing to gather from them.
+ */
+
+/* When their use is requested (see 'use_chunkstats' in H5DSetDescriptor.h),
+   the chunk statistics (see above) are only used to skip the chunks that
+   contain only zeros when at least 1 chunk out of BITMAP_MIN_TCHUNK_RATIO is
+   touched by the user-supplied selection, because loading them requires to
+   read the statistics of all the chunks of the dataset. */
+#define	BITMAP_MIN_TCHUNK_RATIO	8
+
+/* Return 1 if the fill value of the dataset is known to be zero, 0 if it's
+   not, and -1 on error. */
+static int fill_value_is_zero(const H5DSetDescriptor *h5dset)
+{
+	H5D_fill_value_t status;
+	unsigned char *fill_value;
+	size_t i;
+
+	if (H5Pfill_value_defined(h5dset->plist_id, &status) < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Pfill_value_defined() "
+				    "returned an error");
+		return -1;
+	}
+	if (status == H5D_FILL_VALUE_DEFAULT)
+		return 1;
+	if (status != H5D_FILL_VALUE_USER_DEFINED)
+		return 0;
+	fill_value = _scratch_alloc(h5dset->H5size, 0, "'fill_value'");
+	if (fill_value == NULL)
+		return -1;
+	if (H5Pget_fill_value(h5dset->plist_id, h5dset->dtype_id,
+			      fill_value) < 0)
+	{
+		PRINT_TO_ERRMSG_BUF("H5Pget_fill_value() returned an error");
+		return -1;
+	}
+	for (i = 0; i < h5dset->H5size; i++)
+		if (fill_value[i] != 0)
+			return 0;
+	return 1;
+}
+
+static unsigned char *alloc_allocated_chunks_bitmap(long long int nchunk)
+{
+	unsigned char *bitmap;
+
+	bitmap = (unsigned char *) calloc(nchunk / 8 + 1, 1);
+	if (bitmap == NULL)
+		PRINT_TO_ERRMSG_BUF("failed to allocate memory "
+				    "for the bitmap of allocated chunks");
+	return bitmap;
+}
+
+static long long int get_chunk_rank(const H5DSetDescriptor *h5dset,
+				    const hsize_t *h5off)
+{
+	long long int rank;
+	int h5along;
+
+	rank = 0;
+	for (h5along = 0; h5along < h5dset->ndim; h5along++)
+		rank = rank * h5dset->h5nchunk[h5along] +
+		       h5off[h5along] / h5dset->h5chunkdim[h5along];
+	return rank;
+}
+
+/* What we know about the allocated chunks of a dataset. 'bitmap' is NULL
+   when all the chunks are allocated or when we only know how many chunks
+   are allocated (in which case they must be looked up one at a time). */
+typedef struct {
+	char *filepath, *h5name;
+	long long int file_size, file_mtime_ns;
+	long long int nchunk, nallocated;
+	unsigned char *bitmap;
+} AllocatedChunksInfo;
+
+#if H5_VERSION_GE(1, 10, 5)
+/* Return -1 on error. */
+static long long int count_allocated_chunks(const H5DSetDescriptor *h5dset)
+{
+	hsize_t nallocated;
+
+	if (H5Dget_num_chunks(h5dset->dset_id, h5dset->space_id,
+			      &nallocated) < 0)
+	{
+		PRINT_TO_ERRMSG_BUF("H5Dget_num_chunks() returned an error");
+		return -1;
+	}
+	return (long long int) nallocated;
+}
+#endif
+
+#if H5_VERSION_GE(1, 14, 0)
+typedef struct {
+	const H5DSetDescriptor *h5dset;
+	unsigned char *bitmap;
+	long long int nallocated;
+} ChunkIterData;
+
+static int set_allocated_chunk_bit(const hsize_t *offset,
+		unsigned filter_mask, haddr_t addr, hsize_t size,
+		void *op_data)
+{
+	ChunkIterData *data = (ChunkIterData *) op_data;
+	long long int rank;
+
+	if (size == 0)
+		return H5_ITER_CONT;
+	rank = get_chunk_rank(data->h5dset, offset);
+	data->bitmap[rank / 8] |= (unsigned char) (1 << (rank % 8));
+	data->nallocated++;
+	return H5_ITER_CONT;
+}
+
+/* Walk the chunk index once with H5Dchunk_iter(). */
+static int get_allocated_chunks_info(const H5DSetDescriptor *h5dset,
+				     AllocatedChunksInfo *info)
+{
+	ChunkIterData data;
+
+	data.h5dset = h5dset;
+	data.bitmap = alloc_allocated_chunks_bitmap(info->nchunk);
+	if (data.bitmap == NULL)
+		return -1;
+	data.nallocated = 0;
+	if (H5Dchunk_iter(h5dset->dset_id, H5P_DEFAULT,
+			  set_allocated_chunk_bit, &data) < 0)
+	{
+		free(data.bitmap);
+		PRINT_TO_ERRMSG_BUF("H5Dchunk_iter() returned an error");
+		return -1;
+	}
+	info->nallocated = data.nallocated;
+	if (data.nallocated == info->nchunk)
+		free(data.bitmap);
+	else
+		info->bitmap = data.bitmap;
+	return 0;
+}
+#elif H5_VERSION_GE(1, 10, 5)
+/* With HDF5 < 1.14, H5Dget_chunk_info() walks the chunk index from the
+   start every time it's called, so using it to enumerate the allocated
+   chunks is quadratic. We only use H5Dget_num_chunks() to detect the
+   datasets where all chunks or no chunks are allocated, and otherwise
+   look up the chunks one at a time with H5Dget_chunk_info_by_coord(). */
+static int get_allocated_chunks_info(const H5DSetDescriptor *h5dset,
+				     AllocatedChunksInfo *info)
+{
+	long long int nallocated;
+
+	nallocated = count_allocated_chunks(h5dset);
+	if (nallocated < 0)
+		return -1;
+	info->nallocated = nallocated;
+	if (nallocated == 0) {
+		info->bitmap = alloc_allocated_chunks_bitmap(info->nchunk);
+		if (info->bitmap == NULL)
+			return -1;
+	}
+	return 0;
+}
+#else
+/* H5Dget_num_chunks() and H5Dget_chunk_info_by_coord() were introduced in
+   HDF5 1.10.5. With older versions, all the chunks are treated as
+   allocated. */
+static int get_allocated_chunks_info(const H5DSetDescriptor *h5dset,
+				     AllocatedChunksInfo *info)
+{
+	info->nallocated = info->nchunk;
+	return 0;
+}
+#endif
+
+/*
+ * Walking the chunk index (or counting the allocated chunks) is O(total nb
+ * of chunks) so we keep what we learn about the last ALLOCATED_CHUNKS_CACHE
+ * datasets that we've seen. An entry is identified by the path of the file
+ * and the name of the dataset, and becomes obsolete as soon as the size or
+ * modification time of the file changes. Because the resolution of the
+ * modification time is limited (1 sec. on some file systems), we also make
+ * sure that the number of allocated chunks didn't change before reusing an
+ * entry that has a bitmap.
+ */
+
+#define	ALLOCATED_CHUNKS_CACHE	16
+
+static AllocatedChunksInfo allocated_chunks_cache[ALLOCATED_CHUNKS_CACHE];
+static int allocated_chunks_cache_next = 0;  /* next entry to recycle */
+
+static void free_AllocatedChunksInfo(AllocatedChunksInfo *info)
+{
+	free(info->filepath);
+	free(info->h5name);
+	free(info->bitmap);
+	memset(info, 0, sizeof(AllocatedChunksInfo));
+	return;
+}
+
+/* Return NULL if the path of the file cannot be obtained. */
+static char *get_filepath(hid_t dset_id)
+{
+	ssize_t len;
+	char *filepath;
+
+	len = H5Fget_name(dset_id, NULL, 0);
+	if (len < 0)
+		return NULL;
+	filepath = (char *) malloc(len + 1);
+	if (filepath == NULL)
+		return NULL;
+	if (H5Fget_name(dset_id, filepath, len + 1) < 0) {
+		free(filepath);
+		return NULL;
+	}
+	return filepath;
+}
+
+/* Return 0 if the file cannot be stat'ed. The modification time is in
+   nanoseconds (a double cannot hold it at this resolution). */
+static int stat_file(const char *filepath, long long int *size,
+		     long long int *mtime_ns)
+{
+	struct stat st;
+	long long int nsec;
+
+	if (stat(filepath, &st) != 0)
+		return 0;
+	*size = (long long int) st.st_size;
+#if defined(__APPLE__)
+	nsec = (long long int) st.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+	nsec = 0;
+#else
+	nsec = (long long int) st.st_mtim.tv_nsec;
+#endif
+	*mtime_ns = (long long int) st.st_mtime * 1000000000LL + nsec;
+	return 1;
+}
+
+/* A cached bitmap would make the readers skip the chunks that got allocated
+   since it was computed. Note that allocated chunks never get deallocated
+   so the number of allocated chunks is enough to tell. */
+static int allocated_chunks_are_unchanged(const H5DSetDescriptor *h5dset,
+					  const AllocatedChunksInfo *info)
+{
+	if (info->bitmap == NULL)
+		return 1;
+#if H5_VERSION_GE(1, 10, 5)
+	return count_allocated_chunks(h5dset) == info->nallocated;
+#else
+	return 1;
+#endif
+}
+
+/* Return a pointer to the cache entry for the dataset (computing it if
+   needed), or NULL on error. */
+static const AllocatedChunksInfo *get_cached_allocated_chunks_info(
+		const H5DSetDescriptor *h5dset, long long int nchunk)
+{
+	char *filepath;
+	long long int file_size, file_mtime_ns;
+	int i, slot;
+	AllocatedChunksInfo *info;
+
+	filepath = get_filepath(h5dset->dset_id);
+	if (filepath == NULL || h5dset->h5name == NULL ||
+	    !stat_file(filepath, &file_size, &file_mtime_ns))
+	{
+		free(filepath);
+		filepath = NULL;
+	}
+	slot = -1;
+	for (i = 0; filepath != NULL && i < ALLOCATED_CHUNKS_CACHE; i++) {
+		info = allocated_chunks_cache + i;
+		if (info->filepath == NULL ||
+		    strcmp(info->filepath, filepath) != 0 ||
+		    strcmp(info->h5name, h5dset->h5name) != 0)
+			continue;
+		if (info->file_size == file_size &&
+		    info->file_mtime_ns == file_mtime_ns &&
+		    info->nchunk == nchunk &&
+		    allocated_chunks_are_unchanged(h5dset, info))
+		{
+			free(filepath);
+			return info;
+		}
+		slot = i;  /* obsolete entry */
+		break;
+	}
+	if (slot < 0) {
+		slot = allocated_chunks_cache_next;
+		allocated_chunks_cache_next =
+			(slot + 1) % ALLOCATED_CHUNKS_CACHE;
+	}
+	info = allocated_chunks_cache + slot;
+	free_AllocatedChunksInfo(info);
+	info->nchunk = nchunk;
+	if (get_allocated_chunks_info(h5dset, info) < 0) {
+		free(filepath);
+		free_AllocatedChunksInfo(info);
+		return NULL;
+	}
+	if (filepath == NULL)
+		return info;  /* not cached (the entry is recycled next time) */
+	info->h5name = (char *) malloc(strlen(h5dset->h5name) + 1);
+	if (info->h5name == NULL) {
+		free(filepath);
+		return info;
+	}
+	strcpy(info->h5name, h5dset->h5name);
+	info->filepath = filepath;
+	info->file_size = file_size;
+	info->file_mtime_ns = file_mtime_ns;
+	return info;
+}
+
+/* When the dataset has chunk statistics, the chunks that contain only zeros
+   can be skipped whether they are allocated or not. Return 1 if the bitmap
+   was loaded from the statistics, 0 if the dataset has no statistics, and
+   -1 on error. */
+static int load_nonzero_chunks_bitmap(H5DSetDescriptor *h5dset,
+				      long long int nchunk)
+{
+	double *nnz;
+	unsigned char *bitmap;
+	long long int rank;
+	int ret;
+
+	nnz = _scratch_alloc(nchunk * sizeof(double), 0, "'nnz'");
+	if (nnz == NULL)
+		return -1;
+	ret = _load_chunkstat(h5dset, CHUNKSTAT_NNZ, nchunk, nnz);
+	if (ret <= 0)
+		return ret;
+	bitmap = alloc_allocated_chunks_bitmap(nchunk);
+	if (bitmap == NULL)
+		return -1;
+	for (rank = 0; rank < nchunk; rank++)
+		if (nnz[rank] != 0)
+			bitmap[rank / 8] |= (unsigned char) (1 << (rank % 8));
+	h5dset->allocated_chunks = bitmap;
+	h5dset->allocated_chunks_mode = ALLOCATED_CHUNKS_BITMAP;
+	return 1;
+}
+
+/* Set 'h5dset->allocated_chunks_mode' and 'h5dset->allocated_chunks'.
+   'ntchunk' is the total nb of chunks touched by the user-supplied
+   selection. Return -1 on error. */
+int _load_allocated_chunks(H5DSetDescriptor *h5dset, long long int ntchunk)
+{
+	long long int nchunk;
+	int h5along, ret;
+	const AllocatedChunksInfo *info;
+
+	if (h5dset->allocated_chunks != NULL)
+		return 0;  /* already loaded */
+	h5dset->allocated_chunks_mode = ALLOCATED_CHUNKS_ALL;
+	/* String data is excluded because zeroing 'ans' does not produce
+	   empty strings. */
+	if (h5dset->H5layout != H5D_CHUNKED || h5dset->Rtype == STRSXP ||
+	    ntchunk == 0)
+		return 0;
+	ret = fill_value_is_zero(h5dset);
+	if (ret <= 0)
+		return ret;
+	nchunk = 1;
+	for (h5along = 0; h5along < h5dset->ndim; h5along++)
+		nchunk *= h5dset->h5nchunk[h5along];
+	if (h5dset->use_chunkstats &&
+	    ntchunk * BITMAP_MIN_TCHUNK_RATIO >= nchunk)
+	{
+		ret = load_nonzero_chunks_bitmap(h5dset, nchunk);
+		if (ret != 0)
+			return ret < 0 ? -1 : 0;
+	}
+	info = get_cached_allocated_chunks_info(h5dset, nchunk);
+	if (info == NULL)
+		return -1;
+	if (info->nallocated == nchunk)
+		return 0;
+	if (info->bitmap != NULL) {
+		h5dset->allocated_chunks = info->bitmap;
+		h5dset->allocated_chunks_is_cached = 1;
+		h5dset->allocated_chunks_mode = ALLOCATED_CHUNKS_BITMAP;
+		return 0;
+	}
+	h5dset->allocated_chunks_mode = ALLOCATED_CHUNKS_LOOKUP;
+	return 0;
+}
+
+/* Return 1 if the chunk that 'tchunk_vp' is pointing at is allocated, 0 if
+   it's not, and -1 on error. */
+int _tchunk_is_allocated(const H5DSetDescriptor *h5dset,
+			 const H5Viewport *tchunk_vp)
+{
+	long long int rank;
+#if H5_VERSION_GE(1, 10, 5)
+	unsigned filter_mask;
+	haddr_t addr;
+	hsize_t size;
+#endif
+
+	switch (h5dset->allocated_chunks_mode) {
+	    case ALLOCATED_CHUNKS_BITMAP:
+		rank = get_chunk_rank(h5dset, tchunk_vp->h5off);
+		return (h5dset->allocated_chunks[rank / 8] >> (rank % 8)) & 1;
+#if H5_VERSION_GE(1, 10, 5)
+	    case ALLOCATED_CHUNKS_LOOKUP:
+		if (H5Dget_chunk_info_by_coord(h5dset->dset_id,
+					       tchunk_vp->h5off,
+					       &filter_mask, &addr, &size) < 0)
+		{
+			PRINT_TO_ERRMSG_BUF("H5Dget_chunk_info_by_coord() "
+					    "returned an error");
+			return -1;
+		}
+		return addr != HADDR_UNDEF;
+#endif
+	}
+	return 1;
+}
+
+
+/****************************************************************************
+ * Chunks that can match the 'where' predicate
+ *
+ * The min and max of the nonzero non-NA values of each chunk (see "Chunk
+ * statistics" above) tell us which chunks cannot contain any value that
+ * matches the comparison predicate attached to the H5DSetDescriptor struct
+ * (see _set_H5DSetDescriptor_where()). Method 8 skips these chunks.
+ */
+
+/* 'min' and 'max' are Inf and -Inf for a chunk that has no nonzero non-NA
+   values so such a chunk never matches. */
+static int chunk_can_match(int where_op, double where_value,
+			   double min, double max)
+{
+	switch (where_op) {
+	    case WHERE_EQ: return min <= where_value && where_value <= max;
+	    case WHERE_NE: return min <= max &&
+				  !(min == where_value && max == where_value);
+	    case WHERE_LT: return min < where_value;
+	    case WHERE_LE: return min <= where_value;
+	    case WHERE_GT: return max > where_value;
+	    case WHERE_GE: return max >= where_value;
+	}
+	return 1;
+}
+
+/* Set 'h5dset->where_chunks'. Leave it to NULL if no predicate is attached
+   to 'h5dset', if the use of the chunk statistics was not requested, or if
+   the dataset has no chunk statistics. Return -1 on error. */
+int _load_where_chunks(H5DSetDescriptor *h5dset)
+{
+	long long int nchunk, rank;
+	double *min, *max, lo, hi;
+	unsigned char *bitmap;
+	int h5along, ret;
+
+	if (h5dset->where_op == WHERE_NONE || h5dset->where_chunks != NULL ||
+	    !h5dset->use_chunkstats || h5dset->H5layout != H5D_CHUNKED)
+		return 0;
+	/* The statistics are about the values stored in the file. They
+	   don't tell us anything about floating point data loaded as
+	   integers (i.e. truncated). */
+	if (h5dset->H5class == H5T_FLOAT && h5dset->Rtype != REALSXP)
+		return 0;
+	nchunk = 1;
+	for (h5along = 0; h5along < h5dset->ndim; h5along++)
+		nchunk *= h5dset->h5nchunk[h5along];
+	min = _scratch_alloc(2 * nchunk * sizeof(double), 0,
+			     "'min' and 'max'");
+	if (min == NULL)
+		return -1;
+	max = min + nchunk;
+	ret = _load_chunkstat(h5dset, CHUNKSTAT_MIN, nchunk, min);
+	if (ret > 0)
+		ret = _load_chunkstat(h5dset, CHUNKSTAT_MAX, nchunk, max);
+	if (ret <= 0)
+		return ret;
+	bitmap = (unsigned char *) calloc(nchunk / 8 + 1, 1);
+	if (bitmap == NULL) {
+		PRINT_TO_ERRMSG_BUF("failed to allocate memory for the "
+				    "bitmap of chunks matching 'where'");
+		return -1;
+	}
+	for (rank = 0; rank < nchunk; rank++) {
+		lo = min[rank];
+		hi = max[rank];
+		/* The statistics are computed on the values before they
+		   get stored, possibly as single precision floats. */
+		if (h5dset->H5class == H5T_FLOAT &&
+		    h5dset->H5size == sizeof(float))
+		{
+			lo = (float) lo;
+			hi = (float) hi;
+		}
+		if (chunk_can_match(h5dset->where_op, h5dset->where_value,
+				    lo, hi))
+			bitmap[rank / 8] |= (unsigned char) (1 << (rank % 8));
+	}
+	h5dset->where_chunks = bitmap;
+	return 0;
+}
+
+/* Return 1 if the chunk that 'tchunk_vp' is pointing at can contain values
+   that match the predicate attached to 'h5dset', and 0 if it can't. */
+int _tchunk_can_match(const H5DSetDescriptor *h5dset,
+		      const H5Viewport *tchunk_vp)
+{
+	long long int rank;
+
+	if (h5dset->where_chunks == NULL)
+		return 1;
+	rank = get_chunk_rank(h5dset, tchunk_vp->h5off);
+	return (h5dset->where_chunks[rank / 8] >> (rank % 8)) & 1;
+}
+
+
+/****************************************************************************
+ * _widen_narrow_data()
+ *
+ * Convert 'n' elements loaded by _read_narrow_H5Viewport() to the type of
+ * 'ans'. 'in' and 'out' must not overlap.
+ * The loops are kept trivial (no function calls, no branches other than the
+ * NA mapping for logical data) so the compiler can vectorize them.
+ * Data read as logical is stored as int8 or int16 by HDF5Array, with NA
+ * stored as a negative value. We map negative values to NA_LOGICAL here,
+ * which is what fix_logical_NAs() does when the data goes thru HDF5's own
+ * conversion path.
+ */
+
+#define	WIDEN_TO_INT(in_type)						\
+{									\
+	const in_type *restrict in_p = in;				\
+	int *restrict out_p = out;					\
+	for (k = 0; k < n; k++)						\
+		out_p[k] = (int) in_p[k];				\
+}
+
+#define	WIDEN_TO_LOGICAL(in_type)					\
+{									\
+	const in_type *restrict in_p = in;				\
+	int *restrict out_p = out;					\
+	for (k = 0; k < n; k++)						\
+		out_p[k] = in_p[k] < 0 ? NA_LOGICAL : (int) in_p[k];	\
+}
+
+void _widen_narrow_data(const H5DSetDescriptor *h5dset,
+		const void *in, void *out, size_t n)
+{
+	size_t k;
+
+	switch (h5dset->narrow_type) {
+	    case NARROW_SCHAR:
+		if (h5dset->Rtype == LGLSXP)
+			WIDEN_TO_LOGICAL(signed char)
+		else
+			WIDEN_TO_INT(signed char)
+		break;
+	    case NARROW_UCHAR:
+		WIDEN_TO_INT(unsigned char)
+		break;
+	    case NARROW_SHORT:
+		if (h5dset->Rtype == LGLSXP)
+			WIDEN_TO_LOGICAL(short)
+		else
+			WIDEN_TO_INT(short)
+		break;
+	    case NARROW_USHORT:
+		WIDEN_TO_INT(unsigned short)
+		break;
+	    case NARROW_FLOAT: {
+		const float *restrict in_p = in;
+		double *restrict out_p = out;
+		for (k = 0; k < n; k++)
+			out_p[k] = (double) in_p[k];
+		break;
+	    }
+	}
+	return;
+}
+
+
 /****************************************************************************
  * _read_h5chunk()
  */
@@ -519,7 +1738,9 @@ int _read_h5chunk(const H5DSetDescriptor *h5dset,
 	int ret;
 	hsize_t chunk_storage_size;
 	uint32_t filters;
+	double t0, t1;
 
+	t0 = _trace_time();
 	ret = H5Dget_chunk_storage_size(h5dset->dset_id,
 					h5chunk_vp->h5off,
 					&chunk_storage_size);
@@ -548,9 +1769,12 @@ int _read_h5chunk(const H5DSetDescriptor *h5dset,
 
 	//printf("filters = %u\n", filters);
 
+	_h5mread_stats.nH5Dread_chunk++;
+
 	//FIXME: This will error if chunk data is not compressed!
 	//TODO: Decompress only if chunk data is compressed. There should be
 	//a bit in the returned 'filters' that indicates this.
+	t1 = _trace_time();
 	ret = uncompress_chunk_data(compressed_chunk_data_buf,
 				    chunk_storage_size,
 				    chunk_data_buf,
@@ -560,6 +1784,9 @@ int _read_h5chunk(const H5DSetDescriptor *h5dset,
 	size_t nval = h5dset->chunk_data_buf_size / h5dset->ans_elt_size;
 	transpose_bytes(chunk_data_buf, nval, h5dset->ans_elt_size,
 			compressed_chunk_data_buf);
+	_h5mread_stats.decompression_time += _trace_time() - t1;
+	_trace_add_read_time(t0);
+	_trace_add_nbytes_read((long long int) chunk_storage_size);
 	//print_chunk_data(h5dset, compressed_chunk_data_buf);
 	return 0;
 }
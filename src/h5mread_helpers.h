@@ -20,6 +20,49 @@ static inline int _next_midx(int ndim, const int *max_idx_plus_one,
 	return along;
 }
 
+void *_scratch_alloc(
+	size_t size,
+	int zeroes,
+	const char *what
+);
+
+void *_get_chunk_data_buf(size_t size);
+
+void _reset_scratch_arena(void);
+
+int _init_charsxp_cache(
+	cetype_t enc,
+	int dict_mode
+);
+
+SEXP _charsxp_cache_get(
+	const char *key,
+	int key_len
+);
+
+void _charsxp_cache_put(
+	const char *key,
+	int key_len,
+	SEXP val
+);
+
+SEXP _charsxp_cache_mkCharLen(
+	const char *s,
+	int s_len
+);
+
+int _charsxp_cache_code(
+	const char *key,
+	int key_len
+);
+
+int _charsxp_cache_ncode(void);
+
+const char *_charsxp_cache_key(
+	int code,
+	int *key_len
+);
+
 /* A data structure for representing a viewport on a HDF5 dataset. */
 typedef struct {
 	hsize_t *h5off, *h5dim;
@@ -36,8 +79,6 @@ int _alloc_H5Viewport(
 	int mode
 );
 
-void _free_H5Viewport(H5Viewport *vp);
-
 int _alloc_tchunk_vp_middle_vp_dest_vp(
 	int ndim,
 	H5Viewport *tchunk_vp,
@@ -46,12 +87,6 @@ int _alloc_tchunk_vp_middle_vp_dest_vp(
 	int dest_vp_mode
 );
 
-void _free_tchunk_vp_middle_vp_dest_vp(
-	H5Viewport *tchunk_vp,
-	H5Viewport *middle_vp,
-	H5Viewport *dest_vp
-);
-
 int _alloc_tchunk_vp_inner_vp_dest_vp(
 	int ndim,
 	H5Viewport *tchunk_vp,
@@ -59,10 +94,20 @@ int _alloc_tchunk_vp_inner_vp_dest_vp(
 	H5Viewport *dest_vp
 );
 
-void _free_tchunk_vp_inner_vp_dest_vp(
-	H5Viewport *tchunk_vp,
-	H5Viewport *inner_vp,
-	H5Viewport *dest_vp
+/* The user-supplied 'starts' decoded once per call into plain C arrays.
+   'off[along]' holds the 0-based offsets of the selected elements along
+   dimension 'along', or is NULL if 'starts[[along]]' is NULL.
+   'chunk_off[along]' holds the same offsets but relative to the chunk
+   they belong to (only for chunked data, NULL otherwise). */
+typedef struct {
+	long long int **off;
+	int **chunk_off;
+} DecodedStarts;
+
+int _decode_starts(
+	const H5DSetDescriptor *h5dset,
+	SEXP starts,
+	DecodedStarts *dstarts
 );
 
 int _map_starts_to_h5chunks(
@@ -103,6 +148,20 @@ int _read_H5Viewport(
 	hid_t mem_space_id
 );
 
+int _read_narrow_H5Viewport(
+	const H5DSetDescriptor *h5dset,
+	const H5Viewport *h5dset_vp,
+	const H5Viewport *mem_vp,
+	void *mem,
+	hid_t mem_space_id
+);
+
+int _reclaim_vlen_data(
+	const H5DSetDescriptor *h5dset,
+	hid_t mem_space_id,
+	void *mem
+);
+
 int _read_h5selection(
 	const H5DSetDescriptor *h5dset,
 	const H5Viewport *mem_vp,
@@ -113,7 +172,7 @@ int _read_h5selection(
 void _update_tchunk_vp_dest_vp(
 	const H5DSetDescriptor *h5dset,
 	const int *tchunk_midx, int moved_along,
-	SEXP starts,
+	const DecodedStarts *dstarts,
 	const IntAEAE *breakpoint_bufs,
 	const LLongAEAE *tchunkidx_bufs,
 	H5Viewport *tchunk_vp,
@@ -131,6 +190,50 @@ int _tchunk_is_fully_selected(
 	const H5Viewport *dest_vp
 );
 
+/* The statistics stored in the companion dataset written by the writers
+   when 'with.chunkstats=TRUE' (must be kept in sync with
+   .CHUNKSTATS_COLNAMES in R/h5chunkstats.R). */
+#define	CHUNKSTATS_SUFFIX	"_chunkstats"
+#define	CHUNKSTAT_NNZ		0
+#define	CHUNKSTAT_NNA		1
+#define	CHUNKSTAT_MIN		2
+#define	CHUNKSTAT_MAX		3
+#define	CHUNKSTAT_SUM		4
+#define	NCHUNKSTAT		5
+
+int _load_chunkstat(
+	const H5DSetDescriptor *h5dset,
+	int stat,
+	long long int nchunk,
+	double *buf
+);
+
+int _load_allocated_chunks(
+	H5DSetDescriptor *h5dset,
+	long long int ntchunk
+);
+
+int _tchunk_is_allocated(
+	const H5DSetDescriptor *h5dset,
+	const H5Viewport *tchunk_vp
+);
+
+int _load_where_chunks(
+	H5DSetDescriptor *h5dset
+);
+
+int _tchunk_can_match(
+	const H5DSetDescriptor *h5dset,
+	const H5Viewport *tchunk_vp
+);
+
+void _widen_narrow_data(
+	const H5DSetDescriptor *h5dset,
+	const void *in,
+	void *out,
+	size_t n
+);
+
 #define CHUNK_COMPRESSION_OVERHEAD 8  // empirical (increase if necessary)
 
 int _read_h5chunk(
@@ -0,0 +1,669 @@
+/****************************************************************************
+ *           Lazy h5mread(): ALTREP arrays that read data on demand         *
+ *                            Author: H. Pag\`es                            *
+ ****************************************************************************/
+#include "h5mread_lazy.h"
+
+#include "global_errmsg_buf.h"
+#include "uaselection.h"
+#include "H5DSetDescriptor.h"
+#include "h5mread.h"
+
+#include <R_ext/Altrep.h>
+#include <stdlib.h>  /* for qsort() */
+#include <string.h>  /* for memcpy() */
+
+/*
+ * h5mread(..., lazy=TRUE) returns an integer, double, or character array
+ * that doesn't hold any data yet. The selection is checked and the
+ * dimensions of the result are computed upfront but nothing is read until
+ * the data is actually accessed:
+ *   - Elt() and Get_region() only read the smallest box (i.e. array block)
+ *     of the result that covers the requested elements. The box is read
+ *     with _h5mread() so it goes thru the usual chunk walk and only the
+ *     chunks that it touches get loaded.
+ *   - Dataptr() reads the full selection once and keeps it around. All
+ *     subsequent accesses are served from it.
+ *
+ * The state of the object is stored in 'data1' as an ordinary list (see
+ * STATE_* below). The materialized data, if any, is stored in 'data2'.
+ * Since 'data1' only contains ordinary R objects, serialization relies
+ * on the default method i.e. the data gets materialized and serialized
+ * as an ordinary vector.
+ */
+
+enum {
+	STATE_FILEPATH = 0,
+	STATE_NAME,
+	STATE_STARTS,        /* list of 1-based coordinates (or NULL) */
+	STATE_AS_INT,
+	STATE_METHOD,
+	STATE_DIM,
+	STATE_CACHE,         /* last block loaded by Elt() (or NULL) */
+	STATE_CACHE_OFFSET,  /* linear index of 1st element in the block */
+	STATE_LENGTH
+};
+
+/* Minimum number of elements loaded by Elt(). Subsequent calls to Elt()
+   are served from the loaded block as long as they fall in it. */
+#define	ELT_BLOCK_SIZE 4096
+
+static R_altrep_class_t lazy_integer_class, lazy_real_class,
+			lazy_string_class;
+
+static R_altrep_class_t get_lazy_class(SEXPTYPE Rtype)
+{
+	switch (Rtype) {
+	    case INTSXP: return lazy_integer_class;
+	    case REALSXP: return lazy_real_class;
+	}
+	return lazy_string_class;
+}
+
+static void *get_dataptr(SEXP x)
+{
+	switch (TYPEOF(x)) {
+	    case INTSXP: return INTEGER(x);
+	    case REALSXP: return REAL(x);
+	}
+	return DATAPTR(x);
+}
+
+
+/****************************************************************************
+ * read_box()
+ */
+
+typedef struct {
+	long long int val;
+	int pos;
+} ValPos;
+
+static int compar_ValPos(const void *p1, const void *p2)
+{
+	const ValPos *vp1 = (const ValPos *) p1, *vp2 = (const ValPos *) p2;
+
+	if (vp1->val != vp2->val)
+		return vp1->val < vp2->val ? -1 : 1;
+	return vp1->pos - vp2->pos;
+}
+
+/* Turn 'start[offset + 0:(n-1)]' into a strictly ascending selection that
+   can be passed to _h5mread(). If the slice is not already strictly
+   ascending, we sort it, remove the duplicates, and store the map from
+   each position in the slice to its (0-based) position in the returned
+   selection in 'maps[[along]]'. */
+static SEXP make_ascending_slice(SEXP start, int offset, int n,
+				 SEXP maps, int along)
+{
+	SEXP map, ans;
+	ValPos *vp;
+	int i, nuniq;
+
+	for (i = 1; i < n; i++) {
+		if (_get_trusted_elt(start, offset + i) <=
+		    _get_trusted_elt(start, offset + i - 1))
+			break;
+	}
+	if (i >= n) {
+		ans = NEW_NUMERIC(n);
+		for (i = 0; i < n; i++)
+			REAL(ans)[i] = (double)
+				_get_trusted_elt(start, offset + i);
+		return ans;
+	}
+	vp = (ValPos *) R_alloc(n, sizeof(ValPos));
+	for (i = 0; i < n; i++) {
+		vp[i].val = _get_trusted_elt(start, offset + i);
+		vp[i].pos = i;
+	}
+	qsort(vp, n, sizeof(ValPos), compar_ValPos);
+	map = NEW_INTEGER(n);
+	SET_VECTOR_ELT(maps, along, map);
+	for (i = nuniq = 0; i < n; i++) {
+		if (i == 0 || vp[i].val != vp[i - 1].val)
+			vp[nuniq++].val = vp[i].val;
+		INTEGER(map)[vp[i].pos] = nuniq - 1;
+	}
+	ans = NEW_NUMERIC(nuniq);
+	for (i = 0; i < nuniq; i++)
+		REAL(ans)[i] = (double) vp[i].val;
+	return ans;
+}
+
+/* 'res' is the array returned by _h5mread() for the ascending selection.
+   Use 'maps' to put its elements back in the order of the original
+   selection. */
+static SEXP gather_box(SEXP res, int ndim, const int *box_dim, SEXP maps)
+{
+	SEXP ans, map;
+	const int *res_dim, *map0;
+	int along, *midx, i, j;
+	R_xlen_t box_len, k;
+	long long int off;
+
+	for (along = 0; along < ndim; along++)
+		if (VECTOR_ELT(maps, along) != R_NilValue)
+			break;
+	if (along >= ndim)
+		return res;
+
+	res_dim = INTEGER(GET_DIM(res));
+	box_len = 1;
+	for (along = 0; along < ndim; along++)
+		box_len *= box_dim[along];
+	ans = PROTECT(allocVector(TYPEOF(res), box_len));
+	midx = (int *) R_alloc(ndim, sizeof(int));
+	memset(midx, 0, ndim * sizeof(int));
+	map0 = VECTOR_ELT(maps, 0) != R_NilValue ?
+		INTEGER(VECTOR_ELT(maps, 0)) : NULL;
+	for (k = 0; k < box_len; k += box_dim[0]) {
+		/* Offset in 'res' of the first element of the current
+		   column. */
+		off = 0;
+		for (along = ndim - 1; along >= 1; along--) {
+			map = VECTOR_ELT(maps, along);
+			j = map != R_NilValue ? INTEGER(map)[midx[along]] :
+						midx[along];
+			off = off * res_dim[along] + j;
+		}
+		off *= res_dim[0];
+		if (TYPEOF(res) == INTSXP) {
+			for (i = 0; i < box_dim[0]; i++) {
+				j = map0 != NULL ? map0[i] : i;
+				INTEGER(ans)[k + i] = INTEGER(res)[off + j];
+			}
+		} else if (TYPEOF(res) == STRSXP) {
+			for (i = 0; i < box_dim[0]; i++) {
+				j = map0 != NULL ? map0[i] : i;
+				SET_STRING_ELT(ans, k + i,
+					       STRING_ELT(res, off + j));
+			}
+		} else {
+			for (i = 0; i < box_dim[0]; i++) {
+				j = map0 != NULL ? map0[i] : i;
+				REAL(ans)[k + i] = REAL(res)[off + j];
+			}
+		}
+		for (along = 1; along < ndim; along++) {
+			if (++midx[along] < box_dim[along])
+				break;
+			midx[along] = 0;
+		}
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+/* Read the box of the lazy array that starts at 'box_start' (0-based) and
+   has dimensions 'box_dim'. Return an ordinary vector containing the
+   elements of the box in column-major order. */
+static SEXP read_box(SEXP state, const int *box_start, const int *box_dim)
+{
+	SEXP starts, dim, filepath, sub_starts, maps, start, sub_start,
+	     res, ans;
+	int ndim, along, i;
+	hid_t file_id, dset_id;
+
+	starts = VECTOR_ELT(state, STATE_STARTS);
+	dim = VECTOR_ELT(state, STATE_DIM);
+	ndim = LENGTH(dim);
+	sub_starts = PROTECT(NEW_LIST(ndim));
+	maps = PROTECT(NEW_LIST(ndim));
+	for (along = 0; along < ndim; along++) {
+		start = GET_LIST_ELT(starts, along);
+		if (start != R_NilValue) {
+			sub_start = make_ascending_slice(start,
+					box_start[along], box_dim[along],
+					maps, along);
+			SET_VECTOR_ELT(sub_starts, along, sub_start);
+			continue;
+		}
+		if (box_start[along] == 0 &&
+		    box_dim[along] == INTEGER(dim)[along])
+			continue;
+		sub_start = NEW_INTEGER(box_dim[along]);
+		SET_VECTOR_ELT(sub_starts, along, sub_start);
+		for (i = 0; i < box_dim[along]; i++)
+			INTEGER(sub_start)[i] = box_start[along] + i + 1;
+	}
+
+	filepath = VECTOR_ELT(state, STATE_FILEPATH);
+	file_id = _get_file_id(filepath, 1);
+	dset_id = _get_dset_id(file_id, VECTOR_ELT(state, STATE_NAME),
+			       filepath);
+	res = _h5mread(dset_id, sub_starts, R_NilValue, 0,
+		       LOGICAL(VECTOR_ELT(state, STATE_AS_INT))[0], 0,
+		       PACKED_NONE,
+		       INTEGER(VECTOR_ELT(state, STATE_METHOD))[0],
+		       WHERE_NONE, 0.0, 0);
+	H5Dclose(dset_id);
+	H5Fclose(file_id);
+	if (res == R_NilValue)
+		error(_HDF5Array_global_errmsg_buf());
+	PROTECT(res);
+	ans = gather_box(res, ndim, box_dim, maps);
+	UNPROTECT(3);
+	return ans;
+}
+
+
+/****************************************************************************
+ * Reading a range of elements
+ */
+
+/* Compute the smallest box that covers the elements with linear indices
+   'i' to 'i + n - 1' (0-based, column-major order). The box is made of
+   full slices along the dimensions that come before the outermost
+   dimension along which the first and last elements differ, so it always
+   corresponds to a contiguous range of linear indices. Return the linear
+   index of its first element. */
+static R_xlen_t linear_range_to_box(int ndim, const int *dim,
+		R_xlen_t i, R_xlen_t n, int *box_start, int *box_dim)
+{
+	int along, outer;
+	R_xlen_t first, last, offset, stride;
+
+	/* Use 'box_start' and 'box_dim' to store the coordinates of the
+	   first and last elements. */
+	first = i;
+	last = i + n - 1;
+	for (along = 0; along < ndim; along++) {
+		box_start[along] = (int) (first % dim[along]);
+		first /= dim[along];
+		box_dim[along] = (int) (last % dim[along]);
+		last /= dim[along];
+	}
+	for (outer = ndim - 1; outer > 0; outer--)
+		if (box_start[outer] != box_dim[outer])
+			break;
+	offset = 0;
+	stride = 1;
+	for (along = 0; along < ndim; along++) {
+		if (along < outer) {
+			box_start[along] = 0;
+			box_dim[along] = dim[along];
+		} else if (along == outer) {
+			box_dim[along] = box_dim[along] - box_start[along] + 1;
+		} else {
+			box_dim[along] = 1;
+		}
+		offset += box_start[along] * stride;
+		stride *= dim[along];
+	}
+	return offset;
+}
+
+static SEXP load_range(SEXP state, R_xlen_t i, R_xlen_t n, R_xlen_t *offset)
+{
+	SEXP dim, ans;
+	int ndim, *box_start, *box_dim;
+	const void *vmax;
+
+	vmax = vmaxget();
+	dim = VECTOR_ELT(state, STATE_DIM);
+	ndim = LENGTH(dim);
+	box_start = (int *) R_alloc(2 * ndim, sizeof(int));
+	box_dim = box_start + ndim;
+	*offset = linear_range_to_box(ndim, INTEGER(dim), i, n,
+				      box_start, box_dim);
+	ans = read_box(state, box_start, box_dim);
+	vmaxset(vmax);
+	return ans;
+}
+
+
+/****************************************************************************
+ * ALTREP methods
+ */
+
+static R_xlen_t LazyVector_Length(SEXP x)
+{
+	SEXP dim;
+	int ndim, along;
+	R_xlen_t ans;
+
+	dim = VECTOR_ELT(R_altrep_data1(x), STATE_DIM);
+	ndim = LENGTH(dim);
+	ans = 1;
+	for (along = 0; along < ndim; along++)
+		ans *= INTEGER(dim)[along];
+	return ans;
+}
+
+static SEXP materialize(SEXP x)
+{
+	SEXP data, state, dim;
+	int *box_start;
+	const void *vmax;
+
+	data = R_altrep_data2(x);
+	if (data != R_NilValue)
+		return data;
+	vmax = vmaxget();
+	state = R_altrep_data1(x);
+	dim = VECTOR_ELT(state, STATE_DIM);
+	box_start = (int *) R_alloc(LENGTH(dim), sizeof(int));
+	memset(box_start, 0, LENGTH(dim) * sizeof(int));
+	data = PROTECT(read_box(state, box_start, INTEGER(dim)));
+	R_set_altrep_data2(x, data);
+	SET_VECTOR_ELT(state, STATE_CACHE, R_NilValue);
+	UNPROTECT(1);
+	vmaxset(vmax);
+	return data;
+}
+
+static void *LazyVector_Dataptr(SEXP x, Rboolean writeable)
+{
+	return get_dataptr(materialize(x));
+}
+
+static const void *LazyVector_Dataptr_or_null(SEXP x)
+{
+	SEXP data;
+
+	data = R_altrep_data2(x);
+	return data != R_NilValue ? get_dataptr(data) : NULL;
+}
+
+/* Return the block that contains element 'i' and set '*offset' to the
+   linear index of its first element. */
+static SEXP get_elt_block(SEXP x, R_xlen_t i, R_xlen_t *offset)
+{
+	SEXP state, block;
+	R_xlen_t n;
+
+	state = R_altrep_data1(x);
+	block = VECTOR_ELT(state, STATE_CACHE);
+	if (block != R_NilValue) {
+		*offset = (R_xlen_t) REAL(VECTOR_ELT(state,
+						     STATE_CACHE_OFFSET))[0];
+		if (i >= *offset && i - *offset < XLENGTH(block))
+			return block;
+	}
+	n = LazyVector_Length(x) - i;
+	if (n > ELT_BLOCK_SIZE)
+		n = ELT_BLOCK_SIZE;
+	block = PROTECT(load_range(state, i, n, offset));
+	SET_VECTOR_ELT(state, STATE_CACHE, block);
+	SET_VECTOR_ELT(state, STATE_CACHE_OFFSET, ScalarReal((double) *offset));
+	UNPROTECT(1);
+	return block;
+}
+
+static int lazy_integer_Elt(SEXP x, R_xlen_t i)
+{
+	SEXP data;
+	R_xlen_t offset;
+
+	data = R_altrep_data2(x);
+	if (data != R_NilValue)
+		return INTEGER(data)[i];
+	data = get_elt_block(x, i, &offset);
+	return INTEGER(data)[i - offset];
+}
+
+static double lazy_real_Elt(SEXP x, R_xlen_t i)
+{
+	SEXP data;
+	R_xlen_t offset;
+
+	data = R_altrep_data2(x);
+	if (data != R_NilValue)
+		return REAL(data)[i];
+	data = get_elt_block(x, i, &offset);
+	return REAL(data)[i - offset];
+}
+
+static SEXP lazy_string_Elt(SEXP x, R_xlen_t i)
+{
+	SEXP data;
+	R_xlen_t offset;
+
+	data = R_altrep_data2(x);
+	if (data != R_NilValue)
+		return STRING_ELT(data, i);
+	data = get_elt_block(x, i, &offset);
+	return STRING_ELT(data, i - offset);
+}
+
+static void lazy_string_Set_elt(SEXP x, R_xlen_t i, SEXP v)
+{
+	SET_STRING_ELT(materialize(x), i, v);
+	return;
+}
+
+static R_xlen_t get_region(SEXP x, R_xlen_t i, R_xlen_t n, void *buf)
+{
+	SEXP data;
+	size_t elt_size;
+	R_xlen_t offset;
+
+	if (n > LazyVector_Length(x) - i)
+		n = LazyVector_Length(x) - i;
+	if (n <= 0)
+		return 0;
+	elt_size = TYPEOF(x) == INTSXP ? sizeof(int) : sizeof(double);
+	data = R_altrep_data2(x);
+	if (data != R_NilValue) {
+		memcpy(buf, (char *) get_dataptr(data) + i * elt_size,
+		       n * elt_size);
+		return n;
+	}
+	data = PROTECT(load_range(R_altrep_data1(x), i, n, &offset));
+	memcpy(buf, (char *) get_dataptr(data) + (i - offset) * elt_size,
+	       n * elt_size);
+	UNPROTECT(1);
+	return n;
+}
+
+static R_xlen_t lazy_integer_Get_region(SEXP x, R_xlen_t i, R_xlen_t n,
+					int *buf)
+{
+	return get_region(x, i, n, buf);
+}
+
+static R_xlen_t lazy_real_Get_region(SEXP x, R_xlen_t i, R_xlen_t n,
+				     double *buf)
+{
+	return get_region(x, i, n, buf);
+}
+
+/* Without this, duplicating a lazy array would materialize it. */
+static SEXP LazyVector_Duplicate(SEXP x, Rboolean deep)
+{
+	SEXP state, data, ans;
+
+	state = PROTECT(shallow_duplicate(R_altrep_data1(x)));
+	SET_VECTOR_ELT(state, STATE_CACHE, R_NilValue);
+	SET_VECTOR_ELT(state, STATE_CACHE_OFFSET, ScalarReal(0.0));
+	data = R_altrep_data2(x);
+	if (data != R_NilValue)
+		data = duplicate(data);
+	PROTECT(data);
+	ans = R_new_altrep(get_lazy_class(TYPEOF(x)), state, data);
+	UNPROTECT(2);
+	return ans;
+}
+
+static Rboolean LazyVector_Inspect(SEXP x, int pre, int deep, int pvec,
+		void (*inspect_subtree)(SEXP, int, int, int))
+{
+	SEXP state;
+
+	state = R_altrep_data1(x);
+	Rprintf(" HDF5Array lazy %s vector (dataset \"%s\" in file \"%s\", "
+		"%s)\n",
+		CHAR(type2str(TYPEOF(x))),
+		CHAR(STRING_ELT(VECTOR_ELT(state, STATE_NAME), 0)),
+		CHAR(STRING_ELT(VECTOR_ELT(state, STATE_FILEPATH), 0)),
+		R_altrep_data2(x) != R_NilValue ? "materialized" :
+						  "not materialized");
+	return TRUE;
+}
+
+static void set_LazyVector_methods(R_altrep_class_t class)
+{
+	R_set_altrep_Length_method(class, LazyVector_Length);
+	R_set_altrep_Inspect_method(class, LazyVector_Inspect);
+	R_set_altrep_Duplicate_method(class, LazyVector_Duplicate);
+	R_set_altvec_Dataptr_method(class, LazyVector_Dataptr);
+	R_set_altvec_Dataptr_or_null_method(class,
+					    LazyVector_Dataptr_or_null);
+	return;
+}
+
+void _init_lazy_altrep_classes(DllInfo *dll)
+{
+	lazy_integer_class = R_make_altinteger_class("lazy_integer",
+						     "HDF5Array", dll);
+	set_LazyVector_methods(lazy_integer_class);
+	R_set_altinteger_Elt_method(lazy_integer_class, lazy_integer_Elt);
+	R_set_altinteger_Get_region_method(lazy_integer_class,
+					   lazy_integer_Get_region);
+	lazy_real_class = R_make_altreal_class("lazy_real",
+					       "HDF5Array", dll);
+	set_LazyVector_methods(lazy_real_class);
+	R_set_altreal_Elt_method(lazy_real_class, lazy_real_Elt);
+	R_set_altreal_Get_region_method(lazy_real_class,
+					lazy_real_Get_region);
+	lazy_string_class = R_make_altstring_class("lazy_string",
+						   "HDF5Array", dll);
+	set_LazyVector_methods(lazy_string_class);
+	R_set_altstring_Elt_method(lazy_string_class, lazy_string_Elt);
+	R_set_altstring_Set_elt_method(lazy_string_class,
+				       lazy_string_Set_elt);
+	return;
+}
+
+
+/****************************************************************************
+ * C_h5mread_lazy()
+ */
+
+/* Turn 'starts' and 'counts' into a list of coordinates. Assumes that
+   the uaselection has been checked. */
+static SEXP expand_starts(int ndim, SEXP starts, SEXP counts,
+			  const int *ans_dim)
+{
+	SEXP ans, start, count, coords;
+	int along, i, k;
+	long long int s, c, t;
+
+	if (counts == R_NilValue)
+		return starts;
+	ans = PROTECT(NEW_LIST(ndim));
+	for (along = 0; along < ndim; along++) {
+		start = VECTOR_ELT(starts, along);
+		if (start == R_NilValue)
+			continue;
+		count = VECTOR_ELT(counts, along);
+		if (count == R_NilValue) {
+			SET_VECTOR_ELT(ans, along, start);
+			continue;
+		}
+		coords = NEW_NUMERIC(ans_dim[along]);
+		SET_VECTOR_ELT(ans, along, coords);
+		for (i = k = 0; i < LENGTH(start); i++) {
+			s = _get_trusted_elt(start, i);
+			c = _get_trusted_elt(count, i);
+			for (t = 0; t < c; t++)
+				REAL(coords)[k++] = (double) (s + t);
+		}
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+/* Return R_NilValue on error. */
+static SEXP h5mread_lazy(hid_t dset_id, SEXP filepath, SEXP name,
+			 SEXP starts, SEXP counts, int as_int, int method)
+{
+	H5DSetDescriptor h5dset;
+	int ndim, along, h5along;
+	long long int *dim_buf, ans_len;
+	SEXP ans, ans_dim, state;
+
+	ans = R_NilValue;
+
+	if (_init_H5DSetDescriptor(&h5dset, dset_id, as_int, 0) < 0)
+		return ans;
+
+	if (h5dset.Rtype != INTSXP && h5dset.Rtype != REALSXP &&
+	    h5dset.Rtype != STRSXP)
+	{
+		PRINT_TO_ERRMSG_BUF("'lazy=TRUE' is only supported on "
+				    "integer, double, or character data");
+		goto on_error;
+	}
+	ndim = h5dset.ndim;
+	if (_shallow_check_uaselection(ndim, starts, counts) < 0)
+		goto on_error;
+	dim_buf = (long long int *) R_alloc(ndim, sizeof(long long int));
+	for (along = 0, h5along = ndim - 1; along < ndim; along++, h5along--)
+		dim_buf[along] = (long long int) h5dset.h5dim[h5along];
+	ans_dim = PROTECT(NEW_INTEGER(ndim));
+	ans_len = _check_uaselection(ndim, dim_buf, starts, counts,
+				     INTEGER(ans_dim));
+	if (ans_len < 0) {
+		UNPROTECT(1);
+		goto on_error;
+	}
+
+	if (ndim == 0 || ans_len == 0) {
+		/* Nothing to be lazy about. */
+		ans = _h5mread(dset_id, starts, counts, 0, as_int, 0,
+			       PACKED_NONE, method, WHERE_NONE, 0.0, 0);
+		UNPROTECT(1);
+		goto on_error;
+	}
+
+	state = PROTECT(NEW_LIST(STATE_LENGTH));
+	SET_VECTOR_ELT(state, STATE_FILEPATH, filepath);
+	SET_VECTOR_ELT(state, STATE_NAME, name);
+	SET_VECTOR_ELT(state, STATE_STARTS,
+		       expand_starts(ndim, starts, counts, INTEGER(ans_dim)));
+	SET_VECTOR_ELT(state, STATE_AS_INT, ScalarLogical(as_int));
+	SET_VECTOR_ELT(state, STATE_METHOD, ScalarInteger(method));
+	SET_VECTOR_ELT(state, STATE_DIM, ans_dim);
+	SET_VECTOR_ELT(state, STATE_CACHE_OFFSET, ScalarReal(0.0));
+	ans = PROTECT(R_new_altrep(get_lazy_class(h5dset.Rtype),
+				   state, R_NilValue));
+	SET_DIM(ans, ans_dim);
+	UNPROTECT(3);
+
+    on_error:
+	_destroy_H5DSetDescriptor(&h5dset);
+	return ans;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_h5mread_lazy(SEXP filepath, SEXP name, SEXP starts, SEXP counts,
+		    SEXP as_integer, SEXP method)
+{
+	int as_int, method0;
+	hid_t file_id, dset_id;
+	SEXP ans;
+
+	/* Check 'as_integer'. */
+	if (!(IS_LOGICAL(as_integer) && LENGTH(as_integer) == 1))
+		error("'as_integer' must be TRUE or FALSE");
+	as_int = LOGICAL(as_integer)[0];
+
+	/* Check 'method'. */
+	if (!(IS_INTEGER(method) && LENGTH(method) == 1))
+		error("'method' must be a single integer");
+	method0 = INTEGER(method)[0];
+
+	file_id = _get_file_id(filepath, 1);
+	dset_id = _get_dset_id(file_id, name, filepath);
+	ans = PROTECT(h5mread_lazy(dset_id, filepath, name, starts, counts,
+				   as_int, method0));
+	H5Dclose(dset_id);
+	H5Fclose(file_id);
+	UNPROTECT(1);
+	if (ans == R_NilValue)
+		error(_HDF5Array_global_errmsg_buf());
+	return ans;
+}
+
@@ -0,0 +1,19 @@
+#ifndef _H5MREAD_LAZY_H_
+#define _H5MREAD_LAZY_H_
+
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+
+SEXP C_h5mread_lazy(
+	SEXP filepath,
+	SEXP name,
+	SEXP starts,
+	SEXP counts,
+	SEXP as_integer,
+	SEXP method
+);
+
+void _init_lazy_altrep_classes(DllInfo *dll);
+
+#endif  /* _H5MREAD_LAZY_H_ */
+
@@ -0,0 +1,552 @@
+/****************************************************************************
+ *          Workhorse behind h5mread method 9 (memory-mapped reads)         *
+ *                            Author: H. Pag\`es                            *
+ ****************************************************************************/
+#include "h5mread_mmap.h"
+
+#include "global_errmsg_buf.h"
+#include "uaselection.h"
+#include "h5mread_helpers.h"
+#include "h5mread_trace.h"
+
+#include <R_ext/Altrep.h>
+
+#include <string.h>  /* for memcpy */
+#ifndef _WIN32
+#include <sys/mman.h>  /* for mmap(), munmap() */
+#include <unistd.h>  /* for sysconf() */
+#endif
+
+/*
+ * Method 9 only applies to a dataset that is stored contiguously (i.e. in
+ * a single block of bytes) in the file, with no filters or external storage,
+ * and whose on-disk type is the native memory type we'd use for the
+ * returned array, possibly with the opposite byte order. This is typically
+ * what writeHDF5Array(x, chunkdim=0) produces.
+ *
+ * For such a dataset, we get the file offset of its raw data with
+ * H5Dget_offset(), map the region of the file that contains the selected
+ * elements, and gather them directly from the mapping, byte-swapping them
+ * if necessary.
+ *
+ * When method 9 is explicitly requested, the dataset is read in its
+ * entirety, and no conversion is needed, the returned integer or double
+ * vector is an ALTREP object backed by the mapping so nothing is copied at
+ * all. The mapping is private (MAP_PRIVATE) so writing to the vector will
+ * never modify the file. However, the vector aliases the file: on most
+ * platforms, modifying the file in place (i.e. without replacing it) after
+ * the mapping was created alters the content of the vector, and truncating
+ * the file makes accessing it raise SIGBUS. This is why we never return
+ * such a vector when method 9 was selected automatically (method 0).
+ */
+
+#define	MMAP_AS_IS		1
+#define	MMAP_WITH_BYTE_SWAP	2
+
+#ifndef _WIN32
+
+/* Return MMAP_AS_IS, MMAP_WITH_BYTE_SWAP, 0 (if method 9 cannot be used on
+   the dataset), or -1 (if an error occured). */
+static int get_mmap_mode(const H5DSetDescriptor *h5dset)
+{
+	int ret;
+	hid_t swapped_type_id;
+	H5T_order_t order;
+
+	if (h5dset->H5layout != H5D_CONTIGUOUS)
+		return 0;
+	if (h5dset->Rtype != LGLSXP && h5dset->Rtype != INTSXP &&
+	    h5dset->Rtype != REALSXP && h5dset->Rtype != RAWSXP)
+		return 0;
+	if (H5Dget_offset(h5dset->dset_id) == HADDR_UNDEF)
+		return 0;
+	ret = H5Pget_external_count(h5dset->plist_id);
+	if (ret < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Pget_external_count() "
+				    "returned an error");
+		return -1;
+	}
+	if (ret != 0)
+		return 0;
+	ret = H5Tequal(h5dset->dtype_id, h5dset->mem_type_id);
+	if (ret < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Tequal() returned an error");
+		return -1;
+	}
+	if (ret > 0)
+		return MMAP_AS_IS;
+	swapped_type_id = H5Tcopy(h5dset->mem_type_id);
+	if (swapped_type_id < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Tcopy() returned an error");
+		return -1;
+	}
+	order = H5Tget_order(swapped_type_id);
+	ret = H5Tset_order(swapped_type_id,
+			   order == H5T_ORDER_LE ? H5T_ORDER_BE : H5T_ORDER_LE);
+	if (ret >= 0)
+		ret = H5Tequal(h5dset->dtype_id, swapped_type_id);
+	H5Tclose(swapped_type_id);
+	if (ret < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Tset_order() or H5Tequal() "
+				    "returned an error");
+		return -1;
+	}
+	return ret > 0 ? MMAP_WITH_BYTE_SWAP : 0;
+}
+
+/* Return the file descriptor used by the sec2 driver (the default driver)
+   to access the file that contains the dataset, or -1 if the file is not
+   accessed thru the sec2 driver or if an error occured. In the latter case,
+   '*err' is set to 1. */
+static int get_sec2_fd(hid_t dset_id, int *err)
+{
+	hid_t file_id, fapl_id;
+	void *handle;
+	int fd;
+
+	*err = 1;
+	file_id = H5Iget_file_id(dset_id);
+	if (file_id < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Iget_file_id() returned an error");
+		return -1;
+	}
+	fapl_id = H5Fget_access_plist(file_id);
+	if (fapl_id < 0) {
+		H5Fclose(file_id);
+		PRINT_TO_ERRMSG_BUF("H5Fget_access_plist() returned an error");
+		return -1;
+	}
+	fd = -1;
+	if (H5Pget_driver(fapl_id) != H5FD_SEC2) {
+		*err = 0;
+	} else if (H5Fget_vfd_handle(file_id, fapl_id, &handle) < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Fget_vfd_handle() returned an error");
+	} else {
+		fd = *((int *) handle);
+		/* Make sure that any pending raw data (e.g. in the sieve
+		   buffer of a dataset that was written thru another handle
+		   on the same file) makes it to the file before we map it.
+		   This is a no-op if the file was opened in read-only mode. */
+		H5Fflush(file_id, H5F_SCOPE_LOCAL);
+		*err = 0;
+	}
+	H5Pclose(fapl_id);
+	H5Fclose(file_id);
+	return fd;
+}
+
+/* Return 1 if the file that contains the dataset is accessed thru the sec2
+   driver, 0 if it's not, or -1 if an error occured. */
+static int uses_sec2_driver(hid_t dset_id)
+{
+	hid_t file_id, fapl_id, driver_id;
+
+	file_id = H5Iget_file_id(dset_id);
+	if (file_id < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Iget_file_id() returned an error");
+		return -1;
+	}
+	fapl_id = H5Fget_access_plist(file_id);
+	H5Fclose(file_id);
+	if (fapl_id < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Fget_access_plist() returned an error");
+		return -1;
+	}
+	driver_id = H5Pget_driver(fapl_id);
+	H5Pclose(fapl_id);
+	if (driver_id < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Pget_driver() returned an error");
+		return -1;
+	}
+	return driver_id == H5FD_SEC2;
+}
+
+#endif  /* _WIN32 */
+
+/* Return the mmap mode of the dataset (MMAP_AS_IS or MMAP_WITH_BYTE_SWAP),
+   0 if method 9 cannot be used on it, or -1 if an error occured. The
+   returned value can be passed to _h5mread_mmap().
+   This is what the automatic method selection relies on so, unlike
+   _h5mread_mmap(), it also returns 0 if the file is not accessed thru the
+   sec2 driver. */
+int _mmap_read_is_possible(const H5DSetDescriptor *h5dset)
+{
+#ifdef _WIN32
+	return 0;
+#else
+	int mmap_mode, ret;
+
+	mmap_mode = get_mmap_mode(h5dset);
+	if (mmap_mode <= 0)
+		return mmap_mode;
+	ret = uses_sec2_driver(h5dset->dset_id);
+	if (ret < 0)
+		return -1;
+	return ret ? mmap_mode : 0;
+#endif
+}
+
+
+/****************************************************************************
+ * Gather the selected elements from the mapping
+ */
+
+#ifndef _WIN32
+
+static inline void swap_bytes(char *p, size_t elt_size)
+{
+	size_t i, j;
+	char tmp;
+
+	for (i = 0, j = elt_size - 1; i < j; i++, j--) {
+		tmp = p[i];
+		p[i] = p[j];
+		p[j] = tmp;
+	}
+	return;
+}
+
+/* 'idx' must contain the 0-based indices of the selected elements along
+   each dimension (in R order), and 'stride' the nb of elements to skip in
+   the dataset to move by one position along each dimension. 'delta' is the
+   position in bytes of the first element of the dataset with respect to
+   the start of the mapping (can be negative). */
+static void gather_from_mapping(int ndim, const int *ans_dim,
+		const long long int * const *idx, const long long int *stride,
+		const char *map_addr, long long int delta,
+		size_t elt_size, int byte_swap,
+		char *out, int *midx_buf)
+{
+	int along, moved_along, i, n0, contig0;
+	long long int off;
+	const long long int *idx0;
+
+	n0 = ans_dim[0];
+	idx0 = idx[0];
+	/* Is the selection along the 1st dimension a single run of
+	   adjacent positions? */
+	contig0 = 1;
+	for (i = 1; i < n0; i++) {
+		if (idx0[i] != idx0[0] + i) {
+			contig0 = 0;
+			break;
+		}
+	}
+	moved_along = ndim;
+	do {
+		off = 0;
+		for (along = 1; along < ndim; along++)
+			off += idx[along][midx_buf[along]] * stride[along];
+		if (contig0) {
+			memcpy(out, map_addr + delta +
+				    (off + idx0[0]) * (long long int) elt_size,
+			       n0 * elt_size);
+		} else {
+			for (i = 0; i < n0; i++)
+				memcpy(out + i * elt_size,
+				       map_addr + delta +
+				       (off + idx0[i]) * (long long int) elt_size,
+				       elt_size);
+		}
+		if (byte_swap) {
+			for (i = 0; i < n0; i++)
+				swap_bytes(out + i * elt_size, elt_size);
+		}
+		out += n0 * elt_size;
+		/* Move to next row. */
+		moved_along = _next_midx(ndim - 1, ans_dim + 1, midx_buf + 1);
+	} while (moved_along < ndim - 1);
+	return;
+}
+
+/* Expand the user-supplied selection along each dimension into a vector of
+   0-based indices. Return -1 on error. */
+static int expand_uaselection(int ndim, const int *ans_dim,
+		SEXP starts, SEXP counts, long long int **idx)
+{
+	int along, i, j, k;
+	SEXP start, count;
+	long long int s, c, *idx_p;
+
+	for (along = 0; along < ndim; along++) {
+		idx_p = _scratch_alloc(ans_dim[along] * sizeof(long long int),
+				       0, "'idx'");
+		if (idx_p == NULL)
+			return -1;
+		idx[along] = idx_p;
+		start = GET_LIST_ELT(starts, along);
+		if (start == R_NilValue) {
+			for (i = 0; i < ans_dim[along]; i++)
+				idx_p[i] = i;
+			continue;
+		}
+		count = GET_LIST_ELT(counts, along);
+		for (j = 0; j < LENGTH(start); j++) {
+			s = _get_trusted_elt(start, j) - 1;
+			if (count == R_NilValue) {
+				*(idx_p++) = s;
+				continue;
+			}
+			c = _get_trusted_elt(count, j);
+			for (k = 0; k < c; k++)
+				*(idx_p++) = s + k;
+		}
+	}
+	return 0;
+}
+
+
+/****************************************************************************
+ * ALTREP classes for vectors backed by a mapping
+ *
+ * The mapping is owned by an external pointer stored in 'data1'. It gets
+ * unmapped when the external pointer is garbage collected.
+ */
+
+typedef struct {
+	void *map_addr;
+	size_t map_len;
+	void *data;
+	R_xlen_t length;
+} MappedVector;
+
+static R_altrep_class_t mmap_integer_class, mmap_real_class;
+
+static void MappedVector_finalizer(SEXP xp)
+{
+	MappedVector *mv;
+
+	mv = (MappedVector *) R_ExternalPtrAddr(xp);
+	if (mv == NULL)
+		return;
+	munmap(mv->map_addr, mv->map_len);
+	free(mv);
+	R_ClearExternalPtr(xp);
+	return;
+}
+
+static MappedVector *get_MappedVector(SEXP x)
+{
+	return (MappedVector *) R_ExternalPtrAddr(R_altrep_data1(x));
+}
+
+static R_xlen_t MappedVector_Length(SEXP x)
+{
+	return get_MappedVector(x)->length;
+}
+
+/* The mapping is private and writable so there's no need to distinguish
+   between read-only and writable access. */
+static void *MappedVector_Dataptr(SEXP x, Rboolean writeable)
+{
+	return get_MappedVector(x)->data;
+}
+
+static const void *MappedVector_Dataptr_or_null(SEXP x)
+{
+	return get_MappedVector(x)->data;
+}
+
+static Rboolean MappedVector_Inspect(SEXP x, int pre, int deep, int pvec,
+		void (*inspect_subtree)(SEXP, int, int, int))
+{
+	MappedVector *mv;
+
+	mv = get_MappedVector(x);
+	Rprintf(" HDF5Array mmap-backed %s vector (length=%lld, "
+		"mapping=%llu bytes)\n",
+		TYPEOF(x) == INTSXP ? "integer" : "double",
+		(long long int) mv->length,
+		(unsigned long long int) mv->map_len);
+	return TRUE;
+}
+
+static void set_MappedVector_methods(R_altrep_class_t class)
+{
+	R_set_altrep_Length_method(class, MappedVector_Length);
+	R_set_altrep_Inspect_method(class, MappedVector_Inspect);
+	R_set_altvec_Dataptr_method(class, MappedVector_Dataptr);
+	R_set_altvec_Dataptr_or_null_method(class,
+					    MappedVector_Dataptr_or_null);
+	return;
+}
+
+#endif  /* _WIN32 */
+
+void _init_mmap_altrep_classes(DllInfo *dll)
+{
+#ifndef _WIN32
+	mmap_integer_class = R_make_altinteger_class("mmap_integer",
+						     "HDF5Array", dll);
+	set_MappedVector_methods(mmap_integer_class);
+	mmap_real_class = R_make_altreal_class("mmap_real",
+					       "HDF5Array", dll);
+	set_MappedVector_methods(mmap_real_class);
+#endif
+	return;
+}
+
+#ifndef _WIN32
+
+/* Takes ownership of the mapping. */
+static SEXP new_MappedVector(SEXPTYPE Rtype,
+		void *map_addr, size_t map_len,
+		void *data, R_xlen_t length)
+{
+	MappedVector *mv;
+	SEXP xp, ans;
+
+	mv = (MappedVector *) malloc(sizeof(MappedVector));
+	if (mv == NULL) {
+		munmap(map_addr, map_len);
+		error("failed to allocate memory for 'mv'");
+	}
+	mv->map_addr = map_addr;
+	mv->map_len = map_len;
+	mv->data = data;
+	mv->length = length;
+	xp = PROTECT(R_MakeExternalPtr(mv, R_NilValue, R_NilValue));
+	R_RegisterCFinalizerEx(xp, MappedVector_finalizer, TRUE);
+	ans = R_new_altrep(Rtype == INTSXP ? mmap_integer_class :
+					     mmap_real_class,
+			   xp, R_NilValue);
+	UNPROTECT(1);
+	return ans;
+}
+
+#endif  /* _WIN32 */
+
+
+/****************************************************************************
+ * _h5mread_mmap()
+ *
+ * Implements method 9.
+ * 'mmap_mode' is the value returned by an earlier call to
+ * _mmap_read_is_possible() on the dataset, or -1 if that function was not
+ * called. Set 'zero_copy' to 1 to allow returning an ALTREP vector backed
+ * by the mapping.
+ * Return an ordinary array, or an ALTREP vector backed by the mapping, or
+ * R_NilValue if an error occured.
+ */
+
+SEXP _h5mread_mmap(const H5DSetDescriptor *h5dset,
+		   SEXP starts, SEXP counts, int mmap_mode, int zero_copy,
+		   int *ans_dim)
+{
+#ifdef _WIN32
+	PRINT_TO_ERRMSG_BUF("method 9 is not supported on Windows");
+	return R_NilValue;
+#else
+	int fd, err, ndim, along, h5along, full;
+	long long int ans_len, *dim_buf, *stride, **idx, lo, hi;
+	haddr_t offset;
+	size_t elt_size, page_size, map_off, map_len;
+	void *map_addr;
+	int *midx_buf;
+	double t0;
+	SEXP ans;
+
+	if (mmap_mode < 0)
+		mmap_mode = get_mmap_mode(h5dset);
+	if (mmap_mode < 0)
+		return R_NilValue;
+	if (mmap_mode == 0) {
+		PRINT_TO_ERRMSG_BUF("method 9 can only be used on a dataset "
+				    "that is stored contiguously and whose\n  "
+				    "type is the native type used for the "
+				    "returned array (with no conversion)");
+		return R_NilValue;
+	}
+	fd = get_sec2_fd(h5dset->dset_id, &err);
+	if (fd < 0) {
+		if (!err)
+			PRINT_TO_ERRMSG_BUF("method 9 can only be used on "
+					    "a file accessed thru the "
+					    "sec2 driver");
+		return R_NilValue;
+	}
+
+	/* Check the user-supplied array selection and set 'ans_dim'. */
+	t0 = _trace_time();
+	ndim = h5dset->ndim;
+	dim_buf = _scratch_alloc(2 * ndim * sizeof(long long int), 0,
+				 "'dim_buf' and 'stride'");
+	idx = _scratch_alloc(ndim * sizeof(long long int *), 0, "'idx'");
+	midx_buf = _scratch_alloc(ndim * sizeof(int), 1, "'midx_buf'");
+	if (dim_buf == NULL || idx == NULL || midx_buf == NULL)
+		return R_NilValue;
+	stride = dim_buf + ndim;
+	for (along = 0, h5along = ndim - 1; along < ndim; along++, h5along--) {
+		dim_buf[along] = (long long int) h5dset->h5dim[h5along];
+		stride[along] = along == 0 ? 1 :
+				stride[along - 1] * dim_buf[along - 1];
+	}
+	ans_len = _check_uaselection(ndim, dim_buf, starts, counts, ans_dim);
+	if (ans_len < 0)
+		return R_NilValue;
+	if (ans_len == 0)
+		return allocVector(h5dset->Rtype, 0);
+
+	if (expand_uaselection(ndim, ans_dim, starts, counts, idx) < 0)
+		return R_NilValue;
+	_trace_add_select_time(t0);
+
+	/* Find the smallest region of the file to map. Because the indices
+	   along each dimension are not necessarily sorted (when 'counts'
+	   is NULL), we must look at all of them. */
+	lo = hi = 0;
+	full = 1;
+	for (along = 0; along < ndim; along++) {
+		long long int min = idx[along][0], max = min, i;
+		for (i = 1; i < ans_dim[along]; i++) {
+			if (idx[along][i] < min)
+				min = idx[along][i];
+			else if (idx[along][i] > max)
+				max = idx[along][i];
+		}
+		lo += min * stride[along];
+		hi += max * stride[along];
+		if (GET_LIST_ELT(starts, along) != R_NilValue)
+			full = 0;
+	}
+	elt_size = h5dset->ans_elt_size;
+	offset = H5Dget_offset(h5dset->dset_id);
+	page_size = (size_t) sysconf(_SC_PAGESIZE);
+	map_off = (offset + lo * elt_size) / page_size * page_size;
+	map_len = offset + (hi + 1) * elt_size - map_off;
+	/* Writable private mapping (writes are never carried thru to the
+	   file). */
+	t0 = _trace_time();
+	map_addr = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+			fd, (off_t) map_off);
+	_trace_add_read_time(t0);
+	if (map_addr == MAP_FAILED) {
+		PRINT_TO_ERRMSG_BUF("mmap() failed");
+		return R_NilValue;
+	}
+
+	if (zero_copy && full && mmap_mode == MMAP_AS_IS &&
+	    (h5dset->Rtype == INTSXP || h5dset->Rtype == REALSXP) &&
+	    (offset - map_off) % elt_size == 0)
+	{
+		/* Zero-copy. */
+		_h5mread_stats.nzero_copy++;
+		return new_MappedVector(h5dset->Rtype, map_addr, map_len,
+					(char *) map_addr + (offset - map_off),
+					(R_xlen_t) ans_len);
+	}
+	ans = PROTECT(allocVector(h5dset->Rtype, (R_xlen_t) ans_len));
+	t0 = _trace_time();
+	gather_from_mapping(ndim, ans_dim, (const long long int * const *) idx,
+			    stride,
+			    (const char *) map_addr,
+			    (long long int) offset - (long long int) map_off,
+			    elt_size, mmap_mode == MMAP_WITH_BYTE_SWAP,
+			    (char *) DATAPTR(ans), midx_buf);
+	_trace_add_gather_time(t0);
+	munmap(map_addr, map_len);
+	UNPROTECT(1);
+	return ans;
+#endif  /* _WIN32 */
+}
+
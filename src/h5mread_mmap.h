@@ -0,0 +1,22 @@
+#ifndef _H5MREAD_MMAP_H_
+#define _H5MREAD_MMAP_H_
+
+#include "H5DSetDescriptor.h"
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+
+int _mmap_read_is_possible(const H5DSetDescriptor *h5dset);
+
+SEXP _h5mread_mmap(
+	const H5DSetDescriptor *h5dset,
+	SEXP starts,
+	SEXP counts,
+	int mmap_mode,
+	int zero_copy,
+	int *ans_dim
+);
+
+void _init_mmap_altrep_classes(DllInfo *dll);
+
+#endif  /* _H5MREAD_MMAP_H_ */
+
@@ -7,6 +7,7 @@
 #include "global_errmsg_buf.h"
 #include "uaselection.h"
 #include "h5mread_helpers.h"
+#include "h5mread_trace.h"
 
 #include <stdlib.h>  /* for malloc, free */
 #include <string.h>  /* for memcpy */
@@ -45,15 +46,6 @@ static inline void CharAE_fast_append(CharAE *ae, char c)
 	return;
 }
 
-static inline void CharAEAE_fast_append(CharAEAE *aeae, CharAE *ae)
-{
-	/* We don't use CharAEAE_get_nelt() for maximum speed. */
-	if (aeae->_nelt == aeae->_buflength)
-		CharAEAE_extend(aeae, increase_buflength(aeae->_buflength));
-	aeae->elts[aeae->_nelt++] = ae;
-	return;
-}
-
 
 /****************************************************************************
  * Fast append a non-zero value to an auto-extending buffer
@@ -99,24 +91,23 @@ static inline int CharAE_append_if_nonzero(CharAE *ae, char c)
 	return 1;
 }
 
-static inline int CharAEAE_append_if_nonzero(CharAEAE *aeae, const char *s,
-					     size_t n)
+/* Non-empty strings are not copied to the buffer: we only store their code
+   in the dictionary maintained by the CHARSXP cache (see h5mread_helpers.c).
+   Return -2 if the string couldn't be added to the dictionary. */
+static inline int string_code_append_if_nonzero(IntAE *ae, const char *s,
+						size_t n)
 {
-	size_t s_len;
+	int code;
 
-	for (s_len = 0; s_len < n; s_len++)
-		if (s[s_len] == 0)
-			break;
-	if (s_len == 0)
+	if (s[0] == 0)
 		return 0;
-	/* We don't use CharAEAE_get_nelt() for maximum speed. */
-	if (aeae->_nelt >= NZDATA_MAXLENGTH)
+	/* We don't use IntAE_get_nelt() for maximum speed. */
+	if (ae->_nelt >= NZDATA_MAXLENGTH)
 		return -1;
-	CharAE *ae = new_CharAE(s_len);
-	memcpy(ae->elts, s, s_len);
-	/* We don't use CharAE_set_nelt() for maximum speed. */
-	ae->_nelt = s_len;
-	CharAEAE_fast_append(aeae, ae);
+	code = _charsxp_cache_code(s, (int) n);
+	if (code < 0)
+		return -2;
+	IntAE_fast_append(ae, code);
 	return 1;
 }
 
@@ -130,7 +121,7 @@ static void *new_nzdata_buf(SEXPTYPE Rtype)
 	switch (Rtype) {
 	    case LGLSXP: case INTSXP: return new_IntAE(0, 0, 0);
 	    case REALSXP:             return new_DoubleAE(0, 0, 0.0);
-	    case STRSXP:              return new_CharAEAE(0, 0);
+	    case STRSXP:              return new_IntAE(0, 0, 0);
 	    case RAWSXP:              return new_CharAE(0);
 	}
 	/* Should never happen. The early call to _init_H5DSetDescriptor()
@@ -162,13 +153,38 @@ static SEXP make_nzindex_from_bufs(const IntAEAE *nzindex_bufs)
 	return nzindex;
 }
 
+/* Each distinct string is turned into a CHARSXP only once. */
+static SEXP new_CHARACTER_from_string_codes(const IntAE *codes)
+{
+	int ncode, code, key_len, s_len;
+	size_t nelt, i;
+	const char *key;
+	SEXP levels, ans;
+
+	ncode = _charsxp_cache_ncode();
+	levels = PROTECT(NEW_CHARACTER(ncode));
+	for (code = 0; code < ncode; code++) {
+		key = _charsxp_cache_key(code, &key_len);
+		for (s_len = 0; s_len < key_len; s_len++)
+			if (key[s_len] == 0)
+				break;
+		SET_STRING_ELT(levels, code, mkCharLen(key, s_len));
+	}
+	nelt = IntAE_get_nelt(codes);
+	ans = PROTECT(NEW_CHARACTER(nelt));
+	for (i = 0; i < nelt; i++)
+		SET_STRING_ELT(ans, i, STRING_ELT(levels, codes->elts[i]));
+	UNPROTECT(2);
+	return ans;
+}
+
 static SEXP make_nzdata_from_buf(const void *nzdata_buf, SEXPTYPE Rtype)
 {
 	switch (Rtype) {
 	    case LGLSXP:  return new_LOGICAL_from_IntAE(nzdata_buf);
 	    case INTSXP:  return new_INTEGER_from_IntAE(nzdata_buf);
 	    case REALSXP: return new_NUMERIC_from_DoubleAE(nzdata_buf);
-	    case STRSXP:  return new_CHARACTER_from_CharAEAE(nzdata_buf);
+	    case STRSXP:  return new_CHARACTER_from_string_codes(nzdata_buf);
 	    case RAWSXP:  return new_RAW_from_CharAE(nzdata_buf);
 	}
 	/* Should never happen. The early call to _init_H5DSetDescriptor()
@@ -295,44 +311,41 @@ static SEXP NOT_USED_make_nzindex_from_bufs(const IntAEAE *nzindex_bufs,
  * Low-level helpers used by the data gathering functions
  */
 
-static void init_in_offset(int ndim, SEXP starts,
+static void init_in_offset(int ndim, const DecodedStarts *dstarts,
 		const hsize_t *h5chunkdim, const H5Viewport *dest_vp,
-		const H5Viewport *tchunk_vp,
 		size_t *in_offset)
 {
 	size_t in_off;
 	int along, h5along, i;
-	SEXP start;
+	const int *chunk_off;
 
 	in_off = 0;
 	for (along = ndim - 1, h5along = 0; along >= 0; along--, h5along++) {
 		in_off *= h5chunkdim[h5along];
 		i = dest_vp->off[along];
-		start = GET_LIST_ELT(starts, along);
-		if (start != R_NilValue)
-			in_off += _get_trusted_elt(start, i) - 1 -
-				  tchunk_vp->h5off[h5along];
+		chunk_off = dstarts->chunk_off[along];
+		if (chunk_off != NULL)
+			in_off += chunk_off[i];
 	}
 	*in_offset = in_off;
 	return;
 }
 
-static inline void update_in_offset(int ndim, SEXP starts,
+static inline void update_in_offset(int ndim, const DecodedStarts *dstarts,
 		const hsize_t *h5chunkdim, const H5Viewport *dest_vp,
 		const int *inner_midx, int inner_moved_along,
 		size_t *in_offset)
 {
-	SEXP start;
+	const int *chunk_off;
 	int i1, i0, along, h5along, di;
 	long long int in_off_inc;
 
-	start = GET_LIST_ELT(starts, inner_moved_along);
-	if (start != R_NilValue) {
+	chunk_off = dstarts->chunk_off[inner_moved_along];
+	if (chunk_off != NULL) {
 		i1 = dest_vp->off[inner_moved_along] +
 		     inner_midx[inner_moved_along];
 		i0 = i1 - 1;
-		in_off_inc = _get_trusted_elt(start, i1) -
-			     _get_trusted_elt(start, i0);
+		in_off_inc = chunk_off[i1] - chunk_off[i0];
 	} else {
 		in_off_inc = 1;
 	}
@@ -342,12 +355,11 @@ static inline void update_in_offset(int ndim, SEXP starts,
 		do {
 			in_off_inc *= h5chunkdim[h5along];
 			di = 1 - dest_vp->dim[along];
-			start = GET_LIST_ELT(starts, along);
-			if (start != R_NilValue) {
+			chunk_off = dstarts->chunk_off[along];
+			if (chunk_off != NULL) {
 				i1 = dest_vp->off[along];
 				i0 = i1 - di;
-				in_off_inc += _get_trusted_elt(start, i1) -
-					      _get_trusted_elt(start, i0);
+				in_off_inc += chunk_off[i1] - chunk_off[i0];
 			} else {
 				in_off_inc += di;
 			}
@@ -362,7 +374,8 @@ static inline void update_in_offset(int ndim, SEXP starts,
 /* We don't let the length of 'nzdata' exceed INT_MAX (see NZDATA_MAXLENGTH
    above). Return 0 if val is zero, 1 if val is non-zero and was successfully
    appended, and -1 if val is non-zero but couldn't be appended because the
-   length of 'nzdata' is already NZDATA_MAXLENGTH. */
+   length of 'nzdata' is already NZDATA_MAXLENGTH. Return -2 if a string
+   couldn't be added to the dictionary (see string_code_append_if_nonzero()). */
 static inline int append_nonzero_val_to_nzdata_buf(
 		const H5DSetDescriptor *h5dset,
 		const int *in, size_t in_offset,
@@ -382,8 +395,8 @@ static inline int append_nonzero_val_to_nzdata_buf(
 	    } break;
 	    case STRSXP: {
 		const char *s = ((char *) in) + in_offset * h5dset->H5size;
-		ret = CharAEAE_append_if_nonzero((CharAEAE *) nzdata_buf, s,
-						 h5dset->H5size);
+		ret = string_code_append_if_nonzero((IntAE *) nzdata_buf, s,
+						    h5dset->H5size);
 	    } break;
 	    case RAWSXP: {
 		char val = ((char *) in)[in_offset];
@@ -394,7 +407,7 @@ static inline int append_nonzero_val_to_nzdata_buf(
 				    CHAR(type2str(h5dset->Rtype)));
 		return -1;
 	}
-	if (ret < 0)
+	if (ret == -1)
 		PRINT_TO_ERRMSG_BUF("too many non-zero values to load");
 	return ret;
 }
@@ -423,7 +436,7 @@ static inline void append_array_index_to_nzindex_bufs(
  */
 
 typedef int (*GatherChunkDataFunType)(
-		const H5DSetDescriptor *h5dset, SEXP starts,
+		const H5DSetDescriptor *h5dset, const DecodedStarts *dstarts,
 		const void *chunk_data_buf, const H5Viewport *tchunk_vp,
 		const H5Viewport *dest_vp, int *inner_midx_buf,
 		IntAEAE *nzindex_bufs, void *nzdata_buf);
@@ -433,7 +446,7 @@ typedef int (*GatherChunkDataFunType)(
    is a full-size chunk and not a "truncated" chunk (a.k.a. "partial edge
    chunk" in HDF5's terminology). */
 static int gather_full_chunk_data_as_sparse(
-		const H5DSetDescriptor *h5dset, SEXP starts,
+		const H5DSetDescriptor *h5dset, const DecodedStarts *dstarts,
 		const void *in, const H5Viewport *tchunk_vp,
 		const H5Viewport *dest_vp, int *inner_midx_buf,
 		IntAEAE *nzindex_bufs, void *nzdata_buf)
@@ -463,7 +476,7 @@ static int gather_full_chunk_data_as_sparse(
 }
 
 static int gather_selected_chunk_data_as_sparse(
-		const H5DSetDescriptor *h5dset, SEXP starts,
+		const H5DSetDescriptor *h5dset, const DecodedStarts *dstarts,
 		const void *in, const H5Viewport *tchunk_vp,
 		const H5Viewport *dest_vp, int *inner_midx_buf,
 		IntAEAE *nzindex_bufs, void *nzdata_buf)
@@ -472,8 +485,7 @@ static int gather_selected_chunk_data_as_sparse(
 	size_t in_offset;
 
 	ndim = h5dset->ndim;
-	init_in_offset(ndim, starts, h5dset->h5chunkdim, dest_vp,
-		       tchunk_vp,
+	init_in_offset(ndim, dstarts, h5dset->h5chunkdim, dest_vp,
 		       &in_offset);
 	/* Walk on the **selected** elements in current chunk and append
 	   the non-zero ones to 'nzindex_bufs' and 'nzdata_buf'. */
@@ -489,7 +501,7 @@ static int gather_selected_chunk_data_as_sparse(
 					       inner_midx_buf);
 		if (inner_moved_along == ndim)
 			break;
-		update_in_offset(ndim, starts, h5dset->h5chunkdim, dest_vp,
+		update_in_offset(ndim, dstarts, h5dset->h5chunkdim, dest_vp,
 				 inner_midx_buf, inner_moved_along,
 				 &in_offset);
 	};
@@ -497,7 +509,7 @@ static int gather_selected_chunk_data_as_sparse(
 }
 
 static int gather_chunk_data_as_sparse(
-		const H5DSetDescriptor *h5dset, SEXP starts,
+		const H5DSetDescriptor *h5dset, const DecodedStarts *dstarts,
 		const void *chunk_data_buf, const H5Viewport *tchunk_vp,
 		const H5Viewport *dest_vp, int *inner_midx_buf,
 		IntAEAE *nzindex_bufs, void *nzdata_buf)
@@ -508,13 +520,13 @@ static int gather_chunk_data_as_sparse(
 		  && ! _tchunk_is_truncated(h5dset, tchunk_vp);
 	if (go_fast) {
 		ret = gather_full_chunk_data_as_sparse(
-			h5dset, starts,
+			h5dset, dstarts,
 			chunk_data_buf, tchunk_vp,
 			dest_vp, inner_midx_buf,
 			nzindex_bufs, nzdata_buf);
 	} else {
 		ret = gather_selected_chunk_data_as_sparse(
-			h5dset, starts,
+			h5dset, dstarts,
 			chunk_data_buf, tchunk_vp,
 			dest_vp, inner_midx_buf,
 			nzindex_bufs, nzdata_buf);
@@ -527,7 +539,7 @@ static int gather_chunk_data_as_sparse(
    is a full-size chunk and not a "truncated" chunk (a.k.a. "partial edge
    chunk" in HDF5's terminology). */
 static int gather_full_chunk_int_data_as_sparse(
-		const H5DSetDescriptor *h5dset, SEXP starts,
+		const H5DSetDescriptor *h5dset, const DecodedStarts *dstarts,
 		const int *in, const H5Viewport *tchunk_vp,
 		const H5Viewport *dest_vp, int *inner_midx_buf,
 		IntAEAE *nzindex_bufs, IntAE *nzdata_buf)
@@ -556,7 +568,7 @@ static int gather_full_chunk_int_data_as_sparse(
 }
 
 static int gather_selected_chunk_int_data_as_sparse(
-		const H5DSetDescriptor *h5dset, SEXP starts,
+		const H5DSetDescriptor *h5dset, const DecodedStarts *dstarts,
 		const int *in, const H5Viewport *tchunk_vp,
 		const H5Viewport *dest_vp, int *inner_midx_buf,
 		IntAEAE *nzindex_bufs, IntAE *nzdata_buf)
@@ -565,8 +577,7 @@ static int gather_selected_chunk_int_data_as_sparse(
 	size_t in_offset;
 
 	ndim = h5dset->ndim;
-	init_in_offset(ndim, starts, h5dset->h5chunkdim, dest_vp,
-		       tchunk_vp,
+	init_in_offset(ndim, dstarts, h5dset->h5chunkdim, dest_vp,
 		       &in_offset);
 	/* Walk on the **selected** elements in current chunk and append
 	   the non-zero ones to 'nzindex_bufs' and 'nzdata_buf'. */
@@ -583,7 +594,7 @@ static int gather_selected_chunk_int_data_as_sparse(
 					       inner_midx_buf);
 		if (inner_moved_along == ndim)
 			break;
-		update_in_offset(ndim, starts, h5dset->h5chunkdim, dest_vp,
+		update_in_offset(ndim, dstarts, h5dset->h5chunkdim, dest_vp,
 				 inner_midx_buf, inner_moved_along,
 				 &in_offset);
 	};
@@ -591,7 +602,7 @@ static int gather_selected_chunk_int_data_as_sparse(
 }
 
 static int gather_chunk_int_data_as_sparse(
-		const H5DSetDescriptor *h5dset, SEXP starts,
+		const H5DSetDescriptor *h5dset, const DecodedStarts *dstarts,
 		const void *chunk_data_buf, const H5Viewport *tchunk_vp,
 		const H5Viewport *dest_vp, int *inner_midx_buf,
 		IntAEAE *nzindex_bufs, void *nzdata_buf)
@@ -602,13 +613,13 @@ static int gather_chunk_int_data_as_sparse(
 		  && ! _tchunk_is_truncated(h5dset, tchunk_vp);
 	if (go_fast) {
 		ret = gather_full_chunk_int_data_as_sparse(
-			h5dset, starts,
+			h5dset, dstarts,
 			(const int *) chunk_data_buf, tchunk_vp,
 			dest_vp, inner_midx_buf,
 			nzindex_bufs, (IntAE *) nzdata_buf);
 	} else {
 		ret = gather_selected_chunk_int_data_as_sparse(
-			h5dset, starts,
+			h5dset, dstarts,
 			(const int *) chunk_data_buf, tchunk_vp,
 			dest_vp, inner_midx_buf,
 			nzindex_bufs, (IntAE *) nzdata_buf);
@@ -616,6 +627,198 @@ static int gather_chunk_int_data_as_sparse(
 	return ret;
 }
 
+/* 2-D fast paths for integer and double data. Unlike the N-d functions
+   above, they work on truncated chunks too so there's no need to
+   distinguish between fully and partially selected chunks. */
+
+static inline int get_in_offset_2D(const int *chunk_off, int off, int i)
+{
+	return chunk_off == NULL ? i : chunk_off[off + i];
+}
+
+static int gather_chunk_int_data_as_sparse_2D(
+		const H5DSetDescriptor *h5dset, const DecodedStarts *dstarts,
+		const void *chunk_data_buf, const H5Viewport *tchunk_vp,
+		const H5Viewport *dest_vp, int *inner_midx_buf,
+		IntAEAE *nzindex_bufs, void *nzdata_buf)
+{
+	const int *chunk_off0, *chunk_off1;
+	int n0, n1, off0, off1, i, j, ret;
+	IntAE *nzindex_buf0, *nzindex_buf1;
+	const int *in, *in_col;
+
+	chunk_off0 = dstarts->chunk_off[0];
+	chunk_off1 = dstarts->chunk_off[1];
+	n0 = dest_vp->dim[0];
+	n1 = dest_vp->dim[1];
+	off0 = dest_vp->off[0];
+	off1 = dest_vp->off[1];
+	nzindex_buf0 = nzindex_bufs->elts[0];
+	nzindex_buf1 = nzindex_bufs->elts[1];
+	in = (const int *) chunk_data_buf;
+	for (j = 0; j < n1; j++) {
+		in_col = in + (size_t) get_in_offset_2D(chunk_off1, off1, j) *
+			      h5dset->h5chunkdim[1];
+		for (i = 0; i < n0; i++) {
+			ret = IntAE_append_if_nonzero((IntAE *) nzdata_buf,
+				in_col[get_in_offset_2D(chunk_off0, off0, i)]);
+			if (ret == 0)
+				continue;
+			if (ret < 0) {
+				PRINT_TO_ERRMSG_BUF("too many non-zero "
+						    "values to load");
+				return -1;
+			}
+			IntAE_fast_append(nzindex_buf0, off0 + i + 1);
+			IntAE_fast_append(nzindex_buf1, off1 + j + 1);
+		}
+	}
+	return 0;
+}
+
+static int gather_chunk_double_data_as_sparse_2D(
+		const H5DSetDescriptor *h5dset, const DecodedStarts *dstarts,
+		const void *chunk_data_buf, const H5Viewport *tchunk_vp,
+		const H5Viewport *dest_vp, int *inner_midx_buf,
+		IntAEAE *nzindex_bufs, void *nzdata_buf)
+{
+	const int *chunk_off0, *chunk_off1;
+	int n0, n1, off0, off1, i, j, ret;
+	IntAE *nzindex_buf0, *nzindex_buf1;
+	const double *in, *in_col;
+
+	chunk_off0 = dstarts->chunk_off[0];
+	chunk_off1 = dstarts->chunk_off[1];
+	n0 = dest_vp->dim[0];
+	n1 = dest_vp->dim[1];
+	off0 = dest_vp->off[0];
+	off1 = dest_vp->off[1];
+	nzindex_buf0 = nzindex_bufs->elts[0];
+	nzindex_buf1 = nzindex_bufs->elts[1];
+	in = (const double *) chunk_data_buf;
+	for (j = 0; j < n1; j++) {
+		in_col = in + (size_t) get_in_offset_2D(chunk_off1, off1, j) *
+			      h5dset->h5chunkdim[1];
+		for (i = 0; i < n0; i++) {
+			ret = DoubleAE_append_if_nonzero(
+				(DoubleAE *) nzdata_buf,
+				in_col[get_in_offset_2D(chunk_off0, off0, i)]);
+			if (ret == 0)
+				continue;
+			if (ret < 0) {
+				PRINT_TO_ERRMSG_BUF("too many non-zero "
+						    "values to load");
+				return -1;
+			}
+			IntAE_fast_append(nzindex_buf0, off0 + i + 1);
+			IntAE_fast_append(nzindex_buf1, off1 + j + 1);
+		}
+	}
+	return 0;
+}
+
+/* Used when a comparison predicate is attached to 'h5dset' (see 'where'
+   argument of h5mread()). Only the nonzero non-NA values that match the
+   predicate are gathered. Like gather_selected_chunk_data_as_sparse(),
+   they work on fully selected and truncated chunks too. */
+
+static inline int value_matches(double x, int where_op, double where_value)
+{
+	switch (where_op) {
+	    case WHERE_EQ: return x == where_value;
+	    case WHERE_NE: return x != where_value;
+	    case WHERE_LT: return x < where_value;
+	    case WHERE_LE: return x <= where_value;
+	    case WHERE_GT: return x > where_value;
+	    case WHERE_GE: return x >= where_value;
+	}
+	return 1;
+}
+
+static int gather_chunk_int_data_where(
+		const H5DSetDescriptor *h5dset, const DecodedStarts *dstarts,
+		const void *chunk_data_buf, const H5Viewport *tchunk_vp,
+		const H5Viewport *dest_vp, int *inner_midx_buf,
+		IntAEAE *nzindex_bufs, void *nzdata_buf)
+{
+	int ndim, inner_moved_along, val, ret;
+	size_t in_offset;
+	const int *in;
+
+	ndim = h5dset->ndim;
+	in = (const int *) chunk_data_buf;
+	init_in_offset(ndim, dstarts, h5dset->h5chunkdim, dest_vp,
+		       &in_offset);
+	while (1) {
+		val = in[in_offset];
+		if (val != NA_INTEGER &&
+		    value_matches((double) val, h5dset->where_op,
+						h5dset->where_value))
+		{
+			ret = IntAE_append_if_nonzero((IntAE *) nzdata_buf,
+						      val);
+			if (ret < 0) {
+				PRINT_TO_ERRMSG_BUF("too many matching "
+						    "values to load");
+				return -1;
+			}
+			if (ret > 0)
+				append_array_index_to_nzindex_bufs(dest_vp,
+						inner_midx_buf, nzindex_bufs);
+		}
+		inner_moved_along = _next_midx(ndim, dest_vp->dim,
+					       inner_midx_buf);
+		if (inner_moved_along == ndim)
+			break;
+		update_in_offset(ndim, dstarts, h5dset->h5chunkdim, dest_vp,
+				 inner_midx_buf, inner_moved_along,
+				 &in_offset);
+	};
+	return 0;
+}
+
+static int gather_chunk_double_data_where(
+		const H5DSetDescriptor *h5dset, const DecodedStarts *dstarts,
+		const void *chunk_data_buf, const H5Viewport *tchunk_vp,
+		const H5Viewport *dest_vp, int *inner_midx_buf,
+		IntAEAE *nzindex_bufs, void *nzdata_buf)
+{
+	int ndim, inner_moved_along, ret;
+	size_t in_offset;
+	const double *in;
+	double val;
+
+	ndim = h5dset->ndim;
+	in = (const double *) chunk_data_buf;
+	init_in_offset(ndim, dstarts, h5dset->h5chunkdim, dest_vp,
+		       &in_offset);
+	while (1) {
+		val = in[in_offset];
+		if (!ISNAN(val) &&
+		    value_matches(val, h5dset->where_op, h5dset->where_value))
+		{
+			ret = DoubleAE_append_if_nonzero(
+					(DoubleAE *) nzdata_buf, val);
+			if (ret < 0) {
+				PRINT_TO_ERRMSG_BUF("too many matching "
+						    "values to load");
+				return -1;
+			}
+			if (ret > 0)
+				append_array_index_to_nzindex_bufs(dest_vp,
+						inner_midx_buf, nzindex_bufs);
+		}
+		inner_moved_along = _next_midx(ndim, dest_vp->dim,
+					       inner_midx_buf);
+		if (inner_moved_along == ndim)
+			break;
+		update_in_offset(ndim, dstarts, h5dset->h5chunkdim, dest_vp,
+				 inner_midx_buf, inner_moved_along,
+				 &in_offset);
+	};
+	return 0;
+}
+
 typedef struct sparse_data_gatherer_t {
 	GatherChunkDataFunType gathering_fun;
 	IntAEAE *nzindex_bufs;
@@ -628,9 +831,21 @@ static SparseDataGatherer sparse_data_gatherer(
 {
 	SparseDataGatherer gatherer;
 
+	/* _set_H5DSetDescriptor_where() already made sure that 'Rtype' is
+	   INTSXP or REALSXP. */
+	if (h5dset->where_op != WHERE_NONE) {
+		gatherer.gathering_fun = h5dset->Rtype == INTSXP ?
+					 gather_chunk_int_data_where :
+					 gather_chunk_double_data_where;
+	/* Nearly all datasets are 2-D so we give them a boost. */
+	} else if (h5dset->ndim == 2 &&
+	    (h5dset->Rtype == INTSXP || h5dset->Rtype == LGLSXP)) {
+		gatherer.gathering_fun = gather_chunk_int_data_as_sparse_2D;
+	} else if (h5dset->ndim == 2 && h5dset->Rtype == REALSXP) {
+		gatherer.gathering_fun = gather_chunk_double_data_as_sparse_2D;
 	/* INTSXP is the most common Rtype for sparse data so we give it a
 	   little boost. */
-	if (h5dset->Rtype == INTSXP || h5dset->Rtype == LGLSXP) {
+	} else if (h5dset->Rtype == INTSXP || h5dset->Rtype == LGLSXP) {
 		gatherer.gathering_fun = gather_chunk_int_data_as_sparse;
 	} else {
 		gatherer.gathering_fun = gather_chunk_data_as_sparse;
@@ -649,49 +864,65 @@ static SparseDataGatherer sparse_data_gatherer(
  *
  * More precisely, walk over the chunks touched by 'starts'. For each chunk:
  *   - Make one call to _read_H5Viewport() to load the **entire** chunk data
- *     to an intermediate buffer.
+ *     to an intermediate buffer. If the data on disk is of a narrower type
+ *     than 'nzdata_buf' (see 'narrow_type' in H5DSetDescriptor.h), load it
+ *     in that type with _read_narrow_H5Viewport() instead and widen it to
+ *     the intermediate buffer.
  *   - Gather the non-zero user-selected data found in the chunk into
- *     'nzindex_bufs' and 'nzdata_buf'.
+ *     'nzindex_bufs' and 'nzdata_buf'. If a comparison predicate is
+ *     attached to 'h5dset', only the data that matches it is gathered,
+ *     and the chunks that cannot contain matching data according to the
+ *     chunk statistics are not loaded at all.
  *
  * Assumes that 'h5dset->h5chunkdim' and 'h5dset->h5nchunk' are NOT
  * NULL. This is NOT checked!
  */
 
 static int read_data_8(const H5DSetDescriptor *h5dset,
-		SEXP starts,
+		const DecodedStarts *dstarts,
 		const IntAEAE *breakpoint_bufs,
 		const LLongAEAE *tchunkidx_bufs,
 		const int *num_tchunks,
 		IntAEAE *nzindex_bufs, void *nzdata_buf)
 {
 	int ndim, moved_along, ret;
-	IntAE *tchunk_midx_buf, *inner_midx_buf;
-	void *chunk_data_buf; //*compressed_chunk_data_buf;
+	int *tchunk_midx_buf, *inner_midx_buf;
+	void *chunk_data_buf, *narrow_chunk_data_buf;
+	size_t chunk_nelt;
 	hid_t chunk_space_id;
 	H5Viewport tchunk_vp, middle_vp, dest_vp;
 	SparseDataGatherer gatherer;
 	long long int tchunk_rank;
+	double t0;
 
 	ndim = h5dset->ndim;
 
 	/* Prepare buffers. */
 
-	tchunk_midx_buf = new_IntAE(ndim, ndim, 0);
-	inner_midx_buf = new_IntAE(ndim, ndim, 0);
+	tchunk_midx_buf = _scratch_alloc(2 * ndim * sizeof(int), 1,
+					 "'tchunk_midx_buf' and "
+					 "'inner_midx_buf'");
+	if (tchunk_midx_buf == NULL)
+		return -1;
+	inner_midx_buf = tchunk_midx_buf + ndim;
 
-	chunk_data_buf = malloc(h5dset->chunk_data_buf_size);
-	//chunk_data_buf = malloc(2 * h5dset->chunk_data_buf_size +
-	//			CHUNK_COMPRESSION_OVERHEAD);
-	if (chunk_data_buf == NULL) {
-		PRINT_TO_ERRMSG_BUF("failed to allocate memory "
-				    "for 'chunk_data_buf'");
+	chunk_data_buf = _get_chunk_data_buf(h5dset->chunk_data_buf_size);
+	if (chunk_data_buf == NULL)
 		return -1;
+	chunk_nelt = h5dset->chunk_data_buf_size / h5dset->ans_elt_size;
+	narrow_chunk_data_buf = NULL;
+	if (h5dset->narrow_type != NARROW_NONE) {
+		/* Zero-filled so the parts of the buffer not loaded by
+		   _read_narrow_H5Viewport() (truncated chunks) are not
+		   garbage when we widen the entire chunk. */
+		narrow_chunk_data_buf = _scratch_alloc(
+				chunk_nelt * h5dset->narrow_elt_size, 1,
+				"'narrow_chunk_data_buf'");
+		if (narrow_chunk_data_buf == NULL)
+			return -1;
 	}
-	//compressed_chunk_data_buf = chunk_data_buf +
-	//			    h5dset->chunk_data_buf_size;
 	chunk_space_id = H5Screate_simple(ndim, h5dset->h5chunkdim, NULL);
 	if (chunk_space_id < 0) {
-		free(chunk_data_buf);
 		PRINT_TO_ERRMSG_BUF("H5Screate_simple() returned an error");
 		return -1;
 	}
@@ -705,7 +936,6 @@ static int read_data_8(const H5DSetDescriptor *h5dset,
 		ALLOC_OFF_AND_DIM) < 0)
 	{
 		H5Sclose(chunk_space_id);
-		free(chunk_data_buf);
 		return -1;
 	}
 
@@ -716,31 +946,55 @@ static int read_data_8(const H5DSetDescriptor *h5dset,
 	moved_along = ndim;
 	do {
 		_update_tchunk_vp_dest_vp(h5dset,
-				tchunk_midx_buf->elts, moved_along,
-				starts, breakpoint_bufs, tchunkidx_bufs,
+				tchunk_midx_buf, moved_along,
+				dstarts, breakpoint_bufs, tchunkidx_bufs,
 				&tchunk_vp, &dest_vp);
-		ret = _read_H5Viewport(h5dset,
-				&tchunk_vp, &middle_vp,
-				chunk_data_buf, chunk_space_id);
-		//ret = _read_h5chunk(h5dset,
-		//		&tchunk_vp,
-		//		compressed_chunk_data_buf, chunk_data_buf);
+		if (!_tchunk_can_match(h5dset, &tchunk_vp)) {
+			_h5mread_stats.nunmatched_tchunk++;
+			ret = 0;
+		} else {
+			ret = _tchunk_is_allocated(h5dset, &tchunk_vp);
+			if (ret < 0)
+				break;
+			if (ret == 0)
+				_h5mread_stats.nunallocated_tchunk++;
+		}
+		if (ret == 0) {
+			/* Nothing to gather from an unallocated chunk or
+			   from a chunk with no value matching 'where'. */
+			tchunk_rank++;
+			moved_along = _next_midx(ndim, num_tchunks,
+						 tchunk_midx_buf);
+			continue;
+		}
+		if (narrow_chunk_data_buf != NULL) {
+			ret = _read_narrow_H5Viewport(h5dset,
+					&tchunk_vp, &middle_vp,
+					narrow_chunk_data_buf, chunk_space_id);
+			if (ret >= 0)
+				_widen_narrow_data(h5dset,
+					narrow_chunk_data_buf, chunk_data_buf,
+					chunk_nelt);
+		} else {
+			ret = _read_H5Viewport(h5dset,
+					&tchunk_vp, &middle_vp,
+					chunk_data_buf, chunk_space_id);
+		}
 		if (ret < 0)
 			break;
-		ret = gatherer.gathering_fun(h5dset, starts,
+		t0 = _trace_time();
+		ret = gatherer.gathering_fun(h5dset, dstarts,
 				chunk_data_buf, &tchunk_vp,
-				//compressed_chunk_data_buf, &tchunk_vp,
-				&dest_vp, inner_midx_buf->elts,
+				&dest_vp, inner_midx_buf,
 				gatherer.nzindex_bufs, gatherer.nzdata_buf);
+		_trace_add_gather_time(t0);
 		if (ret < 0)
 			break;
 		tchunk_rank++;
 		moved_along = _next_midx(ndim, num_tchunks,
-					 tchunk_midx_buf->elts);
+					 tchunk_midx_buf);
 	} while (moved_along < ndim);
-	_free_tchunk_vp_middle_vp_dest_vp(&tchunk_vp, &middle_vp, &dest_vp);
 	H5Sclose(chunk_space_id);
-	free(chunk_data_buf);
 	return ret;
 }
 
@@ -752,18 +1006,21 @@ static int read_data_8(const H5DSetDescriptor *h5dset,
  * Return 'list(nzindex, nzdata, NULL)' or R_NilValue if an error occured.
  */
 
-SEXP _h5mread_sparse(const H5DSetDescriptor *h5dset, SEXP starts, int *ans_dim)
+SEXP _h5mread_sparse(H5DSetDescriptor *h5dset, SEXP starts, int *ans_dim)
 {
 	int ndim, ret;
 	IntAEAE *breakpoint_bufs, *nzindex_bufs;
 	LLongAEAE *tchunkidx_bufs;  /* touched chunk ids along each dim */
-	IntAE *ntchunk_buf;  /* nb of touched chunks along each dim */
+	int *ntchunk_buf;  /* nb of touched chunks along each dim */
 	long long int total_num_tchunks;
+	DecodedStarts dstarts;
 	void *nzdata_buf;
+	double t0;
 
 	SEXP ans;
 
 	ndim = h5dset->ndim;
+	t0 = _trace_time();
 
 	/* This call will populate 'ans_dim', 'breakpoint_bufs',
 	   and 'tchunkidx_bufs'. */
@@ -774,21 +1031,33 @@ SEXP _h5mread_sparse(const H5DSetDescriptor *h5dset, SEXP starts, int *ans_dim)
 	if (ret < 0)
 		return R_NilValue;
 
-	ntchunk_buf = new_IntAE(ndim, ndim, 0);
+	ntchunk_buf = _scratch_alloc(ndim * sizeof(int), 0, "'ntchunk_buf'");
+	if (ntchunk_buf == NULL)
+		return R_NilValue;
 	total_num_tchunks = _set_num_tchunks(h5dset, starts,
-					     tchunkidx_bufs, ntchunk_buf->elts);
+					     tchunkidx_bufs, ntchunk_buf);
+	_trace_set_ntchunk(total_num_tchunks);
+	if (_load_allocated_chunks(h5dset, total_num_tchunks) < 0)
+		return R_NilValue;
+	if (total_num_tchunks != 0 && _load_where_chunks(h5dset) < 0)
+		return R_NilValue;
+	if (_decode_starts(h5dset, starts, &dstarts) < 0)
+		return R_NilValue;
+	_trace_add_select_time(t0);
 
 	nzindex_bufs = new_IntAEAE(ndim, ndim);
 	nzdata_buf = new_nzdata_buf(h5dset->Rtype);
 	if (nzdata_buf == NULL)  /* should never happen */
 		return R_NilValue;
+	if (h5dset->Rtype == STRSXP && _init_charsxp_cache(CE_NATIVE, 1) < 0)
+		return R_NilValue;
 
 	/* total_num_tchunks != 0 means that the user-supplied array selection
 	   is not empty */
 	if (total_num_tchunks != 0) {
-		ret = read_data_8(h5dset, starts,
+		ret = read_data_8(h5dset, &dstarts,
 				  breakpoint_bufs, tchunkidx_bufs,
-				  ntchunk_buf->elts,
+				  ntchunk_buf,
 				  nzindex_bufs, nzdata_buf);
 		if (ret < 0)
 			return R_NilValue;
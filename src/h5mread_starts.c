@@ -7,9 +7,10 @@
 #include "global_errmsg_buf.h"
 #include "uaselection.h"
 #include "h5mread_helpers.h"
+#include "h5mread_trace.h"
 
 #include <stdlib.h>  /* for malloc, free */
-#include <string.h>  /* for memcmp */
+#include <string.h>  /* for memcmp, strlen */
 //#include <time.h>
 
 
@@ -29,25 +30,24 @@
  * NULL. This is NOT checked!
  */
 
-static void init_in_offset_and_out_offset(int ndim, SEXP starts,
+static void init_in_offset_and_out_offset(int ndim,
+			const DecodedStarts *dstarts,
 			const int *out_dim, const H5Viewport *dest_vp,
-			const H5Viewport *tchunk_vp,
 			const hsize_t *h5chunkdim,
 			size_t *in_offset, size_t *out_offset)
 {
 	size_t in_off, out_off;
 	int along, h5along, i;
-	SEXP start;
+	const int *chunk_off;
 
 	in_off = out_off = 0;
 	for (along = ndim - 1, h5along = 0; along >= 0; along--, h5along++) {
 		in_off *= h5chunkdim[h5along];
 		out_off *= out_dim[along];
 		i = dest_vp->off[along];
-		start = GET_LIST_ELT(starts, along);
-		if (start != R_NilValue)
-			in_off += _get_trusted_elt(start, i) - 1 -
-				  tchunk_vp->h5off[h5along];
+		chunk_off = dstarts->chunk_off[along];
+		if (chunk_off != NULL)
+			in_off += chunk_off[i];
 		out_off += i;
 	}
 	*in_offset = in_off;
@@ -59,22 +59,21 @@ static void init_in_offset_and_out_offset(int ndim, SEXP starts,
 
 static inline void update_in_offset_and_out_offset(int ndim,
 			const int *inner_midx, int inner_moved_along,
-			SEXP starts,
+			const DecodedStarts *dstarts,
 			const int *out_dim, const H5Viewport *dest_vp,
 			const hsize_t *h5chunkdim,
 			size_t *in_offset, size_t *out_offset)
 {
-	SEXP start;
+	const int *chunk_off;
 	int i1, i0, along, h5along, di;
 	long long int in_off_inc, out_off_inc;
 
-	start = GET_LIST_ELT(starts, inner_moved_along);
-	if (start != R_NilValue) {
+	chunk_off = dstarts->chunk_off[inner_moved_along];
+	if (chunk_off != NULL) {
 		i1 = dest_vp->off[inner_moved_along] +
 		     inner_midx[inner_moved_along];
 		i0 = i1 - 1;
-		in_off_inc = _get_trusted_elt(start, i1) -
-			     _get_trusted_elt(start, i0);
+		in_off_inc = chunk_off[i1] - chunk_off[i0];
 	} else {
 		in_off_inc = 1;
 	}
@@ -86,12 +85,11 @@ static inline void update_in_offset_and_out_offset(int ndim,
 			in_off_inc *= h5chunkdim[h5along];
 			out_off_inc *= out_dim[along];
 			di = 1 - dest_vp->dim[along];
-			start = GET_LIST_ELT(starts, along);
-			if (start != R_NilValue) {
+			chunk_off = dstarts->chunk_off[along];
+			if (chunk_off != NULL) {
 				i1 = dest_vp->off[along];
 				i0 = i1 - di;
-				in_off_inc += _get_trusted_elt(start, i1) -
-					      _get_trusted_elt(start, i0);
+				in_off_inc += chunk_off[i1] - chunk_off[i0];
 			} else {
 				in_off_inc += di;
 			}
@@ -125,19 +123,35 @@ static int load_val_to_array(const H5DSetDescriptor *h5dset,
 		REAL(out)[out_offset] = val;
 	    } break;
 	    case STRSXP: {
-		const char *val = ((char *) in) + in_offset * h5dset->H5size;
-		int val_len;
-		for (val_len = 0; val_len < h5dset->H5size; val_len++)
-			if (val[val_len] == 0)
-				break;
-		int is_na = h5dset->as_na_attr &&
-			    val_len == 2 && val[0] == 'N' && val[1] == 'A';
-		if (is_na) {
-			SET_STRING_ELT(out, out_offset, NA_STRING);
+		/* The cache is keyed on the raw fixed-width bytes for
+		   fixed-length strings so on a cache hit we skip the scan
+		   for the terminating null byte and the "NA" check. */
+		const char *key;
+		int key_len;
+		if (h5dset->is_variable_str) {
+			key = ((char **) in)[in_offset];
+			if (key == NULL)
+				key = "";
+			key_len = strlen(key);
+		} else {
+			key = ((char *) in) + in_offset * h5dset->H5size;
+			key_len = h5dset->H5size;
+		}
+		SEXP out_elt = _charsxp_cache_get(key, key_len);
+		if (out_elt == NULL) {
+			int val_len;
+			for (val_len = 0; val_len < key_len; val_len++)
+				if (key[val_len] == 0)
+					break;
+			int is_na = h5dset->as_na_attr &&
+				    val_len == 2 && key[0] == 'N' &&
+				    key[1] == 'A';
+			out_elt = is_na ? NA_STRING :
+				  _charsxp_cache_mkCharLen(key, val_len);
+			SET_STRING_ELT(out, out_offset, out_elt);
+			_charsxp_cache_put(key, key_len, out_elt);
 		} else {
-			SEXP out_elt = PROTECT(mkCharLen(val, val_len));
 			SET_STRING_ELT(out, out_offset, out_elt);
-			UNPROTECT(1);
 		}
 	    } break;
 	    case RAWSXP: {
@@ -152,9 +166,11 @@ static int load_val_to_array(const H5DSetDescriptor *h5dset,
 	return 0;
 }
 
-static int gather_selected_chunk_data(
+/* Walk on the selected elements in current chunk and copy them one at a
+   time. Only used for string data. */
+static int gather_selected_chunk_data_elt_by_elt(
 		const H5DSetDescriptor *h5dset,
-		SEXP starts, const void *in, const H5Viewport *tchunk_vp,
+		const DecodedStarts *dstarts, const void *in,
 		SEXP ans, const int *out_dim,
 		const H5Viewport *dest_vp, int *inner_midx_buf)
 {
@@ -163,9 +179,9 @@ static int gather_selected_chunk_data(
 	long long int num_elts;
 
 	ndim = h5dset->ndim;
-	init_in_offset_and_out_offset(ndim, starts,
+	init_in_offset_and_out_offset(ndim, dstarts,
 			out_dim, dest_vp,
-			tchunk_vp, h5dset->h5chunkdim,
+			h5dset->h5chunkdim,
 			&in_offset, &out_offset);
 	/* Walk on the selected elements in current chunk. */
 	num_elts = 0;
@@ -180,7 +196,7 @@ static int gather_selected_chunk_data(
 			break;
 		update_in_offset_and_out_offset(ndim,
 				inner_midx_buf, inner_moved_along,
-				starts,
+				dstarts,
 				out_dim, dest_vp,
 				h5dset->h5chunkdim,
 				&in_offset, &out_offset);
@@ -190,26 +206,282 @@ static int gather_selected_chunk_data(
 	return 0;
 }
 
+/* Block-copy gather for everything but string data.
+ *
+ * We first compute the offsets (relative to the chunk) of the selected
+ * elements along each dimension. Along the innermost dimension, these
+ * offsets are collapsed into runs of adjacent elements. Then we walk on
+ * the outer dimensions and copy each run with a single memcpy().
+ * The 'GatherBufs' struct holds the buffers used for that. They are
+ * allocated once per call to read_data_4_5() or read_data_7(). */
+
+typedef struct {
+	int in_off, out_off, len;
+} GatherRun;
+
+typedef struct {
+	int *in_idx;  /* the selected offsets along each dim, concatenated */
+	GatherRun *runs;
+	size_t *in_strides, *out_strides;
+	int narrow;   /* chunk data is loaded in its narrow type (method 4
+			 only, see 'narrow_type' in H5DSetDescriptor.h) */
+} GatherBufs;
+
+static int alloc_GatherBufs(const H5DSetDescriptor *h5dset, int method,
+		const int *ans_dim, GatherBufs *gather_bufs)
+{
+	int ndim, along, h5along;
+	size_t in_idx_len, in_stride, out_stride;
+
+	gather_bufs->in_idx = NULL;
+	gather_bufs->narrow = method == 4 &&
+			      h5dset->narrow_type != NARROW_NONE;
+	if (h5dset->Rtype == STRSXP)
+		return 0;
+	ndim = h5dset->ndim;
+	in_idx_len = 0;
+	for (along = 0; along < ndim; along++)
+		in_idx_len += ans_dim[along];
+	gather_bufs->in_idx = _scratch_alloc(in_idx_len * sizeof(int), 0,
+					     "'gather_bufs->in_idx'");
+	gather_bufs->runs = _scratch_alloc(ans_dim[0] * sizeof(GatherRun), 0,
+					   "'gather_bufs->runs'");
+	gather_bufs->in_strides = _scratch_alloc(2 * ndim * sizeof(size_t), 0,
+				"'gather_bufs->in_strides' and "
+				"'gather_bufs->out_strides'");
+	if (gather_bufs->in_idx == NULL || gather_bufs->runs == NULL ||
+	    gather_bufs->in_strides == NULL)
+		return -1;
+	gather_bufs->out_strides = gather_bufs->in_strides + ndim;
+	in_stride = out_stride = 1;
+	for (along = 0, h5along = ndim - 1; along < ndim; along++, h5along--) {
+		gather_bufs->in_strides[along] = in_stride;
+		gather_bufs->out_strides[along] = out_stride;
+		in_stride *= h5dset->h5chunkdim[h5along];
+		out_stride *= ans_dim[along];
+	}
+	return 0;
+}
+
+/* Meant to be called with a constant 'elt_size' so the compiler can
+   specialize the memcpy() calls for each element size. */
+static inline void copy_runs(size_t elt_size,
+		const GatherRun *runs, int nrun,
+		const char *in, size_t in_offset,
+		char *out, size_t out_offset)
+{
+	const GatherRun *run;
+	int r;
+
+	in += in_offset * elt_size;
+	out += out_offset * elt_size;
+	for (r = 0, run = runs; r < nrun; r++, run++)
+		memcpy(out + run->out_off * elt_size,
+		       in + run->in_off * elt_size,
+		       run->len * elt_size);
+	return;
+}
+
+static inline void copy_runs_of_elt_size(size_t elt_size,
+		const GatherRun *runs, int nrun,
+		const void *in, size_t in_offset,
+		void *out, size_t out_offset)
+{
+	switch (elt_size) {
+	    case 1:
+		copy_runs(1, runs, nrun, in, in_offset, out, out_offset);
+		break;
+	    case 2:
+		copy_runs(2, runs, nrun, in, in_offset, out, out_offset);
+		break;
+	    case 4:
+		copy_runs(4, runs, nrun, in, in_offset, out, out_offset);
+		break;
+	    default:
+		copy_runs(8, runs, nrun, in, in_offset, out, out_offset);
+		break;
+	}
+	return;
+}
+
+/* Like copy_runs() but widens the data from the narrow type of the dataset
+   to the type of 'ans'. */
+static void widen_runs(const H5DSetDescriptor *h5dset,
+		const GatherRun *runs, int nrun,
+		const char *in, size_t in_offset,
+		char *out, size_t out_offset, size_t out_elt_size)
+{
+	const GatherRun *run;
+	size_t in_elt_size;
+	int r;
+
+	in_elt_size = h5dset->narrow_elt_size;
+	in += in_offset * in_elt_size;
+	out += out_offset * out_elt_size;
+	for (r = 0, run = runs; r < nrun; r++, run++)
+		_widen_narrow_data(h5dset,
+				   in + run->in_off * in_elt_size,
+				   out + run->out_off * out_elt_size,
+				   run->len);
+	return;
+}
+
+static inline void transfer_runs(const H5DSetDescriptor *h5dset,
+		int narrow, size_t elt_size,
+		const GatherRun *runs, int nrun,
+		const void *in, size_t in_offset,
+		void *out, size_t out_offset)
+{
+	if (narrow)
+		widen_runs(h5dset, runs, nrun,
+			   in, in_offset, out, out_offset, elt_size);
+	else
+		copy_runs_of_elt_size(elt_size, runs, nrun,
+				      in, in_offset, out, out_offset);
+	return;
+}
+
+static void block_copy_selected_chunk_data(
+		const H5DSetDescriptor *h5dset,
+		const DecodedStarts *dstarts, const void *in,
+		SEXP ans,
+		const H5Viewport *dest_vp, int *inner_midx_buf,
+		const GatherBufs *gather_bufs)
+{
+	int ndim, along, n, k, j, nrun, *in_idx;
+	const int *chunk_off;
+	GatherRun *runs;
+	size_t elt_size, in_offset, out_offset0, out_offset,
+	       in_stride, out_stride;
+	const int *idx;
+	void *out;
+
+	ndim = h5dset->ndim;
+
+	/* Offsets of the selected elements relative to the chunk. */
+	in_idx = gather_bufs->in_idx;
+	for (along = 0; along < ndim; along++) {
+		n = dest_vp->dim[along];
+		chunk_off = dstarts->chunk_off[along];
+		if (chunk_off != NULL) {
+			memcpy(in_idx, chunk_off + dest_vp->off[along],
+			       n * sizeof(int));
+		} else {
+			for (k = 0; k < n; k++)
+				in_idx[k] = k;
+		}
+		in_idx += n;
+	}
+
+	/* Collapse the offsets along the innermost dimension into runs. */
+	in_idx = gather_bufs->in_idx;
+	runs = gather_bufs->runs;
+	nrun = 0;
+	for (k = 0; k < dest_vp->dim[0]; k++) {
+		if (nrun != 0 &&
+		    in_idx[k] == runs[nrun - 1].in_off + runs[nrun - 1].len)
+		{
+			runs[nrun - 1].len++;
+			continue;
+		}
+		runs[nrun].in_off = in_idx[k];
+		runs[nrun].out_off = k;
+		runs[nrun].len = 1;
+		nrun++;
+	}
+
+	/* Same as the size of the elements of 'ans' except in packed mode
+	   where 'ans' is a raw vector that stores 2 or 4 bytes per
+	   element. */
+	elt_size = h5dset->ans_elt_size;
+	out = DATAPTR(ans);
+	out_offset0 = 0;
+	for (along = 0; along < ndim; along++)
+		out_offset0 += dest_vp->off[along] *
+			       gather_bufs->out_strides[along];
+
+	if (ndim == 2) {
+		/* 2-D fast path: simple loop on the selected columns. */
+		idx = gather_bufs->in_idx + dest_vp->dim[0];
+		in_stride = gather_bufs->in_strides[1];
+		out_stride = gather_bufs->out_strides[1];
+		for (j = 0; j < dest_vp->dim[1]; j++)
+			transfer_runs(h5dset, gather_bufs->narrow, elt_size,
+				      runs, nrun,
+				      in, idx[j] * in_stride,
+				      out, out_offset0 + j * out_stride);
+		return;
+	}
+
+	/* Walk on the outer dimensions. */
+	while (1) {
+		in_offset = 0;
+		out_offset = out_offset0;
+		idx = gather_bufs->in_idx + dest_vp->dim[0];
+		for (along = 1; along < ndim; along++) {
+			in_offset += idx[inner_midx_buf[along]] *
+				     gather_bufs->in_strides[along];
+			out_offset += inner_midx_buf[along] *
+				      gather_bufs->out_strides[along];
+			idx += dest_vp->dim[along];
+		}
+		transfer_runs(h5dset, gather_bufs->narrow, elt_size,
+			      runs, nrun,
+			      in, in_offset, out, out_offset);
+		if (_next_midx(ndim - 1, dest_vp->dim + 1,
+			       inner_midx_buf + 1) == ndim - 1)
+			break;
+	}
+	return;
+}
+
+static int gather_selected_chunk_data(
+		const H5DSetDescriptor *h5dset,
+		const DecodedStarts *dstarts, const void *in,
+		SEXP ans, const int *out_dim,
+		const H5Viewport *dest_vp, int *inner_midx_buf,
+		const GatherBufs *gather_bufs)
+{
+	if (h5dset->Rtype == STRSXP)
+		return gather_selected_chunk_data_elt_by_elt(h5dset,
+				dstarts, in,
+				ans, out_dim,
+				dest_vp, inner_midx_buf);
+	block_copy_selected_chunk_data(h5dset,
+			dstarts, in,
+			ans,
+			dest_vp, inner_midx_buf,
+			gather_bufs);
+	return 0;
+}
+
 static int read_data_from_chunk_4_5(const H5DSetDescriptor *h5dset, int method,
-		SEXP starts,
+		const DecodedStarts *dstarts,
 		SEXP ans, const int *ans_dim,
 		int *inner_midx_buf,
 		const H5Viewport *tchunk_vp,
 		const H5Viewport *middle_vp,
 		const H5Viewport *dest_vp,
 		void *chunk_data_buf, hid_t chunk_space_id,
-		void *compressed_chunk_data_buf)
+		void *compressed_chunk_data_buf,
+		const GatherBufs *gather_bufs)
 {
 	int ret;
+	double t0;
 
 	if (method == 4) {
 		/* It takes about 218s on my laptop to load all the chunks
 		   from the EH1040 dataset (big 10x Genomics brain dataset
 		   in dense format, chunks of 100x100, wrapped in the
 		   TENxBrainData package). That's 60 microseconds per chunk! */
-		ret = _read_H5Viewport(h5dset,
-				tchunk_vp, middle_vp,
-				chunk_data_buf, chunk_space_id);
+		if (gather_bufs->narrow)
+			ret = _read_narrow_H5Viewport(h5dset,
+					tchunk_vp, middle_vp,
+					chunk_data_buf, chunk_space_id);
+		else
+			ret = _read_H5Viewport(h5dset,
+					tchunk_vp, middle_vp,
+					chunk_data_buf, chunk_space_id);
 	} else {
 		ret = _read_h5chunk(h5dset,
 				tchunk_vp,
@@ -217,14 +489,52 @@ static int read_data_from_chunk_4_5(const H5DSetDescriptor *h5dset, int method,
 	}
 	if (ret < 0)
 		return ret;
+	t0 = _trace_time();
 	ret = gather_selected_chunk_data(
 			h5dset,
-			starts, chunk_data_buf, tchunk_vp,
+			dstarts, chunk_data_buf,
 			ans, ans_dim,
-			dest_vp, inner_midx_buf);
+			dest_vp, inner_midx_buf,
+			gather_bufs);
+	_trace_add_gather_time(t0);
+	/* Only method 4 supports variable-length strings. The elements
+	   selected in 'chunk_space_id' are the ones loaded by
+	   _read_H5Viewport() above. */
+	if (h5dset->is_variable_str &&
+	    _reclaim_vlen_data(h5dset, chunk_space_id, chunk_data_buf) < 0)
+		return -1;
 	return ret;
 }
 
+/* Zero the part of 'ans' that 'dest_vp' maps an unallocated chunk to (see
+   _tchunk_is_allocated()). 'midx_buf' must have room for 'ndim' ints. */
+static void zero_fill_dest_vp(const H5DSetDescriptor *h5dset,
+		SEXP ans, const int *ans_dim,
+		const H5Viewport *dest_vp, int *midx_buf)
+{
+	int ndim, along;
+	size_t elt_size, run_size;
+	long long int offset;
+	char *out;
+
+	ndim = h5dset->ndim;
+	elt_size = h5dset->ans_elt_size;
+	run_size = dest_vp->dim[0] * elt_size;
+	out = (char *) DATAPTR(ans);
+	for (along = 0; along < ndim; along++)
+		midx_buf[along] = 0;
+	do {
+		offset = 0;
+		for (along = ndim - 1; along >= 1; along--)
+			offset = (offset + dest_vp->off[along] +
+				  midx_buf[along]) * ans_dim[along - 1];
+		offset += dest_vp->off[0];
+		memset(out + offset * elt_size, 0, run_size);
+	} while (_next_midx(ndim - 1, dest_vp->dim + 1, midx_buf + 1) <
+		 ndim - 1);
+	return;
+}
+
 /*
   WARNING: method 5 is not working properly on some datasets:
       library(HDF5Array)
@@ -244,44 +554,55 @@ static int read_data_from_chunk_4_5(const H5DSetDescriptor *h5dset, int method,
   shuffled.
  */
 static int read_data_4_5(const H5DSetDescriptor *h5dset, int method,
-		SEXP starts,
+		const DecodedStarts *dstarts,
 		const IntAEAE *breakpoint_bufs,
 		const LLongAEAE *tchunkidx_bufs,
 		const int *num_tchunks,
 		SEXP ans, const int *ans_dim)
 {
 	int ndim, moved_along, ret;
-	IntAE *tchunk_midx_buf, *inner_midx_buf;
+	int *tchunk_midx_buf, *inner_midx_buf;
 	void *chunk_data_buf, *compressed_chunk_data_buf = NULL;
 	hid_t chunk_space_id;
 	H5Viewport tchunk_vp, middle_vp, dest_vp;
+	GatherBufs gather_bufs;
 	long long int tchunk_rank;
 
 	ndim = h5dset->ndim;
 
 	/* Prepare buffers. */
 
-	tchunk_midx_buf = new_IntAE(ndim, ndim, 0);
-	inner_midx_buf = new_IntAE(ndim, ndim, 0);
+	if (alloc_GatherBufs(h5dset, method, ans_dim, &gather_bufs) < 0)
+		return -1;
+
+	tchunk_midx_buf = _scratch_alloc(2 * ndim * sizeof(int), 1,
+					 "'tchunk_midx_buf' and "
+					 "'inner_midx_buf'");
+	if (tchunk_midx_buf == NULL)
+		return -1;
+	inner_midx_buf = tchunk_midx_buf + ndim;
+
+	if (h5dset->Rtype == STRSXP)
+		_init_charsxp_cache(h5dset->is_variable_str &&
+				    H5Tget_cset(h5dset->dtype_id) ==
+				    H5T_CSET_UTF8 ? CE_UTF8 : CE_NATIVE, 0);
 
 	if (method == 4) {
-		chunk_data_buf = malloc(h5dset->chunk_data_buf_size);
+		chunk_data_buf = _get_chunk_data_buf(
+					h5dset->chunk_data_buf_size);
 	} else {
 		warning("method 5 is still experimental, use at your own risk");
-		chunk_data_buf = malloc(2 * h5dset->chunk_data_buf_size +
+		chunk_data_buf = _get_chunk_data_buf(
+					2 * h5dset->chunk_data_buf_size +
 					CHUNK_COMPRESSION_OVERHEAD);
 	}
-	if (chunk_data_buf == NULL) {
-		PRINT_TO_ERRMSG_BUF("failed to allocate memory "
-				    "for 'chunk_data_buf'");
+	if (chunk_data_buf == NULL)
 		return -1;
-	}
 	if (method != 4)
-		compressed_chunk_data_buf = chunk_data_buf +
+		compressed_chunk_data_buf = (char *) chunk_data_buf +
 					    h5dset->chunk_data_buf_size;
 	chunk_space_id = H5Screate_simple(ndim, h5dset->h5chunkdim, NULL);
 	if (chunk_space_id < 0) {
-		free(chunk_data_buf);
 		PRINT_TO_ERRMSG_BUF("H5Screate_simple() returned an error");
 		return -1;
 	}
@@ -295,7 +616,6 @@ static int read_data_4_5(const H5DSetDescriptor *h5dset, int method,
 		ALLOC_OFF_AND_DIM) < 0)
 	{
 		H5Sclose(chunk_space_id);
-		free(chunk_data_buf);
 		return -1;
 	}
 
@@ -304,25 +624,33 @@ static int read_data_4_5(const H5DSetDescriptor *h5dset, int method,
 	moved_along = ndim;
 	do {
 		_update_tchunk_vp_dest_vp(h5dset,
-			tchunk_midx_buf->elts, moved_along,
-			starts, breakpoint_bufs, tchunkidx_bufs,
+			tchunk_midx_buf, moved_along,
+			dstarts, breakpoint_bufs, tchunkidx_bufs,
 			&tchunk_vp, &dest_vp);
-		ret = read_data_from_chunk_4_5(h5dset, method,
-			starts,
-			ans, ans_dim,
-			inner_midx_buf->elts,
-			&tchunk_vp, &middle_vp, &dest_vp,
-			chunk_data_buf, chunk_space_id,
-			compressed_chunk_data_buf);
+		ret = _tchunk_is_allocated(h5dset, &tchunk_vp);
 		if (ret < 0)
 			break;
+		if (ret == 0) {
+			zero_fill_dest_vp(h5dset, ans, ans_dim,
+					  &dest_vp, inner_midx_buf);
+			_h5mread_stats.nunallocated_tchunk++;
+		} else {
+			ret = read_data_from_chunk_4_5(h5dset, method,
+				dstarts,
+				ans, ans_dim,
+				inner_midx_buf,
+				&tchunk_vp, &middle_vp, &dest_vp,
+				chunk_data_buf, chunk_space_id,
+				compressed_chunk_data_buf,
+				&gather_bufs);
+			if (ret < 0)
+				break;
+		}
 		tchunk_rank++;
 		moved_along = _next_midx(ndim, num_tchunks,
-					 tchunk_midx_buf->elts);
+					 tchunk_midx_buf);
 	} while (moved_along < ndim);
-	_free_tchunk_vp_middle_vp_dest_vp(&tchunk_vp, &middle_vp, &dest_vp);
 	H5Sclose(chunk_space_id);
-	free(chunk_data_buf);
 	return ret;
 }
 
@@ -344,13 +672,13 @@ static int read_data_4_5(const H5DSetDescriptor *h5dset, int method,
  */
 
 static void update_inner_breakpoints(int ndim, int moved_along,
-		SEXP starts,
+		const DecodedStarts *dstarts,
 		const H5Viewport *dest_vp,
 		IntAEAE *inner_breakpoint_bufs, int *inner_nchip_buf)
 {
 	int along, d, off, nchip, i;
 	IntAE *inner_breakpoint_buf;
-	SEXP start;
+	const long long int *start0;
 	long long int s0, s1;
 
 	for (along = 0; along < ndim; along++) {
@@ -359,18 +687,18 @@ static void update_inner_breakpoints(int ndim, int moved_along,
 		inner_breakpoint_buf = inner_breakpoint_bufs->elts[along];
 		IntAE_set_nelt(inner_breakpoint_buf, 0);
 		d = dest_vp->dim[along];
-		start = GET_LIST_ELT(starts, along);
-		if (start == R_NilValue) {
+		start0 = dstarts->off[along];
+		if (start0 == NULL) {
 			IntAE_insert_at(inner_breakpoint_buf, 0, d);
 			inner_nchip_buf[along] = 1;
 			continue;
 		}
 		off = dest_vp->off[along];
-		s1 = _get_trusted_elt(start, off);
+		s1 = start0[off];
 		nchip = 0;
 		for (i = 1; i < d; i++) {
 			s0 = s1;
-			s1 = _get_trusted_elt(start, off + i);
+			s1 = start0[off + i];
 			if (s1 != s0 + 1)
 				IntAE_insert_at(inner_breakpoint_buf,
 						nchip++, i);
@@ -382,17 +710,15 @@ static void update_inner_breakpoints(int ndim, int moved_along,
 }
 
 static void init_inner_vp(int ndim,
-		SEXP starts,
+		const DecodedStarts *dstarts,
 		const H5Viewport *tchunk_vp,
 		H5Viewport *inner_vp)
 {
 	int along, h5along;
-	SEXP start;
 	hsize_t d;
 
 	for (along = 0, h5along = ndim - 1; along < ndim; along++, h5along--) {
-		start = GET_LIST_ELT(starts, along);
-		if (start == R_NilValue) {
+		if (dstarts->off[along] == NULL) {
 			inner_vp->h5off[h5along] =
 					tchunk_vp->h5off[h5along];
 			d = tchunk_vp->h5dim[h5along];
@@ -405,22 +731,20 @@ static void init_inner_vp(int ndim,
 }
 
 static void update_inner_vp(int ndim,
-		SEXP starts, const H5Viewport *dest_vp,
+		const DecodedStarts *dstarts, const H5Viewport *dest_vp,
 		const int *inner_midx, int inner_moved_along,
 		const IntAEAE *inner_breakpoint_bufs,
 		H5Viewport *inner_vp)
 {
 	int along, h5along, idx, off, d, i;
-	SEXP start;
+	const long long int *start0;
 	const int *inner_breakpoint;
 
 	for (along = 0; along < ndim; along++) {
 		if (along > inner_moved_along)
 			break;
-		if (starts == R_NilValue)
-			continue;
-		start = VECTOR_ELT(starts, along);
-		if (start == R_NilValue)
+		start0 = dstarts->off[along];
+		if (start0 == NULL)
 			continue;
 		inner_breakpoint = inner_breakpoint_bufs->elts[along]->elts;
 		idx = inner_midx[along];
@@ -428,7 +752,7 @@ static void update_inner_vp(int ndim,
 		d = inner_breakpoint[idx] - off;
 		i = dest_vp->off[along] + off;
 		h5along = ndim - 1 - along;
-		inner_vp->h5off[h5along] = _get_trusted_elt(start, i) - 1;
+		inner_vp->h5off[h5along] = start0[i];
 		inner_vp->h5dim[h5along] = d;
 	}
 	return;
@@ -437,7 +761,7 @@ static void update_inner_vp(int ndim,
 /* Return nb of selected elements (or -1 on error). */
 static long long int NOT_USED_select_elements_from_chunk(
 		const H5DSetDescriptor *h5dset,
-		SEXP starts,
+		const DecodedStarts *dstarts,
 		const H5Viewport *dest_vp,
 		int *inner_midx_buf, hsize_t *coord_buf)
 {
@@ -445,7 +769,7 @@ static long long int NOT_USED_select_elements_from_chunk(
 	size_t num_elements;
 	hsize_t *coord_p;
 	long long int coord;
-	SEXP start;
+	const long long int *start0;
 
 	ret = H5Sselect_none(h5dset->space_id);
 	if (ret < 0) {
@@ -466,9 +790,9 @@ static long long int NOT_USED_select_elements_from_chunk(
 		     along--, h5along++)
 		{
 			i = dest_vp->off[along] + inner_midx_buf[along];
-			start = GET_LIST_ELT(starts, along);
-			if (start != R_NilValue) {
-				coord = _get_trusted_elt(start, i) - 1;
+			start0 = dstarts->off[along];
+			if (start0 != NULL) {
+				coord = start0[i];
 			} else {
 				coord = i;
 			}
@@ -488,7 +812,7 @@ static long long int NOT_USED_select_elements_from_chunk(
 /* Return nb of hyperslabs (or -1 on error). */
 static long long int select_intersection_of_chips_with_chunk(
 		const H5DSetDescriptor *h5dset,
-		SEXP starts,
+		const DecodedStarts *dstarts,
 		const H5Viewport *dest_vp, const H5Viewport *tchunk_vp,
 		const IntAEAE *inner_breakpoint_bufs,
 		const int *inner_nchip,
@@ -506,7 +830,7 @@ static long long int select_intersection_of_chips_with_chunk(
 
 	ndim = h5dset->ndim;
 
-	init_inner_vp(ndim, starts, tchunk_vp, inner_vp);
+	init_inner_vp(ndim, dstarts, tchunk_vp, inner_vp);
 
 	/* Walk on the "inner chips" i.e. on the intersections between
 	   the "chips" in the user-supplied array selection and the currrent
@@ -515,7 +839,7 @@ static long long int select_intersection_of_chips_with_chunk(
 	inner_moved_along = ndim;
 	do {
 		num_hyperslabs++;
-		update_inner_vp(ndim, starts, dest_vp,
+		update_inner_vp(ndim, dstarts, dest_vp,
 				inner_midx_buf, inner_moved_along,
 				inner_breakpoint_bufs,
 				inner_vp);
@@ -533,7 +857,7 @@ static long long int select_intersection_of_chips_with_chunk(
 
 static int read_data_from_chunk_6(const H5DSetDescriptor *h5dset,
 		const int *chunk_midx, int moved_along,
-		SEXP starts,
+		const DecodedStarts *dstarts,
 		const IntAEAE *breakpoint_bufs,
 		const LLongAEAE *tchunkidx_bufs,
 		void *dest, hid_t dest_space_id,
@@ -542,36 +866,39 @@ static int read_data_from_chunk_6(const H5DSetDescriptor *h5dset,
 		H5Viewport *inner_vp,
 		const H5Viewport *dest_vp,
 		IntAEAE *inner_breakpoint_bufs,
-		const IntAE *inner_nchip_buf)
+		int *inner_nchip_buf)
 		// hsize_t *coord_buf)
 {
 	int ret;
+	double t0;
 
+	t0 = _trace_time();
 	update_inner_breakpoints(h5dset->ndim, moved_along,
-			starts, dest_vp,
-			inner_breakpoint_bufs, inner_nchip_buf->elts);
+			dstarts, dest_vp,
+			inner_breakpoint_bufs, inner_nchip_buf);
 	//t0 = clock();
-	/* Having 'inner_nchip_buf->elts' identical to 'dest_vp->dim'
+	/* Having 'inner_nchip_buf' identical to 'dest_vp->dim'
 	   means that all the inner chips are single elements so we
 	   use select_elements_from_chunk() which could be faster than
 	   select_intersection_of_chips_with_chunk() in that case.
 	   NO IT'S NOT FASTER! */
-	//ret = memcmp(inner_nchip_buf->elts, dest_vp->dim,
+	//ret = memcmp(inner_nchip_buf, dest_vp->dim,
 	//	       ndim * sizeof(int));
 	//printf("# chunk %lld: %s\n", tchunk_rank,
 	//       ret == 0 ? "select_elements" : "select_hyperslabs");
 	//if (ret == 0) {
 	//	ret = select_elements_from_chunk(h5dset,
-	//		starts, dest_vp,
+	//		dstarts, dest_vp,
 	//		inner_midx_buf, coord_buf);
 	//} else {
 		ret = select_intersection_of_chips_with_chunk(
-			h5dset, starts, dest_vp, tchunk_vp,
-			inner_breakpoint_bufs, inner_nchip_buf->elts,
+			h5dset, dstarts, dest_vp, tchunk_vp,
+			inner_breakpoint_bufs, inner_nchip_buf,
 			inner_midx_buf, inner_vp);
 	//}
 	if (ret < 0)
 		return ret;
+	_trace_add_select_time(t0);
 	//t_select_elements += clock() - t0;
 
 	//t0 = clock();
@@ -581,18 +908,18 @@ static int read_data_from_chunk_6(const H5DSetDescriptor *h5dset,
 }
 
 static int read_data_6(const H5DSetDescriptor *h5dset,
-		SEXP starts,
+		const DecodedStarts *dstarts,
 		const IntAEAE *breakpoint_bufs,
 		const LLongAEAE *tchunkidx_bufs,
 		const int *num_tchunks,
 		SEXP ans, const int *ans_dim)
 {
 	void *dest;
-	int ndim, moved_along, ret;
+	int ndim, moved_along, stale_along, ret;
 	hid_t dest_space_id;
 	H5Viewport tchunk_vp, inner_vp, dest_vp;
 	//hsize_t *coord_buf;
-	IntAE *tchunk_midx_buf, *inner_nchip_buf, *inner_midx_buf;
+	int *tchunk_midx_buf, *inner_nchip_buf, *inner_midx_buf;
 	IntAEAE *inner_breakpoint_bufs;
 	long long int tchunk_rank;
 
@@ -613,36 +940,56 @@ static int read_data_6(const H5DSetDescriptor *h5dset,
 	}
 
 	/* Prepare buffers. */
-	tchunk_midx_buf = new_IntAE(ndim, ndim, 0);
-	inner_nchip_buf = new_IntAE(ndim, ndim, 0);
-	inner_midx_buf = new_IntAE(ndim, ndim, 0);
+	tchunk_midx_buf = _scratch_alloc(3 * ndim * sizeof(int), 1,
+					 "'tchunk_midx_buf', 'inner_nchip_buf', "
+					 "and 'inner_midx_buf'");
+	if (tchunk_midx_buf == NULL) {
+		H5Sclose(dest_space_id);
+		return -1;
+	}
+	inner_nchip_buf = tchunk_midx_buf + ndim;
+	inner_midx_buf = inner_nchip_buf + ndim;
 	inner_breakpoint_bufs = new_IntAEAE(ndim, ndim);
 
 	/* Walk over the chunks touched by the user-supplied array selection. */
 	tchunk_rank = 0;
-	moved_along = ndim;
+	moved_along = stale_along = ndim;
 	//clock_t t_select_elements = 0, t_read_h5selection = 0, t0;
 	do {
 		_update_tchunk_vp_dest_vp(h5dset,
-			tchunk_midx_buf->elts, moved_along,
-			starts, breakpoint_bufs, tchunkidx_bufs,
+			tchunk_midx_buf, moved_along,
+			dstarts, breakpoint_bufs, tchunkidx_bufs,
 			&tchunk_vp, &dest_vp);
-		ret = read_data_from_chunk_6(h5dset,
-			tchunk_midx_buf->elts, moved_along,
-			starts, breakpoint_bufs, tchunkidx_bufs,
-			dest, dest_space_id,
-			inner_midx_buf->elts,
-			&tchunk_vp, &inner_vp, &dest_vp,
-			inner_breakpoint_bufs, inner_nchip_buf);
-			//coord_buf);
+		/* The inner breakpoints are updated incrementally by
+		   read_data_from_chunk_6() so we must keep track of the
+		   dimensions that moved while skipping chunks. */
+		if (moved_along > stale_along)
+			stale_along = moved_along;
+		ret = _tchunk_is_allocated(h5dset, &tchunk_vp);
 		if (ret < 0)
 			break;
+		if (ret == 0) {
+			zero_fill_dest_vp(h5dset, ans, ans_dim,
+					  &dest_vp, inner_midx_buf);
+			_h5mread_stats.nunallocated_tchunk++;
+		} else {
+			ret = read_data_from_chunk_6(h5dset,
+				tchunk_midx_buf, stale_along,
+				dstarts, breakpoint_bufs, tchunkidx_bufs,
+				dest, dest_space_id,
+				inner_midx_buf,
+				&tchunk_vp, &inner_vp, &dest_vp,
+				inner_breakpoint_bufs, inner_nchip_buf);
+				//coord_buf);
+			if (ret < 0)
+				break;
+			stale_along = -1;
+		}
 		tchunk_rank++;
 		moved_along = _next_midx(ndim, num_tchunks,
-					 tchunk_midx_buf->elts);
+					 tchunk_midx_buf);
 	} while (moved_along < ndim);
 	//free(coord_buf);
-	_free_tchunk_vp_inner_vp_dest_vp(&tchunk_vp, &inner_vp, &dest_vp);
 	H5Sclose(dest_space_id);
 	return ret;
 }
@@ -659,17 +1006,18 @@ static int read_data_6(const H5DSetDescriptor *h5dset,
  */
 
 static int read_data_7(const H5DSetDescriptor *h5dset,
-		SEXP starts,
+		const DecodedStarts *dstarts,
 		const IntAEAE *breakpoint_bufs,
 		const LLongAEAE *tchunkidx_bufs,
 		const int *num_tchunks,
 		SEXP ans, const int *ans_dim)
 {
-	int ndim, moved_along, ok, ret;
+	int ndim, moved_along, fully_selected, ok, ret;
 	hid_t chunk_space_id, dest_space_id;
 	void *dest, *chunk_data_buf;
 	H5Viewport tchunk_vp, middle_vp, dest_vp;
-	IntAE *tchunk_midx_buf, *inner_midx_buf;
+	GatherBufs gather_bufs;
+	int *tchunk_midx_buf, *inner_midx_buf;
 	long long int tchunk_rank;
 
 	ndim = h5dset->ndim;
@@ -703,32 +1051,50 @@ static int read_data_7(const H5DSetDescriptor *h5dset,
 		return -1;
 	}
 
-	chunk_data_buf = malloc(h5dset->chunk_data_buf_size);
-	if (chunk_data_buf == NULL) {
-		_free_tchunk_vp_middle_vp_dest_vp(&tchunk_vp,
-						   &middle_vp,
-						   &dest_vp);
+	/* Prepare buffers. */
+	chunk_data_buf = _get_chunk_data_buf(h5dset->chunk_data_buf_size);
+	tchunk_midx_buf = _scratch_alloc(2 * ndim * sizeof(int), 1,
+					 "'tchunk_midx_buf' and "
+					 "'inner_midx_buf'");
+	if (chunk_data_buf == NULL || tchunk_midx_buf == NULL ||
+	    alloc_GatherBufs(h5dset, 4, ans_dim, &gather_bufs) < 0)
+	{
 		H5Sclose(dest_space_id);
 		H5Sclose(chunk_space_id);
-		PRINT_TO_ERRMSG_BUF("failed to allocate memory "
-				    "for 'chunk_data_buf'");
 		return -1;
 	}
-
-	/* Prepare buffers. */
-	tchunk_midx_buf = new_IntAE(ndim, ndim, 0);
-	inner_midx_buf = new_IntAE(ndim, ndim, 0);
+	inner_midx_buf = tchunk_midx_buf + ndim;
 
 	/* Walk over the chunks touched by the user-supplied array selection. */
 	tchunk_rank = 0;
 	moved_along = ndim;
 	do {
 		_update_tchunk_vp_dest_vp(h5dset,
-			tchunk_midx_buf->elts, moved_along,
-			starts, breakpoint_bufs, tchunkidx_bufs,
+			tchunk_midx_buf, moved_along,
+			dstarts, breakpoint_bufs, tchunkidx_bufs,
 			&tchunk_vp, &dest_vp);
-		ok = _tchunk_is_fully_selected(h5dset->ndim,
-					       &tchunk_vp, &dest_vp);
+		ret = _tchunk_is_allocated(h5dset, &tchunk_vp);
+		if (ret < 0)
+			break;
+		if (ret == 0) {
+			zero_fill_dest_vp(h5dset, ans, ans_dim,
+					  &dest_vp, inner_midx_buf);
+			_h5mread_stats.nunallocated_tchunk++;
+			tchunk_rank++;
+			moved_along = _next_midx(ndim, num_tchunks,
+						 tchunk_midx_buf);
+			continue;
+		}
+		/* When the data can be loaded in its narrow type, it's
+		   cheaper to go thru the intermediate buffer and widen
+		   the data ourselves than to let H5Dread() convert it. */
+		fully_selected = _tchunk_is_fully_selected(h5dset->ndim,
+							   &tchunk_vp, &dest_vp);
+		if (fully_selected)
+			_h5mread_stats.nfull_tchunk++;
+		else
+			_h5mread_stats.npartial_tchunk++;
+		ok = !gather_bufs.narrow && fully_selected;
 		if (ok) {
 			/* Load the chunk **directly** into 'ans' (no
 			   intermediate buffer). */
@@ -740,20 +1106,19 @@ static int read_data_7(const H5DSetDescriptor *h5dset,
 			   buffer then copy the user-selected data from
 			   the intermediate buffer to 'ans'. */
 			ret = read_data_from_chunk_4_5(h5dset, 4,
-				starts,
+				dstarts,
 				ans, ans_dim,
-				inner_midx_buf->elts,
+				inner_midx_buf,
 				&tchunk_vp, &middle_vp, &dest_vp,
-				chunk_data_buf, chunk_space_id, NULL);
+				chunk_data_buf, chunk_space_id, NULL,
+				&gather_bufs);
 		}
 		if (ret < 0)
 			break;
 		tchunk_rank++;
 		moved_along = _next_midx(ndim, num_tchunks,
-					 tchunk_midx_buf->elts);
+					 tchunk_midx_buf);
 	} while (moved_along < ndim);
-	free(chunk_data_buf);
-	_free_tchunk_vp_middle_vp_dest_vp(&tchunk_vp, &middle_vp, &dest_vp);
 	H5Sclose(dest_space_id);
 	H5Sclose(chunk_space_id);
 	return ret;
@@ -767,17 +1132,21 @@ static int read_data_7(const H5DSetDescriptor *h5dset,
  * Return an ordinary array or R_NilValue if an error occured.
  */
 
-SEXP _h5mread_starts(const H5DSetDescriptor *h5dset, SEXP starts,
+SEXP _h5mread_starts(H5DSetDescriptor *h5dset, SEXP starts,
 		     int method, int *ans_dim)
 {
 	int ndim, ret, along;
 	IntAEAE *breakpoint_bufs;
 	LLongAEAE *tchunkidx_bufs;  /* touched chunk ids along each dim */
-	IntAE *ntchunk_buf;  /* nb of touched chunks along each dim */
+	int *ntchunk_buf;  /* nb of touched chunks along each dim */
+	long long int total_num_tchunks;
+	DecodedStarts dstarts;
 	R_xlen_t ans_len;
 	SEXP ans;
+	double t0;
 
 	ndim = h5dset->ndim;
+	t0 = _trace_time();
 
 	/* This call will populate 'ans_dim', 'breakpoint_bufs',
 	   and 'tchunkidx_bufs'. */
@@ -788,34 +1157,47 @@ SEXP _h5mread_starts(const H5DSetDescriptor *h5dset, SEXP starts,
 	if (ret < 0)
 		return R_NilValue;
 
-	ntchunk_buf = new_IntAE(ndim, ndim, 0);
-	_set_num_tchunks(h5dset, starts, tchunkidx_bufs, ntchunk_buf->elts);
+	ntchunk_buf = _scratch_alloc(ndim * sizeof(int), 0, "'ntchunk_buf'");
+	if (ntchunk_buf == NULL)
+		return R_NilValue;
+	total_num_tchunks = _set_num_tchunks(h5dset, starts,
+					     tchunkidx_bufs, ntchunk_buf);
+	_trace_set_ntchunk(total_num_tchunks);
+	if (_load_allocated_chunks(h5dset, total_num_tchunks) < 0)
+		return R_NilValue;
+	if (_decode_starts(h5dset, starts, &dstarts) < 0)
+		return R_NilValue;
+	_trace_add_select_time(t0);
 
 	ans_len = 1;
 	for (along = 0; along < ndim; along++)
 		ans_len *= ans_dim[along];
-	ans = PROTECT(allocVector(h5dset->Rtype, ans_len));
+	/* In packed mode 'ans' is a raw vector with 'ans_elt_size' bytes
+	   per element. */
+	ans = PROTECT(allocVector(h5dset->Rtype,
+				  h5dset->packed_type == PACKED_NONE ?
+				  ans_len : ans_len * h5dset->ans_elt_size));
 
 	/* ans_len != 0 means that the user-supplied array selection
 	   is not empty */
 	if (ans_len != 0) {
 		if (method <= 5) {
 			/* methods 4 and 5 */
-			ret = read_data_4_5(h5dset, method, starts,
+			ret = read_data_4_5(h5dset, method, &dstarts,
 					breakpoint_bufs, tchunkidx_bufs,
-					ntchunk_buf->elts,
+					ntchunk_buf,
 					ans, ans_dim);
 		} else if (method == 6) {
 			/* method 6 */
-			ret = read_data_6(h5dset, starts,
+			ret = read_data_6(h5dset, &dstarts,
 					breakpoint_bufs, tchunkidx_bufs,
-					ntchunk_buf->elts,
+					ntchunk_buf,
 					ans, ans_dim);
 		} else {
 			/* method 7 */
-			ret = read_data_7(h5dset, starts,
+			ret = read_data_7(h5dset, &dstarts,
 					breakpoint_bufs, tchunkidx_bufs,
-					ntchunk_buf->elts,
+					ntchunk_buf,
 					ans, ans_dim);
 		}
 		if (ret < 0)
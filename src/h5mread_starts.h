@@ -5,7 +5,7 @@
 #include <Rdefines.h>
 
 SEXP _h5mread_starts(
-	const H5DSetDescriptor *h5dset,
+	H5DSetDescriptor *h5dset,
 	SEXP starts,
 	int method,
 	int *ans_dim
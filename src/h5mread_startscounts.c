@@ -7,6 +7,7 @@
 #include "global_errmsg_buf.h"
 #include "uaselection.h"
 #include "h5mread_helpers.h"
+#include "h5mread_trace.h"
 
 #include <stdlib.h>  /* for malloc, free */
 //#include <time.h>
@@ -140,22 +141,22 @@ static long long int select_hyperslabs(const H5DSetDescriptor *h5dset,
 	} while (moved_along < ndim);
 	//printf("nb of hyperslabs = %lld\n", num_hyperslabs);
 
-	_free_H5Viewport(&h5dset_vp);
 	return ret < 0 ? -1 : num_hyperslabs;
 }
 
 static inline hsize_t *add_element(int ndim, const int *midx,
-				   SEXP starts, hsize_t *coord_p)
+				   const DecodedStarts *dstarts,
+				   hsize_t *coord_p)
 {
 	int h5along, i;
-	SEXP start;
+	const long long int *start0;
 	long long int coord;
 
 	for (h5along = ndim - 1; h5along >= 0; h5along--) {
 		i = midx[h5along];
-		start = GET_LIST_ELT(starts, h5along);
-		if (start != R_NilValue) {
-			coord = _get_trusted_elt(start, i) - 1;
+		start0 = dstarts->off[h5along];
+		if (start0 != NULL) {
+			coord = start0[i];
 		} else {
 			coord = i;
 		}
@@ -172,12 +173,16 @@ static long long int select_elements(const H5DSetDescriptor *h5dset,
 	int ndim, outer_moved_along, ret;
 	size_t num_elements;
 	hsize_t *coord_buf, *coord_p;
+	DecodedStarts dstarts;
 
 	ndim = h5dset->ndim;
 	num_elements = set_nchips(ndim, starts, ans_dim, 1, nchips);
+	if (_decode_starts(h5dset, starts, &dstarts) < 0)
+		return -1;
 
 	/* Allocate 'coord_buf'. */
-	coord_buf = _alloc_hsize_t_buf(num_elements * ndim, 0, "'coord_buf'");
+	coord_buf = _scratch_alloc(num_elements * ndim * sizeof(hsize_t), 0,
+				   "'coord_buf'");
 	if (coord_buf == NULL)
 		return -1;
 
@@ -185,13 +190,12 @@ static long long int select_elements(const H5DSetDescriptor *h5dset,
 	coord_p = coord_buf;
 	outer_moved_along = ndim;
 	do {
-		coord_p = add_element(ndim, midx_buf, starts, coord_p);
+		coord_p = add_element(ndim, midx_buf, &dstarts, coord_p);
 		outer_moved_along = _next_midx(ndim, nchips, midx_buf);
 	} while (outer_moved_along < ndim);
 
 	ret = H5Sselect_elements(h5dset->space_id, H5S_SELECT_APPEND,
 				 num_elements, coord_buf);
-	free(coord_buf);
 	if (ret < 0)
 		return -1;
 	return (long long int) num_elements;
@@ -200,19 +204,21 @@ static long long int select_elements(const H5DSetDescriptor *h5dset,
 static int set_h5selection(const H5DSetDescriptor *h5dset, int method,
 			   SEXP starts, SEXP counts, const int *ans_dim)
 {
-	int ndim;
-	IntAE *nchip_buf, *midx_buf;
+	int ndim, *nchip_buf, *midx_buf;
 	long long int total_num_chips;
 
 	ndim = h5dset->ndim;
-	nchip_buf = new_IntAE(ndim, ndim, 0);
-	midx_buf = new_IntAE(ndim, ndim, 0);
+	nchip_buf = _scratch_alloc(2 * ndim * sizeof(int), 1,
+				   "'nchip_buf' and 'midx_buf'");
+	if (nchip_buf == NULL)
+		return -1;
+	midx_buf = nchip_buf + ndim;
 
 	//clock_t t0 = clock();
 	if (method == 1) {
 		total_num_chips = select_hyperslabs(h5dset,
 					starts, counts, ans_dim,
-					nchip_buf->elts, midx_buf->elts);
+					nchip_buf, midx_buf);
 	} else {
 		if (counts != R_NilValue) {
 			PRINT_TO_ERRMSG_BUF("'counts' must be NULL when "
@@ -221,13 +227,16 @@ static int set_h5selection(const H5DSetDescriptor *h5dset, int method,
 		}
 		total_num_chips = select_elements(h5dset,
 					starts, ans_dim,
-					nchip_buf->elts, midx_buf->elts);
+					nchip_buf, midx_buf);
 	}
 	//double dt = (1.0 * clock() - t0) / CLOCKS_PER_SEC;
 	//printf("time for setting h5 selection: %e\n", dt);
 	//printf("total_num_chips: %lld, time per chip: %e\n",
 	//	total_num_chips, dt / total_num_chips);
-	return total_num_chips < 0 ? -1 : 0;
+	if (total_num_chips < 0)
+		return -1;
+	_trace_set_nchip(total_num_chips);
+	return 0;
 }
 
 static int read_data_1_2(const H5DSetDescriptor *h5dset, int method,
@@ -235,10 +244,13 @@ static int read_data_1_2(const H5DSetDescriptor *h5dset, int method,
 		void *dest, hid_t dest_space_id)
 {
 	int ret;
+	double t0;
 
+	t0 = _trace_time();
 	ret = set_h5selection(h5dset, method, starts, counts, ans_dim);
 	if (ret < 0)
 		return -1;
+	_trace_add_select_time(t0);
 	return _read_h5selection(h5dset, NULL, dest, dest_space_id);
 }
 
@@ -290,23 +302,25 @@ static int read_data_3(const H5DSetDescriptor *h5dset,
 {
 	int ndim, moved_along, ret;
 	H5Viewport h5dset_vp, dest_vp;
-	IntAE *nchip_buf, *midx_buf;
+	int *nchip_buf, *midx_buf;
 	long long int num_hyperslabs;
 
 	ndim = h5dset->ndim;
-	nchip_buf = new_IntAE(ndim, ndim, 0);
-	midx_buf = new_IntAE(ndim, ndim, 0);
+	nchip_buf = _scratch_alloc(2 * ndim * sizeof(int), 1,
+				   "'nchip_buf' and 'midx_buf'");
+	if (nchip_buf == NULL)
+		return -1;
+	midx_buf = nchip_buf + ndim;
 
-	set_nchips(ndim, starts, ans_dim, 0, nchip_buf->elts);
+	set_nchips(ndim, starts, ans_dim, 0, nchip_buf);
 
 	/* Allocate 'h5dset_vp' and 'dest_vp'. */
 	if (_alloc_H5Viewport(&h5dset_vp, ndim, ALLOC_H5OFF_AND_H5DIM) < 0)
 		return -1;
-	dest_vp.h5off = _alloc_hsize_t_buf(ndim, 1, "'dest_vp.h5off'");
-	if (dest_vp.h5off == NULL) {
-		_free_H5Viewport(&h5dset_vp);
+	dest_vp.h5off = _scratch_alloc(ndim * sizeof(hsize_t), 1,
+				       "'dest_vp.h5off'");
+	if (dest_vp.h5off == NULL)
 		return -1;
-	}
 	dest_vp.h5dim = h5dset_vp.h5dim;
 
 	/* Initialize 'h5dset_vp' (this also initializes 'dest_vp.h5dim'). */
@@ -318,18 +332,16 @@ static int read_data_3(const H5DSetDescriptor *h5dset,
 	do {
 		num_hyperslabs++;
 		ret = read_hyperslab(h5dset, starts, counts,
-				     midx_buf->elts, moved_along,
+				     midx_buf, moved_along,
 				     &h5dset_vp, &dest_vp,
 				     dest, dest_space_id);
 		if (ret < 0)
 			break;
-		moved_along = _next_midx(ndim, nchip_buf->elts,
-					 midx_buf->elts);
+		moved_along = _next_midx(ndim, nchip_buf, midx_buf);
 	} while (moved_along < ndim);
 
 	//printf("nb of hyperslabs = %lld\n", num_hyperslabs);
-	free(dest_vp.h5off);
-	_free_H5Viewport(&h5dset_vp);
+	_trace_set_nchip(num_hyperslabs);
 	return ret;
 }
 
@@ -343,14 +355,15 @@ static long long int check_uaselection_against_h5dset(
 		SEXP starts, SEXP counts, int *uaselection_dim_buf)
 {
 	int ndim, along, h5along;
-	LLongAE *dim_buf;
+	long long int *dim_buf;
 
 	ndim = h5dset->ndim;
-	dim_buf = new_LLongAE(ndim, ndim, 0);
+	dim_buf = _scratch_alloc(ndim * sizeof(long long int), 0, "'dim_buf'");
+	if (dim_buf == NULL)
+		return -1;
 	for (along = 0, h5along = ndim - 1; along < ndim; along++, h5along--)
-		dim_buf->elts[along] =
-			(long long int) h5dset->h5dim[h5along];
-	return _check_uaselection(ndim, dim_buf->elts, starts, counts,
+		dim_buf[along] = (long long int) h5dset->h5dim[h5along];
+	return _check_uaselection(ndim, dim_buf, starts, counts,
 				  uaselection_dim_buf);
 }
 
@@ -361,14 +374,15 @@ static long long int check_ordered_uaselection_against_h5dset(
 		long long int *last_chip_start_buf)
 {
 	int ndim, along, h5along;
-	LLongAE *dim_buf;
+	long long int *dim_buf;
 
 	ndim = h5dset->ndim;
-	dim_buf = new_LLongAE(ndim, ndim, 0);
+	dim_buf = _scratch_alloc(ndim * sizeof(long long int), 0, "'dim_buf'");
+	if (dim_buf == NULL)
+		return -1;
 	for (along = 0, h5along = ndim - 1; along < ndim; along++, h5along--)
-		dim_buf->elts[along] =
-			(long long int) h5dset->h5dim[h5along];
-	return _check_ordered_uaselection(ndim, dim_buf->elts, starts, counts,
+		dim_buf[along] = (long long int) h5dset->h5dim[h5along];
+	return _check_ordered_uaselection(ndim, dim_buf, starts, counts,
 					  uaselection_dim_buf,
 					  nstart_buf, nchip_buf,
 					  last_chip_start_buf);
@@ -382,14 +396,16 @@ SEXP _h5mread_startscounts(const H5DSetDescriptor *h5dset,
 {
 	int ndim, ret;
 	long long int ans_len;
-	IntAE *nstart_buf, *nchip_buf;
-	LLongAE *last_chip_start_buf;
+	int *nstart_buf, *nchip_buf;
+	long long int *last_chip_start_buf;
 	SEXP ans, reduced;
 	void *dest;
 	hid_t dest_space_id;
+	double t0;
 	int nprotect = 0;
 
 	ndim = h5dset->ndim;
+	t0 = _trace_time();
 	if (noreduce || method == 2) {
 		/* This call will populate 'ans_dim'. */
 		ans_len = check_uaselection_against_h5dset(h5dset,
@@ -397,31 +413,41 @@ SEXP _h5mread_startscounts(const H5DSetDescriptor *h5dset,
 		if (ans_len < 0)
 			return R_NilValue;
 	} else {
-		nstart_buf = new_IntAE(ndim, ndim, 0);
-		nchip_buf = new_IntAE(ndim, ndim, 0);
-		last_chip_start_buf = new_LLongAE(ndim, ndim, 0);
+		nstart_buf = _scratch_alloc(2 * ndim * sizeof(int), 1,
+					    "'nstart_buf' and 'nchip_buf'");
+		last_chip_start_buf = _scratch_alloc(
+					ndim * sizeof(long long int), 1,
+					"'last_chip_start_buf'");
+		if (nstart_buf == NULL || last_chip_start_buf == NULL)
+			return R_NilValue;
+		nchip_buf = nstart_buf + ndim;
 		/* This call will populate 'ans_dim', 'nchip_buf',
 		   and 'last_chip_start_buf'. */
 		ans_len = check_ordered_uaselection_against_h5dset(h5dset,
 					starts, counts, ans_dim,
-					nstart_buf->elts, nchip_buf->elts,
-					last_chip_start_buf->elts);
+					nstart_buf, nchip_buf,
+					last_chip_start_buf);
 		if (ans_len < 0)
 			return R_NilValue;
-		if (_uaselection_can_be_reduced(ndim, nstart_buf->elts,
-						nchip_buf->elts))
+		if (_uaselection_can_be_reduced(ndim, nstart_buf, nchip_buf))
 		{
 			reduced = PROTECT(_reduce_uaselection(
 						ndim, starts, counts, ans_dim,
-						nchip_buf->elts,
-						last_chip_start_buf->elts));
+						nchip_buf,
+						last_chip_start_buf));
 			nprotect++;
 			starts = VECTOR_ELT(reduced, 0);
 			counts = VECTOR_ELT(reduced, 1);
 		}
 	}
-
-	ans = PROTECT(allocVector(h5dset->Rtype, (R_xlen_t) ans_len));
+	_trace_add_select_time(t0);
+
+	/* In packed mode 'ans' is a raw vector with 'ans_elt_size' bytes
+	   per element. */
+	ans = PROTECT(allocVector(h5dset->Rtype,
+				  h5dset->packed_type == PACKED_NONE ?
+				  (R_xlen_t) ans_len :
+				  (R_xlen_t) ans_len * h5dset->ans_elt_size));
 	nprotect++;
 
 	if (ans_len != 0) {
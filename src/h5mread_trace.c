@@ -0,0 +1,419 @@
+/****************************************************************************
+ *                     Access-pattern tracing for h5mread                   *
+ *                            Author: H. Pag\`es                            *
+ ****************************************************************************/
+#include "h5mread_trace.h"
+
+#include "hdf5.h"
+
+#include <stdlib.h>  /* for malloc, free */
+#include <string.h>  /* for strlen, memcpy */
+#include <stdio.h>   /* for snprintf */
+#include <time.h>    /* for clock_gettime */
+
+
+/****************************************************************************
+ * Cumulative statistics
+ *
+ * Always collected. They are updated by the instrumentation points below
+ * and by direct increments of the '_h5mread_stats' fields.
+ */
+
+H5mreadStats _h5mread_stats;
+
+
+/****************************************************************************
+ * The ring buffer
+ *
+ * When tracing is turned on, each successful call to C_h5mread() appends
+ * one TraceRecord to a ring buffer of fixed capacity. Once the buffer is
+ * full, new records overwrite the oldest ones. Appending a record only
+ * requires an atomic increment of 'ring_head' so never blocks.
+ */
+
+#define	TRACE_FILEPATH_MAXLEN	256
+#define	TRACE_NAME_MAXLEN	128
+#define	TRACE_MAXDIM		8
+
+typedef struct {
+	char filepath[TRACE_FILEPATH_MAXLEN], name[TRACE_NAME_MAXLEN];
+	int method, ndim, ans_dim[TRACE_MAXDIM];
+	/* -1 when not applicable to the method that was used. */
+	long long int nchip, ntchunk;
+	long long int nbytes_read, nbytes_decompressed;
+	double select_time, read_time, gather_time, total_time;
+} TraceRecord;
+
+static TraceRecord *ring = NULL;
+static size_t ring_capacity = 0;
+static unsigned long long int ring_head = 0;  /* nb of records ever added */
+
+
+/****************************************************************************
+ * Instrumentation points
+ *
+ * They accumulate the measurements for the _h5mread() call in progress in
+ * 'current'. _trace_end() then adds them to the cumulative statistics, and
+ * to the ring buffer if the call is traced (i.e. if it was made by
+ * C_h5mread() with tracing turned on).
+ */
+
+static TraceRecord current;
+static int current_is_traced = 0;
+static double current_t0;
+
+double _trace_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + 1e-9 * (double) ts.tv_nsec;
+}
+
+/* Copy 's' to 'dest', keeping only the last 'dest_size' - 1 chars of 's'
+   if it's too long (the end of a file path is the informative part). */
+static void copy_tail(char *dest, size_t dest_size, const char *s)
+{
+	size_t s_len;
+
+	s_len = strlen(s);
+	if (s_len >= dest_size) {
+		s += s_len - (dest_size - 1);
+		s_len = dest_size - 1;
+	}
+	memcpy(dest, s, s_len);
+	dest[s_len] = '\0';
+	return;
+}
+
+/* Called by C_h5mread() right before it calls _h5mread(). */
+void _trace_begin(SEXP filepath)
+{
+	if (ring == NULL)
+		return;
+	copy_tail(current.filepath, TRACE_FILEPATH_MAXLEN,
+		  CHAR(STRING_ELT(filepath, 0)));
+	current_is_traced = 1;
+	return;
+}
+
+/* Called at the beginning of each _h5mread() call. */
+void _trace_begin_call(void)
+{
+	current.nchip = current.ntchunk = current.nbytes_read = -1;
+	current.nbytes_decompressed = -1;
+	current.select_time = current.read_time = current.gather_time = 0.0;
+	current_t0 = _trace_time();
+	return;
+}
+
+void _trace_add_select_time(double t0)
+{
+	current.select_time += _trace_time() - t0;
+	return;
+}
+
+void _trace_add_read_time(double t0)
+{
+	current.read_time += _trace_time() - t0;
+	return;
+}
+
+void _trace_add_gather_time(double t0)
+{
+	current.gather_time += _trace_time() - t0;
+	return;
+}
+
+void _trace_set_nchip(long long int nchip)
+{
+	current.nchip = nchip;
+	return;
+}
+
+void _trace_set_ntchunk(long long int ntchunk)
+{
+	current.ntchunk = ntchunk;
+	return;
+}
+
+/* Only _read_h5chunk() (method 5) knows exactly how many bytes it reads
+   from the file. */
+void _trace_add_nbytes_read(long long int nbytes)
+{
+	if (current.nbytes_read < 0)
+		current.nbytes_read = 0;
+	current.nbytes_read += nbytes;
+	return;
+}
+
+/* Average number of bytes used on disk by a chunk of the dataset.
+   H5Dget_storage_size() walks the chunk index so this is O(total number of
+   chunks). Only called for traced calls. */
+static double get_avg_chunk_storage_size(const H5DSetDescriptor *h5dset)
+{
+	double nchunk;
+	int h5along;
+
+	nchunk = 1.0;
+	for (h5along = 0; h5along < h5dset->ndim; h5along++)
+		nchunk *= h5dset->h5nchunk[h5along];
+	if (nchunk == 0.0)
+		return 0.0;
+	return (double) H5Dget_storage_size(h5dset->dset_id) / nchunk;
+}
+
+/* Set the number of bytes read and decompressed. We assume that each
+   touched chunk was decompressed once. The number of bytes read is only
+   known for method 5 and for contiguous data, and is left to -1 otherwise
+   (see estimate_nbytes_read() below). */
+static void set_nbytes(const H5DSetDescriptor *h5dset, const int *ans_dim)
+{
+	long long int ans_len, chunk_nbyte;
+	int along, h5along;
+
+	if (h5dset->h5chunkdim == NULL) {
+		ans_len = 1;
+		for (along = 0; along < h5dset->ndim; along++)
+			ans_len *= ans_dim[along];
+		current.nbytes_read = ans_len * (long long int) h5dset->H5size;
+		current.nbytes_decompressed = 0;
+		return;
+	}
+	if (current.ntchunk < 0) {
+		/* Methods 1 to 3 don't know which chunks they touch. */
+		current.nbytes_read = current.nbytes_decompressed = -1;
+		return;
+	}
+	chunk_nbyte = (long long int) h5dset->H5size;
+	for (h5along = 0; h5along < h5dset->ndim; h5along++)
+		chunk_nbyte *= (long long int) h5dset->h5chunkdim[h5along];
+	current.nbytes_decompressed = current.ntchunk * chunk_nbyte;
+	return;
+}
+
+/* For the trace only: estimate the number of bytes read from the average
+   size of a chunk on disk when it's not known. */
+static void estimate_nbytes_read(const H5DSetDescriptor *h5dset)
+{
+	if (current.nbytes_read >= 0 || current.ntchunk < 0)
+		return;
+	current.nbytes_read = (long long int)
+		(current.ntchunk * get_avg_chunk_storage_size(h5dset));
+	return;
+}
+
+static void update_stats(void)
+{
+	_h5mread_stats.ncall++;
+	if (current.ntchunk > 0)
+		_h5mread_stats.ntchunk += current.ntchunk;
+	if (current.nbytes_read > 0)
+		_h5mread_stats.nbytes_read += current.nbytes_read;
+	if (current.nbytes_decompressed > 0)
+		_h5mread_stats.nbytes_decompressed +=
+				current.nbytes_decompressed;
+	_h5mread_stats.select_time += current.select_time;
+	_h5mread_stats.read_time += current.read_time;
+	_h5mread_stats.gather_time += current.gather_time;
+	_h5mread_stats.total_time += current.total_time;
+	return;
+}
+
+/* Called at the end of each successful _h5mread() call. */
+void _trace_end(const H5DSetDescriptor *h5dset, int method,
+		const int *ans_dim)
+{
+	int along;
+	unsigned long long int idx;
+
+	current.total_time = _trace_time() - current_t0;
+	set_nbytes(h5dset, ans_dim);
+	update_stats();
+	if (!current_is_traced)
+		return;
+	current_is_traced = 0;
+	estimate_nbytes_read(h5dset);
+	copy_tail(current.name, TRACE_NAME_MAXLEN,
+		  h5dset->h5name != NULL ? h5dset->h5name : "");
+	current.method = method;
+	current.ndim = h5dset->ndim;
+	for (along = 0; along < h5dset->ndim && along < TRACE_MAXDIM; along++)
+		current.ans_dim[along] = ans_dim[along];
+	idx = __atomic_fetch_add(&ring_head, 1, __ATOMIC_RELAXED);
+	ring[idx % ring_capacity] = current;
+	return;
+}
+
+/* Called when C_h5mread() fails. Failed calls are not recorded. */
+void _trace_cancel(void)
+{
+	current_is_traced = 0;
+	return;
+}
+
+
+/****************************************************************************
+ * Turning the ring buffer into a list of columns
+ */
+
+static SEXP make_ans_dim_string(const TraceRecord *rec)
+{
+	char buf[12 * TRACE_MAXDIM + 8];
+	int along, n;
+	size_t buf_len;
+
+	buf_len = 0;
+	for (along = 0; along < rec->ndim && along < TRACE_MAXDIM; along++) {
+		n = snprintf(buf + buf_len, sizeof(buf) - buf_len, "%s%d",
+			     along == 0 ? "" : "x", rec->ans_dim[along]);
+		buf_len += n;
+	}
+	if (rec->ndim > TRACE_MAXDIM)
+		snprintf(buf + buf_len, sizeof(buf) - buf_len, "x...");
+	return mkChar(buf);
+}
+
+static double LLint_or_NA(long long int x)
+{
+	return x < 0 ? NA_REAL : (double) x;
+}
+
+static const char *trace_colnames[] = {
+	"filepath", "name", "method", "dim",
+	"nchip", "ntchunk", "bytes_read", "bytes_decompressed",
+	"select_time", "read_time", "gather_time", "total_time"
+};
+
+#define	TRACE_NCOL (sizeof(trace_colnames) / sizeof(trace_colnames[0]))
+
+/* --- .Call ENTRY POINT ---
+   Set 'capacity' to 0 to turn tracing off. Turning tracing on (or changing
+   the capacity of the buffer) discards the records collected so far. */
+SEXP C_set_h5mread_tracing(SEXP capacity)
+{
+	int capacity0;
+
+	if (!(IS_INTEGER(capacity) && LENGTH(capacity) == 1 &&
+	      INTEGER(capacity)[0] != NA_INTEGER && INTEGER(capacity)[0] >= 0))
+		error("'capacity' must be a single non-negative integer");
+	capacity0 = INTEGER(capacity)[0];
+	current_is_traced = 0;
+	free(ring);
+	ring = NULL;
+	ring_capacity = 0;
+	ring_head = 0;
+	if (capacity0 == 0)
+		return R_NilValue;
+	ring = (TraceRecord *) malloc(capacity0 * sizeof(TraceRecord));
+	if (ring == NULL)
+		error("failed to allocate memory for the h5mread() trace");
+	ring_capacity = capacity0;
+	return R_NilValue;
+}
+
+/* --- .Call ENTRY POINT ---
+   Return the records from oldest to newest as a named list of columns. */
+SEXP C_get_h5mread_trace(void)
+{
+	unsigned long long int head, nrec, idx;
+	int i;
+	size_t j;
+	const TraceRecord *rec;
+	SEXP ans, ans_names, col;
+
+	head = ring_head;
+	nrec = head < ring_capacity ? head : ring_capacity;
+	ans = PROTECT(NEW_LIST(TRACE_NCOL));
+	ans_names = PROTECT(NEW_CHARACTER(TRACE_NCOL));
+	for (j = 0; j < TRACE_NCOL; j++) {
+		SET_STRING_ELT(ans_names, j, mkChar(trace_colnames[j]));
+		if (j == 2) {
+			col = NEW_INTEGER(nrec);
+		} else if (j <= 3) {
+			col = NEW_CHARACTER(nrec);
+		} else {
+			col = NEW_NUMERIC(nrec);
+		}
+		SET_VECTOR_ELT(ans, j, col);
+	}
+	SET_NAMES(ans, ans_names);
+	for (i = 0, idx = head - nrec; i < nrec; i++, idx++) {
+		rec = ring + idx % ring_capacity;
+		SET_STRING_ELT(VECTOR_ELT(ans, 0), i, mkChar(rec->filepath));
+		SET_STRING_ELT(VECTOR_ELT(ans, 1), i, mkChar(rec->name));
+		INTEGER(VECTOR_ELT(ans, 2))[i] = rec->method;
+		SET_STRING_ELT(VECTOR_ELT(ans, 3), i, make_ans_dim_string(rec));
+		REAL(VECTOR_ELT(ans, 4))[i] = LLint_or_NA(rec->nchip);
+		REAL(VECTOR_ELT(ans, 5))[i] = LLint_or_NA(rec->ntchunk);
+		REAL(VECTOR_ELT(ans, 6))[i] = LLint_or_NA(rec->nbytes_read);
+		REAL(VECTOR_ELT(ans, 7))[i] =
+				LLint_or_NA(rec->nbytes_decompressed);
+		REAL(VECTOR_ELT(ans, 8))[i] = rec->select_time;
+		REAL(VECTOR_ELT(ans, 9))[i] = rec->read_time;
+		REAL(VECTOR_ELT(ans, 10))[i] = rec->gather_time;
+		REAL(VECTOR_ELT(ans, 11))[i] = rec->total_time;
+	}
+	UNPROTECT(2);
+	return ans;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_clear_h5mread_trace(void)
+{
+	ring_head = 0;
+	return R_NilValue;
+}
+
+
+
+/****************************************************************************
+ * Getting/resetting the cumulative statistics
+ */
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_get_h5mread_stats(void)
+{
+	static const char *names[] = {
+		"ncall", "ntchunk",
+		"nfull_tchunk", "npartial_tchunk", "ntruncated_tchunk",
+		"nunallocated_tchunk", "nunmatched_tchunk", "nzero_copy",
+		"bytes_read", "bytes_decompressed",
+		"nH5Dread", "nH5Dread_chunk", "nhyperslab",
+		"select_time", "read_time", "decompression_time",
+		"gather_time", "total_time"
+	};
+	const H5mreadStats *stats = &_h5mread_stats;
+	double vals[] = {
+		stats->ncall, stats->ntchunk,
+		stats->nfull_tchunk, stats->npartial_tchunk,
+		stats->ntruncated_tchunk, stats->nunallocated_tchunk,
+		stats->nunmatched_tchunk, stats->nzero_copy,
+		stats->nbytes_read, stats->nbytes_decompressed,
+		stats->nH5Dread, stats->nH5Dread_chunk, stats->nhyperslab,
+		stats->select_time, stats->read_time,
+		stats->decompression_time,
+		stats->gather_time, stats->total_time
+	};
+	int n, i;
+	SEXP ans, ans_names;
+
+	n = sizeof(vals) / sizeof(double);
+	ans = PROTECT(NEW_NUMERIC(n));
+	ans_names = PROTECT(NEW_CHARACTER(n));
+	for (i = 0; i < n; i++) {
+		REAL(ans)[i] = vals[i];
+		SET_STRING_ELT(ans_names, i, mkChar(names[i]));
+	}
+	SET_NAMES(ans, ans_names);
+	UNPROTECT(2);
+	return ans;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_reset_h5mread_stats(void)
+{
+	memset(&_h5mread_stats, 0, sizeof(H5mreadStats));
+	return R_NilValue;
+}
+
@@ -0,0 +1,76 @@
+#ifndef _H5MREAD_TRACE_H_
+#define _H5MREAD_TRACE_H_
+
+#include <Rdefines.h>
+#include "H5DSetDescriptor.h"
+
+/* Cumulative statistics over all the _h5mread() calls (see h5mreadStats()
+   in R). The counters that don't come from the instrumentation points
+   below are incremented directly by the h5mread workhorses. */
+typedef struct {
+	long long int ncall;
+	/* Touched chunks. Only method 7 looks at whether a chunk is fully
+	   selected or not. */
+	long long int ntchunk, nfull_tchunk, npartial_tchunk;
+	long long int ntruncated_tchunk;
+	/* Touched chunks that are not allocated in the file or that contain
+	   only zeros according to the chunk statistics (methods 4 to 8, see
+	   _tchunk_is_allocated()). */
+	long long int nunallocated_tchunk;
+	/* Touched chunks that cannot contain values matching the 'where'
+	   predicate according to the chunk statistics (method 8, see
+	   _tchunk_can_match()). */
+	long long int nunmatched_tchunk;
+	/* Nb of calls to method 9 that returned a vector backed by the
+	   mapping (see _h5mread_mmap()). */
+	long long int nzero_copy;
+	/* Unlike in the trace, 'nbytes_read' only counts the bytes read by
+	   method 5 and from contiguous datasets (no estimates). */
+	long long int nbytes_read, nbytes_decompressed;
+	long long int nH5Dread, nH5Dread_chunk;
+	/* Nb of hyperslabs added to an h5 selection (methods 1 and 6). */
+	long long int nhyperslab;
+	double select_time, read_time, decompression_time;
+	double gather_time, total_time;
+} H5mreadStats;
+
+extern H5mreadStats _h5mread_stats;
+
+double _trace_time(void);
+
+void _trace_begin(SEXP filepath);
+
+void _trace_begin_call(void);
+
+void _trace_add_select_time(double t0);
+
+void _trace_add_read_time(double t0);
+
+void _trace_add_gather_time(double t0);
+
+void _trace_set_nchip(long long int nchip);
+
+void _trace_set_ntchunk(long long int ntchunk);
+
+void _trace_add_nbytes_read(long long int nbytes);
+
+void _trace_end(
+	const H5DSetDescriptor *h5dset,
+	int method,
+	const int *ans_dim
+);
+
+void _trace_cancel(void);
+
+SEXP C_set_h5mread_tracing(SEXP capacity);
+
+SEXP C_get_h5mread_trace(void);
+
+SEXP C_clear_h5mread_trace(void);
+
+SEXP C_get_h5mread_stats(void);
+
+SEXP C_reset_h5mread_stats(void);
+
+#endif  /* _H5MREAD_TRACE_H_ */
+
@@ -0,0 +1,798 @@
+/****************************************************************************
+ *          Out-of-core rewriting of HDF5 datasets with new chunks          *
+ *                            Author: H. Pag\`es                            *
+ ****************************************************************************/
+#include "h5rechunk.h"
+
+#include "global_errmsg_buf.h"
+#include "h5mread_helpers.h"  /* for _next_midx() */
+
+#include <pthread.h>
+#include <stdio.h>  /* for snprintf() */
+#include <stdlib.h>  /* for malloc, realloc, free */
+#include <string.h>  /* for memset, memcpy, strcmp */
+#include <zlib.h>  /* for compress2(), compressBound(), Z_OK */
+
+/*
+ * C_h5rechunk() copies a dataset to a new dataset with a different chunk
+ * geometry. Like C_h5transpose() (see h5transpose.c), it walks the input
+ * dataset by tiles that span a whole number of output chunks, and writes
+ * each output chunk once with H5Dwrite_chunk(). The output chunks of a tile
+ * are extracted and compressed by 'nthread' threads (this is where the
+ * time goes), then written by the main thread (HDF5 is not thread-safe).
+ *
+ * Half of 'max_memory' goes to the chunk cache of the input dataset, the
+ * other half to the tile buffer and the compressed output chunks.
+ */
+
+
+/****************************************************************************
+ * Helpers shared with h5transpose.c
+ */
+
+/* Attributes that are managed by the Dimension Scale API. They refer to
+   the dimensions of the input dataset so must not be copied. */
+static const char *dimscale_attrs[] = {
+	"CLASS", "NAME", "DIMENSION_LIST", "REFERENCE_LIST", "DIMENSION_LABELS"
+};
+
+static herr_t copy_attribute(hid_t in_dset_id, const char *attr_name,
+			     const H5A_info_t *ainfo, void *op_data)
+{
+	hid_t out_dset_id, attr_id, type_id, space_id, out_attr_id;
+	size_t i, bufsize;
+	hssize_t npoints;
+	void *buf;
+	herr_t ret;
+
+	for (i = 0; i < sizeof(dimscale_attrs) / sizeof(char *); i++)
+		if (strcmp(attr_name, dimscale_attrs[i]) == 0)
+			return 0;
+	out_dset_id = *((hid_t *) op_data);
+	attr_id = H5Aopen(in_dset_id, attr_name, H5P_DEFAULT);
+	if (attr_id < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Aopen() returned an error");
+		return -1;
+	}
+	type_id = H5Aget_type(attr_id);
+	space_id = H5Aget_space(attr_id);
+	npoints = space_id < 0 ? -1 : H5Sget_simple_extent_npoints(space_id);
+	ret = -1;
+	buf = NULL;
+	if (type_id < 0 || npoints < 0) {
+		PRINT_TO_ERRMSG_BUF("failed to get type or space "
+				    "of attribute \"%s\"", attr_name);
+		goto on_error;
+	}
+	bufsize = (size_t) npoints * H5Tget_size(type_id);
+	buf = malloc(bufsize != 0 ? bufsize : 1);
+	if (buf == NULL) {
+		PRINT_TO_ERRMSG_BUF("failed to allocate memory "
+				    "for attribute \"%s\"", attr_name);
+		goto on_error;
+	}
+	if (H5Aread(attr_id, type_id, buf) < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Aread() returned an error");
+		goto on_error;
+	}
+	out_attr_id = H5Acreate(out_dset_id, attr_name, type_id, space_id,
+				H5P_DEFAULT, H5P_DEFAULT);
+	if (out_attr_id < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Acreate() returned an error");
+	} else {
+		ret = H5Awrite(out_attr_id, type_id, buf);
+		if (ret < 0)
+			PRINT_TO_ERRMSG_BUF("H5Awrite() returned an error");
+		H5Aclose(out_attr_id);
+	}
+	if (H5Tdetect_class(type_id, H5T_VLEN) > 0 ||
+	    H5Tis_variable_str(type_id) > 0)
+		H5Dvlen_reclaim(type_id, space_id, H5P_DEFAULT, buf);
+
+    on_error:
+	free(buf);
+	if (space_id >= 0)
+		H5Sclose(space_id);
+	if (type_id >= 0)
+		H5Tclose(type_id);
+	H5Aclose(attr_id);
+	return ret < 0 ? -1 : 0;
+}
+
+/* Create a chunked dataset with the same type and attributes as the
+   dataset described by 'h5dset' so the tiles can be loaded and the chunks
+   written without any type conversion. Only the deflate filter is used
+   (if 'level' != 0). */
+hid_t _create_dataset_like(hid_t file_id, const char *name,
+		const H5DSetDescriptor *h5dset,
+		const hsize_t *h5dim, const hsize_t *h5chunkdim, int level)
+{
+	hid_t space_id, plist_id, dset_id;
+
+	space_id = H5Screate_simple(h5dset->ndim, h5dim, NULL);
+	if (space_id < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Screate_simple() returned an error");
+		return -1;
+	}
+	plist_id = H5Pcreate(H5P_DATASET_CREATE);
+	if (plist_id < 0) {
+		H5Sclose(space_id);
+		PRINT_TO_ERRMSG_BUF("H5Pcreate() returned an error");
+		return -1;
+	}
+	dset_id = -1;
+	if (H5Pset_chunk(plist_id, h5dset->ndim, h5chunkdim) < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Pset_chunk() returned an error");
+	} else if (level != 0 && H5Pset_deflate(plist_id, level) < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Pset_deflate() returned an error");
+	} else {
+		dset_id = H5Dcreate(file_id, name, h5dset->dtype_id, space_id,
+				    H5P_DEFAULT, plist_id, H5P_DEFAULT);
+		if (dset_id < 0)
+			PRINT_TO_ERRMSG_BUF("failed to create dataset '%s'",
+					    name);
+	}
+	H5Pclose(plist_id);
+	H5Sclose(space_id);
+	if (dset_id < 0)
+		return -1;
+	if (H5Aiterate2(h5dset->dset_id, H5_INDEX_NAME, H5_ITER_NATIVE, NULL,
+			copy_attribute, &dset_id) < 0)
+	{
+		H5Dclose(dset_id);
+		return -1;
+	}
+	return dset_id;
+}
+
+/* Load a hyperslab of the dataset in its file type (i.e. without any type
+   conversion). */
+int _read_raw_hyperslab(const H5DSetDescriptor *h5dset,
+		const hsize_t *h5off, const hsize_t *h5count, void *buf)
+{
+	hid_t mem_space_id;
+	int ret;
+
+	ret = H5Sselect_hyperslab(h5dset->space_id, H5S_SELECT_SET,
+				  h5off, NULL, h5count, NULL);
+	if (ret < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Sselect_hyperslab() returned an error");
+		return -1;
+	}
+	mem_space_id = H5Screate_simple(h5dset->ndim, h5count, NULL);
+	if (mem_space_id < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Screate_simple() returned an error");
+		return -1;
+	}
+	ret = H5Dread(h5dset->dset_id, h5dset->dtype_id,
+		      mem_space_id, h5dset->space_id, H5P_DEFAULT, buf);
+	H5Sclose(mem_space_id);
+	if (ret < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Dread() returned an error");
+		return -1;
+	}
+	return 0;
+}
+
+void _check_rewrite_args(SEXP out_name, SEXP chunkdim, SEXP level,
+			 SEXP max_memory)
+{
+	int i;
+
+	if (!(IS_CHARACTER(out_name) && LENGTH(out_name) == 1) ||
+	    STRING_ELT(out_name, 0) == NA_STRING)
+		error("'out_name' must be a single string");
+	if (!IS_INTEGER(chunkdim))
+		error("'chunkdim' must be an integer vector");
+	for (i = 0; i < LENGTH(chunkdim); i++)
+		if (INTEGER(chunkdim)[i] == NA_INTEGER ||
+		    INTEGER(chunkdim)[i] < 1)
+			error("'chunkdim' must contain positive integers");
+	if (!(IS_INTEGER(level) && LENGTH(level) == 1) ||
+	    INTEGER(level)[0] == NA_INTEGER ||
+	    INTEGER(level)[0] < 0 || INTEGER(level)[0] > 9)
+		error("'level' must be a single integer between 0 and 9");
+	if (!(IS_NUMERIC(max_memory) && LENGTH(max_memory) == 1) ||
+	    !(REAL(max_memory)[0] > 0))
+		error("'max_memory' must be a single positive number");
+	return;
+}
+
+static hid_t open_dataset_with_chunk_cache(hid_t file_id, SEXP name,
+					   double cache_size)
+{
+	hid_t dapl_id, dset_id;
+	size_t nslot;
+
+	if (!(IS_CHARACTER(name) && LENGTH(name) == 1) ||
+	    STRING_ELT(name, 0) == NA_STRING)
+	{
+		PRINT_TO_ERRMSG_BUF("'name' must be a single string");
+		return -1;
+	}
+	dapl_id = H5Pcreate(H5P_DATASET_ACCESS);
+	if (dapl_id < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Pcreate() returned an error");
+		return -1;
+	}
+	/* The number of slots in the hash table should be about 100 times
+	   the number of chunks that fit in the cache and preferably a prime
+	   number. An odd number is good enough here. */
+	nslot = (size_t) (cache_size / (1024.0 * 1024.0)) * 100 + 521;
+	nslot |= 1;
+	if (H5Pset_chunk_cache(dapl_id, nslot, (size_t) cache_size, 1.0) < 0) {
+		H5Pclose(dapl_id);
+		PRINT_TO_ERRMSG_BUF("H5Pset_chunk_cache() returned an error");
+		return -1;
+	}
+	dset_id = H5Dopen(file_id, CHAR(STRING_ELT(name, 0)), dapl_id);
+	H5Pclose(dapl_id);
+	if (dset_id < 0)
+		PRINT_TO_ERRMSG_BUF("failed to open dataset '%s'",
+				    CHAR(STRING_ELT(name, 0)));
+	return dset_id;
+}
+
+/* Open the output file in read/write mode, and the input dataset with a
+   chunk cache of 'cache_size' bytes. Call error() if anything goes wrong
+   so must be called before any other resource is allocated. */
+void _open_for_rewrite(SEXP filepath, SEXP name, SEXP out_filepath,
+		double cache_size,
+		hid_t *file_id, hid_t *out_file_id, H5DSetDescriptor *h5dset)
+{
+	hid_t dset_id;
+
+	/* The output file must be opened first in case it's the same as the
+	   input file: HDF5 lets us open a file in read-only mode if it's
+	   already opened in read/write mode but not the other way around. */
+	*out_file_id = _get_file_id(out_filepath, 0);  /* read/write */
+	if (!(IS_CHARACTER(filepath) && LENGTH(filepath) == 1) ||
+	    STRING_ELT(filepath, 0) == NA_STRING)
+	{
+		H5Fclose(*out_file_id);
+		error("'filepath' must be a single string");
+	}
+	*file_id = H5Fopen(CHAR(STRING_ELT(filepath, 0)), H5F_ACC_RDONLY,
+			   H5P_DEFAULT);
+	if (*file_id < 0) {
+		H5Fclose(*out_file_id);
+		error("failed to open file '%s'",
+		      CHAR(STRING_ELT(filepath, 0)));
+	}
+	dset_id = open_dataset_with_chunk_cache(*file_id, name, cache_size);
+	if (dset_id < 0) {
+		H5Fclose(*file_id);
+		H5Fclose(*out_file_id);
+		error(_HDF5Array_global_errmsg_buf());
+	}
+	if (_init_H5DSetDescriptor(h5dset, dset_id, 0, 0) < 0) {
+		H5Dclose(dset_id);
+		H5Fclose(*file_id);
+		H5Fclose(*out_file_id);
+		error(_HDF5Array_global_errmsg_buf());
+	}
+	if (h5dset->is_variable_str ||
+	    H5Tdetect_class(h5dset->dtype_id, H5T_VLEN) > 0)
+	{
+		_close_for_rewrite(*file_id, *out_file_id, h5dset);
+		error("variable-length data is not supported");
+	}
+	return;
+}
+
+void _close_for_rewrite(hid_t file_id, hid_t out_file_id,
+			H5DSetDescriptor *h5dset)
+{
+	hid_t dset_id;
+
+	dset_id = h5dset->dset_id;
+	_destroy_H5DSetDescriptor(h5dset);
+	H5Dclose(dset_id);
+	H5Fclose(file_id);
+	H5Fclose(out_file_id);
+	return;
+}
+
+
+/****************************************************************************
+ * Extracting and compressing the output chunks of a tile (multi-threaded)
+ *
+ * Nothing in this section can use the R API, the scratch arena, the global
+ * error message buffer, or HDF5.
+ */
+
+void _set_tile_chunk_midx(const TileWork *tw, int k, int *midx)
+{
+	int along;
+
+	for (along = 0; along < tw->ndim; along++) {
+		midx[along] = k % tw->nchunk_along[along];
+		k /= tw->nchunk_along[along];
+	}
+	return;
+}
+
+/* Copy the 'k'-th output chunk of the tile to 'w->chunk' (padded with
+   zeros if the chunk is truncated). */
+void _extract_tile_chunk(const TileWork *tw, Worker *w, int k)
+{
+	int ndim, along, partial, n0;
+	long long int *co, *n, *x, tile_off, chunk_off, ts, cs;
+
+	ndim = tw->ndim;
+	co = w->xbuf;
+	n = co + ndim;
+	x = n + ndim;
+	_set_tile_chunk_midx(tw, k, w->midx);
+	partial = 0;
+	for (along = 0; along < ndim; along++) {
+		co[along] = (long long int) w->midx[along] *
+			    tw->out_chunkdim[along];
+		n[along] = tw->tile_dim[along] - co[along];
+		if (n[along] >= tw->out_chunkdim[along])
+			n[along] = tw->out_chunkdim[along];
+		else
+			partial = 1;
+		x[along] = 0;
+	}
+	if (partial)
+		memset(w->chunk, 0, tw->chunk_size);
+	n0 = (int) n[0];
+	while (1) {
+		tile_off = co[0];
+		chunk_off = 0;
+		ts = tw->tile_dim[0];
+		cs = tw->out_chunkdim[0];
+		for (along = 1; along < ndim; along++) {
+			tile_off += (co[along] + x[along]) * ts;
+			chunk_off += x[along] * cs;
+			ts *= tw->tile_dim[along];
+			cs *= tw->out_chunkdim[along];
+		}
+		memcpy(w->chunk + chunk_off * tw->elt_size,
+		       (const char *) tw->tile + tile_off * tw->elt_size,
+		       n0 * tw->elt_size);
+		for (along = 1; along < ndim; along++) {
+			if (++x[along] < n[along])
+				break;
+			x[along] = 0;
+		}
+		if (along >= ndim)
+			break;
+	}
+	return;
+}
+
+/* Apply the shuffle filter. */
+static void shuffle_bytes(const char *in, size_t nelt, size_t elt_size,
+			  char *out)
+{
+	size_t i, j;
+
+	for (j = 0; j < elt_size; j++)
+		for (i = 0; i < nelt; i++)
+			*(out++) = in[i * elt_size + j];
+	return;
+}
+
+/* Compress 'w->chunk' (after shuffling its bytes if 'tw->shuffle' is set,
+   in which case 'w->sbuf' must be at least as big as 'w->chunk'). */
+int _compress_tile_chunk(const TileWork *tw, Worker *w, int k,
+			 char *errmsg)
+{
+	const char *chunk;
+	void *zchunk, *shrunk;
+	uLongf zsize;
+
+	chunk = w->chunk;
+	if (tw->shuffle) {
+		shuffle_bytes(chunk, tw->chunk_size / tw->elt_size,
+			      tw->elt_size, w->sbuf);
+		chunk = w->sbuf;
+	}
+	if (tw->level == 0) {
+		zchunk = malloc(tw->chunk_size);
+		if (zchunk == NULL) {
+			snprintf(errmsg, ERRMSG_BUF_LENGTH, "malloc() failed");
+			return -1;
+		}
+		memcpy(zchunk, chunk, tw->chunk_size);
+		tw->zchunk[k] = zchunk;
+		tw->zchunk_size[k] = tw->chunk_size;
+		return 0;
+	}
+	zsize = compressBound(tw->chunk_size);
+	zchunk = malloc(zsize);
+	if (zchunk == NULL) {
+		snprintf(errmsg, ERRMSG_BUF_LENGTH, "malloc() failed");
+		return -1;
+	}
+	if (compress2(zchunk, &zsize, (const Bytef *) chunk,
+		      tw->chunk_size, tw->level) != Z_OK)
+	{
+		free(zchunk);
+		snprintf(errmsg, ERRMSG_BUF_LENGTH, "compress2() failed");
+		return -1;
+	}
+	/* Give back the unused memory (if realloc() fails, 'zchunk' is
+	   still valid). */
+	shrunk = realloc(zchunk, zsize);
+	if (shrunk != NULL)
+		zchunk = shrunk;
+	tw->zchunk[k] = zchunk;
+	tw->zchunk_size[k] = zsize;
+	return 0;
+}
+
+static void *run_worker(void *arg)
+{
+	Worker *w = arg;
+	TileWork *tw = w->tw;
+	int k;
+	char errmsg[ERRMSG_BUF_LENGTH];
+
+	while (1) {
+		pthread_mutex_lock(&tw->mutex);
+		k = tw->failed ? tw->nchunk : tw->next++;
+		pthread_mutex_unlock(&tw->mutex);
+		if (k >= tw->nchunk)
+			break;
+		_extract_tile_chunk(tw, w, k);
+		if (_compress_tile_chunk(tw, w, k, errmsg) < 0) {
+			pthread_mutex_lock(&tw->mutex);
+			if (!tw->failed) {
+				tw->failed = 1;
+				memcpy(tw->errmsg, errmsg, ERRMSG_BUF_LENGTH);
+			}
+			pthread_mutex_unlock(&tw->mutex);
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Run 'nworker' workers on the current tile: 'nworker' - 1 extra threads
+   plus the calling thread. */
+static int run_workers(Worker *workers, int nworker)
+{
+	pthread_t *threads;
+	int i, nstarted;
+
+	threads = (pthread_t *) malloc(nworker * sizeof(pthread_t));
+	if (threads == NULL) {
+		PRINT_TO_ERRMSG_BUF("failed to allocate memory for 'threads'");
+		return -1;
+	}
+	nstarted = 0;
+	for (i = 1; i < nworker; i++) {
+		if (pthread_create(threads + i, NULL, run_worker,
+				   workers + i) != 0)
+			break;
+		nstarted++;
+	}
+	run_worker(workers);
+	for (i = 1; i <= nstarted; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	if (workers->tw->failed) {
+		PRINT_TO_ERRMSG_BUF("%s", workers->tw->errmsg);
+		return -1;
+	}
+	return 0;
+}
+
+
+/****************************************************************************
+ * Walking the input dataset by tiles
+ */
+
+typedef struct {
+	const H5DSetDescriptor *h5dset;
+	hid_t out_dset_id;
+	int ndim, nthread;
+	/* The following are in the R order (i.e. reversed w.r.t. HDF5). */
+	long long int *dim, *tile_dim;
+	int *out_chunkdim;
+	TileWork tw;
+	Worker *workers;
+	void *tile;
+} Rechunker;
+
+static long long int round_up(long long int x, long long int unit)
+{
+	return (x + unit - 1) / unit * unit;
+}
+
+/* The tiles must span a whole number of output chunks. We try to make them
+   span whole input chunks too, so each input chunk only gets decompressed
+   once, and to make them as big as allowed by 'max_nelt' along the first
+   dimensions. */
+static void choose_tile_dims(Rechunker *rc, long long int max_nelt)
+{
+	const H5DSetDescriptor *h5dset = rc->h5dset;
+	int ndim, along, oc;
+	long long int nelt, t;
+
+	ndim = rc->ndim;
+	nelt = 1;
+	for (along = 0; along < ndim; along++) {
+		oc = rc->out_chunkdim[along];
+		t = oc;
+		if (h5dset->H5layout == H5D_CHUNKED)
+			t = round_up(h5dset->h5chunkdim[ndim - 1 - along], oc);
+		if (t > rc->dim[along])
+			t = rc->dim[along];
+		rc->tile_dim[along] = t;
+		nelt *= t;
+	}
+	for (along = ndim - 1; along >= 0 && nelt > max_nelt; along--) {
+		nelt /= rc->tile_dim[along];
+		rc->tile_dim[along] = rc->out_chunkdim[along];
+		nelt *= rc->tile_dim[along];
+	}
+	for (along = 0; along < ndim; along++) {
+		nelt /= rc->tile_dim[along];
+		oc = rc->out_chunkdim[along];
+		t = max_nelt / nelt / oc * oc;
+		if (t > rc->tile_dim[along])
+			rc->tile_dim[along] = t;
+		if (rc->tile_dim[along] > rc->dim[along])
+			rc->tile_dim[along] = rc->dim[along];
+		nelt *= rc->tile_dim[along];
+		if (rc->tile_dim[along] < rc->dim[along])
+			break;
+	}
+	return;
+}
+
+static int alloc_Rechunker_bufs(Rechunker *rc, int level)
+{
+	TileWork *tw = &rc->tw;
+	int ndim, along, i;
+	long long int max_nchunk;
+	size_t tile_nelt;
+
+	ndim = rc->ndim;
+	tw->ndim = ndim;
+	tw->level = level;
+	tw->elt_size = H5Tget_size(rc->h5dset->dtype_id);
+	tw->out_chunkdim = rc->out_chunkdim;
+	tw->chunk_size = tw->elt_size;
+	tile_nelt = 1;
+	max_nchunk = 1;
+	for (along = 0; along < ndim; along++) {
+		tw->chunk_size *= rc->out_chunkdim[along];
+		tile_nelt *= rc->tile_dim[along];
+		max_nchunk *= (rc->tile_dim[along] - 1) /
+			      rc->out_chunkdim[along] + 1;
+	}
+	rc->tile = malloc(tile_nelt * tw->elt_size);
+	tw->nchunk_along = (int *) malloc(ndim * sizeof(int));
+	tw->zchunk = (void **) calloc(max_nchunk, sizeof(void *));
+	tw->zchunk_size = (size_t *) malloc(max_nchunk * sizeof(size_t));
+	rc->workers = (Worker *) calloc(rc->nthread, sizeof(Worker));
+	if (rc->tile == NULL || tw->nchunk_along == NULL ||
+	    tw->zchunk == NULL || tw->zchunk_size == NULL ||
+	    rc->workers == NULL)
+		goto on_error;
+	for (i = 0; i < rc->nthread; i++) {
+		rc->workers[i].tw = tw;
+		rc->workers[i].midx = (int *) malloc(ndim * sizeof(int));
+		rc->workers[i].xbuf = (long long int *)
+				malloc(3 * ndim * sizeof(long long int));
+		rc->workers[i].chunk = (char *) malloc(tw->chunk_size);
+		if (rc->workers[i].midx == NULL ||
+		    rc->workers[i].xbuf == NULL ||
+		    rc->workers[i].chunk == NULL)
+			goto on_error;
+	}
+	return 0;
+
+    on_error:
+	PRINT_TO_ERRMSG_BUF("failed to allocate memory "
+			    "for the tile and chunk buffers");
+	return -1;
+}
+
+static void free_Rechunker_bufs(Rechunker *rc)
+{
+	int i;
+
+	if (rc->workers != NULL) {
+		for (i = 0; i < rc->nthread; i++) {
+			free(rc->workers[i].midx);
+			free(rc->workers[i].xbuf);
+			free(rc->workers[i].chunk);
+		}
+		free(rc->workers);
+	}
+	free(rc->tw.zchunk_size);
+	free(rc->tw.zchunk);
+	free(rc->tw.nchunk_along);
+	free(rc->tile);
+	return;
+}
+
+static void free_zchunks(TileWork *tw)
+{
+	int k;
+
+	for (k = 0; k < tw->nchunk; k++) {
+		free(tw->zchunk[k]);
+		tw->zchunk[k] = NULL;
+	}
+	return;
+}
+
+/* Write the compressed output chunks of the tile at 'tile_off'. */
+static int write_zchunks(Rechunker *rc, const long long int *tile_off,
+			 hsize_t *h5off, int *midx)
+{
+	TileWork *tw = &rc->tw;
+	int ndim, k, along;
+
+	ndim = rc->ndim;
+	for (k = 0; k < tw->nchunk; k++) {
+		_set_tile_chunk_midx(tw, k, midx);
+		for (along = 0; along < ndim; along++)
+			h5off[ndim - 1 - along] = tile_off[along] +
+				(long long int) midx[along] *
+				rc->out_chunkdim[along];
+		if (H5Dwrite_chunk(rc->out_dset_id, H5P_DEFAULT, 0, h5off,
+				   tw->zchunk_size[k], tw->zchunk[k]) < 0)
+		{
+			PRINT_TO_ERRMSG_BUF("H5Dwrite_chunk() "
+					    "returned an error");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int rechunk_tiles(Rechunker *rc)
+{
+	TileWork *tw = &rc->tw;
+	int ndim, along, ret, *ntile_along, *tile_midx;
+	long long int *tile_off, *cur_tile_dim;
+	hsize_t *h5off, *h5count;
+
+	ndim = rc->ndim;
+	ntile_along = (int *) malloc(3 * ndim * sizeof(int));
+	tile_off = (long long int *) malloc(2 * ndim * sizeof(long long int));
+	h5off = (hsize_t *) malloc(2 * ndim * sizeof(hsize_t));
+	if (ntile_along == NULL || tile_off == NULL || h5off == NULL) {
+		free(h5off);
+		free(tile_off);
+		free(ntile_along);
+		PRINT_TO_ERRMSG_BUF("failed to allocate memory "
+				    "for the tile walker");
+		return -1;
+	}
+	tile_midx = ntile_along + ndim;
+	cur_tile_dim = tile_off + ndim;
+	h5count = h5off + ndim;
+	for (along = 0; along < ndim; along++) {
+		ntile_along[along] = (rc->dim[along] - 1) /
+				     rc->tile_dim[along] + 1;
+		tile_midx[along] = 0;
+	}
+	pthread_mutex_init(&tw->mutex, NULL);
+	tw->tile = rc->tile;
+	tw->tile_dim = cur_tile_dim;
+	do {
+		tw->nchunk = 1;
+		for (along = 0; along < ndim; along++) {
+			tile_off[along] = (long long int) tile_midx[along] *
+					  rc->tile_dim[along];
+			cur_tile_dim[along] = rc->dim[along] - tile_off[along];
+			if (cur_tile_dim[along] > rc->tile_dim[along])
+				cur_tile_dim[along] = rc->tile_dim[along];
+			tw->nchunk_along[along] = (cur_tile_dim[along] - 1) /
+						  rc->out_chunkdim[along] + 1;
+			tw->nchunk *= tw->nchunk_along[along];
+			h5off[ndim - 1 - along] = tile_off[along];
+			h5count[ndim - 1 - along] = cur_tile_dim[along];
+		}
+		ret = _read_raw_hyperslab(rc->h5dset, h5off, h5count, rc->tile);
+		if (ret < 0)
+			break;
+		tw->next = tw->failed = 0;
+		ret = run_workers(rc->workers, rc->nthread);
+		if (ret == 0)
+			ret = write_zchunks(rc, tile_off, h5off,
+					    ntile_along + 2 * ndim);
+		free_zchunks(tw);
+		if (ret < 0)
+			break;
+	} while (_next_midx(ndim, ntile_along, tile_midx) < ndim);
+	pthread_mutex_destroy(&tw->mutex);
+	free(h5off);
+	free(tile_off);
+	free(ntile_along);
+	return ret;
+}
+
+
+/****************************************************************************
+ * C_h5rechunk()
+ */
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_h5rechunk(SEXP filepath, SEXP name,
+		 SEXP out_filepath, SEXP out_name,
+		 SEXP chunkdim, SEXP level, SEXP max_memory, SEXP nthread)
+{
+	hid_t file_id, out_file_id;
+	H5DSetDescriptor h5dset;
+	Rechunker rc;
+	double budget;
+	int ndim, along, ret;
+	hsize_t *h5chunkdim;
+	long long int max_nelt;
+
+	_check_rewrite_args(out_name, chunkdim, level, max_memory);
+	if (!(IS_INTEGER(nthread) && LENGTH(nthread) == 1 &&
+	      INTEGER(nthread)[0] != NA_INTEGER && INTEGER(nthread)[0] >= 1))
+		error("'nthread' must be a single positive integer");
+	budget = REAL(max_memory)[0];
+	_open_for_rewrite(filepath, name, out_filepath, budget / 2,
+			  &file_id, &out_file_id, &h5dset);
+
+	memset(&rc, 0, sizeof(Rechunker));
+	rc.out_dset_id = -1;
+	ret = -1;
+	ndim = h5dset.ndim;
+	if (LENGTH(chunkdim) != ndim) {
+		PRINT_TO_ERRMSG_BUF("'chunkdim' must have one element per "
+				    "dimension in the dataset");
+		goto on_error;
+	}
+	rc.h5dset = &h5dset;
+	rc.ndim = ndim;
+	rc.nthread = INTEGER(nthread)[0];
+	rc.out_chunkdim = INTEGER(chunkdim);
+	rc.dim = (long long int *) malloc(2 * ndim * sizeof(long long int));
+	h5chunkdim = (hsize_t *) malloc(ndim * sizeof(hsize_t) + 1);
+	if (rc.dim == NULL || h5chunkdim == NULL) {
+		free(h5chunkdim);
+		PRINT_TO_ERRMSG_BUF("failed to allocate memory "
+				    "for the dimensions");
+		goto on_error;
+	}
+	rc.tile_dim = rc.dim + ndim;
+	for (along = 0; along < ndim; along++) {
+		rc.dim[along] = h5dset.h5dim[ndim - 1 - along];
+		h5chunkdim[ndim - 1 - along] = rc.out_chunkdim[along];
+		if (rc.out_chunkdim[along] > rc.dim[along]) {
+			free(h5chunkdim);
+			PRINT_TO_ERRMSG_BUF("the chunk dimensions exceed "
+					    "the dimensions of the dataset");
+			goto on_error;
+		}
+	}
+	rc.out_dset_id = _create_dataset_like(out_file_id,
+				CHAR(STRING_ELT(out_name, 0)), &h5dset,
+				h5dset.h5dim, h5chunkdim, INTEGER(level)[0]);
+	free(h5chunkdim);
+	if (rc.out_dset_id < 0)
+		goto on_error;
+	/* Half of the budget goes to the chunk cache of the input dataset.
+	   The tile buffer and the compressed output chunks share the other
+	   half. */
+	max_nelt = (long long int) (budget / 4 / H5Tget_size(h5dset.dtype_id));
+	choose_tile_dims(&rc, max_nelt);
+	if (alloc_Rechunker_bufs(&rc, INTEGER(level)[0]) < 0)
+		goto on_error;
+	ret = rechunk_tiles(&rc);
+
+    on_error:
+	free_Rechunker_bufs(&rc);
+	free(rc.dim);
+	if (rc.out_dset_id >= 0)
+		H5Dclose(rc.out_dset_id);
+	_close_for_rewrite(file_id, out_file_id, &h5dset);
+	if (ret < 0)
+		error(_HDF5Array_global_errmsg_buf());
+	return R_NilValue;
+}
+
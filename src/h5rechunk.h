@@ -0,0 +1,107 @@
+#ifndef _H5RECHUNK_H_
+#define _H5RECHUNK_H_
+
+#include "H5DSetDescriptor.h"
+#include "global_errmsg_buf.h"  /* for ERRMSG_BUF_LENGTH */
+
+#include <pthread.h>
+
+/* The output chunks of a tile (i.e. of an in-memory array in R order) are
+   extracted and compressed by worker threads. Also used by h5writeBlocks.c
+   where the tiles are the blocks of data to write. */
+typedef struct {
+	int ndim, level, shuffle;
+	size_t elt_size, chunk_size;
+	const int *out_chunkdim;
+	/* Current tile. */
+	const void *tile;
+	const long long int *tile_dim;
+	int *nchunk_along;
+	int nchunk;
+	/* Results (one compressed chunk per output chunk in the tile). */
+	void **zchunk;
+	size_t *zchunk_size;
+	/* Shared state. */
+	pthread_mutex_t mutex;
+	int next, failed;
+	char errmsg[ERRMSG_BUF_LENGTH];
+} TileWork;
+
+typedef struct {
+	TileWork *tw;
+	int *midx;
+	long long int *xbuf;
+	char *chunk, *sbuf;
+} Worker;
+
+void _check_rewrite_args(
+	SEXP out_name,
+	SEXP chunkdim,
+	SEXP level,
+	SEXP max_memory
+);
+
+void _open_for_rewrite(
+	SEXP filepath,
+	SEXP name,
+	SEXP out_filepath,
+	double cache_size,
+	hid_t *file_id,
+	hid_t *out_file_id,
+	H5DSetDescriptor *h5dset
+);
+
+void _close_for_rewrite(
+	hid_t file_id,
+	hid_t out_file_id,
+	H5DSetDescriptor *h5dset
+);
+
+hid_t _create_dataset_like(
+	hid_t file_id,
+	const char *name,
+	const H5DSetDescriptor *h5dset,
+	const hsize_t *h5dim,
+	const hsize_t *h5chunkdim,
+	int level
+);
+
+int _read_raw_hyperslab(
+	const H5DSetDescriptor *h5dset,
+	const hsize_t *h5off,
+	const hsize_t *h5count,
+	void *buf
+);
+
+void _set_tile_chunk_midx(
+	const TileWork *tw,
+	int k,
+	int *midx
+);
+
+void _extract_tile_chunk(
+	const TileWork *tw,
+	Worker *w,
+	int k
+);
+
+int _compress_tile_chunk(
+	const TileWork *tw,
+	Worker *w,
+	int k,
+	char *errmsg
+);
+
+SEXP C_h5rechunk(
+	SEXP filepath,
+	SEXP name,
+	SEXP out_filepath,
+	SEXP out_name,
+	SEXP chunkdim,
+	SEXP level,
+	SEXP max_memory,
+	SEXP nthread
+);
+
+#endif  /* _H5RECHUNK_H_ */
+
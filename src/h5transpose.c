@@ -0,0 +1,360 @@
+/****************************************************************************
+ *                 Out-of-core transposition of HDF5 datasets               *
+ *                            Author: H. Pag\`es                            *
+ ****************************************************************************/
+#include "h5transpose.h"
+
+#include "global_errmsg_buf.h"
+#include "h5rechunk.h"
+
+#include <stdlib.h>  /* for malloc, free */
+#include <string.h>  /* for memset, memcpy */
+#include <zlib.h>  /* for compress2(), compressBound(), Z_OK */
+
+/*
+ * C_h5transpose() writes the transpose of a 2D dataset to a new chunked
+ * dataset. It walks the input dataset by tiles that span a whole number of
+ * output chunks, transposes each tile directly into the output chunks, and
+ * writes each output chunk once with H5Dwrite_chunk(), after compressing it
+ * ourselves if needed. So HDF5 never has to read back and rewrite partially
+ * written output chunks, which is what makes transposing a big dataset with
+ * H5Dwrite() (or with writeHDF5Array() on a transposed DelayedArray object)
+ * so slow. The creation of the output dataset and the loading of the tiles
+ * are shared with C_h5rechunk() (see h5rechunk.c).
+ *
+ * The memory used is bounded by 'max_memory': half of it goes to the tile
+ * buffer and the other half to the chunk cache of the input dataset. The
+ * latter avoids decompressing the same input chunk more than once when it
+ * spans several tiles.
+ */
+
+
+/****************************************************************************
+ * Transposition of a tile into an output chunk
+ */
+
+#define	TBLOCK	32
+
+/* Cache-blocked transposition of the 'nb' x 'na' submatrix of 'tile' that
+   starts at ('ioff', 'joff') into the top-left corner of 'chunk'. 'tile'
+   has 'tile_nrow' rows, 'chunk' has 'chunk_nrow' rows. */
+#define	DEFINE_TRANSPOSE_FUN(type)					\
+static void transpose_ ## type(const type *tile, long long int tile_nrow,	\
+		long long int ioff, long long int joff,			\
+		type *chunk, int chunk_nrow, int na, int nb)		\
+{									\
+	int a0, b0, a, b, amax, bmax;					\
+	const type *src;						\
+	type *dest;							\
+									\
+	for (b0 = 0; b0 < nb; b0 += TBLOCK) {				\
+		bmax = b0 + TBLOCK < nb ? b0 + TBLOCK : nb;		\
+		for (a0 = 0; a0 < na; a0 += TBLOCK) {			\
+			amax = a0 + TBLOCK < na ? a0 + TBLOCK : na;	\
+			for (a = a0; a < amax; a++) {			\
+				src = tile + ioff + b0 +		\
+				      (joff + a) * tile_nrow;		\
+				dest = chunk + a + (size_t) b0 * chunk_nrow; \
+				for (b = b0; b < bmax; b++) {		\
+					*dest = *(src++);		\
+					dest += chunk_nrow;		\
+				}					\
+			}						\
+		}							\
+	}								\
+	return;								\
+}
+
+typedef unsigned char uchar;
+typedef unsigned short ushort;
+typedef unsigned long long ull;
+DEFINE_TRANSPOSE_FUN(uchar)
+DEFINE_TRANSPOSE_FUN(ushort)
+DEFINE_TRANSPOSE_FUN(int)
+DEFINE_TRANSPOSE_FUN(ull)
+
+static void transpose_to_chunk(const void *tile, long long int tile_nrow,
+		long long int ioff, long long int joff,
+		void *chunk, int chunk_nrow, int na, int nb,
+		size_t elt_size)
+{
+	int a, b;
+	const char *src;
+
+	switch (elt_size) {
+	    case sizeof(uchar):
+		transpose_uchar(tile, tile_nrow, ioff, joff,
+				chunk, chunk_nrow, na, nb);
+		return;
+	    case sizeof(ushort):
+		transpose_ushort(tile, tile_nrow, ioff, joff,
+				 chunk, chunk_nrow, na, nb);
+		return;
+	    case sizeof(int):
+		transpose_int(tile, tile_nrow, ioff, joff,
+			      chunk, chunk_nrow, na, nb);
+		return;
+	    case sizeof(ull):
+		transpose_ull(tile, tile_nrow, ioff, joff,
+			      chunk, chunk_nrow, na, nb);
+		return;
+	}
+	/* Other element sizes (e.g. fixed-length strings). */
+	for (a = 0; a < na; a++) {
+		src = (const char *) tile +
+		      (ioff + (joff + a) * tile_nrow) * elt_size;
+		for (b = 0; b < nb; b++, src += elt_size)
+			memcpy((char *) chunk +
+			       (a + (size_t) b * chunk_nrow) * elt_size,
+			       src, elt_size);
+	}
+	return;
+}
+
+
+/****************************************************************************
+ * Walking the input dataset by tiles
+ */
+
+typedef struct {
+	const H5DSetDescriptor *h5dset;
+	hid_t out_dset_id;
+	int level;
+	size_t elt_size;
+	/* Dimensions of the input dataset (as seen from R). */
+	long long int nrow, ncol;
+	/* Dimensions of the output chunks (as seen from R). The tiles have
+	   'tile_nrow' rows and 'tile_ncol' columns, which are multiples of
+	   'out_chunkdim[1]' and 'out_chunkdim[0]' respectively (except for
+	   the tiles on the last row or column). */
+	int out_chunkdim[2];
+	long long int tile_nrow, tile_ncol;
+	void *tile, *chunk, *zbuf;
+	size_t chunk_size;
+	uLong zbuf_size;
+} Transposer;
+
+static long long int round_down(long long int x, long long int unit)
+{
+	return x / unit * unit;
+}
+
+static void choose_tile_dims(Transposer *tr, double tile_budget)
+{
+	long long int max_nelt, tile_ncol, in_chunk_ncol;
+	int oc0, oc1;
+
+	oc0 = tr->out_chunkdim[0];  /* along the input columns */
+	oc1 = tr->out_chunkdim[1];  /* along the input rows */
+	max_nelt = (long long int) (tile_budget / tr->elt_size);
+
+	/* Try to make the tiles span whole input chunks along the columns
+	   so each input chunk is only decompressed once. */
+	in_chunk_ncol = tr->h5dset->H5layout == H5D_CHUNKED ?
+			(long long int) tr->h5dset->h5chunkdim[0] : 1;
+	tile_ncol = (in_chunk_ncol + oc0 - 1) / oc0 * oc0;
+	if (tile_ncol > tr->ncol)
+		tile_ncol = tr->ncol;
+	if (max_nelt / tile_ncol < oc1 && max_nelt / tile_ncol < tr->nrow)
+		tile_ncol = oc0 < tr->ncol ? oc0 : tr->ncol;
+	tr->tile_nrow = round_down(max_nelt / tile_ncol, oc1);
+	if (tr->tile_nrow >= tr->nrow) {
+		tr->tile_nrow = tr->nrow;
+		/* The tiles span whole columns of the input dataset so we
+		   can afford to make them wider. */
+		if (tr->nrow != 0)
+			tile_ncol = round_down(max_nelt / tr->nrow, oc0);
+		if (tile_ncol < oc0)
+			tile_ncol = oc0;
+		if (tile_ncol > tr->ncol)
+			tile_ncol = tr->ncol;
+	} else if (tr->tile_nrow < oc1) {
+		/* Exceed the budget rather than write partial chunks. */
+		tr->tile_nrow = oc1 < tr->nrow ? oc1 : tr->nrow;
+	}
+	tr->tile_ncol = tile_ncol;
+	return;
+}
+
+static int alloc_buffers(Transposer *tr)
+{
+	tr->chunk_size = (size_t) tr->out_chunkdim[0] * tr->out_chunkdim[1] *
+			 tr->elt_size;
+	tr->tile = malloc((size_t) tr->tile_nrow * tr->tile_ncol *
+			  tr->elt_size);
+	tr->chunk = malloc(tr->chunk_size);
+	tr->zbuf_size = tr->level != 0 ? compressBound(tr->chunk_size) : 0;
+	tr->zbuf = tr->level != 0 ? malloc(tr->zbuf_size) : NULL;
+	if (tr->tile == NULL || tr->chunk == NULL ||
+	    (tr->level != 0 && tr->zbuf == NULL))
+	{
+		PRINT_TO_ERRMSG_BUF("failed to allocate memory "
+				    "for the tile and chunk buffers");
+		return -1;
+	}
+	return 0;
+}
+
+static int read_tile(const Transposer *tr, long long int i0,
+		long long int j0, long long int nrow, long long int ncol)
+{
+	hsize_t h5off[2], h5count[2];
+
+	h5off[0] = j0;
+	h5off[1] = i0;
+	h5count[0] = ncol;
+	h5count[1] = nrow;
+	return _read_raw_hyperslab(tr->h5dset, h5off, h5count, tr->tile);
+}
+
+/* Write the output chunk whose top-left element is at ('out_i0', 'out_j0')
+   in the output dataset. */
+static int write_chunk(const Transposer *tr,
+		long long int out_i0, long long int out_j0)
+{
+	hsize_t h5off[2];
+	const void *data;
+	size_t data_size;
+	uLongf zsize;
+	herr_t ret;
+
+	h5off[0] = out_j0;
+	h5off[1] = out_i0;
+	data = tr->chunk;
+	data_size = tr->chunk_size;
+	if (tr->level != 0) {
+		zsize = tr->zbuf_size;
+		if (compress2(tr->zbuf, &zsize, tr->chunk, tr->chunk_size,
+			      tr->level) != Z_OK)
+		{
+			PRINT_TO_ERRMSG_BUF("compress2() failed");
+			return -1;
+		}
+		data = tr->zbuf;
+		data_size = zsize;
+	}
+	ret = H5Dwrite_chunk(tr->out_dset_id, H5P_DEFAULT, 0, h5off,
+			     data_size, data);
+	if (ret < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Dwrite_chunk() returned an error");
+		return -1;
+	}
+	return 0;
+}
+
+static int transpose_tiles(Transposer *tr)
+{
+	long long int i0, j0, nrow, ncol, ioff, joff;
+	int oc0, oc1, na, nb;
+
+	oc0 = tr->out_chunkdim[0];
+	oc1 = tr->out_chunkdim[1];
+	for (j0 = 0; j0 < tr->ncol; j0 += tr->tile_ncol) {
+		ncol = tr->ncol - j0;
+		if (ncol > tr->tile_ncol)
+			ncol = tr->tile_ncol;
+		for (i0 = 0; i0 < tr->nrow; i0 += tr->tile_nrow) {
+			nrow = tr->nrow - i0;
+			if (nrow > tr->tile_nrow)
+				nrow = tr->tile_nrow;
+			if (read_tile(tr, i0, j0, nrow, ncol) < 0)
+				return -1;
+			/* Walk the output chunks covered by the tile. Row
+			   'j' of the output is column 'j' of the input. */
+			for (joff = 0; joff < ncol; joff += oc0) {
+				na = ncol - joff < oc0 ? ncol - joff : oc0;
+				for (ioff = 0; ioff < nrow; ioff += oc1) {
+					nb = nrow - ioff < oc1 ?
+					     nrow - ioff : oc1;
+					if (na < oc0 || nb < oc1)
+						memset(tr->chunk, 0,
+						       tr->chunk_size);
+					transpose_to_chunk(tr->tile, nrow,
+						ioff, joff, tr->chunk, oc0,
+						na, nb, tr->elt_size);
+					if (write_chunk(tr, j0 + joff,
+							i0 + ioff) < 0)
+						return -1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+
+/****************************************************************************
+ * C_h5transpose()
+ */
+
+/* --- .Call ENTRY POINT --- */
+SEXP C_h5transpose(SEXP filepath, SEXP name,
+		   SEXP out_filepath, SEXP out_name,
+		   SEXP chunkdim, SEXP level, SEXP max_memory)
+{
+	hid_t file_id, out_file_id;
+	H5DSetDescriptor h5dset;
+	Transposer tr;
+	double budget;
+	hsize_t h5dim[2], h5chunkdim[2];
+	int ret;
+
+	_check_rewrite_args(out_name, chunkdim, level, max_memory);
+	if (LENGTH(chunkdim) != 2)
+		error("'chunkdim' must be a vector of 2 positive integers");
+	budget = REAL(max_memory)[0];
+	_open_for_rewrite(filepath, name, out_filepath, budget / 2,
+			  &file_id, &out_file_id, &h5dset);
+
+	memset(&tr, 0, sizeof(Transposer));
+	tr.out_dset_id = -1;
+	ret = -1;
+	if (h5dset.ndim != 2) {
+		PRINT_TO_ERRMSG_BUF("h5transpose() only supports "
+				    "2-dimensional datasets");
+		goto on_error;
+	}
+	tr.h5dset = &h5dset;
+	tr.level = INTEGER(level)[0];
+	tr.elt_size = H5Tget_size(h5dset.dtype_id);
+	tr.nrow = h5dset.h5dim[1];
+	tr.ncol = h5dset.h5dim[0];
+	tr.out_chunkdim[0] = INTEGER(chunkdim)[0];
+	tr.out_chunkdim[1] = INTEGER(chunkdim)[1];
+	if (tr.out_chunkdim[0] > tr.ncol || tr.out_chunkdim[1] > tr.nrow) {
+		PRINT_TO_ERRMSG_BUF("the chunk dimensions exceed the "
+				    "dimensions of the transposed dataset");
+		goto on_error;
+	}
+	/* Reversing the HDF5 dimensions of the input dataset gives us the
+	   HDF5 dimensions of its transpose. */
+	h5dim[0] = tr.nrow;
+	h5dim[1] = tr.ncol;
+	h5chunkdim[0] = tr.out_chunkdim[1];
+	h5chunkdim[1] = tr.out_chunkdim[0];
+	tr.out_dset_id = _create_dataset_like(out_file_id,
+				CHAR(STRING_ELT(out_name, 0)), &h5dset,
+				h5dim, h5chunkdim, tr.level);
+	if (tr.out_dset_id < 0)
+		goto on_error;
+	if (tr.nrow != 0 && tr.ncol != 0) {
+		choose_tile_dims(&tr, budget / 2);
+		if (alloc_buffers(&tr) < 0)
+			goto on_error;
+		if (transpose_tiles(&tr) < 0)
+			goto on_error;
+	}
+	ret = 0;
+
+    on_error:
+	free(tr.zbuf);
+	free(tr.chunk);
+	free(tr.tile);
+	if (tr.out_dset_id >= 0)
+		H5Dclose(tr.out_dset_id);
+	_close_for_rewrite(file_id, out_file_id, &h5dset);
+	if (ret < 0)
+		error(_HDF5Array_global_errmsg_buf());
+	return R_NilValue;
+}
+
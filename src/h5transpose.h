@@ -0,0 +1,17 @@
+#ifndef _H5TRANSPOSE_H_
+#define _H5TRANSPOSE_H_
+
+#include <Rdefines.h>
+
+SEXP C_h5transpose(
+	SEXP filepath,
+	SEXP name,
+	SEXP out_filepath,
+	SEXP out_name,
+	SEXP chunkdim,
+	SEXP level,
+	SEXP max_memory
+);
+
+#endif  /* _H5TRANSPOSE_H_ */
+
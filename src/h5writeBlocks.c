@@ -0,0 +1,630 @@
+/****************************************************************************
+ *         Writing blocks of data to several HDF5 datasets at once          *
+ *                            Author: H. Pag\`es                            *
+ ****************************************************************************/
+#include "h5writeBlocks.h"
+
+#include "global_errmsg_buf.h"
+#include "H5DSetDescriptor.h"  /* for _get_file_id() */
+#include "h5rechunk.h"  /* for TileWork, Worker, _extract_tile_chunk(), etc */
+
+#include <stdlib.h>  /* for malloc, calloc, free */
+#include <string.h>  /* for memcpy */
+
+/*
+ * C_h5writeBlocks() writes a block of data (an ordinary array) to each
+ * dataset in a list of datasets of the same file, at the same offset. This
+ * is what the multi-assay writer (see writeHDF5Arrays() at the R level)
+ * uses to write the blocks of all the assays of a given viewport.
+ *
+ * When the block is aligned on the chunks of the dataset, the chunks are
+ * extracted from the block and compressed by 'nthread' threads, then
+ * written with H5Dwrite_chunk() by the main thread (HDF5 is not
+ * thread-safe). The chunks of all the datasets are processed by the same
+ * pool of workers. This requires that the filter pipeline of the dataset
+ * only uses the shuffle and/or deflate filters, and that the type of the
+ * data on disk is the native type of the block. Otherwise the block is
+ * written with a single H5Dwrite(), which means that HDF5 does the
+ * compression.
+ */
+
+typedef struct {
+	hid_t dset_id;
+	int ndim, use_raw_chunks;
+	/* In the R order (i.e. reversed w.r.t. HDF5). */
+	long long int *dim, *block_dim;
+	int *chunkdim;
+	hid_t mem_type_id;
+	const void *block;
+	TileWork tw;
+} BlockTarget;
+
+
+/****************************************************************************
+ * Preparing the targets
+ */
+
+/* Return the level of the deflate filter (0 if not used) and set
+   '*shuffle' to 1 if the shuffle filter is used before it. Return -1 if
+   the pipeline uses other filters, and -2 on error. */
+static int get_deflate_level(hid_t plist_id, int *shuffle)
+{
+	int nfilter, i, level;
+	unsigned int flags, cd_values[8], filter_config;
+	size_t cd_nelmts;
+	H5Z_filter_t filter_id;
+
+	*shuffle = 0;
+	level = 0;
+	nfilter = H5Pget_nfilters(plist_id);
+	if (nfilter < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Pget_nfilters() returned an error");
+		return -2;
+	}
+	for (i = 0; i < nfilter; i++) {
+		cd_nelmts = sizeof(cd_values) / sizeof(unsigned int);
+		filter_id = H5Pget_filter2(plist_id, (unsigned) i,
+					   &flags, &cd_nelmts, cd_values,
+					   0, NULL, &filter_config);
+		if (filter_id < 0) {
+			PRINT_TO_ERRMSG_BUF("H5Pget_filter2() "
+					    "returned an error");
+			return -2;
+		}
+		if (filter_id == H5Z_FILTER_SHUFFLE && !*shuffle && level == 0)
+			*shuffle = 1;
+		else if (filter_id == H5Z_FILTER_DEFLATE && level == 0 &&
+			 cd_nelmts >= 1 && cd_values[0] >= 1)
+			level = (int) cd_values[0];
+		else
+			return -1;
+	}
+	return level;
+}
+
+/* The block must start on a chunk boundary and span a whole number of
+   chunks, except along the dimensions where it reaches the end of the
+   dataset. */
+static int is_aligned_on_chunks(const BlockTarget *target,
+				const long long int *offset)
+{
+	int along, c;
+
+	for (along = 0; along < target->ndim; along++) {
+		c = target->chunkdim[along];
+		if (offset[along] % c != 0)
+			return 0;
+		if (target->block_dim[along] % c != 0 &&
+		    offset[along] + target->block_dim[along] !=
+		    target->dim[along])
+			return 0;
+	}
+	return 1;
+}
+
+/* Set the chunk related fields of 'target' and decide whether the block
+   can be written with H5Dwrite_chunk(). Return -1 on error. */
+static int init_chunk_info(BlockTarget *target, const long long int *offset)
+{
+	hid_t plist_id, dtype_id;
+	hsize_t *h5chunkdim;
+	int ndim, along, level, shuffle, ret;
+	htri_t same_type;
+
+	ndim = target->ndim;
+	plist_id = H5Dget_create_plist(target->dset_id);
+	if (plist_id < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Dget_create_plist() returned an error");
+		return -1;
+	}
+	ret = 0;
+	if (H5Pget_layout(plist_id) != H5D_CHUNKED)
+		goto done;
+	h5chunkdim = (hsize_t *) malloc(ndim * sizeof(hsize_t));
+	if (h5chunkdim == NULL) {
+		PRINT_TO_ERRMSG_BUF("failed to allocate memory "
+				    "for 'h5chunkdim'");
+		ret = -1;
+		goto done;
+	}
+	if (H5Pget_chunk(plist_id, ndim, h5chunkdim) != ndim) {
+		free(h5chunkdim);
+		PRINT_TO_ERRMSG_BUF("H5Pget_chunk() returned an error");
+		ret = -1;
+		goto done;
+	}
+	for (along = 0; along < ndim; along++)
+		target->chunkdim[along] = (int) h5chunkdim[ndim - 1 - along];
+	free(h5chunkdim);
+	if (!is_aligned_on_chunks(target, offset))
+		goto done;
+	level = get_deflate_level(plist_id, &shuffle);
+	if (level == -2) {
+		ret = -1;
+		goto done;
+	}
+	if (level < 0)
+		goto done;
+	dtype_id = H5Dget_type(target->dset_id);
+	if (dtype_id < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Dget_type() returned an error");
+		ret = -1;
+		goto done;
+	}
+	same_type = H5Tequal(dtype_id, target->mem_type_id);
+	H5Tclose(dtype_id);
+	if (same_type < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Tequal() returned an error");
+		ret = -1;
+		goto done;
+	}
+	if (!same_type)
+		goto done;
+	target->use_raw_chunks = 1;
+	target->tw.level = level;
+	target->tw.shuffle = shuffle;
+
+    done:
+	H5Pclose(plist_id);
+	return ret;
+}
+
+/* Return -1 on error. */
+static int init_BlockTarget(BlockTarget *target, hid_t file_id,
+		const char *name, SEXP block, const long long int *offset,
+		int ndim)
+{
+	hid_t space_id;
+	hsize_t *h5dim;
+	SEXP block_dim;
+	int along;
+
+	switch (TYPEOF(block)) {
+	    case LGLSXP: case INTSXP:
+		target->mem_type_id = H5T_NATIVE_INT;
+		target->block = INTEGER(block);
+		break;
+	    case REALSXP:
+		target->mem_type_id = H5T_NATIVE_DOUBLE;
+		target->block = REAL(block);
+		break;
+	    default:
+		PRINT_TO_ERRMSG_BUF("the blocks must be arrays of type "
+				    "\"logical\", \"integer\", or \"double\"");
+		return -1;
+	}
+	block_dim = GET_DIM(block);
+	if (LENGTH(block_dim) != ndim) {
+		PRINT_TO_ERRMSG_BUF("the blocks must have one dimension per "
+				    "element in 'offset'");
+		return -1;
+	}
+	target->dset_id = H5Dopen(file_id, name, H5P_DEFAULT);
+	if (target->dset_id < 0) {
+		PRINT_TO_ERRMSG_BUF("failed to open dataset '%s'", name);
+		return -1;
+	}
+	space_id = H5Dget_space(target->dset_id);
+	if (space_id < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Dget_space() returned an error");
+		return -1;
+	}
+	if (H5Sget_simple_extent_ndims(space_id) != ndim) {
+		H5Sclose(space_id);
+		PRINT_TO_ERRMSG_BUF("dataset '%s' does not have the expected "
+				    "number of dimensions", name);
+		return -1;
+	}
+	target->ndim = ndim;
+	target->dim = (long long int *)
+			malloc(2 * ndim * sizeof(long long int));
+	target->chunkdim = (int *) malloc(ndim * sizeof(int));
+	h5dim = (hsize_t *) malloc(ndim * sizeof(hsize_t));
+	if (target->dim == NULL || target->chunkdim == NULL || h5dim == NULL) {
+		free(h5dim);
+		H5Sclose(space_id);
+		PRINT_TO_ERRMSG_BUF("failed to allocate memory "
+				    "for the dimensions");
+		return -1;
+	}
+	target->block_dim = target->dim + ndim;
+	H5Sget_simple_extent_dims(space_id, h5dim, NULL);
+	H5Sclose(space_id);
+	for (along = 0; along < ndim; along++) {
+		target->dim[along] = h5dim[ndim - 1 - along];
+		target->block_dim[along] = INTEGER(block_dim)[along];
+		if (offset[along] + target->block_dim[along] >
+		    target->dim[along])
+		{
+			free(h5dim);
+			PRINT_TO_ERRMSG_BUF("the blocks to write to dataset "
+					    "'%s' go beyond its extent", name);
+			return -1;
+		}
+	}
+	free(h5dim);
+	return init_chunk_info(target, offset);
+}
+
+static void destroy_BlockTarget(BlockTarget *target)
+{
+	int k;
+
+	if (target->tw.zchunk != NULL) {
+		for (k = 0; k < target->tw.nchunk; k++)
+			free(target->tw.zchunk[k]);
+		free(target->tw.zchunk);
+	}
+	free(target->tw.zchunk_size);
+	free(target->tw.nchunk_along);
+	free(target->chunkdim);
+	free(target->dim);
+	if (target->dset_id >= 0)
+		H5Dclose(target->dset_id);
+	return;
+}
+
+/* Set up the TileWork of a target that uses H5Dwrite_chunk(). */
+static int init_TileWork(BlockTarget *target)
+{
+	TileWork *tw = &target->tw;
+	int ndim, along;
+
+	ndim = target->ndim;
+	tw->ndim = ndim;
+	tw->elt_size = H5Tget_size(target->mem_type_id);
+	tw->out_chunkdim = target->chunkdim;
+	tw->tile = target->block;
+	tw->tile_dim = target->block_dim;
+	tw->chunk_size = tw->elt_size;
+	tw->nchunk = 1;
+	tw->nchunk_along = (int *) malloc(ndim * sizeof(int));
+	if (tw->nchunk_along == NULL)
+		goto on_error;
+	for (along = 0; along < ndim; along++) {
+		tw->chunk_size *= target->chunkdim[along];
+		tw->nchunk_along[along] = (target->block_dim[along] +
+					   target->chunkdim[along] - 1) /
+					  target->chunkdim[along];
+		tw->nchunk *= tw->nchunk_along[along];
+	}
+	tw->zchunk = (void **) calloc(tw->nchunk, sizeof(void *));
+	tw->zchunk_size = (size_t *) malloc(tw->nchunk * sizeof(size_t));
+	if (tw->zchunk == NULL || tw->zchunk_size == NULL)
+		goto on_error;
+	return 0;
+
+    on_error:
+	PRINT_TO_ERRMSG_BUF("failed to allocate memory for the chunk tables");
+	return -1;
+}
+
+
+/****************************************************************************
+ * Extracting and compressing the chunks of all the blocks (multi-threaded)
+ *
+ * Nothing in this section can use the R API, the global error message
+ * buffer, or HDF5.
+ */
+
+typedef struct {
+	BlockTarget *targets;
+	int ntarget;
+	/* Shared state. */
+	pthread_mutex_t mutex;
+	int next_target, next_chunk, failed;
+	char errmsg[ERRMSG_BUF_LENGTH];
+} BlocksWork;
+
+typedef struct {
+	BlocksWork *bw;
+	Worker w;
+} BlocksWorker;
+
+/* Hand out the next chunk to process. Return 0 when there is none left. */
+static int next_job(BlocksWork *bw, int *t, int *k)
+{
+	int ret;
+
+	ret = 0;
+	pthread_mutex_lock(&bw->mutex);
+	while (!bw->failed && bw->next_target < bw->ntarget) {
+		if (bw->targets[bw->next_target].use_raw_chunks &&
+		    bw->next_chunk <
+		    bw->targets[bw->next_target].tw.nchunk)
+		{
+			*t = bw->next_target;
+			*k = bw->next_chunk++;
+			ret = 1;
+			break;
+		}
+		bw->next_target++;
+		bw->next_chunk = 0;
+	}
+	pthread_mutex_unlock(&bw->mutex);
+	return ret;
+}
+
+static void *run_blocks_worker(void *arg)
+{
+	BlocksWorker *bwk = arg;
+	BlocksWork *bw = bwk->bw;
+	TileWork *tw;
+	int t, k;
+	char errmsg[ERRMSG_BUF_LENGTH];
+
+	while (next_job(bw, &t, &k)) {
+		tw = &bw->targets[t].tw;
+		_extract_tile_chunk(tw, &bwk->w, k);
+		if (_compress_tile_chunk(tw, &bwk->w, k, errmsg) < 0) {
+			pthread_mutex_lock(&bw->mutex);
+			if (!bw->failed) {
+				bw->failed = 1;
+				memcpy(bw->errmsg, errmsg, ERRMSG_BUF_LENGTH);
+			}
+			pthread_mutex_unlock(&bw->mutex);
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Run 'nworker' workers: 'nworker' - 1 extra threads plus the calling
+   thread. */
+static int run_blocks_workers(BlocksWorker *workers, int nworker)
+{
+	pthread_t *threads;
+	int i, nstarted;
+
+	threads = (pthread_t *) malloc(nworker * sizeof(pthread_t));
+	if (threads == NULL) {
+		PRINT_TO_ERRMSG_BUF("failed to allocate memory for 'threads'");
+		return -1;
+	}
+	nstarted = 0;
+	for (i = 1; i < nworker; i++) {
+		if (pthread_create(threads + i, NULL, run_blocks_worker,
+				   workers + i) != 0)
+			break;
+		nstarted++;
+	}
+	run_blocks_worker(workers);
+	for (i = 1; i <= nstarted; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	if (workers->bw->failed) {
+		PRINT_TO_ERRMSG_BUF("%s", workers->bw->errmsg);
+		return -1;
+	}
+	return 0;
+}
+
+static void free_BlocksWorkers(BlocksWorker *workers, int nworker)
+{
+	int i;
+
+	for (i = 0; i < nworker; i++) {
+		free(workers[i].w.midx);
+		free(workers[i].w.xbuf);
+		free(workers[i].w.chunk);
+		free(workers[i].w.sbuf);
+	}
+	free(workers);
+	return;
+}
+
+static BlocksWorker *alloc_BlocksWorkers(BlocksWork *bw, int nworker,
+					 int ndim, size_t max_chunk_size)
+{
+	BlocksWorker *workers;
+	int i;
+
+	workers = (BlocksWorker *) calloc(nworker, sizeof(BlocksWorker));
+	if (workers == NULL)
+		goto on_error;
+	for (i = 0; i < nworker; i++) {
+		workers[i].bw = bw;
+		workers[i].w.midx = (int *) malloc(ndim * sizeof(int));
+		workers[i].w.xbuf = (long long int *)
+				malloc(3 * ndim * sizeof(long long int));
+		workers[i].w.chunk = (char *) malloc(max_chunk_size);
+		workers[i].w.sbuf = (char *) malloc(max_chunk_size);
+		if (workers[i].w.midx == NULL || workers[i].w.xbuf == NULL ||
+		    workers[i].w.chunk == NULL || workers[i].w.sbuf == NULL)
+		{
+			free_BlocksWorkers(workers, nworker);
+			goto on_error;
+		}
+	}
+	return workers;
+
+    on_error:
+	PRINT_TO_ERRMSG_BUF("failed to allocate memory "
+			    "for the chunk buffers");
+	return NULL;
+}
+
+
+/****************************************************************************
+ * Writing the blocks
+ */
+
+/* Write the block of a target that doesn't use H5Dwrite_chunk(). */
+static int write_block(const BlockTarget *target, const long long int *offset,
+		       hsize_t *h5off, hsize_t *h5count)
+{
+	int ndim, along, ret;
+	hid_t file_space_id, mem_space_id;
+
+	ndim = target->ndim;
+	for (along = 0; along < ndim; along++) {
+		h5off[ndim - 1 - along] = offset[along];
+		h5count[ndim - 1 - along] = target->block_dim[along];
+	}
+	file_space_id = H5Dget_space(target->dset_id);
+	if (file_space_id < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Dget_space() returned an error");
+		return -1;
+	}
+	ret = -1;
+	mem_space_id = H5Screate_simple(ndim, h5count, NULL);
+	if (mem_space_id < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Screate_simple() returned an error");
+	} else if (H5Sselect_hyperslab(file_space_id, H5S_SELECT_SET,
+				       h5off, NULL, h5count, NULL) < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Sselect_hyperslab() returned an error");
+	} else if (H5Dwrite(target->dset_id, target->mem_type_id,
+			    mem_space_id, file_space_id,
+			    H5P_DEFAULT, target->block) < 0) {
+		PRINT_TO_ERRMSG_BUF("H5Dwrite() returned an error");
+	} else {
+		ret = 0;
+	}
+	if (mem_space_id >= 0)
+		H5Sclose(mem_space_id);
+	H5Sclose(file_space_id);
+	return ret;
+}
+
+/* Write the compressed chunks of a target. */
+static int write_zchunks(const BlockTarget *target,
+			 const long long int *offset,
+			 hsize_t *h5off, int *midx)
+{
+	const TileWork *tw = &target->tw;
+	int ndim, k, along;
+
+	ndim = target->ndim;
+	for (k = 0; k < tw->nchunk; k++) {
+		_set_tile_chunk_midx(tw, k, midx);
+		for (along = 0; along < ndim; along++)
+			h5off[ndim - 1 - along] = offset[along] +
+				(long long int) midx[along] *
+				target->chunkdim[along];
+		if (H5Dwrite_chunk(target->dset_id, H5P_DEFAULT, 0, h5off,
+				   tw->zchunk_size[k], tw->zchunk[k]) < 0)
+		{
+			PRINT_TO_ERRMSG_BUF("H5Dwrite_chunk() "
+					    "returned an error");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int write_blocks(BlockTarget *targets, int ntarget, int ndim,
+			const long long int *offset, int nthread)
+{
+	BlocksWork bw;
+	BlocksWorker *workers;
+	size_t max_chunk_size;
+	hsize_t *h5off;
+	int t, ret, *midx;
+
+	h5off = (hsize_t *) malloc(2 * ndim * sizeof(hsize_t));
+	midx = (int *) malloc(ndim * sizeof(int));
+	if (h5off == NULL || midx == NULL) {
+		free(midx);
+		free(h5off);
+		PRINT_TO_ERRMSG_BUF("failed to allocate memory "
+				    "for the offsets");
+		return -1;
+	}
+	ret = 0;
+	max_chunk_size = 0;
+	for (t = 0; t < ntarget && ret == 0; t++) {
+		if (!targets[t].use_raw_chunks) {
+			ret = write_block(targets + t, offset,
+					  h5off, h5off + ndim);
+			continue;
+		}
+		ret = init_TileWork(targets + t);
+		if (targets[t].tw.chunk_size > max_chunk_size)
+			max_chunk_size = targets[t].tw.chunk_size;
+	}
+	if (ret < 0 || max_chunk_size == 0)
+		goto done;
+	bw.targets = targets;
+	bw.ntarget = ntarget;
+	bw.next_target = bw.next_chunk = bw.failed = 0;
+	workers = alloc_BlocksWorkers(&bw, nthread, ndim, max_chunk_size);
+	if (workers == NULL) {
+		ret = -1;
+		goto done;
+	}
+	pthread_mutex_init(&bw.mutex, NULL);
+	ret = run_blocks_workers(workers, nthread);
+	pthread_mutex_destroy(&bw.mutex);
+	free_BlocksWorkers(workers, nthread);
+	for (t = 0; t < ntarget && ret == 0; t++)
+		if (targets[t].use_raw_chunks)
+			ret = write_zchunks(targets + t, offset, h5off, midx);
+
+    done:
+	free(midx);
+	free(h5off);
+	return ret;
+}
+
+
+/****************************************************************************
+ * C_h5writeBlocks()
+ */
+
+/* --- .Call ENTRY POINT ---
+ * 'offset' must be an integer vector containing the 0-based offsets of the
+ * blocks, and 'blocks' a list of ordinary arrays parallel to 'names'.
+ */
+SEXP C_h5writeBlocks(SEXP filepath, SEXP names, SEXP offset, SEXP blocks,
+		     SEXP nthread)
+{
+	hid_t file_id;
+	BlockTarget *targets;
+	long long int *off;
+	int ntarget, ndim, t, along, ret;
+
+	if (!IS_CHARACTER(names))
+		error("'names' must be a character vector");
+	ntarget = LENGTH(names);
+	if (!IS_INTEGER(offset))
+		error("'offset' must be an integer vector");
+	ndim = LENGTH(offset);
+	if (!isVectorList(blocks) || LENGTH(blocks) != ntarget)
+		error("'blocks' must be a list parallel to 'names'");
+	if (!(IS_INTEGER(nthread) && LENGTH(nthread) == 1 &&
+	      INTEGER(nthread)[0] != NA_INTEGER && INTEGER(nthread)[0] >= 1))
+		error("'nthread' must be a single positive integer");
+	if (ntarget == 0)
+		return R_NilValue;
+
+	file_id = _get_file_id(filepath, 0);  /* read/write */
+	targets = (BlockTarget *) calloc(ntarget, sizeof(BlockTarget));
+	off = (long long int *) malloc(ndim * sizeof(long long int) + 1);
+	if (targets == NULL || off == NULL) {
+		free(off);
+		free(targets);
+		H5Fclose(file_id);
+		error("failed to allocate memory for the block targets");
+	}
+	for (along = 0; along < ndim; along++)
+		off[along] = INTEGER(offset)[along];
+	for (t = 0; t < ntarget; t++)
+		targets[t].dset_id = -1;
+	ret = 0;
+	for (t = 0; t < ntarget && ret == 0; t++)
+		ret = init_BlockTarget(targets + t, file_id,
+				       CHAR(STRING_ELT(names, t)),
+				       VECTOR_ELT(blocks, t), off, ndim);
+	if (ret == 0)
+		ret = write_blocks(targets, ntarget, ndim, off,
+				   INTEGER(nthread)[0]);
+	for (t = 0; t < ntarget; t++)
+		destroy_BlockTarget(targets + t);
+	free(off);
+	free(targets);
+	H5Fclose(file_id);
+	if (ret < 0)
+		error(_HDF5Array_global_errmsg_buf());
+	return R_NilValue;
+}
+
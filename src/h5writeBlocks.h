@@ -0,0 +1,15 @@
+#ifndef _H5WRITEBLOCKS_H_
+#define _H5WRITEBLOCKS_H_
+
+#include <Rdefines.h>
+
+SEXP C_h5writeBlocks(
+	SEXP filepath,
+	SEXP names,
+	SEXP offset,
+	SEXP blocks,
+	SEXP nthread
+);
+
+#endif  /* _H5WRITEBLOCKS_H_ */
+